@@ -209,6 +209,40 @@ File &File::Sync()
 	return *this;
 }
 
+File &File::Allocate(off_t size)
+{
+	checkFileOpen();
+
+	if (openFlags == OpenFlags::READ_ONLY)
+		throw std::runtime_error("File is not open for writing");
+
+	int ret = posix_fallocate(fileInternal->fd, 0, size);
+	if (ret)
+		throw std::system_error(ret, std::generic_category());
+
+	return *this;
+}
+
+File &File::Truncate(off_t size)
+{
+	checkFileOpen();
+
+	if (openFlags == OpenFlags::READ_ONLY)
+		throw std::runtime_error("File is not open for writing");
+
+	if (ftruncate(fileInternal->fd, size) < 0)
+		throw std::system_error(errno, std::generic_category());
+
+	return *this;
+}
+
+int File::GetFd() const
+{
+	checkFileOpen();
+
+	return fileInternal->fd;
+}
+
 File::Stats File::GetStats()
 {
 	checkFileOpen();
@@ -299,6 +333,16 @@ void *File::Mmap::GetPtr()
 	return ptr;
 }
 
+void File::Mmap::Sync(size_t offset, size_t size)
+{
+	/* msync() takes page aligned address only */
+	size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t start = offset & ~(page - 1);
+
+	if (msync(static_cast<char *>(ptr) + start, offset - start + size, MS_SYNC) < 0)
+		throw std::system_error(errno, std::generic_category());
+}
+
 /*
  * Write file contents to ostream.
  */
@@ -194,6 +194,34 @@ public:
 	 */
 	File& Sync();
 
+	/**
+	 * Allocate disk space, so writes up to size neither grow the file nor fail for lack of space.
+	 *
+	 * File shorter than size is extended with zeros, data is kept.
+	 *
+	 * @param size File size in bytes
+	 * @return Reference to this File object
+	 * @throw std::system_error on allocation failure
+	 */
+	File& Allocate(off_t size);
+
+	/**
+	 * Set file size, data beyond it is cut off.
+	 *
+	 * @param size File size in bytes
+	 * @return Reference to this File object
+	 * @throw std::system_error on ftruncate failure
+	 */
+	File& Truncate(off_t size);
+
+	/**
+	 * Get file descriptor, e.g. to pass the file to sendfile().
+	 *
+	 * @return File descriptor owned by this File object
+	 * @throw std::runtime_error if file is not open
+	 */
+	int GetFd() const;
+
 	/* Nested types */
 	class Stats;
 	class Mmap;
@@ -298,6 +326,22 @@ public:
 		 */
 		void *GetPtr();
 
+		/**
+		 * Get size of the mapped region.
+		 *
+		 * @return Size in bytes
+		 */
+		size_t GetSize() const { return size_; }
+
+		/**
+		 * Write modified pages of a range to the file and wait for completion.
+		 *
+		 * @param offset Offset of the range in the mapping, rounded down to page size
+		 * @param size Size of the range
+		 * @throw std::system_error on msync failure
+		 */
+		void Sync(size_t offset, size_t size);
+
 		 /** 
 		  * Overload operator-> to allow direct access to the mapped memory.
 		  *
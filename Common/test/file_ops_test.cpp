@@ -18,6 +18,35 @@ int do_file_ops_test()
     return strcmp(str, rd);
 }
 
+int do_file_mmap_test()
+{
+	File f("mmap_test.bin");
+
+	/* Preallocated file is zero filled and mapped whole */
+	f.Truncate(0).Allocate(8192);
+	EXPECT_EQ(f.GetStats().GetSize(), 8192);
+
+	auto map = f.MapFile(8192);
+	EXPECT_EQ(map->GetSize(), 8192u);
+
+	char *data = map->GetPtrAs<char>();
+	EXPECT_EQ(data[100], 0);
+	memcpy(data + 5000, "record", 6);
+	map->Sync(5000, 6);
+
+	char rd[6];
+	f.Seek(5000, File::SeekAt::SET);
+	f.Read(rd, sizeof(rd));
+
+	/* Data stays, only what is past the size goes */
+	f.Truncate(5006);
+	EXPECT_EQ(f.GetStats().GetSize(), 5006);
+	f.Close();
+	unlink("mmap_test.bin");
+
+	return memcmp(rd, "record", sizeof(rd));
+}
+
 int do_csv_file_test()
 {
 	CSVFile csv("test.csv");
@@ -7,6 +7,7 @@ extern int do_bitops_test();
 extern int do_state_machine_test();
 extern int do_filters_test();
 extern int do_file_ops_test();
+extern int do_file_mmap_test();
 extern int do_csv_file_test();
 extern int do_ext_file_test();
 extern int do_device_json_test();
@@ -42,6 +43,10 @@ TEST(file_ops_test, TestFileOperations) {
     EXPECT_EQ(do_file_ops_test(), 0);
 }
 
+TEST(file_mmap_test, TestFileMapping) {
+	EXPECT_EQ(do_file_mmap_test(), 0);
+}
+
 TEST(csv_file_test, TestCSVFileReader) {
 	EXPECT_EQ(do_csv_file_test(), 0);
 }
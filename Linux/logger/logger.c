@@ -46,6 +46,12 @@ static server_event_t server_ops = {
 	.error = error,
 };
 
+/* Log write and ack send block, device that stops reading holds one worker only */
+static const server_config_t server_config = {
+	.mode = SERVER_MODE_EPOLL,
+	.workers = 4,
+};
+
 int main(int argc, char* argv[])
 {
 	if (argc != 4) {
@@ -59,7 +65,8 @@ int main(int argc, char* argv[])
 
 	signal(SIGCHLD, SIG_IGN);
 
-	server_t logserver = server_start(port, &server_ops, 256, NULL);
+	server_t logserver = server_start_ex(port, &server_ops, 256, NULL,
+		&server_config);
 
 	if (!logserver) {
 		fprintf(stderr, "Start message server failed\n");
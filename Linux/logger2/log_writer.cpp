@@ -0,0 +1,307 @@
+#include <unistd.h>
+#include <limits.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdexcept>
+#include <system_error>
+#include "log_writer.h"
+
+/* Records taken by one writev() at most */
+#ifndef LOG_WRITER_BATCH
+#define LOG_WRITER_BATCH	IOV_MAX
+#endif
+
+/* Plain file, records are appended by writev() */
+class FileSink final: public LogSink
+{
+public:
+	explicit FileSink(int fd) : _fd(fd) {}
+	void Write(struct iovec *iov, size_t count) override;
+	void Sync() override;
+private:
+	int _fd;
+};
+
+void FileSink::Write(struct iovec *iov, size_t count)
+{
+	while (count)
+	{
+		ssize_t written = writev(_fd, iov, static_cast<int>(count));
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written < 0)
+			throw std::system_error(errno, std::generic_category());
+
+		/* Partial write, skip what is done */
+		size_t done = static_cast<size_t>(written);
+		while (count && done >= iov->iov_len)
+		{
+			done -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count)
+		{
+			iov->iov_base = static_cast<char *>(iov->iov_base) + done;
+			iov->iov_len -= done;
+		}
+	}
+}
+
+void FileSink::Sync()
+{
+	if (fdatasync(_fd) < 0)
+		throw std::system_error(errno, std::generic_category());
+}
+
+LogWriter::LogWriter(int fd, const DurabilityPolicy &policy, size_t record_max, size_t capacity)
+	: LogWriter(std::unique_ptr<LogSink>(new FileSink(fd)), policy, record_max, capacity)
+{
+}
+
+LogWriter::LogWriter(std::unique_ptr<LogSink> sink, const DurabilityPolicy &policy, size_t record_max, size_t capacity)
+	: _sink(std::move(sink)), _policy(policy), _record_max(record_max)
+{
+	if (!policy.per_message && !policy.interval.count())
+		throw std::runtime_error("LogWriter::LogWriter: Sync interval is required");
+
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	_mask = size - 1;
+
+	_slots.reset(new Slot[size]);
+	_data.reset(new char[size * record_max]);
+	for (size_t i = 0; i != size; i++)
+		_slots[i].seq.store(i, std::memory_order_relaxed);
+
+	_writer = std::thread(&LogWriter::Run, this);
+}
+
+LogWriter::~LogWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(_wake_lock);
+		_stopping = true;
+	}
+	_wake.notify_one();
+	_writer.join();
+}
+
+uint64_t LogWriter::Append(const struct iovec *parts, size_t count)
+{
+	size_t size = 0;
+	for (size_t i = 0; i != count; i++)
+		size += parts[i].iov_len;
+
+	if (size > _record_max)
+		throw std::runtime_error("LogWriter::Append: Record is too large: " + std::to_string(size));
+
+	/* Claim a free slot, slots are reused once writer passes them */
+	uint64_t pos = _tail.load(std::memory_order_relaxed);
+	Slot *slot;
+	while (true)
+	{
+		slot = &_slots[pos & _mask];
+		int64_t diff = static_cast<int64_t>(slot->seq.load(std::memory_order_acquire) - pos);
+		if (!diff && _tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			break;
+
+		/* Queue is full, writer is behind */
+		if (diff < 0)
+			std::this_thread::yield();
+		pos = _tail.load(std::memory_order_relaxed);
+	}
+
+	char *data = Data(pos);
+	for (size_t i = 0; i != count; i++)
+	{
+		memcpy(data, parts[i].iov_base, parts[i].iov_len);
+		data += parts[i].iov_len;
+	}
+	slot->size = size;
+	slot->seq.store(pos + 1, std::memory_order_release);
+
+	/* Pairs with the fence of sleeping writer, one of both sees the other */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (_sleeping.load(std::memory_order_relaxed))
+	{
+		std::lock_guard<std::mutex> lock(_wake_lock);
+		_wake.notify_one();
+	}
+
+	return pos + 1;
+}
+
+/* Timestamp prefix of current second, formatted once the second changes */
+static size_t get_timestamp(std::time_t now, const char *&prefix)
+{
+	thread_local char buffer[32];
+	thread_local std::time_t cached = -1;
+	thread_local size_t size = 0;
+
+	if (now != cached)
+	{
+		struct tm tm;
+		localtime_r(&now, &tm);
+		size = strftime(buffer, sizeof(buffer), "%F %T: ", &tm);
+		cached = now;
+	}
+
+	prefix = buffer;
+	return size;
+}
+
+uint64_t LogWriter::AppendLine(const char *data, size_t size)
+{
+	const char *prefix;
+	size_t prefix_size = get_timestamp(std::time(nullptr), prefix);
+	struct iovec parts[] = {
+		{ const_cast<char *>(prefix), prefix_size },
+		{ const_cast<char *>(data), size },
+		{ const_cast<char *>("\r\n"), 2 },
+	};
+
+	return Append(parts, size && data[size - 1] == '\n' ? 3 : 2);
+}
+
+bool LogWriter::Wait(uint64_t ticket)
+{
+	if (!IsDurable(ticket))
+	{
+		std::unique_lock<std::mutex> lock(_ack_lock);
+		_ack.wait(lock, [this, ticket]() { return IsDurable(ticket); });
+	}
+
+	return !_error.load(std::memory_order_relaxed);
+}
+
+void LogWriter::SetDurableHandler(std::function<void(uint64_t ticket, bool ok)> handler)
+{
+	_on_durable = std::move(handler);
+}
+
+/* Error number of failed sink call, errors not carrying one are I/O errors */
+static int get_error(const std::exception &e)
+{
+	const std::system_error *error = dynamic_cast<const std::system_error *>(&e);
+	return error ? error->code().value() : EIO;
+}
+
+void LogWriter::Write(struct iovec *iov, size_t count)
+{
+	try
+	{
+		_sink->Write(iov, count);
+	}
+	catch (const std::exception &e)
+	{
+		/* Records are lost, their producers get told so */
+		int error = get_error(e);
+		if (!_error.exchange(error))
+			std::cerr << "LogWriter::Write: Write error: " << error << ": " << e.what() << std::endl;
+	}
+}
+
+void LogWriter::Sync()
+{
+	try
+	{
+		_sink->Sync();
+	}
+	catch (const std::exception &e)
+	{
+		int error = get_error(e);
+		if (!_error.exchange(error))
+			std::cerr << "LogWriter::Sync: Sync error: " << error << ": " << e.what() << std::endl;
+	}
+
+	_durable.store(_head, std::memory_order_release);
+	{
+		/* Waiter checks under the lock, so it either sees it or gets notified */
+		std::lock_guard<std::mutex> lock(_ack_lock);
+	}
+	_ack.notify_all();
+
+	if (_on_durable)
+		_on_durable(_head, !_error.load(std::memory_order_relaxed));
+}
+
+void LogWriter::Run()
+{
+	const size_t batch = _policy.per_message ? 1 : LOG_WRITER_BATCH;
+	std::unique_ptr<struct iovec[]> iov(new struct iovec[batch]);
+	size_t unsynced = 0;
+	std::chrono::steady_clock::time_point unsynced_since;
+
+	while (true)
+	{
+		/* Take every filled slot in a row */
+		uint64_t pos = _head;
+		size_t count = 0, bytes = 0;
+		while (count != batch)
+		{
+			Slot &slot = _slots[pos & _mask];
+			if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+				break;
+
+			iov[count].iov_base = Data(pos);
+			iov[count].iov_len = slot.size;
+			bytes += slot.size;
+			count++;
+			pos++;
+		}
+
+		if (count)
+		{
+			Write(iov.get(), count);
+
+			/* Data is in the page cache, slots may be reused */
+			for (uint64_t done = _head; done != pos; done++)
+				_slots[done & _mask].seq.store(done + _mask + 1, std::memory_order_release);
+			_head = pos;
+
+			if (!unsynced)
+				unsynced_since = std::chrono::steady_clock::now();
+			unsynced += bytes;
+		}
+
+		if (unsynced && (_policy.per_message ||
+				 (_policy.bytes && unsynced >= _policy.bytes) ||
+				 std::chrono::steady_clock::now() - unsynced_since >= _policy.interval))
+		{
+			Sync();
+			unsynced = 0;
+		}
+
+		if (count)
+			continue;
+
+		/* Nothing queued, sleep until a record comes or sync is due */
+		std::unique_lock<std::mutex> lock(_wake_lock);
+		_sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		bool queued = _slots[_head & _mask].seq.load(std::memory_order_acquire) == _head + 1;
+		if (!queued && _stopping)
+		{
+			_sleeping.store(false, std::memory_order_relaxed);
+			break;
+		}
+
+		if (!queued)
+		{
+			if (unsynced)
+				_wake.wait_until(lock, unsynced_since + _policy.interval);
+			else
+				_wake.wait(lock);
+		}
+		_sleeping.store(false, std::memory_order_relaxed);
+	}
+
+	if (unsynced)
+		Sync();
+}
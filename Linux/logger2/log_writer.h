@@ -0,0 +1,190 @@
+#ifndef __LOG_WRITER_H__
+#define __LOG_WRITER_H__
+
+#include <sys/uio.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/**
+ * When appended records are synced to disk.
+ *
+ * Records are synced once the oldest unsynced one is interval old or
+ * bytes are unsynced, whichever comes first. Interval bounds how long
+ * an acknowledgement may wait, so it is required unless every record
+ * is synced on its own.
+ */
+struct DurabilityPolicy
+{
+	std::chrono::milliseconds interval { 10 };
+	/* Zero syncs on interval only */
+	size_t bytes = 0;
+	/* Write and sync every record on its own, for the paranoid */
+	bool per_message = false;
+};
+
+/**
+ * Destination of records, used by writer thread of LogWriter only.
+ *
+ * Errors are thrown, preferably as std::system_error carrying the error
+ * number. Writer catches every std::exception and tells the producers
+ * of the records.
+ */
+class LogSink
+{
+public:
+	virtual ~LogSink() = default;
+
+	/**
+	 * @brief Append records.
+	 *
+	 * @param iov		Records, one per element, may be modified.
+	 * @param count		Amount of records.
+	 */
+	virtual void Write(struct iovec *iov, size_t count) = 0;
+
+	/**
+	 * @brief Make everything appended durable.
+	 */
+	virtual void Sync() = 0;
+};
+
+/**
+ * Appends records to a file from a dedicated writer thread.
+ *
+ * Producers copy records into a bounded lock-free queue and return at
+ * once. Writer takes everything queued, appends it with one writev()
+ * and syncs according to durability policy, so one sync commits the
+ * records of many producers. Producers wait for the queue to drain if
+ * it is full.
+ */
+class LogWriter
+{
+public:
+	/**
+	 * @brief Constructor of LogWriter class, starts writer thread.
+	 *
+	 * Throws std::runtime_error if policy never syncs.
+	 *
+	 * @param fd		File to append to, stays owned by caller.
+	 * @param policy	When records are synced.
+	 * @param record_max	Largest record in bytes.
+	 * @param capacity	Records queued at most, rounded up to power of two.
+	 */
+	LogWriter(int fd, const DurabilityPolicy &policy,
+		  size_t record_max = 2048, size_t capacity = 1024);
+
+	/**
+	 * @brief Constructor of LogWriter class writing to a sink.
+	 *
+	 * Throws std::runtime_error if policy never syncs.
+	 *
+	 * @param sink		Destination of records.
+	 * @param policy	When records are synced.
+	 * @param record_max	Largest record in bytes.
+	 * @param capacity	Records queued at most, rounded up to power of two.
+	 */
+	LogWriter(std::unique_ptr<LogSink> sink, const DurabilityPolicy &policy,
+		  size_t record_max = 2048, size_t capacity = 1024);
+
+	/**
+	 * @brief Destructor, writes and syncs everything queued.
+	 */
+	~LogWriter();
+
+	LogWriter(const LogWriter &) = delete;
+	LogWriter &operator=(const LogWriter &) = delete;
+
+	/**
+	 * @brief Queue record made of several parts.
+	 *
+	 * Can be called from any thread. Throws std::runtime_error if
+	 * record is larger than record_max.
+	 *
+	 * @param parts		Parts of the record, copied in order.
+	 * @param count		Amount of parts.
+	 * @return Ticket to wait for the record to be durable.
+	 */
+	uint64_t Append(const struct iovec *parts, size_t count);
+
+	/**
+	 * @brief Queue message as a timestamped log line.
+	 *
+	 * Line is "YYYY-MM-DD HH:MM:SS: " followed by the message, message
+	 * ending with a new line gets "\r\n" after it. Timestamp is kept
+	 * per calling thread and formatted again once a second, line is
+	 * built right in the queue, so nothing is allocated per message.
+	 *
+	 * @param data		Message.
+	 * @param size		Size of message in bytes.
+	 * @return Ticket to wait for the record to be durable.
+	 */
+	uint64_t AppendLine(const char *data, size_t size);
+
+	/**
+	 * @brief Wait until record is synced to disk.
+	 *
+	 * @param ticket	Ticket returned by Append.
+	 * @return False if writing failed.
+	 */
+	bool Wait(uint64_t ticket);
+
+	/**
+	 * @brief Check if record is synced to disk, without waiting.
+	 *
+	 * @param ticket	Ticket returned by Append.
+	 */
+	bool IsDurable(uint64_t ticket) const { return _durable.load(std::memory_order_acquire) >= ticket; }
+
+	/**
+	 * @brief Set function called once records are synced.
+	 *
+	 * Called on writer thread after every sync, so producers need not
+	 * wait. Should be called before the first Append().
+	 *
+	 * @param handler	Gets ticket of the last record synced and false
+	 *			if writing failed.
+	 */
+	void SetDurableHandler(std::function<void(uint64_t ticket, bool ok)> handler);
+private:
+	struct Slot
+	{
+		/* Position the slot is free for, or position + 1 once filled */
+		std::atomic<uint64_t> seq;
+		size_t size;
+	};
+
+	void Run();
+	void Write(struct iovec *iov, size_t count);
+	void Sync();
+	char *Data(uint64_t pos) const { return _data.get() + (pos & _mask) * _record_max; }
+
+	std::unique_ptr<LogSink> _sink;
+	DurabilityPolicy _policy;
+	size_t _record_max;
+	uint64_t _mask;
+	std::unique_ptr<Slot[]> _slots;
+	std::unique_ptr<char[]> _data;
+	/* Producers claim positions from tail, writer consumes from head */
+	alignas(64) std::atomic<uint64_t> _tail { 0 };
+	alignas(64) uint64_t _head = 0;
+	std::atomic<uint64_t> _durable { 0 };
+	std::atomic<int> _error { 0 };
+
+	/* Producers take the lock only if writer sleeps */
+	std::atomic<bool> _sleeping { false };
+	std::mutex _wake_lock;
+	std::condition_variable _wake;
+	std::mutex _ack_lock;
+	std::condition_variable _ack;
+	std::function<void(uint64_t, bool)> _on_durable;
+	bool _stopping = false;
+	std::thread _writer;
+};
+
+#endif /* __LOG_WRITER_H__ */
@@ -0,0 +1,84 @@
+#include <fcntl.h>
+#include <iostream>
+#include "logger.h"
+#include "segment_writer.h"
+
+Logger::Logger(const std::string &name,
+	       const std::string &log_file_path,
+	       uint32_t magic_number,
+	       std::optional<std::string> reply_message,
+	       const DurabilityPolicy &durability,
+	       size_t segment_size)
+	: _name(name), magic_number(magic_number), reply_message(std::move(reply_message))
+{
+	/* Record is timestamp, separator, message and line end */
+	if (segment_size) {
+		writer = std::make_unique<LogWriter>(std::unique_ptr<LogSink>(new SegmentWriter(log_file_path, segment_size)),
+						     durability, MAX_MESSAGE_SIZE + 32);
+	} else {
+		log_file = std::make_unique<File>(log_file_path.c_str(), File::OpenFlags::WRITE_ONLY);
+
+		/* Instance handing off keeps writing while restarted one starts, both append */
+		fcntl(log_file->GetFd(), F_SETFL, fcntl(log_file->GetFd(), F_GETFL) | O_APPEND);
+
+		writer = std::make_unique<LogWriter>(log_file->GetFd(), durability, MAX_MESSAGE_SIZE + 32);
+	}
+	writer->SetDurableHandler([this](uint64_t ticket, bool ok) {
+		std::lock_guard<std::mutex> lock(ack_lock);
+		Acknowledge(ticket, ok);
+	});
+}
+
+void Logger::Receive(Network::MessageBase &msg)
+{
+	uint64_t ticket = Write(msg);
+	if (!ticket || !reply_message.has_value())
+		return;
+
+	/* Reply acknowledges the message is on disk, loop thread does not wait for it */
+	std::lock_guard<std::mutex> lock(ack_lock);
+	acks.push_back({ ticket, msg.GetConnection() });
+
+	/* Synced before it was queued, no sync is coming for it */
+	if (writer->IsDurable(ticket))
+		Acknowledge(ticket, writer->Wait(ticket));
+}
+
+uint64_t Logger::Write(Network::MessageBase &msg)
+{
+	LogMessage *received_msg = reinterpret_cast<LogMessage *>(msg.GetData());
+
+	/* Fixed size buffers of senders come zero padded, padding is no text */
+	size_t size = msg.GetSize() - sizeof(received_msg->magic);
+	while (size && !received_msg->data[size - 1])
+		size--;
+
+	if (!size) {
+		std::cerr << "Warning: Received message with no data" << std::endl;
+		return 0;
+	}
+
+	if (echo_every && received.fetch_add(1, std::memory_order_relaxed) % echo_every == 0) {
+		std::cout << "Received data: ";
+		std::cout.write(received_msg->data, static_cast<std::streamsize>(size)) << std::endl;
+	}
+
+	return writer->AppendLine(received_msg->data, size);
+}
+
+void Logger::Acknowledge(uint64_t ticket, bool ok)
+{
+	size_t done = 0;
+	while (done != acks.size() && acks[done].ticket <= ticket) {
+		/* Captures this only, fits in std::function and is posted as is */
+		if (ok)
+			acks[done].connection.Post([this](Network::MessageBase *msg) {
+				if (msg)
+					msg->Reply(reply_message.value());
+			});
+		done++;
+	}
+
+	/* Queue keeps its capacity, steady traffic allocates nothing */
+	acks.erase(acks.begin(), acks.begin() + static_cast<std::ptrdiff_t>(done));
+}
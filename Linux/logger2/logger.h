@@ -0,0 +1,96 @@
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "file_ops.h"
+#include "server.h"
+#include "log_writer.h"
+
+#ifndef MAX_MESSAGE_SIZE
+#define MAX_MESSAGE_SIZE 1500
+#endif
+
+/* Received message, magic number tells logger it belongs to */
+struct LogMessage
+{
+	uint32_t magic;
+	char data[MAX_MESSAGE_SIZE - sizeof(uint32_t)];
+} __attribute__((packed));
+
+/**
+ * Log file of one configured logger, fed by own listener and shared ones.
+ *
+ * Messages are appended to the writer, ones of streams are acknowledged
+ * with the reply message once they are on disk. Once queues have grown,
+ * a message costs no heap allocation, neither logged nor acknowledged.
+ */
+class Logger final
+{
+public:
+	/**
+	 * @brief Constructor of Logger class, opens log file.
+	 *
+	 * Throws std::runtime_error or std::system_error on error.
+	 *
+	 * @param name		Name of logger.
+	 * @param log_file_path	Log file, path of segments if they are used.
+	 * @param magic_number	Magic number of messages of this logger.
+	 * @param reply_message	Acknowledgement of stream messages, none if not set.
+	 * @param durability	When records are synced.
+	 * @param segment_size	Size of preallocated segments, zero appends to one file.
+	 */
+	Logger(const std::string &name,
+	       const std::string &log_file_path,
+	       uint32_t magic_number,
+	       std::optional<std::string> reply_message,
+	       const DurabilityPolicy &durability,
+	       size_t segment_size);
+
+	uint32_t GetMagic() const { return magic_number; }
+
+	/**
+	 * @brief Log message of a stream, it gets the reply once on disk.
+	 *
+	 * @param msg		Received message.
+	 */
+	void Receive(Network::MessageBase &msg);
+
+	/**
+	 * @brief Queue message to log file.
+	 *
+	 * @param msg		Received message.
+	 * @return Ticket of the record, zero if message is dropped.
+	 */
+	uint64_t Write(Network::MessageBase &msg);
+
+	/* Every n-th message is printed to console, zero keeps it quiet */
+	size_t echo_every = 0;
+private:
+	struct Ack
+	{
+		uint64_t ticket;
+		Network::Connection connection;
+	};
+
+	/* Reply to messages synced up to ticket, ones of failed writes are not acknowledged */
+	void Acknowledge(uint64_t ticket, bool ok);
+
+	std::string _name;
+	std::unique_ptr<File> log_file;
+	uint32_t magic_number;
+	std::optional<std::string> reply_message;
+	std::atomic<size_t> received { 0 };
+	/* Messages waiting for sync, in order of every connection */
+	std::mutex ack_lock;
+	std::vector<Ack> acks;
+	/* Declared after the file, so it is synced and stopped before the file closes */
+	std::unique_ptr<LogWriter> writer;
+};
+
+#endif /* __LOGGER_H__ */
@@ -2,80 +2,144 @@
 #include <jsoncpp/json/json.h>
 #include <list>
 #include <memory>
-#include <future>
 #include <thread>
 #include <chrono>
-#include <mutex>
 #include <optional>
+#include <algorithm>
 #include "file_ops.h"
 #include "server.h"
-
-#ifndef MAX_MESSAGE_SIZE
-#define MAX_MESSAGE_SIZE 1500
-#endif
+#include "logger.h"
+#include "route_table.h"
 
 const std::string config_path = "config.json";
 
-class LoggerServer final : public Network::ServerBase
+/* Magic number of message, false if message is too short to carry one */
+static bool get_magic(Network::MessageBase &msg, uint32_t &magic)
+{
+	if (msg.GetSize() < sizeof(magic))
+		return false;
+
+	magic = reinterpret_cast<const LogMessage *>(msg.GetData())->magic;
+	return true;
+}
+
+/* Listening socket of loggers, may be handed over to restarted instance */
+class Listener : public Network::ServerBase
+{
+public:
+	Listener(uint16_t port, Protocol protocol)
+		: ServerBase(port, MAX_MESSAGE_SIZE, 32, protocol, Mode::EPOLL) {}
+
+	/* Unix socket restarted instance takes sockets over from, empty if off */
+	std::string handoff_path;
+};
+
+/* Own port of one logger, messages of other loggers are refused */
+class LoggerServer final : public Listener
 {
 public:
-	explicit LoggerServer(const std::string &name,
-						  uint16_t port,
-						  Protocol protocol,
-						  const std::string &log_file_path,
-						  uint32_t magic_number,
-						  std::optional<std::string> reply_message)
-		: ServerBase(port, MAX_MESSAGE_SIZE, 32, protocol), _name(std::move(name)), magic_number(magic_number), reply_message(std::move(reply_message))
+	LoggerServer(uint16_t port, Protocol protocol, Logger &logger)
+		: Listener(port, protocol), logger(logger) {}
+
+	/* Handlers append to the writer, stop them first */
+	~LoggerServer()
 	{
-		log_file = std::make_unique<File>(log_file_path.c_str(), File::OpenFlags::WRITE_ONLY);
+		Stop();
 	}
 
 	void OnReceive(Network::MessageBase &msg) override
 	{
-		struct {
-			uint32_t magic;
-			char data[MAX_MESSAGE_SIZE - sizeof(uint32_t)];
-		} __attribute__((packed)) *received_msg = reinterpret_cast<decltype(received_msg)>(msg.GetData());
-
-		if (received_msg->magic != magic_number) {
-			std::cerr << "Received message with invalid magic number: " << received_msg->magic << std::endl;
+		if (!Accept(msg))
 			return;
-		}
 
-		std::cout << "Received data: " << received_msg->data << std::endl;
-		{
-			if (msg.GetSize() < sizeof(received_msg->magic) + 1) {
-				std::cerr << "Warning: Received message with no data" << std::endl;
-				return;
-			}
+		if (_protocol == Protocol::TCP)
+			logger.Receive(msg);
+		else
+			logger.Write(msg);
+	}
 
-			std::string timestamp = get_time();
-			std::lock_guard<std::mutex> lock(log_mutex);
-			log_file->Write(timestamp.c_str(), timestamp.size()).Write(": ", 2).Write(received_msg->data, msg.GetSize() - sizeof(received_msg->magic));
-			if (received_msg->data[msg.GetSize() - sizeof(received_msg->magic) - 1] == '\n')
-				log_file->Write("\r\n", 2);
-			log_file->Sync();
+	/* Datagrams are not acknowledged, writer commits them with others */
+	void OnReceiveBatch(std::vector<Network::MessageBase> &msgs) override
+	{
+		for (auto &msg : msgs)
+			if (Accept(msg))
+				logger.Write(msg);
+	}
+private:
+	bool Accept(Network::MessageBase &msg)
+	{
+		uint32_t magic = 0;
+		if (!get_magic(msg, magic) || magic != logger.GetMagic()) {
+			std::cerr << "Received message with invalid magic number: " << magic << std::endl;
+			return false;
 		}
+		return true;
+	}
+
+	Logger &logger;
+};
+
+/* Port shared by all loggers, every message goes to the one of its magic number */
+class RouterServer final : public Listener
+{
+public:
+	RouterServer(uint16_t port, Protocol protocol, const RouteTable<Logger> &routes)
+		: Listener(port, protocol), routes(routes) {}
 
-		if (_protocol == Protocol::TCP && reply_message.has_value())
-			msg.Reply(reply_message.value());
+	~RouterServer()
+	{
+		Stop();
 	}
-private:
-	static std::string get_time(std::time_t time = std::time(nullptr))
+
+	void OnReceive(Network::MessageBase &msg) override
 	{
-		char timeString[20];
-		std::strftime(timeString, sizeof(timeString), "%F %T", std::localtime(&time));
+		Logger *logger = Route(msg);
+		if (!logger)
+			return;
 
-		return std::string(timeString);
+		if (_protocol == Protocol::TCP)
+			logger->Receive(msg);
+		else
+			logger->Write(msg);
 	}
 
-	std::string _name;
-	std::unique_ptr<File> log_file;
-	uint32_t magic_number;
-	std::optional<std::string> reply_message;
-	std::mutex log_mutex;
+	void OnReceiveBatch(std::vector<Network::MessageBase> &msgs) override
+	{
+		for (auto &msg : msgs)
+			if (Logger *logger = Route(msg))
+				logger->Write(msg);
+	}
+private:
+	Logger *Route(Network::MessageBase &msg)
+	{
+		uint32_t magic = 0;
+		Logger *logger = get_magic(msg, magic) ? routes.Find(magic) : nullptr;
+		if (!logger)
+			std::cerr << "Received message with unknown magic number: " << magic << std::endl;
+		return logger;
+	}
+
+	const RouteTable<Logger> &routes;
 };
 
+/* Keep one flooding sensor from starving the others */
+static void set_rate_limits(Network::ServerBase &server, const Json::Value &limits)
+{
+	const std::pair<const char *, Network::ServerBase::RateScope> scopes[] = {
+		{ "Connection", Network::ServerBase::RateScope::CONNECTION },
+		{ "Source", Network::ServerBase::RateScope::SOURCE },
+		{ "Global", Network::ServerBase::RateScope::GLOBAL },
+	};
+	for (const auto &scope : scopes) {
+		const Json::Value &limit = limits[scope.first];
+		if (limit.isObject())
+			server.SetRateLimit(scope.second, { limit["BytesPerSec"].asDouble(),
+							    limit["MessagesPerSec"].asDouble(),
+							    limit["BurstBytes"].asDouble(),
+							    limit["BurstMessages"].asDouble() });
+	}
+}
+
 /**
  * Test main function that reads config, starts logger servers, and waits indefinitely.
  * To run the test, execute the program with the argument "--test" to start the servers
@@ -83,7 +147,11 @@ private:
  */
 int main(int argc, char *argv[])
 {
-	std::list<std::unique_ptr<LoggerServer>> servers;
+	std::shared_ptr<Network::LoopGroup> group;
+	/* Declared before servers, they feed loggers until stopped */
+	std::list<std::unique_ptr<Logger>> logger_list;
+	RouteTable<Logger> routes;
+	std::list<std::unique_ptr<Listener>> servers;
 	Json::Value root;
 	Json::CharReaderBuilder reader_builder;
 	std::unique_ptr<Json::CharReader> reader(reader_builder.newCharReader());
@@ -99,6 +167,9 @@ int main(int argc, char *argv[])
 	}
 	auto loggers = root["Loggers"];
 
+	/* All loggers share few threads, however many are configured */
+	group = std::make_shared<Network::LoopGroup>(root.get("Workers", 2).asUInt());
+
 	for (const auto &logger : loggers) {
 		std::string name = logger["Name"].asString();
 		std::uint32_t magic_number = logger["MagicNumber"].asUInt();
@@ -111,18 +182,95 @@ int main(int argc, char *argv[])
 		if (logger.isMember("ReplyMessage"))
 			reply_message = logger["ReplyMessage"].asString();
 
+		std::string handoff_path = logger["HandoffPath"].asString();
+
+		/* Sync period bounds acknowledgement delay, size limit alone gets a loose one */
+		DurabilityPolicy durability;
+		const Json::Value &sync = logger["Durability"];
+		if (sync.isObject()) {
+			durability.per_message = sync["SyncEveryMessage"].asBool();
+			durability.bytes = sync["SyncEveryBytes"].asUInt64();
+			if (sync.isMember("SyncEveryMs"))
+				durability.interval = std::chrono::milliseconds(sync["SyncEveryMs"].asUInt());
+			else if (durability.bytes)
+				durability.interval = std::chrono::seconds(1);
+		}
+
+		/* Preallocated segments instead of one growing file, FilePath names them */
+		size_t segment_size = logger["Segments"]["Size"].asUInt64();
+
 		std::cout << "Logger: " << name << " | Port: " << port << " | Protocol: " << protocol << " | MagicNumber: " << magic_number << " | LogFile: " << log_file << std::endl;
-		servers.emplace_back(std::make_unique<LoggerServer>(std::move(name),
-															port, proto,
-															std::move(log_file),
-															magic_number,
-															std::move(reply_message)));
+		logger_list.emplace_back(std::make_unique<Logger>(std::move(name),
+														  std::move(log_file),
+														  magic_number,
+														  std::move(reply_message),
+														  durability,
+														  segment_size));
+		logger_list.back()->echo_every = logger["EchoEvery"].asUInt64();
+
+		try
+		{
+			routes.Add(magic_number, logger_list.back().get());
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << "Logger is not reachable on shared port: " << e.what() << std::endl;
+		}
+
+		/* Logger without port is reached through shared listener only */
+		if (!port)
+			continue;
+
+		servers.emplace_back(std::make_unique<LoggerServer>(port, proto, *logger_list.back()));
+		servers.back()->handoff_path = std::move(handoff_path);
+		servers.back()->SetLoopGroup(group);
+		set_rate_limits(*servers.back(), logger["RateLimit"]);
+	}
+
+	/* One TCP and one UDP socket serve every logger, however many there are */
+	const Json::Value &shared = root["SharedListener"];
+	if (shared.isObject()) {
+		std::uint16_t port = static_cast<uint16_t>(shared["Port"].asUInt());
+		std::string handoff_path = shared["HandoffPath"].asString();
+
+		std::cout << "Shared listener | Port: " << port << " | Loggers: " << routes.Size() << std::endl;
+		for (auto proto : { Network::ServerBase::Protocol::TCP, Network::ServerBase::Protocol::UDP }) {
+			servers.emplace_back(std::make_unique<RouterServer>(port, proto, routes));
+			if (!handoff_path.empty())
+				servers.back()->handoff_path = handoff_path + (proto == Network::ServerBase::Protocol::TCP ? "_tcp" : "_udp");
+			servers.back()->SetLoopGroup(group);
+			set_rate_limits(*servers.back(), shared["RateLimit"]);
+		}
+	}
+
+	/* Nothing would keep the process up, exiting quietly looks like success */
+	if (servers.empty()) {
+		std::cerr << "No logger has a port and no shared listener is configured, nothing to listen on" << std::endl;
+		return 1;
 	}
 
 	for (auto &server : servers) {
 		try
 		{
-			server->Start();
+			/* Restarted instance takes sockets of the running one, nothing is refused meanwhile */
+			bool taken = false;
+			if (!server->handoff_path.empty()) {
+				try
+				{
+					server->TakeOver(server->handoff_path);
+					taken = true;
+				}
+				catch (const std::exception &e)
+				{
+					std::cout << "No running instance to take over: " << e.what() << std::endl;
+				}
+			}
+
+			if (!taken)
+				server->Start();
+
+			if (!server->handoff_path.empty())
+				server->ServeHandoff(server->handoff_path);
 		}
 		catch(const std::exception& e)
 		{
@@ -133,7 +281,11 @@ int main(int argc, char *argv[])
 	if (argc > 1 && std::string(argv[1]) == "--test") {
 		std::this_thread::sleep_for(std::chrono::seconds(1));
 	} else {
-		std::promise<void>().get_future().wait();
+		/* Exit once every logger is handed over and its clients are served */
+		while (std::any_of(servers.begin(), servers.end(), [](const std::unique_ptr<Listener> &server) {
+			return !server->IsHandedOff() || server->GetNumberOfClients();
+		}))
+			std::this_thread::sleep_for(std::chrono::seconds(1));
 	}
 
 	return 0;
@@ -0,0 +1,106 @@
+#ifndef __ROUTE_TABLE_H__
+#define __ROUTE_TABLE_H__
+
+#include <stdint.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Maps magic numbers of messages to their receivers.
+ *
+ * Open addressing with linear probing in a flat array kept at most half
+ * full, so a lookup touches a slot or two whatever the amount of
+ * receivers. Table is filled before servers start and only read
+ * afterwards, lookups need no locking.
+ */
+template <typename T>
+class RouteTable
+{
+public:
+	/**
+	 * @brief Add receiver of magic number.
+	 *
+	 * Throws std::runtime_error if magic number has a receiver already.
+	 *
+	 * @param magic		Magic number.
+	 * @param target	Receiver, stays owned by caller.
+	 */
+	void Add(uint32_t magic, T *target)
+	{
+		if (Find(magic))
+			throw std::runtime_error("RouteTable::Add: Magic number is taken: " + std::to_string(magic));
+
+		if ((_count + 1) * 2 > _slots.size())
+			Resize(_slots.empty() ? 16 : _slots.size() * 2);
+
+		Insert(magic, target);
+		_count++;
+	}
+
+	/**
+	 * @brief Find receiver of magic number.
+	 *
+	 * @param magic		Magic number.
+	 * @return Receiver, nullptr if none.
+	 */
+	T *Find(uint32_t magic) const
+	{
+		if (_slots.empty())
+			return nullptr;
+
+		for (size_t i = Hash(magic) & _mask; _slots[i].target; i = (i + 1) & _mask)
+			if (_slots[i].magic == magic)
+				return _slots[i].target;
+
+		return nullptr;
+	}
+
+	/**
+	 * @brief Get amount of receivers.
+	 */
+	size_t Size() const { return _count; }
+private:
+	struct Slot
+	{
+		uint32_t magic;
+		T *target;
+	};
+
+	/* Magic numbers are often alike or sequential, spread them over low bits */
+	static size_t Hash(uint32_t magic)
+	{
+		magic ^= magic >> 16;
+		magic *= 0x7feb352dU;
+		magic ^= magic >> 15;
+		magic *= 0x846ca68bU;
+		magic ^= magic >> 16;
+		return magic;
+	}
+
+	void Insert(uint32_t magic, T *target)
+	{
+		size_t i = Hash(magic) & _mask;
+		while (_slots[i].target)
+			i = (i + 1) & _mask;
+
+		_slots[i] = { magic, target };
+	}
+
+	void Resize(size_t size)
+	{
+		std::vector<Slot> old(size, Slot { 0, nullptr });
+		old.swap(_slots);
+		_mask = size - 1;
+
+		for (const Slot &slot : old)
+			if (slot.target)
+				Insert(slot.magic, slot.target);
+	}
+
+	std::vector<Slot> _slots;
+	size_t _mask = 0;
+	size_t _count = 0;
+};
+
+#endif /* __ROUTE_TABLE_H__ */
@@ -0,0 +1,118 @@
+#include <sys/file.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+#include "segment_writer.h"
+
+SegmentWriter::SegmentWriter(const std::string &path, size_t segment_size)
+	: _path(path), _segment_size(segment_size)
+{
+	/* Only the last segment may have room left */
+	size_t index = 0;
+	while (!access(GetSegmentPath(index + 1).c_str(), F_OK))
+		index++;
+
+	Segment segment;
+	while (!Open(index, segment))
+		index++;
+	Use(segment);
+}
+
+std::string SegmentWriter::GetSegmentPath(size_t index) const
+{
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), ".%06zu", index);
+
+	return _path + suffix;
+}
+
+bool SegmentWriter::Open(size_t index, Segment &segment)
+{
+	File file(GetSegmentPath(index), File::OpenFlags::READ_WRITE);
+
+	/* Instance handing off still writes it, lock goes away with the file */
+	if (flock(file.GetFd(), LOCK_EX | LOCK_NB) < 0)
+	{
+		if (errno == EWOULDBLOCK)
+			return false;
+		throw std::system_error(errno, std::generic_category());
+	}
+
+	/* Segment cut to its data is finished, so is one of another size */
+	off_t size = file.GetStats().GetSize();
+	if (size && static_cast<size_t>(size) != _segment_size)
+		return false;
+
+	file.Allocate(static_cast<off_t>(_segment_size));
+	std::shared_ptr<File::Mmap> map = file.MapFile(_segment_size);
+	char *data = map->GetPtrAs<char>();
+
+	/* Recovery, data ends with the last byte which is not zero */
+	size_t tail = _segment_size;
+	while (tail && !data[tail - 1])
+		tail--;
+
+	segment.file = file;
+	segment.map = map;
+	segment.index = index;
+	segment.tail = tail;
+	return true;
+}
+
+void SegmentWriter::Use(const Segment &segment)
+{
+	_file = segment.file;
+	_map = segment.map;
+	_data = _map->GetPtrAs<char>();
+	_index = segment.index;
+	_tail = segment.tail;
+	_synced = segment.tail;
+}
+
+void SegmentWriter::Roll()
+{
+	Sync();
+
+	/* Next segment is ready first, failing to open it keeps this one in use */
+	Segment next;
+	size_t index = _index + 1;
+	while (!Open(index, next))
+		index++;
+
+	File finished = _file;
+	off_t size = static_cast<off_t>(_tail);
+	Use(next);
+
+	/* Finished segment holds no padding for readers, mapping goes with it */
+	finished.Truncate(size);
+	finished.Sync();
+	finished.Close();
+}
+
+void SegmentWriter::Write(struct iovec *iov, size_t count)
+{
+	for (size_t i = 0; i != count; i++)
+	{
+		size_t size = iov[i].iov_len;
+		if (size > _segment_size)
+			throw std::system_error(EFBIG, std::generic_category());
+
+		/* Records are never split between segments */
+		if (_tail + size > _segment_size)
+			Roll();
+
+		memcpy(_data + _tail, iov[i].iov_base, size);
+		_tail += size;
+	}
+}
+
+void SegmentWriter::Sync()
+{
+	if (_tail == _synced)
+		return;
+
+	_map->Sync(_synced, _tail - _synced);
+	_synced = _tail;
+}
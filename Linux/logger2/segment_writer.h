@@ -0,0 +1,96 @@
+#ifndef __SEGMENT_WRITER_H__
+#define __SEGMENT_WRITER_H__
+
+#include <memory>
+#include <string>
+#include "file_ops.h"
+#include "log_writer.h"
+
+/**
+ * Appends records to preallocated memory mapped segments.
+ *
+ * Segments are files of fixed size named after path and their index.
+ * Every one is allocated whole once opened, so appends neither grow a
+ * file nor change its metadata and syncing writes data pages only.
+ * Records are copied into the mapping, a sync writes the range appended
+ * since the previous one. Segment too full for the next record is cut
+ * to its data and the next one is opened.
+ *
+ * Tail is kept in memory only. Unused part of a segment is zero, so the
+ * end of data is found scanning the last segment backwards, records must
+ * not end with zero bytes. Segment being written is locked, instance
+ * started while another one still writes continues in a new segment.
+ */
+class SegmentWriter final: public LogSink
+{
+public:
+	/**
+	 * @brief Constructor of SegmentWriter class, opens the last segment.
+	 *
+	 * Throws std::system_error on error.
+	 *
+	 * @param path		Path of segments, ".index" is appended.
+	 * @param segment_size	Size of every segment in bytes.
+	 */
+	SegmentWriter(const std::string &path, size_t segment_size);
+
+	/**
+	 * @brief Copy records into the segment, next one is opened if it is full.
+	 *
+	 * Throws std::system_error on error, EFBIG if record is larger than segment.
+	 */
+	void Write(struct iovec *iov, size_t count) override;
+
+	/**
+	 * @brief Sync records appended since the last sync.
+	 *
+	 * Throws std::system_error on error.
+	 */
+	void Sync() override;
+
+	/**
+	 * @brief Get index of segment being written.
+	 */
+	size_t GetSegment() const { return _index; }
+
+	/**
+	 * @brief Get offset of the next record in the segment.
+	 */
+	size_t GetTail() const { return _tail; }
+
+	/**
+	 * @brief Get path of segment.
+	 *
+	 * @param index		Index of segment.
+	 */
+	std::string GetSegmentPath(size_t index) const;
+private:
+	/* Segment opened and mapped, continued at tail */
+	struct Segment
+	{
+		File file;
+		std::shared_ptr<File::Mmap> map;
+		size_t index;
+		size_t tail;
+	};
+
+	/* Open segment to continue, false if it is finished or written by another instance */
+	bool Open(size_t index, Segment &segment);
+
+	/* Open next free segment, then cut this one to its data */
+	void Roll();
+
+	/* Continue writing opened segment */
+	void Use(const Segment &segment);
+
+	std::string _path;
+	size_t _segment_size;
+	size_t _index = 0;
+	File _file;
+	std::shared_ptr<File::Mmap> _map;
+	char *_data = nullptr;
+	size_t _tail = 0;
+	size_t _synced = 0;
+};
+
+#endif /* __SEGMENT_WRITER_H__ */
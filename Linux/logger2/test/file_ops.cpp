@@ -0,0 +1 @@
+../../../Common/file_ops.cpp
\ No newline at end of file
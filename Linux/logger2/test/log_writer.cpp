@@ -0,0 +1 @@
+../log_writer.cpp
\ No newline at end of file
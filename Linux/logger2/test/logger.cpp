@@ -0,0 +1 @@
+../logger.cpp
\ No newline at end of file
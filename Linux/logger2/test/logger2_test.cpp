@@ -1,11 +1,324 @@
 #include "server.h"
+#include "logger.h"
+#include "log_writer.h"
+#include "route_table.h"
+#include "segment_writer.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <iostream>
+#include <fstream>
 #include <thread>
 #include <chrono>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 
-#ifndef MAX_MESSAGE_SIZE
-#define MAX_MESSAGE_SIZE 1500
-#endif
+/* Every heap allocation of the test goes through here and is counted */
+static std::atomic<size_t> allocations { 0 };
+
+void *operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+/*
+ * Append records from several threads, each waiting for its last one to
+ * be durable, then check every record is in the file whole.
+ */
+static bool check_writer(const DurabilityPolicy &policy)
+{
+	const size_t threads = 4;
+	const size_t records = 1000;
+	const char *path = "/tmp/logger2_writer_test.txt";
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0)
+		return false;
+
+	bool durable = true;
+	{
+		/* Small queue makes producers wait for the writer too */
+		LogWriter writer(fd, policy, 64, 256);
+		std::vector<std::thread> producers;
+		for (size_t t = 0; t != threads; t++) {
+			producers.emplace_back([&writer, &durable, t, records]() {
+				uint64_t ticket = 0;
+				for (size_t i = 0; i != records; i++) {
+					std::string record = std::to_string(t) + ":" + std::to_string(i) + "\n";
+					struct iovec part = { &record[0], record.size() };
+					ticket = writer.Append(&part, 1);
+				}
+				if (!writer.Wait(ticket) || !writer.IsDurable(ticket))
+					durable = false;
+			});
+		}
+
+		for (auto &producer : producers)
+			producer.join();
+	}
+	close(fd);
+
+	/* Records of one thread keep their order */
+	std::vector<size_t> next(threads, 0);
+	std::ifstream file(path);
+	std::string line;
+	size_t lines = 0;
+	while (std::getline(file, line)) {
+		size_t t = std::stoul(line);
+		if (t >= threads || line != std::to_string(t) + ":" + std::to_string(next[t]++))
+			return false;
+		lines++;
+	}
+
+	return durable && lines == threads * records;
+}
+
+/* Feeds logger the way listeners of logger2 do */
+class Ingest_Server final : public Network::ServerBase
+{
+public:
+	Ingest_Server(uint16_t port, Logger &logger)
+		: ServerBase(port, MAX_MESSAGE_SIZE, 32, Protocol::TCP, Mode::EPOLL), logger(logger) {}
+
+	~Ingest_Server()
+	{
+		Stop();
+	}
+
+	void OnReceive(Network::MessageBase &msg) override
+	{
+		logger.Receive(msg);
+	}
+private:
+	Logger &logger;
+};
+
+/*
+ * Send messages from several connections to a logger, each waiting for
+ * the acknowledgement of its previous one. Once warmed up none of them
+ * may allocate, neither in loop, writer nor sync path.
+ */
+static bool check_no_allocations()
+{
+	const uint16_t port = 7600;
+	const size_t clients = 16;
+	const char *path = "/tmp/logger2_alloc_test.txt";
+	const std::string reply = "Logged";
+
+	unlink(path);
+	DurabilityPolicy policy;
+	policy.interval = std::chrono::milliseconds(1);
+	Logger logger("Alloc", path, 1, reply, policy, 0);
+	Ingest_Server server(port, logger);
+	server.Start();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::vector<int> sockets;
+	for (size_t i = 0; i != clients; i++) {
+		struct sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)))
+			return false;
+		sockets.push_back(fd);
+	}
+
+	/* Messages go one per connection at a time, stream carries no framing */
+	LogMessage msg = { 1, "sensor 1: 21.5C\n" };
+	size_t size = sizeof(msg.magic) + strlen(msg.data);
+	auto exchange = [&sockets, &msg, size, &reply](size_t rounds) {
+		char ack[16];
+		for (size_t r = 0; r != rounds; r++) {
+			for (int fd : sockets)
+				if (send(fd, &msg, size, 0) != static_cast<ssize_t>(size))
+					return false;
+			for (int fd : sockets)
+				if (recv(fd, ack, reply.size(), MSG_WAITALL) != static_cast<ssize_t>(reply.size()) ||
+				    memcmp(ack, reply.data(), reply.size()))
+					return false;
+		}
+		return true;
+	};
+
+	/* First messages set time zone, thread locals and queues up */
+	bool passed = exchange(100);
+	size_t before = allocations.load();
+	passed = exchange(1000) && passed;
+	size_t after = allocations.load();
+
+	for (int fd : sockets)
+		close(fd);
+
+	if (after != before)
+		std::cerr << "Heap allocations per " << 1000 * clients << " messages: " << after - before << std::endl;
+	return passed && after == before;
+}
+
+/*
+ * Write records over many small segments, continue after restart where
+ * the last segment ends, then read all segments back in order. Second
+ * writer on the same path keeps off the segment the first one holds.
+ */
+static bool check_segments()
+{
+	const size_t segment_size = 1024;
+	const size_t records = 1000;
+	const std::string path = "/tmp/logger2_segment_test";
+
+	/* Segments of previous run */
+	char name[64];
+	for (size_t i = 0; snprintf(name, sizeof(name), "%s.%06zu", path.c_str(), i), !unlink(name); i++)
+		;
+
+	size_t segment, tail;
+	auto append = [&path, segment_size, &segment, &tail](size_t from, size_t to) {
+		SegmentWriter *sink = new SegmentWriter(path, segment_size);
+		LogWriter writer(std::unique_ptr<LogSink>(sink), DurabilityPolicy(), 64, 256);
+		uint64_t ticket = 0;
+		for (size_t i = from; i != to; i++) {
+			std::string record = std::to_string(i) + "\n";
+			struct iovec part = { &record[0], record.size() };
+			ticket = writer.Append(&part, 1);
+		}
+		bool durable = writer.Wait(ticket);
+		segment = sink->GetSegment();
+		tail = sink->GetTail();
+		return durable;
+	};
+
+	if (!append(0, records / 2))
+		return false;
+
+	/* Restart continues the last segment at its tail */
+	size_t last_segment = segment, last_tail = tail;
+	SegmentWriter resumed(path, segment_size);
+	if (resumed.GetSegment() != last_segment || resumed.GetTail() != last_tail)
+		return false;
+
+	/* Segment of running writer is locked */
+	if (SegmentWriter(path, segment_size).GetSegment() == resumed.GetSegment())
+		return false;
+
+	if (!append(records / 2, records))
+		return false;
+
+	size_t next = 0;
+	for (size_t i = 0; i <= segment; i++) {
+		std::ifstream file(resumed.GetSegmentPath(i));
+		std::string line;
+		while (std::getline(file, line)) {
+			/* Active segments are zero padded */
+			line.erase(line.find_last_not_of('\0') + 1);
+			if (line.empty())
+				continue;
+			if (line != std::to_string(next++))
+				return false;
+		}
+	}
+
+	std::cout << "Segments: " << segment + 1 << ", records read back: " << next << std::endl;
+	return next == records && segment > 1;
+}
+
+/*
+ * Next segment can not be opened. Records which do not fit are lost and
+ * reported while the full segment stays in use, writing continues once
+ * the next one opens.
+ */
+static bool check_segment_errors()
+{
+	const size_t segment_size = 1024;
+	const std::string path = "/tmp/logger2_segment_error_test";
+
+	char name[64];
+	for (size_t i = 0; snprintf(name, sizeof(name), "%s.%06zu", path.c_str(), i),
+	     !unlink(name) || !rmdir(name); i++)
+		;
+
+	SegmentWriter *sink = new SegmentWriter(path, segment_size);
+	std::string blocked = sink->GetSegmentPath(1);
+	if (mkdir(blocked.c_str(), 0755))
+		return false;
+
+	bool first, failed;
+	size_t segment;
+	{
+		LogWriter writer(std::unique_ptr<LogSink>(sink), DurabilityPolicy(), 64, 256);
+		size_t next = 0;
+		auto append = [&writer, &next](size_t count) {
+			uint64_t ticket = 0;
+			for (size_t i = 0; i != count; i++) {
+				char record[16];
+				int size = snprintf(record, sizeof(record), "%08zu\n", next++);
+				struct iovec part = { record, static_cast<size_t>(size) };
+				ticket = writer.Append(&part, 1);
+			}
+			return writer.Wait(ticket);
+		};
+
+		first = append(100);
+		failed = !append(50);
+		rmdir(blocked.c_str());
+		append(10);
+		segment = sink->GetSegment();
+	}
+
+	/* Records after the failure went to the next segment */
+	std::ifstream file(blocked);
+	std::string line;
+	bool continued = std::getline(file, line) && line == "00000150";
+
+	return first && failed && continued && segment == 1;
+}
+
+/* Sequential and scattered magic numbers are all found, others are not */
+static bool check_routes()
+{
+	const uint32_t count = 1000;
+	std::vector<uint32_t> targets(count * 2);
+	RouteTable<uint32_t> routes;
+
+	for (uint32_t i = 0; i != count; i++) {
+		routes.Add(i, &targets[i]);
+		routes.Add(i * 2654435761U + 0x80000000U, &targets[count + i]);
+	}
+
+	try {
+		routes.Add(0, &targets[0]);
+		return false;
+	} catch (const std::runtime_error &) {
+	}
+
+	for (uint32_t i = 0; i != count; i++)
+		if (routes.Find(i) != &targets[i] || routes.Find(i * 2654435761U + 0x80000000U) != &targets[count + i])
+			return false;
+
+	return routes.Size() == count * 2 && !routes.Find(count) && !RouteTable<uint32_t>().Find(0);
+}
 
 int main()
 {
@@ -15,11 +328,7 @@ int main()
 	Network::Client clientTCP("127.0.0.1", 7000, Network::ServerBase::Protocol::TCP);
 	Network::Client clientUDP("127.0.0.1", 8000, Network::ServerBase::Protocol::UDP);
 
-	struct
-	{
-		uint32_t magic;
-		char data[MAX_MESSAGE_SIZE - sizeof(uint32_t)];
-	} __attribute__((packed)) msg_to_send = {12345, "Hello, Logger2!"};
+	LogMessage msg_to_send = {12345, "Hello, Logger2!"};
 
 	clientTCP.Send(reinterpret_cast<const char *>(&msg_to_send), 20);
 	auto response = clientTCP.ReadString();
@@ -28,5 +337,43 @@ int main()
 	msg_to_send.magic = 67890;
 	clientUDP.Send(reinterpret_cast<const char *>(&msg_to_send), 20);
 
+	/* Shared port routes by magic number, reply comes from the logger it belongs to */
+	Network::Client sharedTCP("127.0.0.1", 7500, Network::ServerBase::Protocol::TCP);
+	Network::Client sharedUDP("127.0.0.1", 7500, Network::ServerBase::Protocol::UDP);
+	msg_to_send.magic = 12345;
+	sharedTCP.Send(reinterpret_cast<const char *>(&msg_to_send), 20);
+	auto shared_response = sharedTCP.ReadString();
+	std::cout << "Received response on shared port: " << shared_response << std::endl;
+	msg_to_send.magic = 67890;
+	sharedUDP.Send(reinterpret_cast<const char *>(&msg_to_send), 20);
+
+	if (shared_response != "Hello from Logger1!" || !check_routes()) {
+		std::cerr << "Routing test failed" << std::endl;
+		return 1;
+	}
+
+	/* Logger runs for a second only, writer checks go after talking to it */
+	DurabilityPolicy interval, bytes, paranoid;
+	bytes.bytes = 4096;
+	bytes.interval = std::chrono::seconds(1);
+	paranoid.per_message = true;
+	if (!check_writer(interval) || !check_writer(bytes) || !check_writer(paranoid)) {
+		std::cerr << "Log writer test failed" << std::endl;
+		return 1;
+	}
+	std::cout << "Log writer test passed" << std::endl;
+
+	if (!check_segments() || !check_segment_errors()) {
+		std::cerr << "Segment writer test failed" << std::endl;
+		return 1;
+	}
+	std::cout << "Segment writer test passed" << std::endl;
+
+	if (!check_no_allocations()) {
+		std::cerr << "Allocation test failed" << std::endl;
+		return 1;
+	}
+	std::cout << "Allocation test passed" << std::endl;
+
 	return response == "Hello from Logger1!" ? 0 : 1;
 }
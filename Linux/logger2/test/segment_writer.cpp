@@ -0,0 +1 @@
+../segment_writer.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../server/uring.cpp
\ No newline at end of file
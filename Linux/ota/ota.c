@@ -136,6 +136,12 @@ static server_event_t server_ops = {
 	.read_timeout_s = 0,
 };
 
+/* Page send blocks, device that stops reading holds one worker only */
+static const server_config_t server_config = {
+	.mode = SERVER_MODE_EPOLL,
+	.workers = 4,
+};
+
 static char *version(uint8_t *firmware)
 {
 	return (char *)firmware + 48;
@@ -249,8 +255,8 @@ restart:
 	}
 
 	/* start server */
-	ota_server = server_start(ota_ops.port, &server_ops,
-		OTA_HEADER_SIZE, 0);
+	ota_server = server_start_ex(ota_ops.port, &server_ops,
+		OTA_HEADER_SIZE, 0, &server_config);
 	if (!ota_server) {
 		fprintf(stderr, "Start OTA server failed\n");
 		free(ota_ops.firmware);
@@ -1,10 +1,14 @@
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include "server.h"
 
@@ -16,10 +20,18 @@
 #define MAX_CLIENTS				128
 #endif
 
+#ifndef EPOLL_EVENTS_MAX
+#define EPOLL_EVENTS_MAX			64
+#endif
+
+/* Pause of accepting after an error the loop survives */
+#ifndef ACCEPT_RETRY_MS
+#define ACCEPT_RETRY_MS				100
+#endif
+
 static const char *no_mem_err = "No memory";
 static const char *thread_err = "Thread create error";
-static int client_socket_list[MAX_CLIENTS] = { 0 };
-static pthread_mutex_t lock;
+static const char *no_slot_err = "Too many clients";
 
 struct client {
 	int socket;
@@ -28,60 +40,134 @@ struct client {
 	pthread_t thread;
 	size_t size;
 	void *user;
+	server_t server;
+	int active;
+	/* Next free slot, -1 ends the list */
+	int next_free;
+	/* EPOLL mode only */
+	void *buffer;
+	int armed;
+	time_t last_active;
 };
 
 struct server {
 	int socket;
 	pthread_t thread;
-	socklen_t clilen;
 	server_event_t *ops;
 	size_t size;
 	void *user;
+	server_mode_t mode;
+	int stopping;
+	int joined;
+	int result;
+
+	/* Slot table, free slots are linked from free_head */
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	struct client *clients;
+	size_t max_clients;
+	size_t active;
+	int free_head;
+
+	/* EPOLL mode only */
+	int epollfd;
+	int wakefd;
+	/* Accepting is paused until then, 0 if it runs */
+	int64_t accept_resume;
+	int64_t last_sweep;
+	pthread_t *workers;
+	size_t num_workers;
+	pthread_mutex_t job_lock;
+	pthread_cond_t job_ready;
+	client_t *jobs;
+	size_t job_head;
+	size_t job_count;
 };
 
-static int add_client_to_list(int new_socket)
+static int is_stopping(server_t server)
 {
-	int i;
+	return __atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE);
+}
 
-	pthread_mutex_lock(&lock);
+static int64_t now_ms(void)
+{
+	struct timespec ts;
 
-	for (i = 0; i != MAX_CLIENTS; i++)
-		if (client_socket_list[i] == 0) {
-			client_socket_list[i] = new_socket;
-			pthread_mutex_unlock(&lock);
-			return 0;
-		}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	pthread_mutex_unlock(&lock);
-	return EAGAIN;
+/* Out of descriptors or memory, clients leaving give them back */
+static int is_resource_error(int error)
+{
+	return error == EMFILE || error == ENFILE || error == ENOBUFS ||
+		error == ENOMEM;
 }
 
-static void remove_client_from_list(int old_socket)
+/*
+ * Accept error is reported, server stops only if error() asks for it.
+ * Running out of resources never stops it.
+ */
+static int accept_failed(server_t server, int error)
 {
-	int i;
+	server_event_t *ops = server->ops;
 
-	pthread_mutex_lock(&lock);
-	for (i = 0; i != MAX_CLIENTS; i++)
-		if (client_socket_list[i] == old_socket) {
-			client_socket_list[i] = 0;
-			pthread_mutex_unlock(&lock);
-			return;
-		}
-	pthread_mutex_unlock(&lock);
+	return ops->error && ops->error("Socket accept error", error,
+		server->user) && !is_resource_error(error);
 }
 
-static void terminate_all_clients(void)
+static client_t acquire_client(server_t server, int sockfd,
+	const struct sockaddr_in *addr)
 {
-	int i;
+	client_t client = NULL;
 
-	pthread_mutex_lock(&lock);
-	for (i = 0; i != MAX_CLIENTS; i++) {
-		if (client_socket_list[i]) {
-			shutdown(client_socket_list[i], SHUT_RD);
-			close(client_socket_list[i]);
-		}
+	pthread_mutex_lock(&server->lock);
+	if (server->free_head >= 0) {
+		client = &server->clients[server->free_head];
+		server->free_head = client->next_free;
+		server->active++;
+
+		client->socket = sockfd;
+		client->cli_addr = *addr;
+		client->ops = server->ops;
+		client->size = server->size;
+		client->user = server->user;
+		client->active = 1;
+		client->armed = 0;
+		client->buffer = NULL;
+		client->last_active = time(NULL);
 	}
-	pthread_mutex_unlock(&lock);
+	pthread_mutex_unlock(&server->lock);
+
+	return client;
+}
+
+static void release_client(client_t client)
+{
+	server_t server = client->server;
+
+	pthread_mutex_lock(&server->lock);
+	/* Closed under lock, so expiry never shuts down a reused descriptor */
+	close(client->socket);
+	client->socket = -1;
+	client->active = 0;
+	client->next_free = server->free_head;
+	server->free_head = (int)(client - server->clients);
+	if (!--server->active)
+		pthread_cond_broadcast(&server->idle);
+	pthread_mutex_unlock(&server->lock);
+}
+
+static void terminate_all_clients(server_t server)
+{
+	size_t i;
+
+	/* Handlers see end of stream and release the slots */
+	pthread_mutex_lock(&server->lock);
+	for (i = 0; i != server->max_clients; i++)
+		if (server->clients[i].active)
+			shutdown(server->clients[i].socket, SHUT_RDWR);
+	pthread_mutex_unlock(&server->lock);
 }
 
 static void *client_handler(void *ptr)
@@ -113,19 +199,6 @@ static void *client_handler(void *ptr)
 		}
 	}
 
-	if (ops->read_timeout_s) {
-		struct timeval tv;
-		tv.tv_sec = ops->read_timeout_s;
-		tv.tv_usec = 0;
-		if (setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO,
-			(void *)&tv, sizeof tv)) {
-			if (ops->error)
-				ops->error("Socket setsockopt error", errno,
-					client->user);
-			goto err_free;
-		}
-	}
-
 	do {
 		size = read(client->socket, buffer,
 			client->size);
@@ -138,155 +211,600 @@ static void *client_handler(void *ptr)
 err_free:
 	free(buffer);
 err_nomem:
-	close(client->socket);
-	remove_client_from_list(client->socket);
-
 	if (ops->disconnected)
 		ops->disconnected(client);
 
-	free(client);
+	release_client(client);
 
 	pthread_detach(pthread_self());
 	pthread_exit(0);
 	return 0;
 }
 
+static void set_socket_timeout(int sockfd)
+{
+#ifdef SOCKET_TIMEOUT
+	struct timeval timeout = {
+		.tv_sec = SOCKET_TIMEOUT,
+		.tv_usec = 0,
+	};
+
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+		sizeof timeout);
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+		sizeof timeout);
+#else
+	(void)sockfd;
+#endif /* SOCKET_TIMEOUT */
+}
+
 static void *server_handler(void *ptr)
 {
 	server_t server = (server_t)ptr;
 	int clientfd;
+	server_event_t *ops = server->ops;
+	int res = 0;
+
+	do {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		client_t client;
+
+		clientfd = accept(server->socket,
+			(struct sockaddr *)&addr, &len);
+		if (clientfd < 0) {
+			struct timespec retry = {
+				.tv_sec = 0,
+				.tv_nsec = ACCEPT_RETRY_MS * 1000000L,
+			};
+
+			/* server_stop() wakes accept by shutting socket down */
+			if (is_stopping(server))
+				break;
+
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			res = errno;
+			if (accept_failed(server, res))
+				break;
+
+			res = 0;
+			nanosleep(&retry, NULL);
+			continue;
+		}
+
+		set_socket_timeout(clientfd);
+
+		client = acquire_client(server, clientfd, &addr);
+		if (!client) {
+			close(clientfd);
+			if (ops->error && ops->error(no_slot_err, EAGAIN,
+				server->user)) {
+				res = EAGAIN;
+				break;
+			}
+			continue;
+		}
+
+		res = pthread_create(&client->thread, NULL, client_handler,
+			(void *)client);
+		if (res) {
+			if (ops->error)
+				ops->error(thread_err, res, server->user);
+			release_client(client);
+			break;
+		}
+	} while (!is_stopping(server));
+
+	shutdown(server->socket, SHUT_RD);
+	server->result = res;
+
+	return 0;
+}
+
+static int client_arm(server_t server, client_t client)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP,
+		.data.ptr = client,
+	};
+	int op = client->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	/* Worker owns the client until it is armed again */
+	if (server->num_workers)
+		ev.events |= EPOLLONESHOT;
+	else if (client->armed)
+		return 0;
+
+	/* Set first, worker taking the first event must see a read job */
+	client->armed = 1;
+	if (epoll_ctl(server->epollfd, op, client->socket, &ev)) {
+		client->armed = op == EPOLL_CTL_MOD;
+		return errno;
+	}
+
+	return 0;
+}
+
+static void client_drop(server_t server, client_t client)
+{
+	if (client->armed)
+		epoll_ctl(server->epollfd, EPOLL_CTL_DEL, client->socket, NULL);
+
+	if (server->ops->disconnected)
+		server->ops->disconnected(client);
+
+	free(client->buffer);
+	release_client(client);
+}
+
+static void client_connect(server_t server, client_t client)
+{
 	server_event_t *ops = server->ops;
 	int res;
 
-	res = listen(server->socket, LISTEN_BACKLOG_VALUE);
+	client->buffer = malloc(server->size);
+	if (!client->buffer) {
+		if (ops->error)
+			ops->error(no_mem_err, ENOMEM, server->user);
+		goto err;
+	}
+
+	if (ops->connected && ops->connected(client))
+		goto err;
+
+	res = client_arm(server, client);
 	if (res) {
-		res = errno;
 		if (ops->error)
-                                ops->error("Socket listen error", res, server->user);
+			ops->error("Epoll add error", res, server->user);
 		goto err;
 	}
 
-	do {
-		client_t client = malloc(sizeof(*client));
-		if (!client) {
-			res = ENOMEM;
-			if (ops->error && ops->error(no_mem_err, ENOMEM, server->user))
-				goto err;
-			continue;
+	return;
+err:
+	client_drop(server, client);
+}
+
+static void client_read(server_t server, client_t client)
+{
+	server_event_t *ops = server->ops;
+	ssize_t size;
+	int res;
+
+	size = read(client->socket, client->buffer, server->size);
+	if (!size || (size < 0 && errno != EINTR))
+		goto err;
+
+	if (size > 0) {
+		if (ops->receive && ops->receive(client, client->buffer, size))
+			goto err;
+
+		__atomic_store_n(&client->last_active, time(NULL),
+			__ATOMIC_RELAXED);
+	}
+
+	res = client_arm(server, client);
+	if (res) {
+		if (ops->error)
+			ops->error("Epoll modify error", res, server->user);
+		goto err;
+	}
+
+	return;
+err:
+	client_drop(server, client);
+}
+
+static void queue_job(server_t server, client_t client)
+{
+	pthread_mutex_lock(&server->job_lock);
+	/* Client is queued once at most, so the ring never overflows */
+	server->jobs[(server->job_head + server->job_count) %
+		server->max_clients] = client;
+	server->job_count++;
+	pthread_cond_signal(&server->job_ready);
+	pthread_mutex_unlock(&server->job_lock);
+}
+
+static void *worker_handler(void *ptr)
+{
+	server_t server = (server_t)ptr;
+	client_t client;
+
+	while (1) {
+		pthread_mutex_lock(&server->job_lock);
+		while (!server->job_count && !is_stopping(server))
+			pthread_cond_wait(&server->job_ready,
+				&server->job_lock);
+
+		if (is_stopping(server)) {
+			pthread_mutex_unlock(&server->job_lock);
+			break;
 		}
 
+		client = server->jobs[server->job_head];
+		server->job_head = (server->job_head + 1) % server->max_clients;
+		server->job_count--;
+		pthread_mutex_unlock(&server->job_lock);
+
+		if (client->armed)
+			client_read(server, client);
+		else
+			client_connect(server, client);
+	}
+
+	return 0;
+}
+
+/* Listening socket stays readable while accept fails, stop polling it */
+static int pause_accept(server_t server)
+{
+	struct epoll_event ev = { .events = 0, .data.ptr = server };
+
+	if (epoll_ctl(server->epollfd, EPOLL_CTL_MOD, server->socket, &ev))
+		return errno;
+
+	server->accept_resume = now_ms() + ACCEPT_RETRY_MS;
+	return 0;
+}
+
+static int resume_accept(server_t server)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = server };
+
+	if (epoll_ctl(server->epollfd, EPOLL_CTL_MOD, server->socket, &ev))
+		return errno;
+
+	server->accept_resume = 0;
+	return 0;
+}
+
+static int accept_clients(server_t server)
+{
+	server_event_t *ops = server->ops;
+	int res;
+
+	while (1) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		client_t client;
+		int clientfd;
+
 		clientfd = accept(server->socket,
-			(struct sockaddr *)&client->cli_addr, &server->clilen);
+			(struct sockaddr *)&addr, &len);
 		if (clientfd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EINTR || errno == ECONNABORTED)
+				return 0;
+
 			res = errno;
-			if (ops->error && ops->error("Socket accept error", res,
-				server->user)) {
-				free(client);
-				goto err;
-			}
+			if (accept_failed(server, res))
+				return res;
+
+			return pause_accept(server);
+		}
+
+		/* Listening socket is nonblocking, clients are not */
+		fcntl(clientfd, F_SETFL,
+			fcntl(clientfd, F_GETFL) & ~O_NONBLOCK);
+		set_socket_timeout(clientfd);
+
+		client = acquire_client(server, clientfd, &addr);
+		if (!client) {
+			close(clientfd);
+			if (ops->error && ops->error(no_slot_err, EAGAIN,
+				server->user))
+				return EAGAIN;
 			continue;
 		}
 
-#ifdef SOCKET_TIMEOUT
-	{
-		struct timeval timeout = {
-			.tv_sec = SOCKET_TIMEOUT,
-			.tv_usec = 0,
-	};
+		if (server->num_workers)
+			queue_job(server, client);
+		else
+			client_connect(server, client);
+	}
+}
 
-		setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
-		sizeof timeout);
-		setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
-		sizeof timeout);
+static void expire_clients(server_t server)
+{
+	time_t now = time(NULL);
+	time_t timeout = (time_t)server->ops->read_timeout_s;
+	size_t i;
+
+	/* Idle ones read end of stream and are dropped as usual */
+	pthread_mutex_lock(&server->lock);
+	for (i = 0; i != server->max_clients; i++) {
+		client_t client = &server->clients[i];
+
+		if (client->active && now - __atomic_load_n(
+			&client->last_active, __ATOMIC_RELAXED) > timeout)
+			shutdown(client->socket, SHUT_RDWR);
 	}
-#endif /* SOCKET_TIMEOUT */
+	pthread_mutex_unlock(&server->lock);
+}
 
-		client->ops = server->ops;
-		client->user = server->user;
-		client->socket = clientfd;
-		client->size = server->size;
+/* Wait until the next idle sweep or accept retry, whichever comes first */
+static int loop_timeout(server_t server, int64_t now)
+{
+	int64_t due = -1;
 
-		res = add_client_to_list(clientfd);
-		if (res) {
-			free(client);
-			goto err;
-		}
+	if (server->ops->read_timeout_s)
+		due = server->last_sweep + 1000;
 
-		res = pthread_create(&client->thread, NULL, client_handler,
-			(void *)client);
-		if (res) {
+	if (server->accept_resume && (due < 0 || server->accept_resume < due))
+		due = server->accept_resume;
+
+	if (due < 0)
+		return -1;
+
+	return due > now ? (int)(due - now) : 0;
+}
+
+static void *server_loop(void *ptr)
+{
+	server_t server = (server_t)ptr;
+	server_event_t *ops = server->ops;
+	struct epoll_event events[EPOLL_EVENTS_MAX];
+	int64_t now;
+	int res = 0;
+	int i, n;
+
+	server->last_sweep = now_ms();
+	while (!is_stopping(server)) {
+		n = epoll_wait(server->epollfd, events, EPOLL_EVENTS_MAX,
+			loop_timeout(server, now_ms()));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			res = errno;
 			if (ops->error)
-				ops->error(thread_err, res, server->user);
-			close(clientfd);
-			remove_client_from_list(clientfd);
-			free(client);
-			goto err;
+				ops->error("Epoll wait error", res,
+					server->user);
+			break;
 		}
 
-	} while (clientfd > 0 && server->socket > 0);
+		for (i = 0; i != n && !res; i++) {
+			void *ptr = events[i].data.ptr;
 
-err:
-	shutdown(server->socket, SHUT_RD);
+			/* Wake up descriptor is registered with NULL */
+			if (!ptr)
+				continue;
+
+			if (ptr == server)
+				res = accept_clients(server);
+			else if (server->num_workers)
+				queue_job(server, (client_t)ptr);
+			else
+				client_read(server, (client_t)ptr);
+		}
+
+		if (res)
+			break;
+
+		now = now_ms();
+		if (server->accept_resume && now >= server->accept_resume) {
+			res = resume_accept(server);
+			if (res) {
+				if (ops->error)
+					ops->error("Epoll modify error", res,
+						server->user);
+				break;
+			}
+		}
+
+		/* Sweep walks the whole table, once a second is enough */
+		if (ops->read_timeout_s && now - server->last_sweep >= 1000) {
+			server->last_sweep = now;
+			expire_clients(server);
+		}
+	}
+
+	server->result = res;
+
+	return 0;
+}
+
+static int epoll_setup(server_t server, size_t workers)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	size_t i;
+	int res;
+
+	server->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (server->epollfd < 0)
+		return errno;
+
+	server->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (server->wakefd < 0)
+		return errno;
+
+	if (fcntl(server->socket, F_SETFL,
+		fcntl(server->socket, F_GETFL) | O_NONBLOCK))
+		return errno;
+
+	ev.data.ptr = server;
+	if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, server->socket, &ev))
+		return errno;
+
+	ev.data.ptr = NULL;
+	if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, server->wakefd, &ev))
+		return errno;
+
+	if (!workers)
+		return 0;
+
+	server->jobs = calloc(server->max_clients, sizeof(*server->jobs));
+	server->workers = calloc(workers, sizeof(*server->workers));
+	if (!server->jobs || !server->workers)
+		return ENOMEM;
+
+	/* Counts running workers only, failed setup joins just those */
+	for (i = 0; i != workers; i++) {
+		res = pthread_create(&server->workers[i], NULL, worker_handler,
+			(void *)server);
+		if (res)
+			return res;
+		server->num_workers++;
+	}
 
-	pthread_exit(&res);
 	return 0;
 }
 
+static void stop_workers(server_t server)
+{
+	size_t i;
+
+	pthread_mutex_lock(&server->job_lock);
+	__atomic_store_n(&server->stopping, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&server->job_ready);
+	pthread_mutex_unlock(&server->job_lock);
+
+	for (i = 0; i != server->num_workers; i++)
+		pthread_join(server->workers[i], NULL);
+	server->num_workers = 0;
+}
+
+static void server_free(server_t server)
+{
+	if (server->mode == SERVER_MODE_EPOLL) {
+		if (server->epollfd >= 0)
+			close(server->epollfd);
+		if (server->wakefd >= 0)
+			close(server->wakefd);
+		free(server->workers);
+		free(server->jobs);
+	}
+
+	if (server->socket >= 0)
+		close(server->socket);
+	pthread_cond_destroy(&server->job_ready);
+	pthread_mutex_destroy(&server->job_lock);
+	pthread_cond_destroy(&server->idle);
+	pthread_mutex_destroy(&server->lock);
+	free(server->clients);
+	free(server);
+}
+
+static server_t server_alloc(const server_config_t *config)
+{
+	server_t server = calloc(1, sizeof(*server));
+	size_t i;
+
+	if (!server)
+		return NULL;
+
+	server->mode = config ? config->mode : SERVER_MODE_THREADED;
+	server->max_clients = config && config->max_clients ?
+		config->max_clients : MAX_CLIENTS;
+	server->socket = -1;
+	server->epollfd = -1;
+	server->wakefd = -1;
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->idle, NULL);
+	pthread_mutex_init(&server->job_lock, NULL);
+	pthread_cond_init(&server->job_ready, NULL);
+
+	server->clients = calloc(server->max_clients, sizeof(*server->clients));
+	if (!server->clients) {
+		server_free(server);
+		return NULL;
+	}
+
+	/* All slots are free, linked in order */
+	for (i = 0; i != server->max_clients; i++) {
+		server->clients[i].server = server;
+		server->clients[i].socket = -1;
+		server->clients[i].next_free =
+			i + 1 == server->max_clients ? -1 : (int)(i + 1);
+	}
+
+	return server;
+}
+
 server_t server_start(uint16_t port, server_event_t *ops, size_t size, void *user)
 {
-	server_t server = (server_t)malloc(sizeof(*server));
+	return server_start_ex(port, ops, size, user, NULL);
+}
+
+server_t server_start_ex(uint16_t port, server_event_t *ops, size_t size, void *user,
+	const server_config_t *config)
+{
+	server_t server;
 
 	struct sockaddr_in serv_addr = {
 		.sin_family = AF_INET,
 		.sin_addr.s_addr = htonl(INADDR_ANY),
 		.sin_port = htons(port),
 	};
-	int sockfd;
+	int enable = 1;
 	int res;
 
 	if (!ops)
 		return NULL;
 
+	server = server_alloc(config);
 	if (!server) {
 		if (ops->error)
 			ops->error(no_mem_err, ENOMEM, user);
 		return NULL;
 	}
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
+	server->ops = ops;
+	server->size = size;
+	server->user = user;
+
+	server->socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server->socket < 0) {
 		res = errno;
 		if (ops->error)
 			ops->error("Open socket error", res, user);
 		goto err_free;
 	}
 
-	if (bind(sockfd, (struct sockaddr *) &serv_addr,
+	/* Restarted server binds while old connections are in TIME_WAIT */
+	setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &enable,
+		sizeof(enable));
+
+	if (bind(server->socket, (struct sockaddr *) &serv_addr,
 		sizeof(serv_addr)) < 0) {
 		res = errno;
 		if (ops->error)
 			ops->error("Bind socked error", res, user);
-		goto err_close;
+		goto err_free;
 	}
 
-	server->socket = sockfd;
-	server->ops = ops;
-	server->size = size;
-	server->user = user;
+	if (listen(server->socket, LISTEN_BACKLOG_VALUE)) {
+		res = errno;
+		if (ops->error)
+			ops->error("Socket listen error", res, user);
+		goto err_free;
+	}
 
-	res = pthread_create(&server->thread, NULL, server_handler,
+	if (server->mode == SERVER_MODE_EPOLL) {
+		res = epoll_setup(server, config ? config->workers : 0);
+		if (res) {
+			if (ops->error)
+				ops->error("Epoll setup error", res, user);
+			goto err_workers;
+		}
+	}
+
+	res = pthread_create(&server->thread, NULL,
+		server->mode == SERVER_MODE_EPOLL ? server_loop : server_handler,
 		(void *)server);
 	if (res) {
 		if (ops->error)
 			ops->error(thread_err, res, user);
-		goto err_free;
+		goto err_workers;
 	}
 
 	return server;
+err_workers:
+	stop_workers(server);
 err_free:
-	free(server);
-err_close:
-	close(sockfd);
+	server_free(server);
 	return NULL;
 }
 
@@ -314,28 +832,52 @@ void *get_user_data(client_t client)
 
 int server_stop(server_t server)
 {
+	uint64_t wake = 1;
+	size_t i;
+	int res;
+
 	if (!server)
 		return EINVAL;
 
-	terminate_all_clients();
-	close(server->socket);
+	__atomic_store_n(&server->stopping, 1, __ATOMIC_RELEASE);
+
+	if (server->mode == SERVER_MODE_EPOLL) {
+		if (write(server->wakefd, &wake, sizeof(wake)) < 0)
+			shutdown(server->socket, SHUT_RDWR);
+		res = server_wait_for_err(server);
+		stop_workers(server);
+
+		/* Loop and workers are gone, drop the rest in place */
+		for (i = 0; i != server->max_clients; i++)
+			if (server->clients[i].active)
+				client_drop(server, &server->clients[i]);
+	} else {
+		shutdown(server->socket, SHUT_RDWR);
+		res = server_wait_for_err(server);
+
+		terminate_all_clients(server);
+		pthread_mutex_lock(&server->lock);
+		while (server->active)
+			pthread_cond_wait(&server->idle, &server->lock);
+		pthread_mutex_unlock(&server->lock);
+	}
+
+	server_free(server);
 
-	return server_wait_for_err(server);
+	return res;
 }
 
 int server_wait_for_err(server_t server)
 {
-	int res;
-	union {
-		void *retval;
-		int err;
-	} ret;
+	int res = 0;
 
         if (!server)
                 return EINVAL;
 
-	res = pthread_join(server->thread, &ret.retval);
+	if (!server->joined) {
+		res = pthread_join(server->thread, NULL);
+		server->joined = 1;
+	}
 
-	return res ? res : ret.err;
+	return res ? res : server->result;
 }
-
@@ -19,7 +19,20 @@ typedef struct {
 	size_t read_timeout_s;
 } server_event_t;
 
+typedef enum {
+	SERVER_MODE_THREADED,	/* Thread per client */
+	SERVER_MODE_EPOLL,	/* One epoll thread serves all clients */
+} server_mode_t;
+
+typedef struct {
+	server_mode_t mode;
+	size_t max_clients;	/* 0 is MAX_CLIENTS */
+	size_t workers;		/* EPOLL mode threads running callbacks, 0 runs them on the epoll thread */
+} server_config_t;
+
 server_t server_start(uint16_t port, server_event_t *ops, size_t size, void *user);
+server_t server_start_ex(uint16_t port, server_event_t *ops, size_t size, void *user,
+	const server_config_t *config);
 int send_to_client(client_t client, void *msg, size_t size);
 const char *get_client_ip(client_t client);
 int get_client_port(client_t client);
@@ -0,0 +1,472 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Load generator for Network::ServerBase.
+ *
+ * Starts an echo server in the requested modes and drives it over loopback
+ * from concurrent clients for a fixed time. Every client keeps one request
+ * in flight and measures its round trip on the wall clock. Results are
+ * printed as JSON to stdout, progress goes to stderr.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "server.h"
+
+using namespace Network;
+using Clock = std::chrono::steady_clock;
+
+#ifndef BENCH_UDP_TIMEOUT_MS
+#define BENCH_UDP_TIMEOUT_MS		100
+#endif
+
+class Echo_Server final: public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+	void OnReceive(MessageBase &msg) override
+	{
+		msg.Reply(msg.GetData(), msg.GetSize());
+	}
+};
+
+struct Options
+{
+	std::vector<ServerBase::Mode> modes = { ServerBase::Mode::EPOLL };
+	ServerBase::Protocol protocol = ServerBase::Protocol::TCP;
+	size_t clients = 8;
+	size_t size = 64;
+	double duration = 2.0;
+	uint16_t port = 9000;
+	size_t loop_threads = 1;
+	size_t listeners = 1;
+};
+
+/* Outcome of one client, latencies are in nanoseconds */
+struct Stats
+{
+	std::vector<uint32_t> latencies;
+	size_t errors = 0;
+};
+
+static const char *const protocol_names[] = { "tcp", "udp", "unix", "unix-dgram" };
+
+static bool is_stream(const Options &opts)
+{
+	return opts.protocol == ServerBase::Protocol::TCP || opts.protocol == ServerBase::Protocol::UNIX_STREAM;
+}
+
+static bool is_unix(const Options &opts)
+{
+	return opts.protocol == ServerBase::Protocol::UNIX_STREAM || opts.protocol == ServerBase::Protocol::UNIX_DGRAM;
+}
+
+/* Unix servers listen on abstract name derived from the port */
+static std::string unix_path(const Options &opts)
+{
+	return "@bench_server_" + std::to_string(opts.port);
+}
+
+static const char *mode_name(ServerBase::Mode mode)
+{
+	switch (mode)
+	{
+	case ServerBase::Mode::THREADED:
+		return "THREADED";
+	case ServerBase::Mode::EPOLL:
+		return "EPOLL";
+	case ServerBase::Mode::URING:
+		return "URING";
+	}
+	return "UNKNOWN";
+}
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options]\n"
+		  << "  -m, --mode MODE        threaded, epoll, uring or all [epoll]\n"
+		  << "  -p, --protocol PROTO   tcp, udp, unix or unix-dgram [tcp]\n"
+		  << "  -c, --clients N        concurrent clients [8]\n"
+		  << "  -s, --size BYTES       message size [64]\n"
+		  << "  -d, --duration SEC     run time per mode [2]\n"
+		  << "  -P, --port PORT        server port [9000]\n"
+		  << "  -t, --threads N        event loop threads [1]\n"
+		  << "  -l, --listeners N      SO_REUSEPORT listeners [1]\n"
+		  << "\n"
+		  << "mb_per_s counts echoed payload one way, latency is round trip.\n";
+}
+
+static bool parse_options(int argc, char *argv[], Options &opts)
+{
+	static const struct option long_options[] = {
+		{ "mode", required_argument, nullptr, 'm' },
+		{ "protocol", required_argument, nullptr, 'p' },
+		{ "clients", required_argument, nullptr, 'c' },
+		{ "size", required_argument, nullptr, 's' },
+		{ "duration", required_argument, nullptr, 'd' },
+		{ "port", required_argument, nullptr, 'P' },
+		{ "threads", required_argument, nullptr, 't' },
+		{ "listeners", required_argument, nullptr, 'l' },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "m:p:c:s:d:P:t:l:h", long_options, nullptr)) != -1)
+	{
+		std::string arg = optarg ? optarg : "";
+
+		switch (opt)
+		{
+		case 'm':
+			if (arg == "threaded")
+				opts.modes = { ServerBase::Mode::THREADED };
+			else if (arg == "epoll")
+				opts.modes = { ServerBase::Mode::EPOLL };
+			else if (arg == "uring")
+				opts.modes = { ServerBase::Mode::URING };
+			else if (arg == "all")
+				opts.modes = { ServerBase::Mode::THREADED, ServerBase::Mode::EPOLL,
+					       ServerBase::Mode::URING };
+			else
+				return false;
+			break;
+		case 'p':
+		{
+			auto it = std::find(std::begin(protocol_names), std::end(protocol_names), arg);
+			if (it == std::end(protocol_names))
+				return false;
+			opts.protocol = static_cast<ServerBase::Protocol>(it - std::begin(protocol_names));
+			break;
+		}
+		case 'c':
+			opts.clients = std::stoul(arg);
+			break;
+		case 's':
+			opts.size = std::stoul(arg);
+			break;
+		case 'd':
+			opts.duration = std::stod(arg);
+			break;
+		case 'P':
+			opts.port = static_cast<uint16_t>(std::stoul(arg));
+			break;
+		case 't':
+			opts.loop_threads = std::stoul(arg);
+			break;
+		case 'l':
+			opts.listeners = std::stoul(arg);
+			break;
+		default:
+			return false;
+		}
+	}
+
+	/* Datagram has to fit into one IPv4 packet */
+	if (!opts.clients || !opts.size || opts.duration <= 0)
+		return false;
+	return is_stream(opts) || opts.size <= 65507;
+}
+
+static int connect_client(const Options &opts)
+{
+	bool tcp = opts.protocol == ServerBase::Protocol::TCP;
+	int sockfd = socket(is_unix(opts) ? AF_UNIX : AF_INET, is_stream(opts) ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (sockfd < 0)
+		return -1;
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(opts.port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	/* Abstract name, no terminating NUL */
+	std::string path = unix_path(opts);
+	struct sockaddr_un unix_addr = {};
+	unix_addr.sun_family = AF_UNIX;
+	memcpy(unix_addr.sun_path + 1, path.c_str() + 1, path.size() - 1);
+	socklen_t unix_len = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + path.size());
+
+	/* Datagram client needs an address for the echo, family alone autobinds */
+	sa_family_t family = AF_UNIX;
+	if (opts.protocol == ServerBase::Protocol::UNIX_DGRAM &&
+	    bind(sockfd, reinterpret_cast<struct sockaddr *>(&family), sizeof(family)) < 0)
+	{
+		close(sockfd);
+		return -1;
+	}
+
+	if (tcp)
+	{
+		/* Small requests must not wait for Nagle */
+		int one = 1;
+		setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	else if (!is_stream(opts))
+	{
+		/* Datagrams may be lost, do not wait forever */
+		struct timeval tv = { 0, BENCH_UDP_TIMEOUT_MS * 1000 };
+		setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+
+	int res = is_unix(opts) ? connect(sockfd, (struct sockaddr *)&unix_addr, unix_len) :
+				  connect(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+	if (res < 0)
+	{
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+/* Send request and wait for the whole echo, false on error */
+static bool round_trip(int sockfd, bool tcp, const std::vector<char> &request,
+		       std::vector<char> &reply)
+{
+	for (size_t sent = 0; sent != request.size();)
+	{
+		ssize_t res = send(sockfd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+		if (res <= 0)
+			return false;
+		sent += static_cast<size_t>(res);
+	}
+
+	/* Echo of a stream may come in pieces, a datagram comes whole */
+	size_t expected = request.size();
+	for (size_t received = 0; received != expected;)
+	{
+		ssize_t res = recv(sockfd, reply.data() + received, reply.size() - received, 0);
+		if (res <= 0)
+			return false;
+		received += static_cast<size_t>(res);
+		if (!tcp)
+			return received == expected;
+	}
+	return true;
+}
+
+static void run_client(const Options &opts, int sockfd, std::atomic<bool> &start,
+		       Clock::time_point &deadline, Stats &stats)
+{
+	bool tcp = is_stream(opts);
+	std::vector<char> request(opts.size, 'x');
+	std::vector<char> reply(opts.size);
+
+	while (!start)
+		std::this_thread::yield();
+
+	while (true)
+	{
+		Clock::time_point begin = Clock::now();
+		if (begin >= deadline)
+			break;
+
+		if (!round_trip(sockfd, tcp, request, reply))
+		{
+			stats.errors++;
+
+			/* Broken stream can not recover, lost datagram can */
+			if (tcp)
+				break;
+			continue;
+		}
+
+		auto rtt = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin);
+		stats.latencies.push_back(static_cast<uint32_t>(std::min<int64_t>(rtt.count(), UINT32_MAX)));
+	}
+}
+
+static double percentile(const std::vector<uint32_t> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+
+	size_t index = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+	return sorted[index] / 1000.0;
+}
+
+/* Entry of mode which could not be run, keeps output valid JSON */
+static void print_error(ServerBase::Mode mode, const char *error)
+{
+	printf("    {\n");
+	printf("      \"requested_mode\": \"%s\",\n", mode_name(mode));
+	printf("      \"error\": \"%s\"\n", error);
+	printf("    }");
+}
+
+/* Run load against one mode and print its JSON entry, false if server failed */
+static bool run_mode(const Options &opts, ServerBase::Mode mode)
+{
+	std::unique_ptr<Echo_Server> echo(is_unix(opts) ?
+		new Echo_Server(unix_path(opts), std::max<size_t>(opts.size, 1500), opts.clients, opts.protocol, mode) :
+		new Echo_Server(opts.port, std::max<size_t>(opts.size, 1500), opts.clients, opts.protocol, mode));
+	Echo_Server &server = *echo;
+	server.SetLoopThreads(opts.loop_threads);
+	server.SetListeners(opts.listeners);
+
+	try
+	{
+		server.Start();
+	}
+	catch (const std::runtime_error &e)
+	{
+		std::cerr << "Server start failed: " << e.what() << std::endl;
+		print_error(mode, "server start failed");
+		return false;
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	std::vector<int> sockets;
+	for (size_t i = 0; i != opts.clients; i++)
+	{
+		int sockfd = connect_client(opts);
+		if (sockfd < 0)
+		{
+			std::cerr << "Connect failed: " << strerror(errno) << std::endl;
+			for (int fd : sockets)
+				close(fd);
+			server.Stop();
+			print_error(mode, "connect failed");
+			return false;
+		}
+		sockets.push_back(sockfd);
+	}
+
+	std::atomic<bool> start { false };
+	Clock::time_point deadline;
+	std::vector<Stats> stats(opts.clients);
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i != opts.clients; i++)
+		threads.emplace_back(run_client, std::cref(opts), sockets[i], std::ref(start),
+				     std::ref(deadline), std::ref(stats[i]));
+
+	std::cerr << "Running " << mode_name(server.GetMode()) << " for " << opts.duration
+		  << " s with " << opts.clients << " clients" << std::endl;
+
+	Clock::time_point begin = Clock::now();
+	deadline = begin + std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>(opts.duration));
+	start = true;
+
+	for (auto &thread : threads)
+		thread.join();
+	double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+
+	for (int fd : sockets)
+		close(fd);
+	server.Stop();
+
+	std::vector<uint32_t> latencies;
+	size_t errors = 0;
+	for (auto &s : stats)
+	{
+		latencies.insert(latencies.end(), s.latencies.begin(), s.latencies.end());
+		errors += s.errors;
+	}
+	std::sort(latencies.begin(), latencies.end());
+
+	double messages = static_cast<double>(latencies.size());
+	printf("    {\n");
+	printf("      \"requested_mode\": \"%s\",\n", mode_name(mode));
+	printf("      \"mode\": \"%s\",\n", mode_name(server.GetMode()));
+	printf("      \"messages\": %zu,\n", latencies.size());
+	printf("      \"errors\": %zu,\n", errors);
+	printf("      \"elapsed_s\": %.3f,\n", elapsed);
+	printf("      \"msgs_per_s\": %.1f,\n", messages / elapsed);
+	printf("      \"mb_per_s\": %.3f,\n", messages * static_cast<double>(opts.size) / elapsed / 1e6);
+	printf("      \"latency_us\": { \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f }\n",
+	       percentile(latencies, 0.5), percentile(latencies, 0.99),
+	       percentile(latencies, 0.999), percentile(latencies, 1.0));
+	printf("    }");
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	Options opts;
+	if (!parse_options(argc, argv, opts))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("{\n");
+	printf("  \"protocol\": \"%s\",\n", protocol_names[static_cast<int>(opts.protocol)]);
+	printf("  \"clients\": %zu,\n", opts.clients);
+	printf("  \"size\": %zu,\n", opts.size);
+	printf("  \"duration_s\": %.3f,\n", opts.duration);
+	printf("  \"loop_threads\": %zu,\n", opts.loop_threads);
+	printf("  \"listeners\": %zu,\n", opts.listeners);
+	printf("  \"results\": [\n");
+
+	bool ok = true;
+	for (size_t i = 0; i != opts.modes.size(); i++)
+	{
+		/* Every mode prints an entry, separators go between them */
+		if (i)
+			printf(",\n");
+		ok = run_mode(opts, opts.modes[i]) && ok;
+	}
+
+	printf("\n  ]\n");
+	printf("}\n");
+	return ok ? 0 : 1;
+}
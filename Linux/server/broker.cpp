@@ -0,0 +1,582 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Publish/subscribe broker of Posix server.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdexcept>
+#include <algorithm>
+#include <deque>
+#include <cstring>
+#include "broker.h"
+
+using namespace Network;
+
+/* Frame is header, topic and payload, handler gets all of them */
+class BrokerFramer final: public Framer
+{
+public:
+	size_t Next(const char *data, size_t size, size_t &offset, size_t &length) const override
+	{
+		if (size < sizeof(BrokerHeader))
+			return 0;
+
+		BrokerHeader header;
+		memcpy(&header, data, sizeof(header));
+		if (header.magic != BROKER_MAGIC)
+			throw std::runtime_error("BrokerFramer::Next: Invalid frame magic");
+
+		offset = 0;
+		length = sizeof(header) + header.size;
+		return length;
+	}
+};
+
+struct Broker::Subscriber
+{
+	Subscriber(const Connection &connection, size_t slot)
+		: connection(connection), slot(slot) {}
+
+	const Connection connection;
+	const size_t slot;
+	/* Guarded by broker lock */
+	std::unordered_set<std::string> topics;
+	std::mutex lock;
+	/* Frames are shared with other subscribers, never copied */
+	std::deque<Frame> queue;
+	/* Flush is posted to the connection and has not run yet */
+	bool posted = false;
+	/* Socket is above high watermark, OnWritable resumes */
+	bool waiting = false;
+	/* Queue overflowed with DISCONNECT policy */
+	bool closing = false;
+	/* THREADED publishers may flush at once, keeps frames whole and in order */
+	std::mutex writing;
+};
+
+static std::shared_ptr<std::vector<char>> make_frame(BrokerType type, const std::string &topic,
+						    const char *src, size_t size, const char *caller)
+{
+	if (topic.size() > UINT16_MAX || size > UINT32_MAX - topic.size())
+		throw std::runtime_error(std::string(caller) + ": Message is too large");
+
+	BrokerHeader header = { BROKER_MAGIC, static_cast<uint32_t>(topic.size() + size),
+				static_cast<uint16_t>(type), static_cast<uint16_t>(topic.size()) };
+
+	auto frame = std::make_shared<std::vector<char>>(sizeof(header) + topic.size() + size);
+	memcpy(frame->data(), &header, sizeof(header));
+	memcpy(frame->data() + sizeof(header), topic.data(), topic.size());
+	if (size)
+		memcpy(frame->data() + sizeof(header) + topic.size(), src, size);
+	return frame;
+}
+
+static struct in_addr parse_address(const std::string &ip, const char *caller)
+{
+	struct in_addr addr;
+	if (inet_pton(AF_INET, ip.c_str(), &addr) <= 0)
+		throw std::runtime_error(std::string(caller) + ": Invalid address: " + ip);
+	return addr;
+}
+
+Broker::Broker(uint16_t port, size_t msg_size, size_t max_connections, Protocol protocol, Mode mode)
+	: ServerBase(port, msg_size, max_connections, protocol, mode)
+{
+	if (!IsStream())
+		throw std::runtime_error("Broker::Broker: Broker needs stream protocol");
+
+	SetFramer(std::make_shared<BrokerFramer>());
+}
+
+Broker::Broker(const std::string &path, size_t msg_size, size_t max_connections, Mode mode)
+	: ServerBase(path, msg_size, max_connections, Protocol::UNIX_STREAM, mode)
+{
+	SetFramer(std::make_shared<BrokerFramer>());
+}
+
+Broker::~Broker()
+{
+	/* Handlers use the topics, stop them before those are gone */
+	Stop();
+
+	if (_multicast >= 0)
+		close(_multicast);
+}
+
+void Broker::SetQueueLimit(size_t messages, DropPolicy policy)
+{
+	if (!messages)
+		throw std::runtime_error("Broker::SetQueueLimit: Queue limit must not be zero");
+
+	_queue_limit = messages;
+	_policy = policy;
+}
+
+void Broker::EnableMulticast(const std::string &group, uint16_t port, uint8_t ttl, const std::string &iface)
+{
+	if (_multicast >= 0)
+		throw std::runtime_error("Broker::EnableMulticast: Multicast is enabled already");
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr = parse_address(group, "Broker::EnableMulticast");
+	if (!IN_MULTICAST(ntohl(addr.sin_addr.s_addr)))
+		throw std::runtime_error("Broker::EnableMulticast: Not a multicast address: " + group);
+
+	struct in_addr local = {};
+	if (!iface.empty())
+		local = parse_address(iface, "Broker::EnableMulticast");
+
+	int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0)
+		throw std::runtime_error(
+			"Broker::EnableMulticast: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	unsigned char hops = ttl;
+	if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops)) < 0 ||
+	    (!iface.empty() && setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) < 0))
+	{
+		int err = errno;
+		close(sockfd);
+		throw std::runtime_error(
+			"Broker::EnableMulticast: Set socket option error: " + std::to_string(err) + ": " + std::string(strerror(err)));
+	}
+
+	_multicast = sockfd;
+	_group = addr;
+}
+
+size_t Broker::Publish(const std::string &topic, const char *src, size_t size)
+{
+	/* Framed once, every queue and the multicast share this buffer */
+	Frame frame = make_frame(BrokerType::MESSAGE, topic, src, size, "Broker::Publish");
+
+	/* Best effort as any datagram, failures are not reported */
+	if (_multicast >= 0 && frame->size() <= BROKER_MULTICAST_MAX)
+		sendto(_multicast, frame->data(), frame->size(), MSG_DONTWAIT,
+		       reinterpret_cast<const struct sockaddr *>(&_group), sizeof(_group));
+
+	std::vector<std::shared_ptr<Subscriber>> wake;
+	size_t count = 0;
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		auto subscribers = _topics.find(topic);
+		if (subscribers != _topics.end())
+		{
+			count = subscribers->second.size();
+			for (const auto &subscriber : subscribers->second)
+				if (Queue(*subscriber, frame))
+					wake.push_back(subscriber);
+		}
+	}
+
+	/* THREADED mode writes in place, keep the lock out of it */
+	for (const auto &subscriber : wake)
+		Schedule(subscriber);
+
+	return count;
+}
+
+size_t Broker::GetSubscribers(const std::string &topic) const
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	auto subscribers = _topics.find(topic);
+	return subscribers == _topics.end() ? 0 : subscribers->second.size();
+}
+
+bool Broker::Queue(Subscriber &subscriber, const Frame &frame)
+{
+	std::lock_guard<std::mutex> lock(subscriber.lock);
+	if (subscriber.closing)
+		return false;
+
+	bool full = subscriber.queue.size() >= _queue_limit;
+	if (full)
+	{
+		_dropped.fetch_add(1, std::memory_order_relaxed);
+		switch (_policy)
+		{
+		case DropPolicy::DROP_OLDEST:
+			subscriber.queue.pop_front();
+			subscriber.queue.push_back(frame);
+			break;
+		case DropPolicy::DROP_NEWEST:
+			break;
+		case DropPolicy::DISCONNECT:
+			subscriber.closing = true;
+			subscriber.queue.clear();
+			break;
+		}
+	}
+	else
+	{
+		subscriber.queue.push_back(frame);
+	}
+
+	/* Waiting one is resumed by OnWritable, overflow checks it is still there */
+	if (subscriber.posted || (subscriber.waiting && !full))
+		return false;
+
+	subscriber.posted = true;
+	return true;
+}
+
+void Broker::Schedule(const std::shared_ptr<Subscriber> &subscriber)
+{
+	subscriber->connection.Post([this, subscriber](MessageBase *msg) {
+		{
+			std::lock_guard<std::mutex> lock(subscriber->lock);
+			subscriber->posted = false;
+		}
+
+		if (msg)
+		{
+			Flush(*msg, subscriber);
+			return;
+		}
+
+		/* Connection is gone */
+		std::lock_guard<std::mutex> lock(_lock);
+		Detach(subscriber);
+	});
+}
+
+void Broker::Flush(MessageBase &msg, const std::shared_ptr<Subscriber> &subscriber)
+{
+	std::lock_guard<std::mutex> writing(subscriber->writing);
+
+	while (true)
+	{
+		bool writable = msg.IsWritable();
+		Frame frame;
+		{
+			std::lock_guard<std::mutex> lock(subscriber->lock);
+			if (subscriber->closing)
+				break;
+
+			subscriber->waiting = !writable && !subscriber->queue.empty();
+			if (!writable || subscriber->queue.empty())
+				return;
+
+			frame = std::move(subscriber->queue.front());
+			subscriber->queue.pop_front();
+		}
+
+		/* Reference keeps the shared buffer until the socket is done with it */
+		msg.ReplyZeroCopy(frame->data(), frame->size(), [frame]() {});
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		Detach(subscriber);
+	}
+
+	/* Drops the connection */
+	throw std::runtime_error("Broker::Flush: Subscriber queue overflow");
+}
+
+void Broker::Detach(const std::shared_ptr<Subscriber> &subscriber)
+{
+	for (const std::string &topic : subscriber->topics)
+	{
+		auto subscribers = _topics.find(topic);
+		if (subscribers == _topics.end())
+			continue;
+
+		auto &list = subscribers->second;
+		list.erase(std::remove(list.begin(), list.end(), subscriber), list.end());
+		if (list.empty())
+			_topics.erase(subscribers);
+	}
+	subscriber->topics.clear();
+
+	auto entry = _subscribers.find(subscriber->slot);
+	if (entry != _subscribers.end() && entry->second == subscriber)
+		_subscribers.erase(entry);
+
+	std::lock_guard<std::mutex> lock(subscriber->lock);
+	subscriber->queue.clear();
+}
+
+void Broker::OnReceive(MessageBase &msg)
+{
+	/* Framer passes whole frames only, header is there */
+	BrokerHeader header;
+	memcpy(&header, msg.GetData(), sizeof(header));
+	if (header.topic_size > header.size)
+		throw std::runtime_error("Broker::OnReceive: Topic is out of frame");
+
+	const char *data = msg.GetData() + sizeof(header);
+	std::string topic(data, header.topic_size);
+
+	switch (static_cast<BrokerType>(header.type))
+	{
+	case BrokerType::PUBLISH:
+		Publish(topic, data + header.topic_size, header.size - header.topic_size);
+		return;
+	case BrokerType::SUBSCRIBE:
+	{
+		Connection connection = msg.GetConnection();
+		std::lock_guard<std::mutex> lock(_lock);
+
+		/* Subscriber of the slot may be a client gone before */
+		std::shared_ptr<Subscriber> &subscriber = _subscribers[msg.GetSlot()];
+		if (subscriber && subscriber->connection != connection)
+		{
+			std::shared_ptr<Subscriber> stale = subscriber;
+			Detach(stale);
+		}
+
+		std::shared_ptr<Subscriber> &entry = _subscribers[msg.GetSlot()];
+		if (!entry)
+			entry = std::make_shared<Subscriber>(connection, msg.GetSlot());
+
+		if (entry->topics.insert(topic).second)
+			_topics[topic].push_back(entry);
+		return;
+	}
+	case BrokerType::UNSUBSCRIBE:
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		auto entry = _subscribers.find(msg.GetSlot());
+		if (entry == _subscribers.end() || entry->second->connection != msg.GetConnection() ||
+		    !entry->second->topics.erase(topic))
+			return;
+
+		auto &list = _topics[topic];
+		list.erase(std::remove(list.begin(), list.end(), entry->second), list.end());
+		if (list.empty())
+			_topics.erase(topic);
+		return;
+	}
+	default:
+		/* Clients never send messages, anything else drops them */
+		throw std::runtime_error("Broker::OnReceive: Unexpected frame type");
+	}
+}
+
+void Broker::OnWritable(MessageBase &msg)
+{
+	std::shared_ptr<Subscriber> subscriber;
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		auto entry = _subscribers.find(msg.GetSlot());
+		if (entry == _subscribers.end() || entry->second->connection != msg.GetConnection())
+			return;
+
+		subscriber = entry->second;
+	}
+
+	Flush(msg, subscriber);
+}
+
+BrokerClient::BrokerClient(const std::string &ip, uint16_t port)
+	: _client(ip, port, ServerBase::Protocol::TCP)
+{
+}
+
+BrokerClient::BrokerClient(const std::string &path)
+	: _client(path, ServerBase::Protocol::UNIX_STREAM)
+{
+}
+
+void BrokerClient::Send(BrokerType type, const std::string &topic, const char *src, size_t size)
+{
+	if (topic.size() > UINT16_MAX || size > UINT32_MAX - topic.size())
+		throw std::runtime_error("BrokerClient::Send: Message is too large");
+
+	BrokerHeader header = { BROKER_MAGIC, static_cast<uint32_t>(topic.size() + size),
+				static_cast<uint16_t>(type), static_cast<uint16_t>(topic.size()) };
+
+	struct iovec iov[3] = {
+		{ &header, sizeof(header) },
+		{ const_cast<char *>(topic.data()), topic.size() },
+		{ const_cast<char *>(src), size },
+	};
+
+	/* Frames of several threads must not interleave */
+	std::lock_guard<std::mutex> lock(_send_lock);
+	_client.Send(iov, 3);
+}
+
+void BrokerClient::Subscribe(const std::string &topic)
+{
+	Send(BrokerType::SUBSCRIBE, topic, nullptr, 0);
+}
+
+void BrokerClient::Unsubscribe(const std::string &topic)
+{
+	Send(BrokerType::UNSUBSCRIBE, topic, nullptr, 0);
+}
+
+void BrokerClient::Publish(const std::string &topic, const char *src, size_t size)
+{
+	Send(BrokerType::PUBLISH, topic, src, size);
+}
+
+void BrokerClient::Publish(const std::string &topic, const std::string &payload)
+{
+	Send(BrokerType::PUBLISH, topic, payload.data(), payload.size());
+}
+
+void BrokerClient::Receive(std::string &topic, std::string &payload)
+{
+	BrokerHeader header;
+	_client.ReadExact(reinterpret_cast<char *>(&header), sizeof(header));
+	if (header.magic != BROKER_MAGIC || header.type != static_cast<uint16_t>(BrokerType::MESSAGE) ||
+	    header.topic_size > header.size)
+		throw std::runtime_error("BrokerClient::Receive: Invalid frame");
+
+	topic.resize(header.topic_size);
+	if (header.topic_size)
+		_client.ReadExact(&topic[0], header.topic_size);
+
+	payload.resize(header.size - header.topic_size);
+	if (!payload.empty())
+		_client.ReadExact(&payload[0], payload.size());
+}
+
+void BrokerClient::Close()
+{
+	_client.Close();
+}
+
+MulticastSubscriber::MulticastSubscriber(const std::string &group, uint16_t port, const std::string &iface)
+{
+	struct ip_mreq membership = {};
+	membership.imr_multiaddr = parse_address(group, "MulticastSubscriber::MulticastSubscriber");
+	membership.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (!iface.empty())
+		membership.imr_interface = parse_address(iface, "MulticastSubscriber::MulticastSubscriber");
+
+	_sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (_sockfd < 0)
+		throw std::runtime_error(
+			"MulticastSubscriber::MulticastSubscriber: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	/* Bound to the group, so other traffic to the port is not received */
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr = membership.imr_multiaddr;
+
+	/* Several listeners of one host share the port */
+	int enable = 1;
+	if (setsockopt(_sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+	    bind(_sockfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+	    setsockopt(_sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0)
+	{
+		int err = errno;
+		close(_sockfd);
+		throw std::runtime_error(
+			"MulticastSubscriber::MulticastSubscriber: Join group error: " + std::to_string(err) + ": " + std::string(strerror(err)));
+	}
+
+	_buffer.resize(BROKER_MULTICAST_MAX);
+}
+
+MulticastSubscriber::~MulticastSubscriber()
+{
+	close(_sockfd);
+}
+
+void MulticastSubscriber::Subscribe(const std::string &topic)
+{
+	_topics.insert(topic);
+}
+
+void MulticastSubscriber::Unsubscribe(const std::string &topic)
+{
+	_topics.erase(topic);
+}
+
+bool MulticastSubscriber::Receive(std::string &topic, std::string &payload, std::chrono::milliseconds timeout)
+{
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+
+	while (true)
+	{
+		if (timeout.count())
+		{
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now());
+			struct pollfd pfd = { _sockfd, POLLIN, 0 };
+			int ret = poll(&pfd, 1, static_cast<int>(std::max<int64_t>(left.count(), 0)));
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				throw std::runtime_error(
+					"MulticastSubscriber::Receive: Poll error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+			if (!ret)
+				return false;
+		}
+
+		ssize_t len = recv(_sockfd, _buffer.data(), _buffer.size(), 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			throw std::runtime_error(
+				"MulticastSubscriber::Receive: Receive error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		/* Anything else sent to the group is skipped */
+		BrokerHeader header;
+		if (static_cast<size_t>(len) < sizeof(header))
+			continue;
+
+		memcpy(&header, _buffer.data(), sizeof(header));
+		if (header.magic != BROKER_MAGIC || header.type != static_cast<uint16_t>(BrokerType::MESSAGE) ||
+		    header.topic_size > header.size || sizeof(header) + header.size != static_cast<size_t>(len))
+			continue;
+
+		const char *name = _buffer.data() + sizeof(header);
+		if (!_topics.empty() && !_topics.count(std::string(name, header.topic_size)))
+			continue;
+
+		topic.assign(name, header.topic_size);
+		payload.assign(name + header.topic_size, header.size - header.topic_size);
+		return true;
+	}
+}
@@ -0,0 +1,348 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Publish/subscribe broker of Posix server.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#ifndef __SERVER_BROKER_H__
+#define __SERVER_BROKER_H__
+
+#include <chrono>
+#include <unordered_set>
+#include "server.h"
+
+/* "PUB1" in memory, starts every frame */
+#define BROKER_MAGIC			0x31425550
+
+/* Largest frame sent by multicast, bigger ones go to connections only */
+#define BROKER_MULTICAST_MAX		(65507)
+
+namespace Network {
+
+/**
+ * Fixed header of every broker frame.
+ *
+ * Topic of topic_size bytes follows, then payload, size counts both.
+ * Fields are in host byte order, peers are expected to share it.
+ */
+struct BrokerHeader
+{
+	uint32_t magic;
+	uint32_t size;
+	uint16_t type;
+	uint16_t topic_size;
+};
+
+/**
+ * Type of frame.
+ *
+ * SUBSCRIBE, UNSUBSCRIBE and PUBLISH are sent by clients, MESSAGE is
+ * delivered to subscribers and multicast group.
+ */
+enum class BrokerType : uint16_t { SUBSCRIBE, UNSUBSCRIBE, PUBLISH, MESSAGE };
+
+/**
+ * What to do with a message once the queue of a subscriber is full.
+ *
+ * DROP_OLDEST	Oldest queued message is dropped, latest values win.
+ * DROP_NEWEST	Message is not queued, subscriber gets the older ones.
+ * DISCONNECT	Subscriber is dropped, it should reconnect and resync.
+ */
+enum class DropPolicy { DROP_OLDEST, DROP_NEWEST, DISCONNECT };
+
+/**
+ * Topic based publish/subscribe broker.
+ *
+ * Works over stream sockets in any mode. Every published message is
+ * framed once into a reference counted buffer which is shared by the
+ * queues of all subscribers and written to each socket from there,
+ * large ones with MSG_ZEROCOPY. Subscriber falling behind keeps up to
+ * the queue limit of messages, then the drop policy applies. Messages
+ * may also go to a UDP multicast group, once for all LAN listeners.
+ *
+ * In EPOLL and URING modes messages are written by the loop serving
+ * the subscriber. THREADED mode writes them from the publishing thread,
+ * a subscriber not reading stalls it, so queue limits matter in loop
+ * modes only.
+ */
+class Broker : public ServerBase
+{
+public:
+	/**
+	 * @brief Constructor of Broker class.
+	 *
+	 * Throws std::runtime_error for datagram protocols.
+	 *
+	 * @param port			Port number to listen to.
+	 * @param msg_size		Largest frame, header included.
+	 * @param max_connections	Maximum allowed connections.
+	 * @param protocol		Stream protocol.
+	 * @param mode			Client handling mode.
+	 */
+	Broker(uint16_t port,
+	       size_t msg_size = 64 * 1024,
+	       size_t max_connections = 32,
+	       Protocol protocol = Protocol::TCP,
+	       Mode mode = Mode::THREADED);
+
+	/**
+	 * @brief Constructor of Broker class listening to Unix socket.
+	 *
+	 * @param path			Socket path, leading '@' is abstract.
+	 * @param msg_size		Largest frame, header included.
+	 * @param max_connections	Maximum allowed connections.
+	 * @param mode			Client handling mode.
+	 */
+	Broker(const std::string &path,
+	       size_t msg_size = 64 * 1024,
+	       size_t max_connections = 32,
+	       Mode mode = Mode::THREADED);
+
+	~Broker();
+
+	/**
+	 * @brief Set queue limit of every subscriber.
+	 *
+	 * Should be called before Start(). Default is 1024 messages
+	 * dropping the oldest.
+	 *
+	 * @param messages		Messages queued per subscriber, at least one.
+	 * @param policy		What to do once the queue is full.
+	 */
+	void SetQueueLimit(size_t messages, DropPolicy policy = DropPolicy::DROP_OLDEST);
+
+	/**
+	 * @brief Send every published message to multicast group as well.
+	 *
+	 * Should be called before Start(). Delivery is best effort, frames
+	 * larger than BROKER_MULTICAST_MAX are not multicast. Throws
+	 * std::runtime_error on error.
+	 *
+	 * @param group		Multicast group address.
+	 * @param port		Port of the group.
+	 * @param ttl		Hops allowed, 1 keeps datagrams in the LAN.
+	 * @param iface		Address of the interface to send from, default route if empty.
+	 */
+	void EnableMulticast(const std::string &group, uint16_t port,
+			     uint8_t ttl = 1, const std::string &iface = "");
+
+	/**
+	 * @brief Publish message from the process running the broker.
+	 *
+	 * Can be called from any thread.
+	 *
+	 * @param topic		Topic of message, up to 65535 bytes.
+	 * @param src		Pointer to payload.
+	 * @param size		Size of payload.
+	 * @return Amount of subscribers the message is queued to.
+	 */
+	size_t Publish(const std::string &topic, const char *src, size_t size);
+
+	/**
+	 * @brief Get amount of connections subscribed to topic.
+	 */
+	size_t GetSubscribers(const std::string &topic) const;
+
+	/**
+	 * @brief Get amount of messages dropped by full queues.
+	 */
+	uint64_t GetDropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+	void OnReceive(MessageBase &msg) override;
+	void OnWritable(MessageBase &msg) override;
+private:
+	struct Subscriber;
+	using Frame = std::shared_ptr<const std::vector<char>>;
+
+	bool Queue(Subscriber &subscriber, const Frame &frame);
+	void Schedule(const std::shared_ptr<Subscriber> &subscriber);
+	void Flush(MessageBase &msg, const std::shared_ptr<Subscriber> &subscriber);
+	void Detach(const std::shared_ptr<Subscriber> &subscriber);
+
+	mutable std::mutex _lock;
+	std::unordered_map<std::string, std::vector<std::shared_ptr<Subscriber>>> _topics;
+	std::unordered_map<size_t, std::shared_ptr<Subscriber>> _subscribers;
+	size_t _queue_limit = 1024;
+	DropPolicy _policy = DropPolicy::DROP_OLDEST;
+	std::atomic<uint64_t> _dropped { 0 };
+	int _multicast = -1;
+	struct sockaddr_in _group = {};
+};
+
+/**
+ * Client publishing to and subscribing on broker.
+ *
+ * Publish may be called from any thread, Receive from one thread only.
+ */
+class BrokerClient
+{
+public:
+	/**
+	 * @brief Connect to TCP broker.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param ip		Broker IP address.
+	 * @param port		Broker port.
+	 */
+	BrokerClient(const std::string &ip, uint16_t port);
+
+	/**
+	 * @brief Connect to Unix stream broker.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param path		Socket path, leading '@' is abstract.
+	 */
+	explicit BrokerClient(const std::string &path);
+
+	/**
+	 * @brief Subscribe to topic, messages published later are delivered.
+	 *
+	 * @param topic		Topic name.
+	 */
+	void Subscribe(const std::string &topic);
+
+	/**
+	 * @brief Stop receiving messages of topic.
+	 *
+	 * @param topic		Topic name.
+	 */
+	void Unsubscribe(const std::string &topic);
+
+	/**
+	 * @brief Publish message to topic.
+	 *
+	 * @param topic		Topic name.
+	 * @param src		Pointer to payload.
+	 * @param size		Size of payload.
+	 */
+	void Publish(const std::string &topic, const char *src, size_t size);
+
+	/**
+	 * @brief Publish message to topic.
+	 *
+	 * @param topic		Topic name.
+	 * @param payload	Message payload.
+	 */
+	void Publish(const std::string &topic, const std::string &payload);
+
+	/**
+	 * @brief Wait for next message of subscribed topics.
+	 *
+	 * Strings are reused, so ones kept across calls keep their storage.
+	 * Throws std::runtime_error once the connection is closed.
+	 *
+	 * @param topic		Topic of received message.
+	 * @param payload	Received payload.
+	 */
+	void Receive(std::string &topic, std::string &payload);
+
+	/**
+	 * @brief Close connection.
+	 */
+	void Close();
+private:
+	void Send(BrokerType type, const std::string &topic, const char *src, size_t size);
+
+	Client _client;
+	std::mutex _send_lock;
+};
+
+/**
+ * Listener of broker messages sent to multicast group.
+ *
+ * Gets messages of all topics unless some are subscribed to, then the
+ * rest is filtered out locally.
+ */
+class MulticastSubscriber
+{
+public:
+	/**
+	 * @brief Join multicast group.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param group		Multicast group address.
+	 * @param port		Port of the group.
+	 * @param iface		Address of the interface to join on, any if empty.
+	 */
+	MulticastSubscriber(const std::string &group, uint16_t port, const std::string &iface = "");
+	~MulticastSubscriber();
+
+	MulticastSubscriber(const MulticastSubscriber &) = delete;
+	MulticastSubscriber &operator=(const MulticastSubscriber &) = delete;
+
+	/**
+	 * @brief Accept messages of topic only, together with others subscribed.
+	 *
+	 * @param topic		Topic name.
+	 */
+	void Subscribe(const std::string &topic);
+
+	/**
+	 * @brief Stop accepting messages of topic.
+	 *
+	 * @param topic		Topic name.
+	 */
+	void Unsubscribe(const std::string &topic);
+
+	/**
+	 * @brief Wait for next message.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param topic		Topic of received message.
+	 * @param payload	Received payload.
+	 * @param timeout	Time to wait, zero waits forever.
+	 * @return False if nothing came in time.
+	 */
+	bool Receive(std::string &topic, std::string &payload,
+		     std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+private:
+	int _sockfd = -1;
+	std::unordered_set<std::string> _topics;
+	std::vector<char> _buffer;
+};
+
+} /* namespace Network */
+
+#endif /* __SERVER_BROKER_H__ */
@@ -0,0 +1,414 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * C++20 coroutine API of Posix server and client.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#include "coro.h"
+
+#ifdef NETWORK_COROUTINES
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef REACTOR_MAX_EVENTS
+#define REACTOR_MAX_EVENTS		64
+#endif
+
+using namespace Network;
+
+/* Readiness seen while nobody waited, consumed by the next wait */
+static void *const READY = reinterpret_cast<void *>(1);
+
+bool Reactor::Ready::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+	void *expected = nullptr;
+	if (_state.compare_exchange_strong(expected, handle.address(), std::memory_order_acq_rel))
+		return true;
+
+	/* Became ready since the last attempt, retry at once */
+	_state.store(nullptr, std::memory_order_relaxed);
+	return false;
+}
+
+Reactor::Reactor()
+{
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (_epfd < 0)
+		throw std::runtime_error(
+			"Reactor::Reactor: epoll create error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wakefd < 0)
+	{
+		close(_epfd);
+		throw std::runtime_error(
+			"Reactor::Reactor: eventfd create error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = &_wakefd;
+	epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakefd, &ev);
+
+	_running = true;
+	_thread = std::thread(&Reactor::Run, this);
+}
+
+Reactor::~Reactor()
+{
+	_running = false;
+	uint64_t one = 1;
+	ssize_t res = write(_wakefd, &one, sizeof(one));
+	(void)res;
+	_thread.join();
+
+	/* Watches removed meanwhile are freed here */
+	RunPosted();
+
+	close(_wakefd);
+	close(_epfd);
+}
+
+Reactor::Watch *Reactor::Add(int fd)
+{
+	std::unique_ptr<Watch> watch(new Watch);
+	watch->fd = fd;
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = watch.get();
+	if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		throw std::runtime_error(
+			"Reactor::Add: epoll add error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	return watch.release();
+}
+
+void Reactor::Remove(Watch *watch)
+{
+	epoll_ctl(_epfd, EPOLL_CTL_DEL, watch->fd, nullptr);
+
+	/* Events already fetched may point to it, free after the batch */
+	Post([watch]() { delete watch; });
+}
+
+void Reactor::Wake(std::atomic<void *> &state)
+{
+	void *waiting = state.exchange(READY, std::memory_order_acq_rel);
+	if (!waiting || waiting == READY)
+		return;
+
+	/* Waiter retries its operation, readiness is consumed */
+	state.store(nullptr, std::memory_order_relaxed);
+	std::coroutine_handle<>::from_address(waiting).resume();
+}
+
+void Reactor::Post(std::function<void()> fn)
+{
+	{
+		std::lock_guard<std::mutex> lock(_post_lock);
+		_posted.push_back(std::move(fn));
+	}
+
+	uint64_t one = 1;
+	ssize_t res = write(_wakefd, &one, sizeof(one));
+	(void)res;
+}
+
+void Reactor::RunPosted()
+{
+	std::vector<std::function<void()>> posted;
+	{
+		std::lock_guard<std::mutex> lock(_post_lock);
+		posted.swap(_posted);
+	}
+
+	for (auto &fn : posted)
+		fn();
+}
+
+void Reactor::Run()
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+
+	while (_running)
+	{
+		int n = epoll_wait(_epfd, events, REACTOR_MAX_EVENTS, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (int i = 0; i != n; i++)
+		{
+			if (events[i].data.ptr == &_wakefd)
+			{
+				uint64_t value;
+				ssize_t res = read(_wakefd, &value, sizeof(value));
+				(void)res;
+				continue;
+			}
+
+			/* Errors wake both sides, they learn it from the next call */
+			Watch *watch = static_cast<Watch *>(events[i].data.ptr);
+			uint32_t flags = events[i].events;
+			if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				Wake(watch->reader);
+			if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+				Wake(watch->writer);
+		}
+
+		RunPosted();
+	}
+}
+
+AsyncClient::~AsyncClient()
+{
+	Close();
+}
+
+AsyncClient::AsyncClient(AsyncClient &&other) noexcept
+	: _reactor(other._reactor), _watch(std::exchange(other._watch, nullptr)),
+	  _sockfd(std::exchange(other._sockfd, -1)) {}
+
+AsyncClient &AsyncClient::operator=(AsyncClient &&other) noexcept
+{
+	if (this != &other)
+	{
+		Close();
+		_reactor = other._reactor;
+		_watch = std::exchange(other._watch, nullptr);
+		_sockfd = std::exchange(other._sockfd, -1);
+	}
+	return *this;
+}
+
+Task<AsyncClient> AsyncClient::Connect(Reactor &reactor, std::string ip, uint16_t port,
+				       ServerBase::Protocol protocol)
+{
+	AsyncClient client;
+	client._reactor = &reactor;
+	client._sockfd = socket(AF_INET, (protocol == ServerBase::Protocol::TCP ? SOCK_STREAM : SOCK_DGRAM) |
+				SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (client._sockfd < 0)
+		throw std::runtime_error(
+			"AsyncClient::Connect: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	struct sockaddr_in serv_addr = {};
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(port);
+
+	if (inet_pton(AF_INET, ip.c_str(), &serv_addr.sin_addr) <= 0)
+		throw std::runtime_error(
+			"AsyncClient::Connect: Invalid address/ Address not supported: " + ip);
+
+	int res = connect(client._sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+	if (res < 0 && errno != EINPROGRESS)
+		throw std::runtime_error(
+			"AsyncClient::Connect: Connection Failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	/* Watched once connecting, unconnected socket reports hang up */
+	client._watch = reactor.Add(client._sockfd);
+
+	if (res < 0)
+	{
+		struct pollfd pfd = { client._sockfd, POLLOUT, 0 };
+		while (poll(&pfd, 1, 0) <= 0)
+			co_await reactor.Writable(*client._watch);
+
+		int error = 0;
+		socklen_t len = sizeof(error);
+		getsockopt(client._sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+		if (error)
+			throw std::runtime_error(
+				"AsyncClient::Connect: Connection Failed: " + std::to_string(error) + ": " + std::string(strerror(error)));
+	}
+
+	co_return client;
+}
+
+Task<void> AsyncClient::Send(const char *src, size_t size)
+{
+	while (size)
+	{
+		ssize_t sent = send(_sockfd, src, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			co_await _reactor->Writable(*_watch);
+			continue;
+		}
+
+		if (sent < 0)
+			throw std::runtime_error(
+				"AsyncClient::Send: Send failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		src += sent;
+		size -= static_cast<size_t>(sent);
+	}
+}
+
+Task<void> AsyncClient::Send(const std::string &msg)
+{
+	return Send(msg.data(), msg.size());
+}
+
+Task<size_t> AsyncClient::ReadSome(char *dst, size_t max_size)
+{
+	while (true)
+	{
+		ssize_t received = recv(_sockfd, dst, max_size, 0);
+		if (received >= 0)
+			co_return static_cast<size_t>(received);
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			co_await _reactor->Readable(*_watch);
+		else if (errno != EINTR)
+			throw std::runtime_error(
+				"AsyncClient::ReadSome: Read failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+}
+
+Task<void> AsyncClient::ReadExact(char *dst, size_t size)
+{
+	while (size)
+	{
+		size_t received = co_await ReadSome(dst, size);
+		if (!received)
+			throw std::runtime_error("AsyncClient::ReadExact: Connection closed");
+
+		dst += received;
+		size -= received;
+	}
+}
+
+void AsyncClient::Close()
+{
+	if (_watch)
+	{
+		_reactor->Remove(_watch);
+		_watch = nullptr;
+	}
+
+	if (_sockfd >= 0)
+	{
+		close(_sockfd);
+		_sockfd = -1;
+	}
+}
+
+bool AsyncClient::IsOpen() const
+{
+	return _sockfd >= 0;
+}
+
+void AsyncServer::Replying::await_suspend(std::coroutine_handle<> handle)
+{
+	/* Coroutine may continue and free the awaiter before Post returns */
+	Connection connection = _connection;
+	connection.Post([this, handle](MessageBase *msg) {
+		bool failed = false;
+		if (msg)
+		{
+			try
+			{
+				msg->Reply(_src, _size);
+				_sent = true;
+			}
+			catch (const std::exception &)
+			{
+				failed = true;
+			}
+		}
+
+		/* Awaiter may be gone once the coroutine continues */
+		handle.resume();
+
+		/* Connection is dropped by the serving thread */
+		if (failed)
+			throw std::runtime_error("AsyncServer::Reply: Send failed");
+	});
+}
+
+AsyncServer::Request::Request(MessageBase &msg)
+	: _data(msg.GetData(), msg.GetData() + msg.GetSize()), _connection(msg.GetConnection()) {}
+
+void AsyncServer::OnReceive(MessageBase &msg)
+{
+	/* Runs here until the handler first suspends */
+	Spawn(Serve(Request(msg)));
+}
+
+Task<void> AsyncServer::Serve(Request request)
+{
+	Connection connection = request.GetConnection();
+	bool failed = false;
+
+	try
+	{
+		co_await OnRequest(std::move(request));
+	}
+	catch (const std::exception &)
+	{
+		failed = true;
+	}
+
+	/* Handler failed, client is dropped like for synchronous handlers */
+	if (failed)
+		connection.Post([](MessageBase *msg) {
+			if (msg)
+				throw std::runtime_error("AsyncServer::OnRequest: Handler failed");
+		});
+}
+
+#endif /* NETWORK_COROUTINES */
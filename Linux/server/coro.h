@@ -0,0 +1,479 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * C++20 coroutine API of Posix server and client.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#ifndef __SERVER_CORO_H__
+#define __SERVER_CORO_H__
+
+#include "server.h"
+
+/* Coroutine API is built only by compilers supporting it */
+#if defined(__has_include)
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#define NETWORK_COROUTINES		1
+#endif
+#endif
+
+#ifdef NETWORK_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace Network {
+
+template <typename T = void>
+class Task;
+
+/**
+ * @brief Start task without waiting for it.
+ *
+ * Task frees itself once finished, exception it throws is ignored.
+ *
+ * @param task		Task to run.
+ */
+void Spawn(Task<void> task);
+
+namespace detail {
+
+struct PromiseBase
+{
+	struct FinalAwaiter
+	{
+		bool await_ready() const noexcept { return false; }
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+		{
+			PromiseBase &promise = handle.promise();
+			if (promise.detached)
+			{
+				handle.destroy();
+				return std::noop_coroutine();
+			}
+			return promise.continuation ? promise.continuation : std::noop_coroutine();
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	FinalAwaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { error = std::current_exception(); }
+
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+	bool detached = false;
+};
+
+template <typename T>
+struct Promise final: PromiseBase
+{
+	Task<T> get_return_object() noexcept
+	{
+		return Task<T>(std::coroutine_handle<Promise>::from_promise(*this));
+	}
+
+	template <typename U>
+	void return_value(U &&value)
+	{
+		result.emplace(std::forward<U>(value));
+	}
+
+	T Result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(*result);
+	}
+
+	std::optional<T> result;
+};
+
+template <>
+struct Promise<void> final: PromiseBase
+{
+	Task<void> get_return_object() noexcept;
+
+	void return_void() const noexcept {}
+
+	void Result() const
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+} /* namespace detail */
+
+/**
+ * Lazy coroutine result.
+ *
+ * Coroutine starts once the task is awaited and resumes the awaiting one
+ * when it finishes, exceptions are rethrown to the awaiting coroutine.
+ */
+template <typename T>
+class Task
+{
+public:
+	using promise_type = detail::Promise<T>;
+
+	Task() = default;
+	explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+	Task(Task &&other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other)
+		{
+			if (_handle)
+				_handle.destroy();
+			_handle = std::exchange(other._handle, nullptr);
+		}
+		return *this;
+	}
+
+	~Task()
+	{
+		if (_handle)
+			_handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return !_handle || _handle.done(); }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		_handle.promise().continuation = awaiting;
+		return _handle;
+	}
+
+	T await_resume() { return _handle.promise().Result(); }
+private:
+	friend void Spawn(Task<void> task);
+
+	std::coroutine_handle<promise_type> _handle;
+};
+
+inline Task<void> detail::Promise<void>::get_return_object() noexcept
+{
+	return Task<void>(std::coroutine_handle<Promise>::from_promise(*this));
+}
+
+inline void Spawn(Task<void> task)
+{
+	std::coroutine_handle<detail::Promise<void>> handle = std::exchange(task._handle, nullptr);
+	handle.promise().detached = true;
+	handle.resume();
+}
+
+/**
+ * Event loop resuming coroutines waiting for sockets.
+ *
+ * Runs own thread, coroutines waiting on its sockets continue there.
+ * Sockets are watched edge triggered, one reader and one writer may wait
+ * on a socket at once. Coroutines still waiting when the reactor is
+ * destroyed are never resumed.
+ */
+class Reactor
+{
+public:
+	/** Socket registered with the reactor */
+	struct Watch
+	{
+		int fd;
+		/* Idle, ready or address of waiting coroutine */
+		std::atomic<void *> reader { nullptr };
+		std::atomic<void *> writer { nullptr };
+	};
+
+	/** Awaitable suspending until the socket becomes ready */
+	class Ready
+	{
+	public:
+		explicit Ready(std::atomic<void *> &state) : _state(state) {}
+
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> handle) noexcept;
+		void await_resume() const noexcept {}
+	private:
+		std::atomic<void *> &_state;
+	};
+
+	/**
+	 * @brief Constructor of Reactor class, starts reactor thread.
+	 *
+	 * Throws std::runtime_error on error.
+	 */
+	Reactor();
+	~Reactor();
+
+	Reactor(const Reactor &) = delete;
+	Reactor &operator=(const Reactor &) = delete;
+
+	/**
+	 * @brief Watch non-blocking socket.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param fd		Socket to watch.
+	 * @return Watch to wait on.
+	 */
+	Watch *Add(int fd);
+
+	/**
+	 * @brief Stop watching socket, before it is closed.
+	 *
+	 * @param watch		Watch returned by Add().
+	 */
+	void Remove(Watch *watch);
+
+	/**
+	 * @brief Wait until socket may be read.
+	 *
+	 * Retry the operation after resume, readiness may be stale.
+	 *
+	 * @param watch		Watch returned by Add().
+	 */
+	Ready Readable(Watch &watch) { return Ready(watch.reader); }
+
+	/**
+	 * @brief Wait until socket may be written.
+	 *
+	 * @param watch		Watch returned by Add().
+	 */
+	Ready Writable(Watch &watch) { return Ready(watch.writer); }
+private:
+	void Run();
+	void Wake(std::atomic<void *> &state);
+	void Post(std::function<void()> fn);
+	void RunPosted();
+
+	int _epfd = -1;
+	int _wakefd = -1;
+	std::atomic<bool> _running { false };
+	std::thread _thread;
+	std::mutex _post_lock;
+	std::vector<std::function<void()>> _posted;
+};
+
+/**
+ * Non-blocking client driven by coroutines.
+ *
+ * Operations are awaited, so thousands of conversations share reactor
+ * thread instead of a thread each. One send and one read may be in flight
+ * at once.
+ */
+class AsyncClient
+{
+public:
+	AsyncClient() = default;
+	~AsyncClient();
+
+	AsyncClient(const AsyncClient &) = delete;
+	AsyncClient &operator=(const AsyncClient &) = delete;
+	AsyncClient(AsyncClient &&other) noexcept;
+	AsyncClient &operator=(AsyncClient &&other) noexcept;
+
+	/**
+	 * @brief Connect to server.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param reactor	Reactor to wait on, has to outlive the client.
+	 * @param ip		IP address of server.
+	 * @param port		Port number of server.
+	 * @param protocol	Protocol type (TCP/UDP) [default = TCP].
+	 * @return Connected client.
+	 */
+	static Task<AsyncClient> Connect(Reactor &reactor, std::string ip, uint16_t port,
+					 ServerBase::Protocol protocol = ServerBase::Protocol::TCP);
+
+	/**
+	 * @brief Send data to server.
+	 *
+	 * Finishes once all data is written. Throws std::runtime_error on error.
+	 *
+	 * @param src		Pointer to the buffer to send.
+	 * @param size		Amount of bytes to send.
+	 */
+	Task<void> Send(const char *src, size_t size);
+
+	/**
+	 * @brief Send data to server.
+	 *
+	 * @param msg		String message to send.
+	 */
+	Task<void> Send(const std::string &msg);
+
+	/**
+	 * @brief Read data available from server.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param dst		Pointer to the buffer to read data to.
+	 * @param max_size	Amount of bytes to read.
+	 * @return Amount of bytes read, 0 once server closed connection.
+	 */
+	Task<size_t> ReadSome(char *dst, size_t max_size);
+
+	/**
+	 * @brief Read exact amount of bytes from stream.
+	 *
+	 * Throws std::runtime_error on error or if connection is closed earlier.
+	 *
+	 * @param dst		Pointer to the buffer to read data to.
+	 * @param size		Amount of bytes to read.
+	 */
+	Task<void> ReadExact(char *dst, size_t size);
+
+	/**
+	 * @brief Terminate current connection.
+	 */
+	void Close();
+
+	/**
+	 * @brief Check if connection is open.
+	 *
+	 * @return True if socket is open.
+	 */
+	bool IsOpen() const;
+private:
+	Reactor *_reactor = nullptr;
+	Reactor::Watch *_watch = nullptr;
+	int _sockfd = -1;
+};
+
+/**
+ * Server with coroutine request handlers.
+ *
+ * Every received message starts OnRequest coroutine, which may await
+ * other services before it replies. Handler runs on the thread serving
+ * the connection until it first suspends, replies bring it back there.
+ * Replies of concurrent requests of one connection are sent in the order
+ * handlers make them. Throwing from the handler drops the connection.
+ * Only TCP connections can be replied to.
+ */
+class AsyncServer : public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+
+	/** Awaitable reply, true once data is queued to the connection */
+	class Replying
+	{
+	public:
+		Replying(const Connection &connection, const char *src, size_t size)
+			: _connection(connection), _src(src), _size(size) {}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle);
+		bool await_resume() const noexcept { return _sent; }
+	private:
+		Connection _connection;
+		const char *_src;
+		size_t _size;
+		bool _sent = false;
+	};
+
+	/** Received message owning its data */
+	class Request
+	{
+	public:
+		explicit Request(MessageBase &msg);
+
+		const char *GetData() const { return _data.data(); }
+		size_t GetSize() const { return _data.size(); }
+		const Connection &GetConnection() const { return _connection; }
+
+		/**
+		 * @brief Send reply to client.
+		 *
+		 * Coroutine continues on the thread serving the connection.
+		 * Data has to stay valid until the reply is awaited.
+		 *
+		 * @param src		Pointer to the buffer to send.
+		 * @param size		Amount of bytes to send.
+		 * @return Awaitable, false if client is gone.
+		 */
+		Replying Reply(const char *src, size_t size) const
+		{
+			return Replying(_connection, src, size);
+		}
+
+		/**
+		 * @brief Send reply to client.
+		 *
+		 * @param msg		String message to send.
+		 * @return Awaitable, false if client is gone.
+		 */
+		Replying Reply(const std::string &msg) const
+		{
+			return Replying(_connection, msg.data(), msg.size());
+		}
+	private:
+		std::vector<char> _data;
+		Connection _connection;
+	};
+
+	/**
+	 * @brief Handle received message.
+	 *
+	 * @param request	Received message.
+	 * @return Coroutine serving the request.
+	 */
+	virtual Task<void> OnRequest(Request request) = 0;
+
+	void OnReceive(MessageBase &msg) final;
+private:
+	Task<void> Serve(Request request);
+};
+
+} /* namespace Network */
+
+#endif /* NETWORK_COROUTINES */
+
+#endif /* __SERVER_CORO_H__ */
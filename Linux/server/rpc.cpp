@@ -0,0 +1,329 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Request/response RPC layer of Posix server.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#include <sys/uio.h>
+#include <stdexcept>
+#include <algorithm>
+#include <future>
+#include <cstring>
+#include "rpc.h"
+
+using namespace Network;
+
+/* Frame is header and payload, handler gets both */
+class RpcFramer final: public Framer
+{
+public:
+	size_t Next(const char *data, size_t size, size_t &offset, size_t &length) const override
+	{
+		if (size < sizeof(RpcHeader))
+			return 0;
+
+		RpcHeader header;
+		memcpy(&header, data, sizeof(header));
+		if (header.magic != RPC_MAGIC)
+			throw std::runtime_error("RpcFramer::Next: Invalid frame magic");
+
+		offset = 0;
+		length = sizeof(header) + header.size;
+		return length;
+	}
+};
+
+/* Write response as one frame, responses of other threads must not interleave */
+static void respond(MessageBase &msg, std::vector<std::mutex> &locks, size_t slot, uint32_t id,
+		    uint32_t method, RpcStatus status, const char *src, size_t size)
+{
+	/* Buffer of the thread is reused, no allocation once it fits */
+	static thread_local std::vector<char> frame;
+
+	RpcHeader header = { RPC_MAGIC, static_cast<uint32_t>(size), id, method,
+			     static_cast<uint16_t>(RpcType::RESPONSE), static_cast<uint16_t>(status) };
+	frame.resize(sizeof(header) + size);
+	memcpy(frame.data(), &header, sizeof(header));
+	if (size)
+		memcpy(frame.data() + sizeof(header), src, size);
+
+	std::lock_guard<std::mutex> lock(locks[slot % locks.size()]);
+	msg.Reply(frame.data(), frame.size());
+}
+
+void RpcReply::Send(const char *src, size_t size, RpcStatus status) const
+{
+	if (!_locks)
+		throw std::runtime_error("RpcReply::Send: Empty handle");
+
+	/* Payload is copied, it goes out from the thread serving the connection */
+	std::shared_ptr<std::vector<std::mutex>> locks = _locks;
+	size_t slot = _slot;
+	uint32_t id = _id;
+	uint32_t method = _method;
+	_connection.Post([locks, slot, id, method, status, payload = std::string(src, size)](MessageBase *msg) {
+		if (msg)
+			respond(*msg, *locks, slot, id, method, status, payload.data(), payload.size());
+	});
+}
+
+void RpcReply::Send(const std::string &data, RpcStatus status) const
+{
+	Send(data.data(), data.size(), status);
+}
+
+void RpcRequest::Reply(const char *src, size_t size, RpcStatus status)
+{
+	if (_answered)
+		throw std::runtime_error("RpcRequest::Reply: Request is answered already");
+
+	_answered = true;
+	respond(_msg, *_server._write_locks, _msg.GetSlot(), _header.id, _header.method, status, src, size);
+}
+
+void RpcRequest::Reply(const std::string &data, RpcStatus status)
+{
+	Reply(data.data(), data.size(), status);
+}
+
+RpcReply RpcRequest::Defer()
+{
+	if (_answered)
+		throw std::runtime_error("RpcRequest::Defer: Request is answered already");
+
+	_answered = true;
+
+	RpcReply reply;
+	reply._locks = _server._write_locks;
+	reply._connection = _msg.GetConnection();
+	reply._slot = _msg.GetSlot();
+	reply._id = _header.id;
+	reply._method = _header.method;
+	return reply;
+}
+
+RpcServer::RpcServer(uint16_t port, size_t msg_size, size_t max_connections, Protocol protocol, Mode mode)
+	: ServerBase(port, msg_size, max_connections, protocol, mode),
+	  _write_locks(std::make_shared<std::vector<std::mutex>>(std::max<size_t>(max_connections, 1)))
+{
+	if (!IsStream())
+		throw std::runtime_error("RpcServer::RpcServer: RPC needs stream protocol");
+
+	SetFramer(std::make_shared<RpcFramer>());
+}
+
+RpcServer::RpcServer(const std::string &path, size_t msg_size, size_t max_connections, Mode mode)
+	: ServerBase(path, msg_size, max_connections, Protocol::UNIX_STREAM, mode),
+	  _write_locks(std::make_shared<std::vector<std::mutex>>(std::max<size_t>(max_connections, 1)))
+{
+	SetFramer(std::make_shared<RpcFramer>());
+}
+
+void RpcServer::Register(uint32_t method, Handler handler)
+{
+	if (!_methods.emplace(method, std::move(handler)).second)
+		throw std::runtime_error("RpcServer::Register: Method is registered already: " + std::to_string(method));
+}
+
+void RpcServer::OnReceive(MessageBase &msg)
+{
+	/* Framer passes whole frames only, header is there */
+	RpcHeader header;
+	memcpy(&header, msg.GetData(), sizeof(header));
+
+	/* Client sends requests only, anything else drops it */
+	if (header.type != static_cast<uint16_t>(RpcType::REQUEST))
+		throw std::runtime_error("RpcServer::OnReceive: Unexpected frame type");
+
+	RpcRequest request(*this, msg, header, msg.GetData() + sizeof(header), header.size);
+
+	auto method = _methods.find(header.method);
+	if (method == _methods.end())
+	{
+		request.Reply(nullptr, 0, RpcStatus::NO_METHOD);
+		return;
+	}
+
+	try
+	{
+		method->second(request);
+	}
+	catch (const std::exception &e)
+	{
+		/* Failed response leaves the connection broken */
+		if (request._answered)
+			throw;
+
+		request.Reply(e.what(), strlen(e.what()), RpcStatus::FAILED);
+		return;
+	}
+
+	if (!request._answered)
+		request.Reply(nullptr, 0);
+}
+
+RpcClient::RpcClient(const std::string &ip, uint16_t port)
+	: _client(ip, port, ServerBase::Protocol::TCP)
+{
+	_reader = std::thread(&RpcClient::Run, this);
+}
+
+RpcClient::RpcClient(const std::string &path)
+	: _client(path, ServerBase::Protocol::UNIX_STREAM)
+{
+	_reader = std::thread(&RpcClient::Run, this);
+}
+
+RpcClient::~RpcClient()
+{
+	Close();
+}
+
+void RpcClient::Call(uint32_t method, const char *src, size_t size, Callback callback)
+{
+	RpcHeader header = { RPC_MAGIC, static_cast<uint32_t>(size), 0, method,
+			     static_cast<uint16_t>(RpcType::REQUEST), static_cast<uint16_t>(RpcStatus::OK) };
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_closed)
+			throw std::runtime_error("RpcClient::Call: Connection is closed");
+
+		header.id = _next_id++;
+		_pending[header.id] = std::move(callback);
+	}
+
+	struct iovec iov[2] = {
+		{ &header, sizeof(header) },
+		{ const_cast<char *>(src), size },
+	};
+
+	try
+	{
+		/* Frame goes in one write, requests of other threads must not interleave */
+		std::lock_guard<std::mutex> lock(_send_lock);
+		_client.Send(iov, size ? 2 : 1);
+	}
+	catch (const std::exception &)
+	{
+		/* Reader may have failed the request already, callback is called once */
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_pending.erase(header.id))
+			throw;
+	}
+}
+
+RpcStatus RpcClient::Call(uint32_t method, const std::string &request, std::string &response)
+{
+	std::promise<RpcStatus> done;
+	std::future<RpcStatus> status = done.get_future();
+
+	Call(method, request.data(), request.size(), [&done, &response](RpcStatus result, const char *data, size_t size) {
+		response.assign(data, size);
+		done.set_value(result);
+	});
+
+	return status.get();
+}
+
+size_t RpcClient::GetPending() const
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return _pending.size();
+}
+
+void RpcClient::Close()
+{
+	/* Reader wakes up, fails requests pending and exits */
+	_client.Shutdown();
+	if (_reader.joinable())
+		_reader.join();
+
+	_client.Close();
+}
+
+void RpcClient::Run()
+{
+	/* Grows to the largest response and is reused */
+	std::vector<char> payload;
+
+	try
+	{
+		while (true)
+		{
+			RpcHeader header;
+			_client.ReadExact(reinterpret_cast<char *>(&header), sizeof(header));
+			if (header.magic != RPC_MAGIC || header.type != static_cast<uint16_t>(RpcType::RESPONSE))
+				break;
+
+			payload.resize(header.size);
+			if (header.size)
+				_client.ReadExact(payload.data(), header.size);
+
+			Callback callback;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				auto call = _pending.find(header.id);
+				if (call == _pending.end())
+					continue;
+
+				callback = std::move(call->second);
+				_pending.erase(call);
+			}
+
+			callback(static_cast<RpcStatus>(header.status), payload.data(), payload.size());
+		}
+	}
+	catch (const std::exception &)
+	{
+		/* Connection is closed */
+	}
+
+	/* No response comes anymore, fail the rest */
+	std::unordered_map<uint32_t, Callback> pending;
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_closed = true;
+		pending.swap(_pending);
+	}
+
+	for (auto &call : pending)
+		call.second(RpcStatus::DISCONNECTED, nullptr, 0);
+}
@@ -0,0 +1,337 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Request/response RPC layer of Posix server.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#ifndef __SERVER_RPC_H__
+#define __SERVER_RPC_H__
+
+#include "server.h"
+#include "hash.h"
+
+/* "RPC1" in memory, starts every frame */
+#define RPC_MAGIC			0x31435052
+
+namespace Network {
+
+/**
+ * Fixed header of every RPC frame, payload of size bytes follows.
+ *
+ * Fields are in host byte order, peers are expected to share it. Method
+ * is Hash() of its name from hash.h, computed at compile time.
+ */
+struct RpcHeader
+{
+	uint32_t magic;
+	uint32_t size;
+	uint32_t id;
+	uint32_t method;
+	uint16_t type;
+	uint16_t status;
+};
+
+enum class RpcType : uint16_t { REQUEST, RESPONSE };
+
+/**
+ * Status of response.
+ *
+ * OK		Handler replied, payload is its reply.
+ * NO_METHOD	Method is not registered by the server.
+ * FAILED	Handler failed, payload is the reason.
+ * DISCONNECTED	Connection is lost before response, set by client only.
+ */
+enum class RpcStatus : uint16_t { OK, NO_METHOD, FAILED, DISCONNECTED };
+
+class RpcServer;
+
+/**
+ * Handle to respond to a request after its handler returned.
+ *
+ * Can be used from any thread, responses to requests of one connection
+ * may go in any order. Respond once, handle is cheap to copy.
+ */
+class RpcReply
+{
+public:
+	RpcReply() = default;
+
+	/**
+	 * @brief Send response, dropped if client is gone.
+	 *
+	 * @param src		Pointer to response payload.
+	 * @param size		Size of response payload.
+	 * @param status	Status of response.
+	 */
+	void Send(const char *src, size_t size, RpcStatus status = RpcStatus::OK) const;
+
+	/**
+	 * @brief Send response, dropped if client is gone.
+	 *
+	 * @param data		Response payload.
+	 * @param status	Status of response.
+	 */
+	void Send(const std::string &data, RpcStatus status = RpcStatus::OK) const;
+
+	/**
+	 * @brief Check if handle refers to a request.
+	 *
+	 * @return False for empty handle.
+	 */
+	bool IsValid() const { return _locks != nullptr; }
+private:
+	friend class RpcRequest;
+	/* Outlive the server, reply may be sent after it is gone */
+	std::shared_ptr<std::vector<std::mutex>> _locks;
+	Connection _connection;
+	size_t _slot = 0;
+	uint32_t _id = 0;
+	uint32_t _method = 0;
+};
+
+/**
+ * Request passed to method handler.
+ *
+ * Payload points into the receive buffer and is valid until the handler
+ * returns. Handler replies once or defers the reply, one returning
+ * without either answers with empty payload. Throwing answers FAILED
+ * with exception text.
+ */
+class RpcRequest
+{
+public:
+	const char *GetData() const { return _data; }
+	size_t GetSize() const { return _size; }
+	uint32_t GetId() const { return _header.id; }
+	uint32_t GetMethod() const { return _header.method; }
+
+	/**
+	 * @brief Get received message, to get peer credentials etc.
+	 */
+	MessageBase &GetMessage() const { return _msg; }
+
+	/**
+	 * @brief Send response.
+	 *
+	 * @param src		Pointer to response payload.
+	 * @param size		Size of response payload.
+	 * @param status	Status of response.
+	 */
+	void Reply(const char *src, size_t size, RpcStatus status = RpcStatus::OK);
+
+	/**
+	 * @brief Send response.
+	 *
+	 * @param data		Response payload.
+	 * @param status	Status of response.
+	 */
+	void Reply(const std::string &data, RpcStatus status = RpcStatus::OK);
+
+	/**
+	 * @brief Respond later, connection keeps serving other requests meanwhile.
+	 *
+	 * @return Handle to send response with.
+	 */
+	RpcReply Defer();
+private:
+	friend class RpcServer;
+	RpcRequest(RpcServer &server, MessageBase &msg, const RpcHeader &header, const char *data, size_t size)
+		: _server(server), _msg(msg), _header(header), _data(data), _size(size) {}
+
+	RpcServer &_server;
+	MessageBase &_msg;
+	const RpcHeader &_header;
+	const char *_data;
+	size_t _size;
+	bool _answered = false;
+};
+
+/**
+ * Server dispatching requests to registered methods.
+ *
+ * Works over stream sockets in any mode. Every frame is a fixed header
+ * and payload, parsed in place without allocation. Clients may keep many
+ * requests outstanding on one connection, deferred responses go out as
+ * soon as they are ready regardless of request order.
+ */
+class RpcServer : public ServerBase
+{
+public:
+	using Handler = std::function<void(RpcRequest &request)>;
+
+	/**
+	 * @brief Constructor of RpcServer class.
+	 *
+	 * Throws std::runtime_error for datagram protocols.
+	 *
+	 * @param port			Port number to listen to.
+	 * @param msg_size		Largest frame, header included.
+	 * @param max_connections	Maximum allowed connections.
+	 * @param protocol		Stream protocol.
+	 * @param mode			Client handling mode.
+	 */
+	RpcServer(uint16_t port,
+		  size_t msg_size = 64 * 1024,
+		  size_t max_connections = 32,
+		  Protocol protocol = Protocol::TCP,
+		  Mode mode = Mode::THREADED);
+
+	/**
+	 * @brief Constructor of RpcServer class listening to Unix socket.
+	 *
+	 * @param path			Socket path, leading '@' is abstract.
+	 * @param msg_size		Largest frame, header included.
+	 * @param max_connections	Maximum allowed connections.
+	 * @param mode			Client handling mode.
+	 */
+	RpcServer(const std::string &path,
+		  size_t msg_size = 64 * 1024,
+		  size_t max_connections = 32,
+		  Mode mode = Mode::THREADED);
+
+	/**
+	 * @brief Register method handler.
+	 *
+	 * Should be called before Start(). Throws std::runtime_error if
+	 * method is registered already, names of two methods may collide.
+	 *
+	 * @param method		Hash("name") of the method.
+	 * @param handler		Handler called from the thread serving the client.
+	 */
+	void Register(uint32_t method, Handler handler);
+
+	void OnReceive(MessageBase &msg) override;
+private:
+	friend class RpcRequest;
+
+	std::unordered_map<uint32_t, Handler> _methods;
+	/* Per slot, THREADED mode writes deferred responses from caller threads */
+	std::shared_ptr<std::vector<std::mutex>> _write_locks;
+};
+
+/**
+ * Client multiplexing RPC calls on one stream connection.
+ *
+ * Any thread may call, requests go out at once and responses are matched
+ * by request ID in whatever order they come. Responses are handled by
+ * the reader thread of the client.
+ */
+class RpcClient
+{
+public:
+	using Callback = std::function<void(RpcStatus status, const char *data, size_t size)>;
+
+	/**
+	 * @brief Connect to TCP server.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param ip		Server IP address.
+	 * @param port		Server port.
+	 */
+	RpcClient(const std::string &ip, uint16_t port);
+
+	/**
+	 * @brief Connect to Unix stream server.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param path		Socket path, leading '@' is abstract.
+	 */
+	explicit RpcClient(const std::string &path);
+
+	~RpcClient();
+
+	RpcClient(const RpcClient &) = delete;
+	RpcClient &operator=(const RpcClient &) = delete;
+
+	/**
+	 * @brief Send request without waiting for response.
+	 *
+	 * Callback is called from the reader thread with the response, or
+	 * with DISCONNECTED once the connection is lost. It must not throw
+	 * or close the client. Throws std::runtime_error if the connection
+	 * is closed, callback is not called then.
+	 *
+	 * @param method	Hash("name") of the method.
+	 * @param src		Pointer to request payload.
+	 * @param size		Size of request payload.
+	 * @param callback	Function to handle response.
+	 */
+	void Call(uint32_t method, const char *src, size_t size, Callback callback);
+
+	/**
+	 * @brief Send request and wait for response.
+	 *
+	 * Calls of other threads go on meanwhile on the same connection.
+	 * Throws std::runtime_error if the connection is closed.
+	 *
+	 * @param method	Hash("name") of the method.
+	 * @param request	Request payload.
+	 * @param response	Response payload.
+	 * @return Status of response.
+	 */
+	RpcStatus Call(uint32_t method, const std::string &request, std::string &response);
+
+	/**
+	 * @brief Get amount of requests waiting for response.
+	 */
+	size_t GetPending() const;
+
+	/**
+	 * @brief Close connection, requests pending fail with DISCONNECTED.
+	 */
+	void Close();
+private:
+	void Run();
+
+	Client _client;
+	std::thread _reader;
+	std::mutex _send_lock;
+	mutable std::mutex _lock;
+	std::unordered_map<uint32_t, Callback> _pending;
+	uint32_t _next_id = 0;
+	bool _closed = false;
+};
+
+} /* namespace Network */
+
+#endif /* __SERVER_RPC_H__ */
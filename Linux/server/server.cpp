@@ -43,402 +43,4182 @@
  */
 
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdexcept>
+#include <atomic>
+#include <future>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <unordered_map>
 #include "server.h"
+#include "server_internal.h"
 #include <cstring>
 
+#ifndef EPOLL_MAX_EVENTS
+#define EPOLL_MAX_EVENTS		64
+#endif
+
+#ifndef HANDOFF_TIMEOUT_MS
+#define HANDOFF_TIMEOUT_MS		5000
+#endif
+
+/* Descriptors passed by one message, SCM_MAX_FD of the kernel */
+#define HANDOFF_FDS_MAX			253
+#define HANDOFF_MAGIC			0x48414e44
+
 using namespace Network;
 
-void MessageBase::Reply(const char *src, size_t size)
+/* Fill Unix socket address, leading '@' selects abstract namespace */
+static socklen_t unix_address(const std::string &path, struct sockaddr_un &addr, const char *where)
 {
-	ssize_t sent = write(_sockfd, src, size);
-	if (sent != static_cast<ssize_t>(size))
-		throw std::runtime_error(
-			"MessageBase::Reply: Send failed " + std::to_string(errno) + ": " + std::string(strerror(errno)));
-}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
 
-void MessageBase::Reply(const std::string &msg)
-{
-	Reply(msg.c_str(), msg.size());
+	if (path.empty() || path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error(std::string(where) + ": Invalid socket path: " + path);
+
+	memcpy(addr.sun_path, path.data(), path.size());
+
+	/* Abstract name is not NUL terminated, its length is part of the address */
+	if (path[0] == '@')
+	{
+		addr.sun_path[0] = '\0';
+		return static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + path.size());
+	}
+	return static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + path.size() + 1);
 }
 
-void MessageBase::Reply(const std::vector<char> &msg)
+static std::string peer_name(const struct sockaddr *addr, socklen_t len)
 {
-	Reply(msg.data(), msg.size());
+	if (len >= sizeof(struct sockaddr_in) && addr->sa_family == AF_INET)
+	{
+		char ip[INET_ADDRSTRLEN] = { 0 };
+		inet_ntop(AF_INET, &reinterpret_cast<const struct sockaddr_in *>(addr)->sin_addr, ip, sizeof(ip));
+		return ip;
+	}
+
+	/* Unbound Unix peers have family only */
+	size_t offset = offsetof(struct sockaddr_un, sun_path);
+	if (len <= offset || addr->sa_family != AF_UNIX)
+		return std::string();
+
+	const char *path = reinterpret_cast<const struct sockaddr_un *>(addr)->sun_path;
+	size_t size = len - offset;
+	if (!path[0])
+		return "@" + std::string(path + 1, size - 1);
+	return std::string(path, strnlen(path, size));
 }
 
-char *MessageBase::GetData() const
+struct sockaddr_in PeerAddress::Inet() const
 {
-	return data;
+	struct sockaddr_in inet = {};
+	if (addr.ss_family == AF_INET)
+		memcpy(&inet, &addr, sizeof(inet));
+	return inet;
 }
 
-size_t MessageBase::GetSize() const
+std::string PeerAddress::Name() const
 {
-	return size;
+	return peer_name(reinterpret_cast<const struct sockaddr *>(&addr), len);
 }
 
-ServerBase::ServerBase(uint16_t port, size_t msg_size, size_t max_connections, Protocol protocol)
-	: _port(port), _msg_size(msg_size), _max_connections(max_connections), _protocol(protocol)
-{}
-
-ServerBase::~ServerBase()
+/* Message of handoff socket, descriptors are passed along as SCM_RIGHTS */
+struct HandoffHeader
 {
-	Stop();
-}
+	enum Kind : uint32_t { LISTENERS, READY, CLIENTS };
 
-class ServerInternal final: public ServerBase
+	uint32_t magic;
+	uint32_t kind;
+	uint32_t count;
+};
+
+static bool send_handoff(int sockfd, uint32_t kind, const int *fds, size_t count)
 {
-public:
-	using ServerBase::ServerBase;
+	HandoffHeader hdr = { HANDOFF_MAGIC, kind, static_cast<uint32_t>(count) };
+	struct iovec iov = { &hdr, sizeof(hdr) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_MAX)];
+		struct cmsghdr align;
+	} control;
 
-	void AddClient(int sockfd)
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (count)
 	{
-		std::lock_guard<std::mutex> lock(_socket->guard);
-		_socket->clients_list.insert(sockfd);
-	}
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
 
-	void RemoveClient(int sockfd)
-	{
-		std::lock_guard<std::mutex> lock(_socket->guard);
-		_socket->clients_list.erase(sockfd);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
 	}
 
-	int AcceptClient()
-	{
-		if (_socket->_sockfd < 0)
-			return -1;
+	ssize_t res;
+	do
+		res = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+	while (res < 0 && errno == EINTR);
 
-		socklen_t socklen;
-		struct sockaddr_in cli_addr;
-		int clientfd = accept(_socket->_sockfd, (struct sockaddr *)&cli_addr, &socklen);
+	return res == sizeof(hdr);
+}
 
-		return clientfd;
-	}
+/* Receive handoff message, descriptors passed along are closed if it is malformed */
+static bool receive_handoff(int sockfd, HandoffHeader &hdr, std::vector<int> &fds)
+{
+	struct iovec iov = { &hdr, sizeof(hdr) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_MAX)];
+		struct cmsghdr align;
+	} control;
 
-	std::string GetClientIP(int sockfd)
-	{
-		socklen_t socklen;
-		struct sockaddr_in cli_addr;
-		getpeername(sockfd, (struct sockaddr *)&cli_addr, &socklen);
-		return std::string{ inet_ntoa(cli_addr.sin_addr) };
-	}
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
 
-	size_t GetMaxMsgSize() const
-	{
-		return _msg_size;
-	}
+	ssize_t res;
+	do
+		res = recvmsg(sockfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	while (res < 0 && errno == EINTR);
 
-	void CloseAllClients()
+	fds.clear();
+	for (struct cmsghdr *cmsg = res > 0 ? CMSG_FIRSTHDR(&msg) : nullptr; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
 	{
-		std::lock_guard<std::mutex> lock(_socket->guard);
-		for (const auto& client: _socket->clients_list)
-			close(client);
-	}
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
 
-	ssize_t ReceiveUDP(char *buffer, size_t size, struct sockaddr_in *cli_addr)
-	{
-		socklen_t si_client_len = sizeof(*cli_addr);
-		return recvfrom(_socket->_sockfd, buffer, size, 0,
-				(struct sockaddr *)cli_addr, &si_client_len);
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		size_t offset = fds.size();
+		fds.resize(offset + count);
+		memcpy(&fds[offset], CMSG_DATA(cmsg), sizeof(int) * count);
 	}
 
-	int GetSockfd() const
-	{
-		return _socket->_sockfd;
-	}
-};
+	if (res == sizeof(hdr) && hdr.magic == HANDOFF_MAGIC && !(msg.msg_flags & MSG_CTRUNC) &&
+	    hdr.count == fds.size())
+		return true;
 
-static void client_handler(ServerBase *server, int sockfd)
-{
-	ServerInternal *srv = static_cast<ServerInternal *>(server);
+	for (int fd : fds)
+		close(fd);
+	fds.clear();
+	return false;
+}
 
-	char *buffer = new char[srv->GetMaxMsgSize()];
-	if (!buffer)
-	{
-		/* Memory error, close connection */
-		srv->RemoveClient(sockfd);
-		close(sockfd);
-		return;
-	}
+/* Wait until socket is readable, false on timeout or if woken up */
+static bool wait_handoff(int sockfd, int wakefd, int timeout)
+{
+	struct pollfd pfds[2] = { { sockfd, POLLIN, 0 }, { wakefd, POLLIN, 0 } };
 
 	while (true)
 	{
-		auto size = read(sockfd, buffer, srv->GetMaxMsgSize());
-		if (size <= 0)
-			break;
+		int ret = poll(pfds, 2, timeout);
+		if (ret > 0)
+			return !pfds[1].revents;
 
-		MessageBase msg(sockfd, buffer, static_cast<size_t>(size));
-		server->OnReceive(msg);
+		if (ret == 0 || errno != EINTR)
+			return false;
 	}
+}
 
-	/* Client is terminated, remove from list */
-	srv->RemoveClient(sockfd);
-
-	/* Gently close */
-	close(sockfd);
+/* Handed over listening socket has to serve the same protocol */
+static bool listener_matches(int sockfd, int domain, int type)
+{
+	int value = 0;
+	socklen_t len = sizeof(value);
+	if (getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &value, &len) < 0 || value != domain)
+		return false;
 
-	server->OnDisconnect();
-	delete[] buffer;
+	len = sizeof(value);
+	return getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &value, &len) == 0 && value == type;
 }
 
-static void tcp_handler(ServerBase *server)
+static void send_all(int fd, const char *src, size_t size,
+		     std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
 {
-	ServerInternal *srv = static_cast<ServerInternal *>(server);
+	/* Timeout needs non-blocking sends, socket flags are left alone */
+	int flags = MSG_NOSIGNAL | (timeout.count() ? MSG_DONTWAIT : 0);
 
-	while (true)
+	while (size)
 	{
-		int clientfd = srv->AcceptClient();
+		ssize_t sent = send(fd, src, size, flags);
+		if (sent < 0 && errno == EINTR)
+			continue;
 
-		/* Socket failed due to termination */
-		if (clientfd < 0)
-			return;
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			/* Socket is full, wait for room */
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+			if (!poll(&pfd, 1, timeout.count() ? static_cast<int>(timeout.count()) : -1))
+				throw std::runtime_error("MessageBase::Reply: Write timeout");
+			continue;
+		}
 
-		/* Call event when connected */
-		server->OnConnect(srv->GetClientIP(clientfd));
+		if (sent <= 0)
+			throw std::runtime_error(
+				"MessageBase::Reply: Send failed " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		/* Partial write, the rest goes next */
+		src += sent;
+		size -= static_cast<size_t>(sent);
+	}
+}
+
+/* Wait for the socket to become writable, false on timeout */
+static bool wait_writable(int fd, std::chrono::milliseconds timeout)
+{
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	int res;
+
+	do
+		res = poll(&pfd, 1, timeout.count() ? static_cast<int>(timeout.count()) : -1);
+	while (res < 0 && errno == EINTR);
+	return res != 0;
+}
 
-		size_t num_clients = server->GetNumberOfClients();
+static void send_file(int fd, int file, off_t offset, size_t size,
+		      std::chrono::milliseconds timeout, const char *where)
+{
+	while (size)
+	{
+		/* Blocking socket may stall inside sendfile(), chunks bound the wait */
+		if (timeout.count() && !wait_writable(fd, timeout))
+			throw std::runtime_error(std::string(where) + ": Write timeout");
+
+		ssize_t sent = sendfile(fd, file, &offset, std::min<size_t>(size, SENDFILE_CHUNK));
+		if (sent < 0 && errno == EINTR)
+			continue;
 
-		if (num_clients >= server->GetMaxConnections())
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
 		{
-			/* Too many connections, close socket */
-			close(clientfd);
+			if (!wait_writable(fd, timeout))
+				throw std::runtime_error(std::string(where) + ": Write timeout");
 			continue;
 		}
 
-		/* Register client */
-		srv->AddClient(clientfd);
+		if (sent < 0)
+			throw std::runtime_error(std::string(where) +
+				": Send failed " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		if (!sent)
+			throw std::runtime_error(std::string(where) + ": File is shorter than requested");
+
+		size -= static_cast<size_t>(sent);
+	}
+}
+
+static void send_zerocopy(int fd, ZeroCopyTracker &zerocopy, const char *src, size_t size,
+			  std::chrono::milliseconds timeout, const char *where)
+{
+	int flags = MSG_NOSIGNAL | MSG_ZEROCOPY | (timeout.count() ? MSG_DONTWAIT : 0);
+
+	while (size)
+	{
+		ssize_t sent = send(fd, src, size, flags);
+		if (sent < 0 && errno == EINTR)
+			continue;
 
-		if (num_clients == 1)
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
 		{
-			/* For single connection use this thread */
-			client_handler(server, clientfd);
+			if (!wait_writable(fd, timeout))
+				throw std::runtime_error(std::string(where) + ": Write timeout");
+			continue;
 		}
-		else
+
+		/* Socket option memory is exhausted, the rest is copied */
+		if (sent < 0 && errno == ENOBUFS)
 		{
-			/* Create client thread */
-			std::thread(client_handler, server, clientfd).detach();
+			send_all(fd, src, size, timeout);
+			break;
 		}
-	};
-}
 
-static void udp_handler(ServerBase *server)
-{
-	ServerInternal *srv = static_cast<ServerInternal *>(server);
-	char *buffer = static_cast<char *>(malloc(srv->GetMaxMsgSize()));
-	if (!buffer)
-	{
-		/* Memory error, terminate */
-		return;
+		if (sent <= 0)
+			throw std::runtime_error(std::string(where) +
+				": Send failed " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		zerocopy.Sent();
+		src += sent;
+		size -= static_cast<size_t>(sent);
 	}
 
-	while (true)
+	/* Caller takes the buffer back on return, wait for the kernel to let it go */
+	while (zerocopy.Pending())
 	{
-		struct sockaddr_in cli_addr;
-		auto size = srv->ReceiveUDP(buffer, srv->GetMaxMsgSize(), &cli_addr);
-		if (size < 0)
-			break;
-
-		if (size == 0)
+		/* Completions raise POLLERR, nothing else is polled for */
+		struct pollfd pfd = { fd, 0, 0 };
+		int res = poll(&pfd, 1, timeout.count() ? static_cast<int>(timeout.count()) : -1);
+		if (res < 0 && errno == EINTR)
 			continue;
-		
-		/* Call event when connected */
-		server->OnConnect(inet_ntoa(cli_addr.sin_addr));
 
-		MessageBase msg(srv->GetSockfd(), buffer, static_cast<size_t>(size));
-		server->OnReceive(msg);
+		if (!res)
+			throw std::runtime_error(std::string(where) + ": Write timeout");
 
-		server->OnDisconnect();
-	}
+		if (res < 0 || !zerocopy.Reap(fd))
+			throw std::runtime_error(std::string(where) + ": Send failed");
 
-	free(buffer);
+		/* Connection is gone, completions of data dropped with it are reaped above */
+		if ((pfd.revents & (POLLHUP | POLLNVAL)) && zerocopy.Pending())
+			throw std::runtime_error(std::string(where) + ": Connection closed");
+	}
 }
 
-void ServerBase::Start()
-{
-	_socket = std::make_shared<ServerSocket>(*this);
-	_socket->Start();
-}
+MessageBase::MessageBase(ClientContext *client, char *data, size_t size)
+	: _sockfd(client->fd), _client(client), data(data), size(size) {}
 
-void ServerBase::Stop()
+MessageBase::MessageBase(DatagramBatch *batch, char *data, size_t size,
+			 const struct sockaddr_in &peer)
+	: MessageBase(batch, data, size, reinterpret_cast<const struct sockaddr *>(&peer), sizeof(peer)) {}
+
+MessageBase::MessageBase(DatagramBatch *batch, char *data, size_t size,
+			 const struct sockaddr *peer, socklen_t peer_len, const struct ucred *cred)
+	: _sockfd(-1), _batch(batch), data(data), size(size)
 {
-	_socket->Stop();
+	_peer_len = std::min<socklen_t>(peer_len, sizeof(_peer));
+	memcpy(&_peer, peer, _peer_len);
+	if (cred)
+		_cred = *cred;
 }
 
-ServerBase::ServerSocket::ServerSocket(ServerBase &server)
-	: server(server) {}
-
-void ServerBase::ServerSocket::Start()
+void MessageBase::Reply(const char *src, size_t size)
 {
-	_sockfd = socket(AF_INET, server._protocol == ServerBase::Protocol::TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
-	if (_sockfd < 0)
-		throw std::runtime_error(
-			"ServerBase::Start: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	/* Event loops may queue data instead of writing it */
+	if (_client)
+	{
+		if (_client->loop)
+			_client->loop->Send(*_client, src, size);
+		else
+			send_all(_sockfd, src, size, _client->write_timeout);
 
-	/* Bind socket */
-	struct sockaddr_in serv_addr;
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serv_addr.sin_port = htons(server._port);
+		if (_client->slot)
+			_client->slot->bytes_out.fetch_add(size, std::memory_order_relaxed);
+		return;
+	}
 
-	if (bind(_sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+	/* Socket is not connected, reply goes to the sender address */
+	if (_batch)
 	{
-		close(_sockfd);
-		throw std::runtime_error(
-			"ServerBase::Start: Bind socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+		_batch->Queue(_peer, _peer_len, src, size);
+		return;
 	}
 
-	/* Start listening for incoming connections. */
-	if (server._protocol == ServerBase::Protocol::TCP)
+	send_all(_sockfd, src, size);
+}
+
+void MessageBase::ReplyFile(int fd, off_t offset, size_t size)
+{
+	if (_client)
 	{
-		int res = listen(_sockfd, server._max_connections);
-		if (res)
-		{
-			close(_sockfd);
-			throw std::runtime_error(
-				"ServerBase::Start: Socket listen error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
-		}
+		if (_client->loop)
+			_client->loop->SendFile(*_client, fd, offset, size);
+		else
+			send_file(_sockfd, fd, offset, size, _client->write_timeout, "MessageBase::ReplyFile");
+
+		if (_client->slot)
+			_client->slot->bytes_out.fetch_add(size, std::memory_order_relaxed);
+		return;
 	}
 
-	/* Start server thread */
-	_server_thread = std::thread(server._protocol == ServerBase::Protocol::TCP ? tcp_handler : udp_handler, &server);
+	if (_batch)
+		throw std::runtime_error("MessageBase::ReplyFile: Not supported for datagrams");
+
+	send_file(_sockfd, fd, offset, size, std::chrono::milliseconds(0), "MessageBase::ReplyFile");
 }
 
-void ServerBase::ServerSocket::Stop()
+void MessageBase::ReplyZeroCopy(const char *src, size_t size, std::function<void()> release)
 {
-	/* Close all client connections */
-	ServerInternal *srv = static_cast<ServerInternal *>(&server);
-	srv->CloseAllClients();
+	if (_client)
+	{
+		if (_client->loop)
+		{
+			_client->loop->SendZeroCopy(*_client, src, size, std::move(release));
+		}
+		else
+		{
+			/* Handler thread owns the client, wait for completion in place */
+			try
+			{
+				if (size >= ZEROCOPY_MIN && _client->zerocopy.Enable(_sockfd))
+					send_zerocopy(_sockfd, _client->zerocopy, src, size,
+						      _client->write_timeout, "MessageBase::ReplyZeroCopy");
+				else
+					send_all(_sockfd, src, size, _client->write_timeout);
+			}
+			catch (const std::exception &)
+			{
+				release();
+				throw;
+			}
+			release();
+		}
 
-	/* Close socket to terminate server thread */
-	if (_sockfd >= 0)
+		if (_client->slot)
+			_client->slot->bytes_out.fetch_add(size, std::memory_order_relaxed);
+		return;
+	}
+
+	/* Datagrams and foreign threads copy */
+	try
 	{
-		shutdown(_sockfd, SHUT_RD);
-		_sockfd = -1;
+		Reply(src, size);
+	}
+	catch (const std::exception &)
+	{
+		release();
+		throw;
 	}
+	release();
+}
 
-	/* Wait for server thread termination */
-	if (_server_thread.joinable())
-		_server_thread.join();
+void MessageBase::Reply(const std::string &msg)
+{
+	Reply(msg.c_str(), msg.size());
 }
 
-ServerBase::ServerSocket::~ServerSocket()
+void MessageBase::Reply(const std::vector<char> &msg)
 {
-	Stop();
+	Reply(msg.data(), msg.size());
 }
 
-size_t ServerBase::GetNumberOfClients()
+char *MessageBase::GetData() const
 {
-	std::lock_guard<std::mutex> lock(_socket->guard);
-	return _socket->clients_list.size();
+	return data;
 }
 
-size_t ServerBase::GetMaxConnections() const
+size_t MessageBase::GetSize() const
 {
-	return _max_connections;
+	return size;
 }
 
-Client::Client(const std::string& ip, uint16_t port, ServerBase::Protocol protocol)
+const struct sockaddr_in &MessageBase::GetPeer() const
 {
-	_sockfd = socket(AF_INET, protocol == ServerBase::Protocol::TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
-	if (_sockfd < 0)
-		throw std::runtime_error(
-			"Client::Client: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	static const struct sockaddr_in none = {};
 
-	struct sockaddr_in serv_addr;
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(port);
+	if (_peer.ss_family != AF_INET)
+		return none;
+	return reinterpret_cast<const struct sockaddr_in &>(_peer);
+}
 
-	if (inet_pton(AF_INET, ip.c_str(), &serv_addr.sin_addr) <= 0)
-	{
-		close(_sockfd);
-		throw std::runtime_error(
-			"Client::Client: Invalid address/ Address not supported: " + ip);
-	}
+std::string MessageBase::GetPeerName() const
+{
+	return peer_name(reinterpret_cast<const struct sockaddr *>(&_peer), _peer_len);
+}
 
-	if (connect(_sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
-	{
-		close(_sockfd);
-		throw std::runtime_error(
-			"Client::Client: Connection Failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
-	}
+bool MessageBase::GetCredentials(struct ucred &cred) const
+{
+	cred = _client ? _client->cred : _cred;
+	return cred.pid != 0;
 }
 
-Client::~Client()
+size_t MessageBase::GetSlot() const
 {
-	Close();
+	return _client && _client->slot ? _client->slot->index : SIZE_MAX;
 }
 
-void Client::Send(const char *src, size_t size)
+void MessageBase::SetTimer(std::chrono::milliseconds delay)
 {
-	ssize_t sent = write(_sockfd, src, size);
-	if (sent < 0 || static_cast<size_t>(sent) != size)
-		throw std::runtime_error(
-			"Client::Send: Send failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	if (!_client)
+		throw std::runtime_error("MessageBase::SetTimer: Not a connection");
+
+	ClientContext::Timer &timer = _client->timers[ClientContext::USER_TIMER];
+	if (delay.count())
+		_client->wheel->Arm(timer, delay);
+	else
+		_client->wheel->Cancel(timer);
 }
 
-void Client::Send(const std::string &msg)
+bool MessageBase::IsWritable() const
 {
-	Send(msg.c_str(), msg.size());
+	/* Other replies are written synchronously */
+	return !_client || !_client->loop || _client->loop->IsWritable(*_client);
 }
 
-void Client::Send(const std::vector<char> &msg)
+Connection MessageBase::GetConnection() const
 {
-	Send(msg.data(), msg.size());
+	return _client ? Connection(_client) : Connection();
 }
 
-size_t Client::Read(char *dst, size_t max_size)
+Connection::Connection(ClientContext *client)
+	: _loop(client->loop)
 {
-	ssize_t received = read(_sockfd, dst, max_size);
-	if (received < 0)
-		throw std::runtime_error(
-			"Client::Read: Read failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
-	return static_cast<size_t>(received);
+	if (!client->server || !client->slot)
+		return;
+
+	_socket = client->server->_socket;
+	_slot = client->slot->index;
+	_seq = client->slot->seq.load(std::memory_order_acquire);
 }
 
-size_t Client::Read(std::string &out_str, size_t max_size)
+void Connection::Post(std::function<void(MessageBase *)> fn) const
 {
-	char *buffer = new char[max_size];
-	if (!buffer)
-		throw std::runtime_error("Client::Read: No memory");
+	std::shared_ptr<ServerBase::ServerSocket> socket = _socket.lock();
 
-	ssize_t received = read(_sockfd, buffer, max_size);
-	if (received < 0)
+	if (socket && _loop)
 	{
-		delete[] buffer;
-		throw std::runtime_error(
-			"Client::Read: Read failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+		/* Loops are gone once the server stops */
+		std::lock_guard<std::mutex> lock(socket->posting);
+		bool running = socket->listening && std::any_of(socket->loops.begin(), socket->loops.end(),
+			[this](const std::unique_ptr<EventLoop> &loop) { return loop.get() == _loop; });
+
+		if (running)
+		{
+			_loop->Post(_slot, _seq, std::move(fn));
+			return;
+		}
 	}
+	else if (socket)
+	{
+		/* Handler thread may close the socket, keep it open meanwhile */
+		int fd = socket->clients->Pin(_slot, _seq);
+		if (fd >= 0)
+		{
+			MessageBase msg(fd, nullptr, 0);
+			try
+			{
+				fn(&msg);
+			}
+			catch (const std::exception &)
+			{
+				/* Handler thread sees the socket closed and drops the client */
+				shutdown(fd, SHUT_RDWR);
+			}
 
-	out_str.assign(buffer, static_cast<size_t>(received));
-	delete[] buffer;
-	return static_cast<size_t>(received);
+			socket->clients->Unpin(_slot);
+			return;
+		}
+	}
+
+	fn(nullptr);
 }
 
-std::string Client::ReadString(size_t max_size)
+bool Connection::IsValid() const
 {
-	std::string result;
-	result.resize(max_size);
-	size_t read_bytes = Read(&result[0], max_size);
-	result.resize(read_bytes);
-	return result;
+	return _slot != SIZE_MAX;
 }
 
-std::vector<char> Client::ReadVector(size_t max_size)
+bool Connection::operator==(const Connection &other) const
 {
-	std::vector<char> buffer(max_size);
-	size_t read_bytes = Read(buffer.data(), max_size);
-	buffer.resize(read_bytes);
-	return buffer;
+	/* Slot sequence tells clients of one slot apart, owner tells servers */
+	return _slot == other._slot && _seq == other._seq &&
+	       !_socket.owner_before(other._socket) && !other._socket.owner_before(_socket);
 }
 
-void Client::Close()
+LengthPrefixFramer::LengthPrefixFramer(size_t prefix_size, bool big_endian)
+	: _prefix_size(prefix_size), _big_endian(big_endian)
 {
-	if (_sockfd >= 0)
-	{
-		close(_sockfd);
-		_sockfd = -1;
+	if (prefix_size != 1 && prefix_size != 2 && prefix_size != 4 && prefix_size != 8)
+		throw std::runtime_error(
+			"LengthPrefixFramer::LengthPrefixFramer: Unsupported prefix size " + std::to_string(prefix_size));
+}
+
+size_t LengthPrefixFramer::Next(const char *data, size_t size, size_t &offset, size_t &length) const
+{
+	if (size < _prefix_size)
+		return 0;
+
+	const unsigned char *prefix = reinterpret_cast<const unsigned char *>(data);
+	uint64_t value = 0;
+	for (size_t i = 0; i != _prefix_size; i++)
+		value |= static_cast<uint64_t>(prefix[_big_endian ? _prefix_size - 1 - i : i]) << (8 * i);
+
+	if (value > SIZE_MAX - _prefix_size)
+		throw std::runtime_error("LengthPrefixFramer::Next: Frame length is out of range");
+
+	offset = _prefix_size;
+	length = static_cast<size_t>(value);
+	return _prefix_size + length;
+}
+
+DelimiterFramer::DelimiterFramer(const std::string &delimiter)
+	: _delimiter(delimiter)
+{
+	if (_delimiter.empty())
+		throw std::runtime_error("DelimiterFramer::DelimiterFramer: Empty delimiter");
+}
+
+size_t DelimiterFramer::Next(const char *data, size_t size, size_t &offset, size_t &length) const
+{
+	const void *end = memmem(data, size, _delimiter.data(), _delimiter.size());
+	if (!end)
+		return 0;
+
+	offset = 0;
+	length = static_cast<size_t>(static_cast<const char *>(end) - data);
+	return length + _delimiter.size();
+}
+
+ServerBase::ServerBase(uint16_t port, size_t msg_size, size_t max_connections, Protocol protocol, Mode mode)
+	: _port(port), _msg_size(msg_size), _max_connections(max_connections), _protocol(protocol), _mode(mode)
+{}
+
+ServerBase::ServerBase(const std::string &path, size_t msg_size, size_t max_connections, Protocol protocol, Mode mode)
+	: _path(path), _msg_size(msg_size), _max_connections(max_connections), _protocol(protocol), _mode(mode)
+{
+	if (!IsUnix())
+		throw std::runtime_error("ServerBase::ServerBase: Socket path needs Unix protocol");
+}
+
+ServerBase::~ServerBase()
+{
+	Stop();
+}
+
+void ServerBase::OnReceiveBatch(std::vector<MessageBase> &msgs)
+{
+	for (auto &msg : msgs)
+	{
+		/* Call event when connected */
+		OnConnect(msg.GetPeerName());
+		OnReceive(msg);
+		OnDisconnect();
+	}
+}
+
+class ServerInternal final: public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+
+	ClientTable::Slot *AddClient(int sockfd, const PeerAddress &addr)
+	{
+		ClientTable::Slot *slot = _socket->clients->Acquire(sockfd, addr.Inet());
+		if (slot)
+			_socket->handlers++;
+		return slot;
+	}
+
+	void HandlerDone()
+	{
+		/* Waiter checks the counter under the lock, notify under it as well */
+		if (--_socket->handlers == 0)
+		{
+			std::lock_guard<std::mutex> lock(_socket->guard);
+			_socket->handlers_done.notify_all();
+		}
+	}
+
+	void WaitForHandlers()
+	{
+		std::unique_lock<std::mutex> lock(_socket->guard);
+		_socket->handlers_done.wait(lock, [this]() { return _socket->handlers == 0; });
+	}
+
+	void RemoveClient(ClientTable::Slot *slot)
+	{
+		_socket->clients->Release(slot);
+	}
+
+	int AcceptClient(int listenfd, PeerAddress &cli_addr)
+	{
+		if (!_socket->listening)
+			return -1;
+
+		int clientfd = accept(listenfd, cli_addr.Get(), &cli_addr.len);
+
+		return clientfd;
+	}
+
+	std::string GetClientIP(const PeerAddress &cli_addr)
+	{
+		return cli_addr.Name();
+	}
+
+	size_t GetMaxMsgSize() const
+	{
+		return _msg_size;
+	}
+
+	void CloseAllClients()
+	{
+		/* Wake up blocked readers, handlers close their sockets */
+		_socket->clients->Shutdown();
+	}
+
+	bool IsListening() const
+	{
+		return _socket->listening;
+	}
+
+	bool WaitListener(int listenfd)
+	{
+		/* Listening socket may be shared with another process, handoff wakes handler up */
+		return wait_handoff(listenfd, _socket->wakefd, -1);
+	}
+
+	const Framer *GetFramer() const
+	{
+		return _framer.get();
+	}
+
+	BufferPool &GetPool()
+	{
+		return *_pool;
+	}
+
+	std::chrono::milliseconds GetIdleTimeout() const
+	{
+		return _idle_timeout;
+	}
+
+	std::chrono::milliseconds GetWriteTimeout() const
+	{
+		return _write_timeout;
+	}
+
+	bool IsUnixSocket() const
+	{
+		return IsUnix();
+	}
+
+	RateLimiter *GetLimiter() const
+	{
+		return _socket->limiter.get();
+	}
+};
+
+/* Handle expired client timer, false if client has to be dropped */
+static bool client_timer(ServerBase &server, TimerWheel::Timer *expired)
+{
+	ClientContext::Timer *timer = static_cast<ClientContext::Timer *>(expired);
+
+	/* Rate limited client may be read again */
+	if (timer->kind == ClientContext::THROTTLE_TIMER)
+	{
+		timer->client->Unthrottle();
+		return true;
+	}
+
+	/* Client is idle or does not read replies */
+	if (timer->kind != ClientContext::USER_TIMER)
+		return false;
+
+	MessageBase msg(timer->client, nullptr, 0);
+	try
+	{
+		server.OnTimer(msg);
+	}
+	catch (const std::exception &)
+	{
+		return false;
+	}
+	return true;
+}
+
+/* Block until socket has data or is closed serving client timers, false if client has to be dropped */
+static bool wait_readable(ServerBase *server, ClientContext &client)
+{
+	struct pollfd pfd = { client.fd, POLLIN, 0 };
+
+	while (true)
+	{
+		int ret = poll(&pfd, 1, client.wheel->Timeout());
+		if (ret > 0)
+			return true;
+
+		if (ret < 0 && errno != EINTR)
+			return false;
+
+		while (TimerWheel::Timer *timer = client.wheel->Expire())
+			if (!client_timer(*server, timer))
+				return false;
+	}
+}
+
+/* Charge data read from client and sleep while it is over rate limit, false if client has to be dropped */
+static bool admit(ServerBase *server, ClientContext &client, size_t size, size_t count)
+{
+	RateLimiter *limiter = static_cast<ServerInternal *>(server)->GetLimiter();
+	if (!limiter)
+		return true;
+
+	std::chrono::milliseconds delay = limiter->Charge(client.rate, client.RateSource(), size, count);
+	if (!delay.count())
+		return true;
+
+	/* Socket is left unread, timers of the client are served meanwhile */
+	limiter->Throttled();
+	client.Throttle(delay);
+	while (client.throttled)
+	{
+		poll(nullptr, 0, client.wheel->Timeout());
+
+		while (TimerWheel::Timer *timer = client.wheel->Expire())
+			if (!client_timer(*server, timer))
+				return false;
+	}
+	return true;
+}
+
+static void receive_data(ServerBase *server, ClientContext &client)
+{
+	ServerInternal *srv = static_cast<ServerInternal *>(server);
+
+	/* Idle client holds no buffer, it is borrowed once data is there */
+	while (wait_readable(server, client))
+	{
+		BufferPool::Buffer buffer = srv->GetPool().Acquire(srv->GetMaxMsgSize());
+
+		auto size = read(client.fd, buffer.GetData(), srv->GetMaxMsgSize());
+		if (size <= 0)
+			break;
+
+		client.slot->bytes_in.fetch_add(static_cast<size_t>(size), std::memory_order_relaxed);
+		client.Touch();
+
+		MessageBase msg(&client, buffer.GetData(), static_cast<size_t>(size));
+		try
+		{
+			server->OnReceive(msg);
+		}
+		catch (const std::exception &)
+		{
+			/* Reply failed, timed out or handler failed, drop the client */
+			break;
+		}
+
+		/* Throttled client holds no buffer either */
+		buffer.Reset();
+		if (!admit(server, client, static_cast<size_t>(size), 1))
+			break;
+	}
+}
+
+static void receive_frames(ServerBase *server, ClientContext &client, const Framer &framer)
+{
+	ServerInternal *srv = static_cast<ServerInternal *>(server);
+	FrameReader reader(framer, srv->GetMaxMsgSize(), srv->GetPool());
+
+	while (wait_readable(server, client))
+	{
+		/* Read straight into the ring, frames are handed out in place */
+		struct iovec iov[2];
+		int count = reader.Space(iov);
+		auto size = readv(client.fd, iov, count);
+		if (size <= 0)
+			return;
+
+		client.slot->bytes_in.fetch_add(static_cast<size_t>(size), std::memory_order_relaxed);
+		client.Touch();
+		reader.Commit(static_cast<size_t>(size));
+
+		char *data;
+		size_t length;
+		size_t frames = 0;
+		try
+		{
+			while (reader.Next(data, length))
+			{
+				MessageBase msg(&client, data, length);
+				server->OnReceive(msg);
+				frames++;
+			}
+		}
+		catch (const std::exception &)
+		{
+			/* Stream is malformed, client is gone or handler failed, drop it */
+			return;
+		}
+
+		if (!admit(server, client, static_cast<size_t>(size), frames))
+			return;
+	}
+}
+
+static void client_handler(ServerBase *server, int sockfd, ClientTable::Slot *slot)
+{
+	ServerInternal *srv = static_cast<ServerInternal *>(server);
+
+	/* Client has no loop, replies are written synchronously */
+	TimerWheel timers;
+	ClientContext client(sockfd, nullptr);
+	client.server = server;
+	client.slot = slot;
+	client.wheel = &timers;
+	client.idle_timeout = srv->GetIdleTimeout();
+	client.write_timeout = srv->GetWriteTimeout();
+	client.Touch();
+	if (srv->IsUnixSocket())
+		client.ReadCredentials();
+	if (srv->GetLimiter())
+		srv->GetLimiter()->Attach(client.rate);
+
+	if (srv->GetFramer())
+		receive_frames(server, client, *srv->GetFramer());
+	else
+		receive_data(server, client);
+
+	/* Client is terminated, remove from list */
+	srv->RemoveClient(slot);
+
+	/* Gently close */
+	close(sockfd);
+
+	server->OnDisconnect();
+	srv->HandlerDone();
+}
+
+static void serve_client(ServerBase *server, int clientfd, const PeerAddress &cli_addr)
+{
+	ServerInternal *srv = static_cast<ServerInternal *>(server);
+
+	/* Call event when connected */
+	server->OnConnect(srv->GetClientIP(cli_addr));
+
+	/* Register client */
+	ClientTable::Slot *slot = srv->AddClient(clientfd, cli_addr);
+	if (!slot)
+	{
+		/* Too many connections, close socket */
+		close(clientfd);
+		return;
+	}
+
+	/* Create client thread, accept thread is never blocked by a client */
+	std::thread(client_handler, server, clientfd, slot).detach();
+}
+
+static void tcp_handler(ServerBase *server, int listenfd)
+{
+	ServerInternal *srv = static_cast<ServerInternal *>(server);
+
+	while (srv->WaitListener(listenfd))
+	{
+		PeerAddress cli_addr;
+		int clientfd = srv->AcceptClient(listenfd, cli_addr);
+
+		if (clientfd < 0)
+		{
+			/* Another listener or process took the client */
+			if (srv->IsListening() && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED))
+				continue;
+
+			/* Socket failed due to termination */
+			return;
+		}
+
+		serve_client(server, clientfd, cli_addr);
+	}
+}
+
+static void udp_handler(ServerBase *server, int listenfd)
+{
+	ServerInternal *srv = static_cast<ServerInternal *>(server);
+	DatagramBatch batch(listenfd, srv->GetMaxMsgSize(), UDP_BATCH_SIZE, srv->GetLimiter());
+
+	while (!server->IsHandedOff())
+	{
+		/* Take whatever is queued, wait only if nothing is */
+		int count = batch.Receive(MSG_DONTWAIT);
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if (!srv->WaitListener(listenfd))
+				break;
+			continue;
+		}
+
+		/* Socket is shut down on termination, reads return zero */
+		if (count < 0 || !srv->IsListening())
+			break;
+
+		batch.Dispatch(*server);
+	}
+}
+
+DatagramBatch::DatagramBatch(int sockfd, size_t msg_size, size_t count, RateLimiter *limiter)
+	: _sockfd(sockfd), _msg_size(msg_size), _count(std::max<size_t>(count, 1)), _limiter(limiter),
+	  _hdrs(_count), _iovs(_count), _addrs(_count)
+{
+	_messages.reserve(_count);
+
+	/* Unix datagram servers set SO_PASSCRED, credentials come as control data */
+	int passcred = 0;
+	socklen_t len = sizeof(passcred);
+	if (!getsockopt(sockfd, SOL_SOCKET, SO_PASSCRED, &passcred, &len) && passcred)
+	{
+		_credentials = true;
+		_controls.resize(_count);
+	}
+}
+
+const struct ucred *DatagramBatch::Credentials(const struct msghdr &msg)
+{
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(const_cast<struct msghdr *>(&msg), cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_CREDENTIALS &&
+		    cm->cmsg_len >= CMSG_LEN(sizeof(struct ucred)))
+			return reinterpret_cast<const struct ucred *>(CMSG_DATA(cm));
+	return nullptr;
+}
+
+int DatagramBatch::Receive(int flags)
+{
+	/* Batches filled by Add() never need own buffers */
+	if (!_buffers)
+		_buffers.reset(new char[_msg_size * _count]);
+
+	for (size_t i = 0; i != _count; i++)
+	{
+		_iovs[i].iov_base = _buffers.get() + i * _msg_size;
+		_iovs[i].iov_len = _msg_size;
+		_hdrs[i].msg_hdr = {};
+		_hdrs[i].msg_hdr.msg_name = &_addrs[i];
+		_hdrs[i].msg_hdr.msg_namelen = sizeof(_addrs[i]);
+		_hdrs[i].msg_hdr.msg_iov = &_iovs[i];
+		_hdrs[i].msg_hdr.msg_iovlen = 1;
+		if (_credentials)
+		{
+			_hdrs[i].msg_hdr.msg_control = &_controls[i];
+			_hdrs[i].msg_hdr.msg_controllen = sizeof(_controls[i]);
+		}
+	}
+
+	int count;
+	do
+	{
+		count = recvmmsg(_sockfd, _hdrs.data(), _count, flags, nullptr);
+	} while (count < 0 && errno == EINTR);
+
+	for (int i = 0; i < count; i++)
+		Add(static_cast<char *>(_iovs[i].iov_base), _hdrs[i].msg_len,
+		    reinterpret_cast<struct sockaddr *>(&_addrs[i]), _hdrs[i].msg_hdr.msg_namelen,
+		    _credentials ? Credentials(_hdrs[i].msg_hdr) : nullptr);
+
+	return count;
+}
+
+void DatagramBatch::Add(char *data, size_t size, const struct sockaddr *peer, socklen_t peer_len,
+			const struct ucred *cred)
+{
+	/* Empty datagrams carry nothing to handle */
+	if (!size)
+		return;
+
+	/* Dropped before the server sees it, sender gets no reply */
+	if (_limiter && !_limiter->Admit(RateLimiter::Source(peer, cred), size))
+		return;
+
+	_messages.emplace_back(this, data, size, peer, peer_len, cred);
+}
+
+void DatagramBatch::Dispatch(ServerBase &server)
+{
+	if (!_messages.empty())
+	{
+		try
+		{
+			server.OnReceiveBatch(_messages);
+		}
+		catch (const std::exception &)
+		{
+			/* Nothing to drop, keep serving */
+		}
+	}
+
+	_messages.clear();
+	Flush();
+}
+
+void DatagramBatch::Queue(const struct sockaddr_storage &peer, socklen_t peer_len,
+			  const char *src, size_t size)
+{
+	_replies.push_back({ peer, peer_len, _out.size(), size });
+	_out.insert(_out.end(), src, src + size);
+}
+
+BufferPool::Buffer::Buffer(Buffer &&other) noexcept
+	: _pool(other._pool), _data(other._data), _size(other._size)
+{
+	other._data = nullptr;
+}
+
+BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&other) noexcept
+{
+	if (this != &other)
+	{
+		Reset();
+		_pool = other._pool;
+		_data = other._data;
+		_size = other._size;
+		other._data = nullptr;
+	}
+	return *this;
+}
+
+void BufferPool::Buffer::Reset()
+{
+	if (_data)
+		_pool->Release(_data, _size);
+	_data = nullptr;
+}
+
+BufferPool::BufferPool(size_t cache_limit)
+	: _free(sizeof(size_t) * 8), _cache_limit(cache_limit) {}
+
+BufferPool::~BufferPool()
+{
+	for (auto &list : _free)
+		for (char *data : list)
+			delete[] data;
+}
+
+/* Smallest power of two class holding given size */
+static size_t size_class(size_t size)
+{
+	size_t cls = 8;
+	while ((static_cast<size_t>(1) << cls) < size)
+		cls++;
+	return cls;
+}
+
+BufferPool::Buffer BufferPool::Acquire(size_t size)
+{
+	size_t cls = size_class(size);
+	size = static_cast<size_t>(1) << cls;
+
+	char *data = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_in_use += size;
+		_stats.peak_bytes = std::max(_stats.peak_bytes, _in_use);
+
+		if (!_free[cls].empty())
+		{
+			data = _free[cls].back();
+			_free[cls].pop_back();
+			_cached -= size;
+			_stats.hits++;
+		}
+		else
+		{
+			_stats.misses++;
+		}
+	}
+
+	/* Allocate outside of the lock, other connections keep going */
+	if (!data)
+		data = new char[size];
+
+	return Buffer(this, data, size);
+}
+
+void BufferPool::Release(char *data, size_t size)
+{
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_in_use -= size;
+
+		if (_cached + size <= _cache_limit)
+		{
+			_free[size_class(size)].push_back(data);
+			_cached += size;
+			return;
+		}
+	}
+
+	/* Pool is full, give memory back */
+	delete[] data;
+}
+
+ServerBase::BufferStats BufferPool::GetStats() const
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return _stats;
+}
+
+FrameReader::FrameReader(const Framer &framer, size_t capacity, BufferPool &pool)
+	: _framer(framer), _capacity(std::max<size_t>(capacity, 1)), _pool(pool) {}
+
+int FrameReader::Space(struct iovec iov[2])
+{
+	Consume();
+
+	if (_size == _capacity)
+		return 0;
+
+	/* Ring is borrowed only while data is on its way */
+	if (!_buffer)
+		_buffer = _pool.Acquire(_capacity);
+
+	size_t tail = (_head + _size) % _capacity;
+	if (tail < _head)
+	{
+		iov[0] = { _buffer.GetData() + tail, _head - tail };
+		return 1;
+	}
+
+	iov[0] = { _buffer.GetData() + tail, _capacity - tail };
+	if (!_head)
+		return 1;
+
+	iov[1] = { _buffer.GetData(), _head };
+	return 2;
+}
+
+void FrameReader::Commit(size_t size)
+{
+	_size += size;
+}
+
+void FrameReader::Feed(char *data, size_t size)
+{
+	_ext = data;
+	_ext_size = size;
+}
+
+void FrameReader::Consume()
+{
+	/* Frame handed out last time is processed */
+	_head = (_head + _consume) % _capacity;
+	_size -= _consume;
+	_consume = 0;
+
+	/* Linear copy is needed only while its frame is handled */
+	_linear.Reset();
+
+	/* Start from the beginning to keep free space contiguous */
+	if (!_size)
+	{
+		_head = 0;
+		_buffer.Reset();
+	}
+}
+
+void FrameReader::Release()
+{
+	Consume();
+}
+
+size_t FrameReader::Append(const char *src, size_t size)
+{
+	struct iovec iov[2];
+	int count = Space(iov);
+	size_t copied = 0;
+
+	for (int i = 0; i != count && copied != size; i++)
+	{
+		size_t chunk = std::min(iov[i].iov_len, size - copied);
+		memcpy(iov[i].iov_base, src + copied, chunk);
+		copied += chunk;
+	}
+
+	Commit(copied);
+	return copied;
+}
+
+bool FrameReader::Next(char *&data, size_t &size)
+{
+	size_t offset, length, total;
+
+	Consume();
+
+	if (_ext_size)
+	{
+		/* Nothing is buffered, frame may be complete in given data */
+		if (!_size)
+		{
+			total = _framer.Next(_ext, _ext_size, offset, length);
+			if (total && total <= _ext_size)
+			{
+				data = _ext + offset;
+				size = length;
+				_ext += total;
+				_ext_size -= total;
+				return true;
+			}
+		}
+
+		size_t copied = Append(_ext, _ext_size);
+		_ext += copied;
+		_ext_size -= copied;
+	}
+
+	if (!_size)
+		return false;
+
+	char *base = _buffer.GetData() + _head;
+	size_t contiguous = std::min(_size, _capacity - _head);
+	total = _framer.Next(base, contiguous, offset, length);
+
+	if ((!total || (total > contiguous && total <= _size)) && contiguous < _size)
+	{
+		/* Frame wraps around the end of the ring, make it linear */
+		if (!_linear)
+			_linear = _pool.Acquire(_capacity);
+		memcpy(_linear.GetData(), base, contiguous);
+		memcpy(_linear.GetData() + contiguous, _buffer.GetData(), _size - contiguous);
+
+		base = _linear.GetData();
+		total = _framer.Next(base, _size, offset, length);
+	}
+
+	if (total > _capacity || (!total && _size == _capacity))
+		throw std::runtime_error("FrameReader::Next: Frame exceeds buffer size");
+
+	if (!total || total > _size)
+		return false;
+
+	data = base + offset;
+	size = length;
+	_consume = total;
+	return true;
+}
+
+ClientTable::ClientTable(size_t capacity)
+	: _capacity(std::min<size_t>(capacity, NIL)), _slots(new Slot[_capacity])
+{
+	/* Lowest slots are handed out first */
+	for (size_t i = _capacity; i-- != 0;)
+	{
+		_slots[i].index = i;
+		Push(static_cast<uint32_t>(i));
+	}
+}
+
+void ClientTable::Push(uint32_t index)
+{
+	uint64_t head = _free.load(std::memory_order_relaxed);
+	uint64_t top;
+
+	do
+	{
+		_slots[index].next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+		top = ((head >> 32) + 1) << 32 | index;
+	} while (!_free.compare_exchange_weak(head, top, std::memory_order_release,
+					      std::memory_order_relaxed));
+}
+
+ClientTable::Slot *ClientTable::Acquire(int fd, const struct sockaddr_in &peer)
+{
+	uint64_t head = _free.load(std::memory_order_acquire);
+	uint64_t top;
+	uint32_t index;
+
+	/* Tag makes the exchange fail if the slot was taken and given back meanwhile */
+	do
+	{
+		index = static_cast<uint32_t>(head);
+		if (index == NIL)
+			return nullptr;
+		top = ((head >> 32) + 1) << 32 | _slots[index].next.load(std::memory_order_relaxed);
+	} while (!_free.compare_exchange_weak(head, top, std::memory_order_acquire,
+					      std::memory_order_acquire));
+
+	Slot *slot = &_slots[index];
+	uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+	slot->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->fd.store(fd, std::memory_order_relaxed);
+	slot->addr.store(peer.sin_addr.s_addr, std::memory_order_relaxed);
+	slot->port.store(peer.sin_port, std::memory_order_relaxed);
+	slot->connected.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+	slot->bytes_in.store(0, std::memory_order_relaxed);
+	slot->bytes_out.store(0, std::memory_order_relaxed);
+
+	slot->seq.store(seq + 2, std::memory_order_release);
+
+	/* Shutdown() may hold a pin on the free slot, keep its count */
+	slot->state.fetch_or(LIVE, std::memory_order_release);
+	_size.fetch_add(1, std::memory_order_relaxed);
+	return slot;
+}
+
+void ClientTable::Release(Slot *slot)
+{
+	/* Socket may be shut down from outside right now, wait for it */
+	slot->state.fetch_and(~LIVE, std::memory_order_acq_rel);
+	while (slot->state.load(std::memory_order_acquire))
+		std::this_thread::yield();
+
+	uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+	slot->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot->fd.store(-1, std::memory_order_relaxed);
+	slot->seq.store(seq + 2, std::memory_order_release);
+
+	_size.fetch_sub(1, std::memory_order_relaxed);
+	Push(static_cast<uint32_t>(slot->index));
+}
+
+void ClientTable::Shutdown()
+{
+	for (size_t i = 0; i != _capacity; i++)
+	{
+		Slot &slot = _slots[i];
+
+		/* Pinned socket is not closed until we are done with it */
+		if (slot.state.fetch_add(PIN, std::memory_order_acquire) & LIVE)
+			shutdown(slot.fd.load(std::memory_order_relaxed), SHUT_RDWR);
+		slot.state.fetch_sub(PIN, std::memory_order_release);
+	}
+}
+
+bool ClientTable::Read(size_t index, ServerBase::ClientInfo &info) const
+{
+	const Slot &slot = _slots[index];
+
+	while (true)
+	{
+		uint32_t seq = slot.seq.load(std::memory_order_acquire);
+		if (seq & 1)
+		{
+			/* Slot is being taken or released */
+			std::this_thread::yield();
+			continue;
+		}
+
+		int fd = slot.fd.load(std::memory_order_relaxed);
+		info.slot = index;
+		info.peer = {};
+		info.peer.sin_family = AF_INET;
+		info.peer.sin_addr.s_addr = slot.addr.load(std::memory_order_relaxed);
+		info.peer.sin_port = slot.port.load(std::memory_order_relaxed);
+		info.connected = std::chrono::system_clock::time_point(std::chrono::duration_cast<
+			std::chrono::system_clock::duration>(std::chrono::nanoseconds(
+			slot.connected.load(std::memory_order_relaxed))));
+		info.bytes_in = slot.bytes_in.load(std::memory_order_relaxed);
+		info.bytes_out = slot.bytes_out.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.seq.load(std::memory_order_relaxed) == seq)
+			return fd >= 0;
+	}
+}
+
+ClientTable::Slot *ClientTable::Find(size_t index, uint32_t seq)
+{
+	if (index >= _capacity)
+		return nullptr;
+
+	Slot &slot = _slots[index];
+	if (!(slot.state.load(std::memory_order_acquire) & LIVE) ||
+	    slot.seq.load(std::memory_order_acquire) != seq)
+		return nullptr;
+	return &slot;
+}
+
+int ClientTable::Pin(size_t index, uint32_t seq)
+{
+	if (index >= _capacity)
+		return -1;
+
+	/* Release() waits for the pin once it is seen on a live slot */
+	Slot &slot = _slots[index];
+	if (!(slot.state.fetch_add(PIN, std::memory_order_acquire) & LIVE) ||
+	    slot.seq.load(std::memory_order_acquire) != seq)
+	{
+		slot.state.fetch_sub(PIN, std::memory_order_release);
+		return -1;
+	}
+	return slot.fd.load(std::memory_order_relaxed);
+}
+
+void ClientTable::Unpin(size_t index)
+{
+	_slots[index].state.fetch_sub(PIN, std::memory_order_release);
+}
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick)
+	: _start(std::chrono::steady_clock::now()), _tick(tick) {}
+
+TimerWheel::~TimerWheel()
+{
+	/* Timers may outlive the wheel, detach them */
+	for (auto &level : _slots)
+		for (Timer *&head : level)
+			while (head)
+				Unlink(*head);
+}
+
+uint64_t TimerWheel::Now() const
+{
+	return static_cast<uint64_t>((std::chrono::steady_clock::now() - _start) / _tick);
+}
+
+void TimerWheel::Arm(Timer &timer, std::chrono::milliseconds delay)
+{
+	Cancel(timer);
+
+	/* Idle wheel catches up with the clock without walking the ticks */
+	auto elapsed = std::chrono::steady_clock::now() - _start;
+	if (!_count)
+		_now = static_cast<uint64_t>(elapsed / _tick);
+
+	/* Round up, timer never fires early */
+	auto due = elapsed + delay + _tick - std::chrono::nanoseconds(1);
+	timer._expires = std::max(static_cast<uint64_t>(due / _tick), _now + 1);
+	Insert(timer);
+}
+
+void TimerWheel::Cancel(Timer &timer)
+{
+	if (timer._wheel == this)
+		Unlink(timer);
+}
+
+void TimerWheel::Insert(Timer &timer)
+{
+	uint64_t delta = timer._expires - _now;
+	uint64_t at = timer._expires;
+	unsigned level = 0;
+
+	while (level + 1 != LEVELS && delta >> (SLOT_BITS * (level + 1)))
+		level++;
+
+	/* Out of range, expiry is checked again once the slot comes */
+	if (delta >> (SLOT_BITS * LEVELS))
+		at = _now + (static_cast<uint64_t>(1) << (SLOT_BITS * LEVELS)) - 1;
+
+	Timer *&head = _slots[level][(at >> (SLOT_BITS * level)) & (SLOTS - 1)];
+	timer._next = head;
+	timer._pprev = &head;
+	if (head)
+		head->_pprev = &timer._next;
+	head = &timer;
+
+	timer._wheel = this;
+	_count++;
+}
+
+void TimerWheel::Unlink(Timer &timer)
+{
+	*timer._pprev = timer._next;
+	if (timer._next)
+		timer._next->_pprev = timer._pprev;
+
+	timer._wheel = nullptr;
+	timer._next = nullptr;
+	timer._pprev = nullptr;
+	_count--;
+}
+
+TimerWheel::Timer *TimerWheel::Expire()
+{
+	uint64_t now = Now();
+
+	while (_count)
+	{
+		Timer *&head = _slots[0][_now & (SLOTS - 1)];
+		while (head)
+		{
+			Timer &timer = *head;
+			Unlink(timer);
+			if (timer._expires <= _now)
+				return &timer;
+			Insert(timer);
+		}
+
+		if (_now >= now)
+			return nullptr;
+		_now++;
+
+		/* Move timers of the block just entered one level down */
+		for (unsigned level = LEVELS - 1; level; level--)
+		{
+			if (_now & ((static_cast<uint64_t>(1) << (SLOT_BITS * level)) - 1))
+				continue;
+
+			Timer *list = _slots[level][(_now >> (SLOT_BITS * level)) & (SLOTS - 1)];
+			while (list)
+			{
+				Timer &timer = *list;
+				list = timer._next;
+				Unlink(timer);
+				Insert(timer);
+			}
+		}
+	}
+
+	_now = now;
+	return nullptr;
+}
+
+int TimerWheel::Timeout() const
+{
+	if (!_count)
+		return -1;
+
+	/* Wake up for the first busy slot or the next cascade */
+	uint64_t next = (_now | (SLOTS - 1)) + 1;
+	for (uint64_t tick = _now + 1; tick != next; tick++)
+	{
+		if (_slots[0][tick & (SLOTS - 1)])
+		{
+			next = tick;
+			break;
+		}
+	}
+
+	auto left = _start + _tick * static_cast<int64_t>(next) - std::chrono::steady_clock::now();
+	if (left.count() <= 0)
+		return 0;
+	return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+		left + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count());
+}
+
+ClientContext::ClientContext(int fd, EventLoop *loop)
+	: fd(fd), loop(loop)
+{
+	for (int i = 0; i != TIMERS; i++)
+	{
+		timers[i].client = this;
+		timers[i].kind = static_cast<TimerKind>(i);
+	}
+}
+
+void ClientContext::Touch()
+{
+	if (idle_timeout.count() && !throttled)
+		wheel->Arm(timers[IDLE_TIMER], idle_timeout);
+}
+
+void ClientContext::ReadCredentials()
+{
+	/* Peer credentials are taken by the kernel at connect() */
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		cred = {};
+}
+
+void ClientContext::Progress()
+{
+	if (!write_timeout.count())
+		return;
+
+	if (out.Empty())
+		wheel->Cancel(timers[WRITE_TIMER]);
+	else
+		wheel->Arm(timers[WRITE_TIMER], write_timeout);
+}
+
+void ClientContext::Throttle(std::chrono::milliseconds delay)
+{
+	/* Client is held back, not idle */
+	throttled = true;
+	wheel->Cancel(timers[IDLE_TIMER]);
+	wheel->Arm(timers[THROTTLE_TIMER], delay);
+}
+
+void ClientContext::Unthrottle()
+{
+	throttled = false;
+	Touch();
+}
+
+uint64_t ClientContext::RateSource() const
+{
+	if (cred.pid)
+		return RateLimiter::Source(nullptr, &cred);
+	return slot ? slot->addr.load(std::memory_order_relaxed) : 0;
+}
+
+void TokenBucket::Configure(double rate, double burst, double now)
+{
+	_rate = rate > 0 ? rate : 0;
+	_burst = burst > 0 ? burst : _rate;
+	_tokens = _burst;
+	_stamp = now;
+}
+
+void TokenBucket::Refill(double now)
+{
+	_tokens = std::min(_burst, _tokens + (now - _stamp) * _rate);
+	_stamp = now;
+}
+
+double TokenBucket::Charge(double tokens, double now)
+{
+	if (!Enabled())
+		return 0;
+
+	Refill(now);
+	_tokens -= tokens;
+	return _tokens < 0 ? -_tokens / _rate : 0;
+}
+
+bool TokenBucket::Has(double tokens, double now)
+{
+	if (!Enabled())
+		return true;
+
+	Refill(now);
+	return _tokens >= tokens;
+}
+
+bool TokenBucket::Full(double now)
+{
+	if (!Enabled())
+		return true;
+
+	Refill(now);
+	return _tokens >= _burst;
+}
+
+void RateBuckets::Configure(const ServerBase::RateLimit &limit, double now)
+{
+	bytes.Configure(limit.bytes_per_sec, limit.burst_bytes, now);
+	messages.Configure(limit.messages_per_sec, limit.burst_messages, now);
+}
+
+double RateBuckets::Charge(size_t size, size_t count, double now)
+{
+	return std::max(bytes.Charge(static_cast<double>(size), now),
+			messages.Charge(static_cast<double>(count), now));
+}
+
+bool RateBuckets::Has(size_t size, size_t count, double now)
+{
+	return bytes.Has(static_cast<double>(size), now) && messages.Has(static_cast<double>(count), now);
+}
+
+static bool rate_enabled(const ServerBase::RateLimit &limit)
+{
+	return limit.bytes_per_sec > 0 || limit.messages_per_sec > 0;
+}
+
+/* Seconds an emptied bucket takes to refill, depth defaults to one second */
+static double refill_time(double rate, double burst)
+{
+	if (rate <= 0)
+		return 0;
+	return burst > 0 ? burst / rate : 1;
+}
+
+RateLimiter::RateLimiter(const ServerBase::RateLimit limits[3])
+	: _connection(limits[static_cast<int>(ServerBase::RateScope::CONNECTION)]),
+	  _source(limits[static_cast<int>(ServerBase::RateScope::SOURCE)])
+{
+	const ServerBase::RateLimit &global = limits[static_cast<int>(ServerBase::RateScope::GLOBAL)];
+
+	_global.Configure(global, Now());
+	_shared = rate_enabled(_source) || rate_enabled(global);
+	_sweep_interval = std::max(refill_time(_source.bytes_per_sec, _source.burst_bytes),
+				   refill_time(_source.messages_per_sec, _source.burst_messages));
+}
+
+bool RateLimiter::Enabled(const ServerBase::RateLimit limits[3])
+{
+	return rate_enabled(limits[0]) || rate_enabled(limits[1]) || rate_enabled(limits[2]);
+}
+
+double RateLimiter::Now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t RateLimiter::Source(const struct sockaddr *peer, const struct ucred *cred)
+{
+	/* Users are kept apart from IPv4 addresses by upper half */
+	if (cred && cred->pid)
+		return (static_cast<uint64_t>(1) << 32) | cred->uid;
+	if (peer && peer->sa_family == AF_INET)
+		return reinterpret_cast<const struct sockaddr_in *>(peer)->sin_addr.s_addr;
+	return 0;
+}
+
+void RateLimiter::Attach(RateBuckets &connection)
+{
+	connection.Configure(_connection, Now());
+}
+
+RateBuckets *RateLimiter::Find(uint64_t source, double now)
+{
+	if (!rate_enabled(_source))
+		return nullptr;
+
+	auto it = _sources.find(source);
+	if (it != _sources.end())
+		return &it->second;
+
+	/* Sources refilled to the top hold no state worth keeping */
+	if (_sources.size() >= RATE_SOURCES_MAX)
+	{
+		/* Table of busy sources is swept once per refill, flood of new ones costs no walk */
+		if (now < _next_sweep)
+			return nullptr;
+		_next_sweep = now + _sweep_interval;
+
+		for (auto i = _sources.begin(); i != _sources.end();)
+		{
+			if (i->second.bytes.Full(now) && i->second.messages.Full(now))
+				i = _sources.erase(i);
+			else
+				++i;
+		}
+
+		if (_sources.size() >= RATE_SOURCES_MAX)
+			return nullptr;
+	}
+
+	RateBuckets &buckets = _sources[source];
+	buckets.Configure(_source, now);
+	return &buckets;
+}
+
+std::chrono::milliseconds RateLimiter::Charge(RateBuckets &connection, uint64_t source,
+					      size_t size, size_t count)
+{
+	double now = Now();
+	double wait = connection.Charge(size, count, now);
+
+	if (_shared)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		wait = std::max(wait, _global.Charge(size, count, now));
+
+		/* Stream of source over the table limit is bound by the rest */
+		RateBuckets *buckets = Find(source, now);
+		if (buckets)
+			wait = std::max(wait, buckets->Charge(size, count, now));
+	}
+
+	return std::chrono::milliseconds(static_cast<int64_t>(std::ceil(wait * 1000)));
+}
+
+bool RateLimiter::Admit(uint64_t source, size_t size)
+{
+	if (!_shared)
+		return true;
+
+	double now = Now();
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		RateBuckets *buckets = Find(source, now);
+
+		/* Datagram takes tokens of all buckets or of none */
+		if (_global.Has(size, 1, now) && (buckets ? buckets->Has(size, 1, now) : !rate_enabled(_source)))
+		{
+			_global.Charge(size, 1, now);
+			if (buckets)
+				buckets->Charge(size, 1, now);
+			return true;
+		}
+	}
+
+	_dropped.fetch_add(1, std::memory_order_relaxed);
+	_dropped_bytes.fetch_add(size, std::memory_order_relaxed);
+	return false;
+}
+
+ServerBase::RateStats RateLimiter::GetStats() const
+{
+	return ServerBase::RateStats { _throttled.load(), _dropped.load(), _dropped_bytes.load() };
+}
+
+ZeroCopyTracker::~ZeroCopyTracker()
+{
+	/* Socket is closed, kernel keeps its own page references */
+	for (auto &held : _held)
+		held.second();
+}
+
+bool ZeroCopyTracker::Enable(int fd)
+{
+	if (_enabled < 0)
+	{
+		int one = 1;
+		_enabled = !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+	}
+	return _enabled;
+}
+
+void ZeroCopyTracker::Hold(std::function<void()> release)
+{
+	if (!Pending())
+	{
+		release();
+		return;
+	}
+	_held.emplace_back(_next, std::move(release));
+}
+
+void ZeroCopyTracker::Complete(uint32_t lo, uint32_t hi)
+{
+	if (lo != _done)
+	{
+		_early.emplace_back(lo, hi);
+		return;
+	}
+	_done = hi + 1;
+
+	/* Ranges reported ahead may continue the finished one now */
+	for (auto it = _early.begin(); it != _early.end(); )
+	{
+		if (it->first != _done)
+		{
+			++it;
+			continue;
+		}
+		_done = it->second + 1;
+		_early.erase(it);
+		it = _early.begin();
+	}
+
+	/* Counters wrap around, distance tells the order */
+	while (!_held.empty() && static_cast<int32_t>(_held.front().first - _done) <= 0)
+	{
+		std::function<void()> release = std::move(_held.front().second);
+		_held.pop_front();
+		release();
+	}
+}
+
+bool ZeroCopyTracker::Reap(int fd)
+{
+	while (true)
+	{
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+		struct msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cm), sizeof(err));
+			if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno)
+				return false;
+
+			Complete(err.ee_info, err.ee_data);
+		}
+	}
+}
+
+void SendQueue::Push(const char *src, size_t size)
+{
+	_chunks.push_back({ COPY, std::vector<char>(src, src + size), nullptr, size, nullptr, -1, 0 });
+	_chunks.back().ptr = _chunks.back().data.data();
+	_size += size;
+}
+
+void SendQueue::PushZeroCopy(const char *src, size_t size, std::function<void()> release)
+{
+	_chunks.push_back({ ZEROCOPY, {}, src, size, std::move(release), -1, 0 });
+	_size += size;
+}
+
+void SendQueue::PushFile(int fd, off_t offset, size_t size)
+{
+	/* Caller may close its descriptor once the reply is queued */
+	int dup = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup < 0)
+		throw std::runtime_error(
+			"MessageBase::ReplyFile: Duplicate file error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	_chunks.push_back({ FILE_REGION, {}, nullptr, size, nullptr, dup, offset });
+	_size += size;
+}
+
+int SendQueue::Peek(struct iovec *iov, int max) const
+{
+	int count = 0;
+	size_t offset = _offset;
+
+	if (_chunks.empty() || _chunks.front().kind == FILE_REGION)
+		return 0;
+
+	/* Zero-copy chunks go with own send flags, runs are not mixed */
+	Kind kind = _chunks.front().kind;
+	for (auto it = _chunks.begin(); it != _chunks.end() && it->kind == kind && count != max;
+	     ++it, count++)
+	{
+		iov[count].iov_base = const_cast<char *>(it->ptr) + offset;
+		iov[count].iov_len = it->size - offset;
+		offset = 0;
+	}
+	return count;
+}
+
+bool SendQueue::PeekFile(int &fd, off_t &offset, size_t &size) const
+{
+	if (_chunks.empty() || _chunks.front().kind != FILE_REGION)
+		return false;
+
+	fd = _chunks.front().fd;
+	offset = _chunks.front().offset + static_cast<off_t>(_offset);
+	size = _chunks.front().size - _offset;
+	return true;
+}
+
+void SendQueue::Finish(Chunk &chunk, ZeroCopyTracker *zerocopy)
+{
+	if (chunk.kind == FILE_REGION)
+		close(chunk.fd);
+	else if (chunk.kind == ZEROCOPY && zerocopy)
+		zerocopy->Hold(std::move(chunk.release));
+	else if (chunk.kind == ZEROCOPY)
+		chunk.release();
+}
+
+void SendQueue::Pop(size_t size, ZeroCopyTracker *zerocopy)
+{
+	_size -= size;
+	size += _offset;
+
+	while (!_chunks.empty() && size >= _chunks.front().size)
+	{
+		size -= _chunks.front().size;
+		Finish(_chunks.front(), zerocopy);
+		_chunks.pop_front();
+	}
+	_offset = size;
+}
+
+void SendQueue::Clear()
+{
+	/* Nothing was sent without copy, buffers are released at once */
+	for (auto &chunk : _chunks)
+		Finish(chunk, nullptr);
+
+	_chunks.clear();
+	_offset = 0;
+	_size = 0;
+}
+
+void DatagramBatch::Flush()
+{
+	size_t done = 0;
+
+	while (done != _replies.size())
+	{
+		/* Headers are built once data buffer is not going to move */
+		size_t count = std::min(_replies.size() - done, _count);
+		for (size_t i = 0; i != count; i++)
+		{
+			Reply &reply = _replies[done + i];
+			_iovs[i].iov_base = _out.data() + reply.offset;
+			_iovs[i].iov_len = reply.size;
+			_hdrs[i].msg_hdr = {};
+			_hdrs[i].msg_hdr.msg_name = &reply.peer;
+			_hdrs[i].msg_hdr.msg_namelen = reply.peer_len;
+			_hdrs[i].msg_hdr.msg_iov = &_iovs[i];
+			_hdrs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int sent = sendmmsg(_sockfd, _hdrs.data(), count, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+
+		/* Datagram which failed is dropped, the rest are retried */
+		done += sent > 0 ? static_cast<size_t>(sent) : 1;
+	}
+
+	_replies.clear();
+	_out.clear();
+}
+
+/*
+ * CPU for n-th listener among the ones process is allowed to run on,
+ * -1 if affinity is not available.
+ */
+static int listener_cpu(size_t n)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return -1;
+
+	int count = CPU_COUNT(&set);
+	if (!count)
+		return -1;
+
+	n %= count;
+	for (int cpu = 0; cpu != CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &set) && n-- == 0)
+			return cpu;
+
+	return -1;
+}
+
+static void pin_thread(std::thread &thread, int cpu)
+{
+	if (cpu < 0)
+		return;
+
+	/* Best effort, thread keeps running anywhere on failure */
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+void EventLoop::Start(int cpu)
+{
+	_running = true;
+	_thread = std::thread([this]() {
+		_owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+		Run();
+	});
+	pin_thread(_thread, cpu);
+}
+
+void EventLoop::Start(LoopGroup &group)
+{
+	int fd = PollFd();
+	if (fd < 0)
+	{
+		Start();
+		return;
+	}
+
+	_running = true;
+	_member = group.Add(this, fd);
+	_group = &group;
+}
+
+void EventLoop::Stop()
+{
+	_running = false;
+
+	if (_group)
+	{
+		/* No group thread serves the loop once it is removed */
+		_group->Remove(_member);
+		_group = nullptr;
+		DisconnectAll();
+	}
+	else
+	{
+		Wakeup();
+
+		if (_thread.joinable())
+			_thread.join();
+	}
+
+	/* Clients are closed, functions left learn they are gone */
+	RunPosted();
+}
+
+void EventLoop::Post(std::function<void()> fn)
+{
+	{
+		std::lock_guard<std::mutex> lock(_post_lock);
+		_posted.push_back({ std::move(fn), nullptr, 0, 0 });
+	}
+	Wakeup();
+}
+
+void EventLoop::Post(size_t slot, uint32_t seq, std::function<void(MessageBase *)> fn)
+{
+	{
+		std::lock_guard<std::mutex> lock(_post_lock);
+		_posted.push_back({ nullptr, std::move(fn), slot, seq });
+	}
+	Wakeup();
+}
+
+void EventLoop::RunPosted()
+{
+	/* Only the thread serving the loop runs them */
+	{
+		std::lock_guard<std::mutex> lock(_post_lock);
+		_posted_run.swap(_posted);
+	}
+
+	for (auto &posted : _posted_run)
+	{
+		if (posted.on_client)
+			RunOn(posted.slot, posted.seq, posted.on_client);
+		else
+			posted.fn();
+	}
+	_posted_run.clear();
+}
+
+void EventLoop::RunOn(size_t slot, uint32_t seq, const std::function<void(MessageBase *)> &fn)
+{
+	/* Slot is released by this thread only, so the client stays */
+	ClientTable::Slot *entry = server._socket->clients->Find(slot, seq);
+	ClientContext *client = entry ? entry->context : nullptr;
+	if (!client)
+	{
+		fn(nullptr);
+		return;
+	}
+
+	MessageBase msg(client, nullptr, 0);
+	try
+	{
+		fn(&msg);
+	}
+	catch (const std::exception &)
+	{
+		Drop(client);
+	}
+}
+
+void EventLoop::Send(ClientContext &client, const char *src, size_t size)
+{
+	send_all(client.fd, src, size, client.write_timeout);
+}
+
+void EventLoop::SendFile(ClientContext &client, int fd, off_t offset, size_t size)
+{
+	send_file(client.fd, fd, offset, size, client.write_timeout, "MessageBase::ReplyFile");
+}
+
+void EventLoop::SendZeroCopy(ClientContext &client, const char *src, size_t size,
+			     std::function<void()> release)
+{
+	/* Zero-copy state belongs to the loop thread, others copy */
+	try
+	{
+		Send(client, src, size);
+	}
+	catch (const std::exception &)
+	{
+		release();
+		throw;
+	}
+	release();
+}
+
+void EventLoop::Enqueue(ClientContext &client, const char *src, size_t size)
+{
+	bool idle = client.out.Empty();
+
+	client.out.Push(src, size);
+	Queued(client, idle);
+}
+
+void EventLoop::EnqueueFile(ClientContext &client, int fd, off_t offset, size_t size)
+{
+	bool idle = client.out.Empty();
+
+	client.out.PushFile(fd, offset, size);
+	Queued(client, idle);
+}
+
+void EventLoop::EnqueueZeroCopy(ClientContext &client, const char *src, size_t size,
+				std::function<void()> release)
+{
+	bool idle = client.out.Empty();
+
+	client.out.PushZeroCopy(src, size, std::move(release));
+	Queued(client, idle);
+}
+
+void EventLoop::Queued(ClientContext &client, bool idle)
+{
+	if (!IsWritable(client))
+		client.paused = true;
+
+	/* Write timer runs from the first queued byte */
+	if (idle)
+		client.Progress();
+}
+
+bool EventLoop::Drained(ClientContext *client)
+{
+	if (!client->paused || client->out.Size() > server._low_watermark)
+		return true;
+
+	client->paused = false;
+
+	MessageBase msg(client, nullptr, 0);
+	try
+	{
+		server.OnWritable(msg);
+	}
+	catch (const std::exception &)
+	{
+		/* Handler failed, client has to be dropped */
+		return false;
+	}
+	return true;
+}
+
+ClientTable::Slot *EventLoop::AddClient(int fd, const PeerAddress &addr)
+{
+	return server._socket->clients->Acquire(fd, addr.Inet());
+}
+
+void EventLoop::ExpireTimers()
+{
+	while (TimerWheel::Timer *expired = _timers.Expire())
+	{
+		ClientContext::Timer *timer = static_cast<ClientContext::Timer *>(expired);
+
+		if (!client_timer(server, timer))
+			Drop(timer->client);
+		else if (timer->kind == ClientContext::THROTTLE_TIMER)
+			Resume(timer->client);
+	}
+}
+
+void EventLoop::Admit(ClientContext *client, size_t size)
+{
+	size_t count = client->received;
+	client->received = 0;
+
+	RateLimiter *limiter = Limiter();
+	if (!limiter)
+		return;
+
+	std::chrono::milliseconds delay = limiter->Charge(client->rate, client->RateSource(), size, count);
+	if (!delay.count())
+		return;
+
+	/* Data already in flight extends throttle of the client */
+	if (!client->throttled)
+		limiter->Throttled();
+	client->Throttle(delay);
+}
+
+void EventLoop::RemoveClient(ClientContext *client)
+{
+	/* Client is going away, its timers must not fire */
+	for (auto &timer : client->timers)
+		_timers.Cancel(timer);
+
+	if (!client->slot)
+		return;
+
+	server._socket->clients->Release(client->slot);
+	client->slot = nullptr;
+}
+
+void EventLoop::Connected(const PeerAddress &addr)
+{
+	server.OnConnect(addr.Name());
+}
+
+bool EventLoop::Dispatch(ClientContext *client, char *data, size_t size)
+{
+	MessageBase msg(client, data, size);
+	client->received++;
+	try
+	{
+		server.OnReceive(msg);
+	}
+	catch (const std::exception &)
+	{
+		/* Handler failed, client has to be dropped */
+		return false;
+	}
+	return true;
+}
+
+bool EventLoop::DispatchFrames(ClientContext *client)
+{
+	char *data;
+	size_t size;
+
+	try
+	{
+		while (client->reader->Next(data, size))
+			if (!Dispatch(client, data, size))
+				return false;
+	}
+	catch (const std::runtime_error &)
+	{
+		/* Stream is malformed, client has to be dropped */
+		return false;
+	}
+	return true;
+}
+
+std::unique_ptr<EventLoop> EventLoop::Create(ServerBase &server, int listenfd, ServerBase::Mode &mode)
+{
+	/* Group polls epoll instances of its loops */
+	if (mode == ServerBase::Mode::URING && server._group)
+		mode = ServerBase::Mode::EPOLL;
+
+	if (mode == ServerBase::Mode::URING)
+	{
+		std::unique_ptr<EventLoop> loop = CreateUringLoop(server, listenfd);
+		if (loop)
+			return loop;
+
+		/* Kernel lacks io_uring features we need */
+		mode = ServerBase::Mode::EPOLL;
+	}
+
+	return CreateEpollLoop(server, listenfd);
+}
+
+/*
+ * Event loop used in EPOLL mode. Every loop owns an epoll instance with the
+ * listening socket registered as EPOLLEXCLUSIVE, so the kernel wakes up only
+ * one loop per incoming connection and the loop accepts it itself. Clients
+ * are edge-triggered and stay on the loop that accepted them, no locking is
+ * needed for per-client state. Replies are written directly while nothing is
+ * queued, the rest waits for EPOLLOUT and goes out with one writev.
+ */
+class EpollLoop final: public EventLoop
+{
+public:
+	EpollLoop(ServerBase &server, int listenfd);
+	~EpollLoop();
+	void Send(ClientContext &client, const char *src, size_t size) override;
+	void SendFile(ClientContext &client, int fd, off_t offset, size_t size) override;
+	void SendZeroCopy(ClientContext &client, const char *src, size_t size,
+			  std::function<void()> release) override;
+	void StopAccepting() override;
+	void Adopt(int fd) override;
+	void Release(std::vector<int> &fds) override;
+	void Poll() override;
+private:
+	struct Client final: ClientContext
+	{
+		using ClientContext::ClientContext;
+		/* Peer has finished, disconnect once replies are written */
+		bool draining = false;
+	};
+
+	void Run() override;
+	void Wakeup() override;
+	int PollFd() override;
+	void DisconnectAll() override;
+	bool Wait(int timeout);
+	void Accept();
+	void Register(int clientfd, const PeerAddress &cli_addr);
+	void ReceiveUDP();
+	void Process(Client *client, uint32_t events);
+	void Receive(Client *client, uint32_t events);
+	bool Flush(Client *client);
+	void Drop(ClientContext *client) override;
+	void Resume(ClientContext *client) override;
+	void Disconnect(Client *client);
+
+	int _epfd = -1;
+	int _wakefd = -1;
+	/* Wakes grouped loop when a timer is due, group does not know about timers */
+	int _timerfd = -1;
+	bool _timer_armed = false;
+	std::unique_ptr<char[]> _buffer;
+	std::unique_ptr<DatagramBatch> _batch;
+	std::unordered_map<int, std::unique_ptr<Client>> _clients;
+};
+
+EpollLoop::EpollLoop(ServerBase &server, int listenfd)
+	: EventLoop(server, listenfd)
+{
+	if (IsStream())
+		_buffer.reset(new char[MsgSize()]);
+	else
+		_batch.reset(new DatagramBatch(listenfd, MsgSize(), UDP_BATCH_SIZE, Limiter()));
+
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (_epfd < 0)
+		throw std::runtime_error(
+			"ServerBase::Start: epoll create error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wakefd < 0)
+	{
+		close(_epfd);
+		throw std::runtime_error(
+			"ServerBase::Start: eventfd create error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = &_wakefd;
+	epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakefd, &ev);
+
+	/* Only one loop is woken up per incoming connection or datagram */
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = this;
+	if (epoll_ctl(_epfd, EPOLL_CTL_ADD, _listenfd, &ev) < 0)
+	{
+		close(_wakefd);
+		close(_epfd);
+		throw std::runtime_error(
+			"ServerBase::Start: epoll add error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+}
+
+EpollLoop::~EpollLoop()
+{
+	Stop();
+	if (_timerfd >= 0)
+		close(_timerfd);
+	close(_wakefd);
+	close(_epfd);
+}
+
+void EpollLoop::Wakeup()
+{
+	uint64_t one = 1;
+	ssize_t res = write(_wakefd, &one, sizeof(one));
+	(void)res;
+}
+
+void EpollLoop::Run()
+{
+	while (_running && Wait(_timers.Timeout()))
+		;
+
+	/* Loop is terminated, close clients left */
+	DisconnectAll();
+}
+
+bool EpollLoop::Wait(int timeout)
+{
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+
+	int n = epoll_wait(_epfd, events, EPOLL_MAX_EVENTS, timeout);
+	if (n < 0)
+		return errno == EINTR;
+
+	for (int i = 0; i != n; i++)
+	{
+		void *ptr = events[i].data.ptr;
+
+		if (ptr == &_wakefd || ptr == &_timerfd)
+		{
+			uint64_t value;
+			ssize_t res = read(*static_cast<int *>(ptr), &value, sizeof(value));
+			(void)res;
+			continue;
+		}
+
+		if (ptr != this)
+			Process(static_cast<Client *>(ptr), events[i].events);
+		else if (IsStream())
+			Accept();
+		else
+			ReceiveUDP();
+	}
+
+	ExpireTimers();
+	RunPosted();
+	return true;
+}
+
+int EpollLoop::PollFd()
+{
+	_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (_timerfd < 0)
+		throw std::runtime_error(
+			"ServerBase::Start: timerfd create error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = &_timerfd;
+	epoll_ctl(_epfd, EPOLL_CTL_ADD, _timerfd, &ev);
+
+	return _epfd;
+}
+
+void EpollLoop::Poll()
+{
+	Wait(0);
+
+	/* Timer fires a bit late rather than early, zero would disarm it */
+	int timeout = _timers.Timeout();
+	if (timeout < 0 && !_timer_armed)
+		return;
+
+	struct itimerspec spec = {};
+	if (timeout >= 0)
+	{
+		timeout = std::max(timeout, 1);
+		spec.it_value.tv_sec = timeout / 1000;
+		spec.it_value.tv_nsec = (timeout % 1000) * 1000000L;
+	}
+	timerfd_settime(_timerfd, 0, &spec, nullptr);
+	_timer_armed = timeout >= 0;
+}
+
+void EpollLoop::DisconnectAll()
+{
+	while (!_clients.empty())
+		Disconnect(_clients.begin()->second.get());
+}
+
+void EpollLoop::Accept()
+{
+	while (true)
+	{
+		PeerAddress cli_addr;
+		int clientfd = accept4(_listenfd, cli_addr.Get(), &cli_addr.len,
+				       SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		/* Backlog is drained or another loop took the client */
+		if (clientfd < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		Register(clientfd, cli_addr);
+	}
+}
+
+void EpollLoop::Register(int clientfd, const PeerAddress &cli_addr)
+{
+	ClientTable::Slot *slot = AddClient(clientfd, cli_addr);
+	if (!slot)
+	{
+		/* Too many connections, close socket */
+		close(clientfd);
+		return;
+	}
+
+	Connected(cli_addr);
+
+	std::unique_ptr<Client> ctx = NewClient<Client>(clientfd, slot);
+
+	/* Edge-triggered EPOLLOUT costs nothing until a reply is queued */
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = ctx.get();
+	_clients[clientfd] = std::move(ctx);
+
+	if (epoll_ctl(_epfd, EPOLL_CTL_ADD, clientfd, &ev) < 0)
+		Disconnect(_clients[clientfd].get());
+}
+
+void EpollLoop::StopAccepting()
+{
+	/* Socket stays open, closing it would not remove what another process shares */
+	epoll_ctl(_epfd, EPOLL_CTL_DEL, _listenfd, nullptr);
+}
+
+void EpollLoop::Adopt(int fd)
+{
+	if (!_running)
+	{
+		close(fd);
+		return;
+	}
+
+	/* Data received meanwhile waits in the socket, adding it reports the edge */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	PeerAddress cli_addr;
+	getpeername(fd, cli_addr.Get(), &cli_addr.len);
+	Register(fd, cli_addr);
+}
+
+void EpollLoop::Release(std::vector<int> &fds)
+{
+	for (auto it = _clients.begin(); it != _clients.end();)
+	{
+		Client *client = it->second.get();
+
+		/* Client moves between requests only, nothing read or written may be left behind */
+		if (client->draining || client->paused || client->throttled || !client->out.Empty() ||
+		    client->zerocopy.Pending() || client->timers[ClientContext::USER_TIMER].Armed() ||
+		    (client->reader && !client->reader->Empty()))
+		{
+			++it;
+			continue;
+		}
+
+		epoll_ctl(_epfd, EPOLL_CTL_DEL, client->fd, nullptr);
+		RemoveClient(client);
+		fds.push_back(client->fd);
+		it = _clients.erase(it);
+
+		server.OnDisconnect();
+	}
+}
+
+void EpollLoop::Process(Client *client, uint32_t events)
+{
+	/* Zero-copy completions are reported through the socket error queue */
+	if ((events & EPOLLERR) && client->zerocopy.Pending())
+	{
+		int error = 0;
+		socklen_t len = sizeof(error);
+
+		if (!client->zerocopy.Reap(client->fd) ||
+		    getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error)
+		{
+			Disconnect(client);
+			return;
+		}
+		events &= ~EPOLLERR;
+	}
+
+	if ((events & EPOLLOUT) && !client->out.Empty())
+	{
+		bool paused = client->paused;
+
+		if (!Flush(client) || (client->draining && client->out.Empty()) || !Drained(client))
+		{
+			Disconnect(client);
+			return;
+		}
+
+		/* Reading was paused, socket may hold data without a new edge */
+		if (paused && !client->paused)
+			events |= EPOLLIN;
+	}
+
+	if (client->draining)
+	{
+		if (events & (EPOLLHUP | EPOLLERR))
+			Disconnect(client);
+		return;
+	}
+
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		Receive(client, events);
+}
+
+void EpollLoop::Receive(Client *client, uint32_t events)
+{
+	bool hangup = events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+	ssize_t size;
+
+	while (true)
+	{
+		/* Replies are not draining or client is over rate limit, leave requests in the socket */
+		if (client->paused || client->throttled)
+			return;
+
+		struct iovec iov[2] = { { _buffer.get(), MsgSize() } };
+		int count = client->reader ? client->reader->Space(iov) : 1;
+		size_t space = iov[0].iov_len + (count > 1 ? iov[1].iov_len : 0);
+		size = readv(client->fd, iov, count);
+
+		if (size > 0)
+		{
+			client->slot->bytes_in.fetch_add(static_cast<size_t>(size), std::memory_order_relaxed);
+			client->Touch();
+
+			bool ok;
+			if (client->reader)
+			{
+				/* Data is read into the ring, frames are handed out in place */
+				client->reader->Commit(static_cast<size_t>(size));
+				ok = DispatchFrames(client);
+			}
+			else
+			{
+				ok = Dispatch(client, _buffer.get(), static_cast<size_t>(size));
+			}
+
+			if (!ok)
+				break;
+
+			Admit(client, static_cast<size_t>(size));
+
+			/* Short read means the socket is drained, next data raises a new edge */
+			if (static_cast<size_t>(size) < space && !hangup)
+				return;
+			continue;
+		}
+
+		if (size < 0 && errno == EINTR)
+			continue;
+
+		if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !hangup)
+		{
+			/* Ring borrowed for the read is not needed while idle */
+			if (client->reader)
+				client->reader->Release();
+			return;
+		}
+
+		break;
+	}
+
+	/* Peer has only closed its side, write replies left before closing */
+	if (!size && !client->out.Empty())
+	{
+		client->draining = true;
+		return;
+	}
+
+	Disconnect(client);
+}
+
+bool EpollLoop::Flush(Client *client)
+{
+	while (!client->out.Empty())
+	{
+		ZeroCopyTracker *zerocopy = nullptr;
+		int file;
+		off_t offset;
+		size_t size;
+		ssize_t sent;
+
+		if (client->out.PeekFile(file, offset, size))
+		{
+			sent = sendfile(client->fd, file, &offset, std::min<size_t>(size, SENDFILE_CHUNK));
+
+			/* File got shorter since it was queued, stream can not be completed */
+			if (!sent)
+				return false;
+		}
+		else
+		{
+			struct iovec iov[SEND_IOV_MAX];
+			struct msghdr msg = {};
+			msg.msg_iov = iov;
+			msg.msg_iovlen = client->out.Peek(iov, SEND_IOV_MAX);
+
+			int flags = MSG_NOSIGNAL;
+			if (client->out.Front() == SendQueue::ZEROCOPY)
+			{
+				zerocopy = &client->zerocopy;
+				flags |= MSG_ZEROCOPY;
+			}
+
+			sent = sendmsg(client->fd, &msg, flags);
+
+			/* Socket option memory is exhausted, this part is copied */
+			if (sent < 0 && errno == ENOBUFS && zerocopy)
+			{
+				zerocopy = nullptr;
+				sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+			}
+		}
+
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			/* Socket is full, next EPOLLOUT edge continues */
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		if (zerocopy)
+			zerocopy->Sent();
+
+		client->out.Pop(static_cast<size_t>(sent), zerocopy);
+		client->Progress();
+	}
+	return true;
+}
+
+void EpollLoop::Send(ClientContext &ctx, const char *src, size_t size)
+{
+	/* Other threads can not touch the queue, write synchronously */
+	if (!OnLoopThread())
+	{
+		EventLoop::Send(ctx, src, size);
+		return;
+	}
+
+	/* Nothing is queued, write directly and keep only the rest */
+	if (ctx.out.Empty())
+	{
+		ssize_t sent;
+		do
+			sent = send(ctx.fd, src, size, MSG_NOSIGNAL);
+		while (sent < 0 && errno == EINTR);
+
+		if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			throw std::runtime_error(
+				"MessageBase::Reply: Send failed " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		if (sent > 0)
+		{
+			src += sent;
+			size -= static_cast<size_t>(sent);
+		}
+	}
+
+	if (size)
+		Enqueue(ctx, src, size);
+}
+
+void EpollLoop::SendFile(ClientContext &ctx, int fd, off_t offset, size_t size)
+{
+	if (!OnLoopThread())
+	{
+		EventLoop::SendFile(ctx, fd, offset, size);
+		return;
+	}
+
+	/* Nothing is queued, write directly and keep only the rest */
+	while (ctx.out.Empty() && size)
+	{
+		ssize_t sent = sendfile(ctx.fd, fd, &offset, std::min<size_t>(size, SENDFILE_CHUNK));
+		if (sent < 0 && errno == EINTR)
+			continue;
+
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		if (sent < 0)
+			throw std::runtime_error(
+				"MessageBase::ReplyFile: Send failed " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		if (!sent)
+			throw std::runtime_error("MessageBase::ReplyFile: File is shorter than requested");
+
+		size -= static_cast<size_t>(sent);
+	}
+
+	if (size)
+		EnqueueFile(ctx, fd, offset, size);
+}
+
+void EpollLoop::SendZeroCopy(ClientContext &ctx, const char *src, size_t size,
+			     std::function<void()> release)
+{
+	/* Small buffers are cheaper to copy than to track */
+	if (!OnLoopThread() ||
+	    size < ZEROCOPY_MIN || !ctx.zerocopy.Enable(ctx.fd))
+	{
+		EventLoop::SendZeroCopy(ctx, src, size, std::move(release));
+		return;
+	}
+
+	/* Nothing is queued, write directly and keep only the rest */
+	if (ctx.out.Empty())
+	{
+		ssize_t sent;
+		do
+			sent = send(ctx.fd, src, size, MSG_NOSIGNAL | MSG_ZEROCOPY);
+		while (sent < 0 && errno == EINTR);
+
+		/* Out of option memory is retried from the queue, copying if it persists */
+		if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+		{
+			release();
+			throw std::runtime_error(
+				"MessageBase::ReplyZeroCopy: Send failed " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+		}
+
+		if (sent > 0)
+		{
+			ctx.zerocopy.Sent();
+			src += sent;
+			size -= static_cast<size_t>(sent);
+		}
+	}
+
+	/* Buffer is released once the part sent here and the rest complete */
+	if (size)
+		EnqueueZeroCopy(ctx, src, size, std::move(release));
+	else
+		ctx.zerocopy.Hold(std::move(release));
+}
+
+void EpollLoop::Drop(ClientContext *client)
+{
+	Disconnect(static_cast<Client *>(client));
+}
+
+void EpollLoop::Resume(ClientContext *ctx)
+{
+	Client *client = static_cast<Client *>(ctx);
+
+	/* Socket may hold data without a new edge */
+	if (!client->draining)
+		Receive(client, EPOLLIN);
+}
+
+void EpollLoop::Disconnect(Client *client)
+{
+	int fd = client->fd;
+
+	/* Closing descriptor removes it from epoll set as well */
+	RemoveClient(client);
+	close(fd);
+	_clients.erase(fd);
+
+	server.OnDisconnect();
+}
+
+void EpollLoop::ReceiveUDP()
+{
+	while (true)
+	{
+		int count = _batch->Receive(MSG_DONTWAIT);
+		if (count <= 0)
+			return;
+
+		_batch->Dispatch(server);
+
+		/* Listening socket is level-triggered, partial batch drains it */
+		if (static_cast<size_t>(count) < UDP_BATCH_SIZE)
+			return;
+	}
+}
+
+std::unique_ptr<EventLoop> Network::CreateEpollLoop(ServerBase &server, int listenfd)
+{
+	return std::unique_ptr<EventLoop>(new EpollLoop(server, listenfd));
+}
+
+/* Event data of the descriptor stopping group threads */
+static const uint64_t GROUP_WAKE = UINT64_MAX;
+
+LoopGroup::LoopGroup(size_t threads)
+{
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (_epfd < 0)
+		throw std::runtime_error(
+			"LoopGroup::LoopGroup: epoll create error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wakefd < 0)
+	{
+		close(_epfd);
+		throw std::runtime_error(
+			"LoopGroup::LoopGroup: eventfd create error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+
+	/* Level-triggered and never read, so it wakes every thread */
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = GROUP_WAKE;
+	epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakefd, &ev);
+
+	for (size_t i = 0; i != std::max<size_t>(threads, 1); i++)
+		_threads.emplace_back(&LoopGroup::Run, this);
+}
+
+LoopGroup::~LoopGroup()
+{
+	uint64_t one = 1;
+	ssize_t res = write(_wakefd, &one, sizeof(one));
+	(void)res;
+
+	for (auto &thread : _threads)
+		thread.join();
+
+	close(_wakefd);
+	close(_epfd);
+}
+
+size_t LoopGroup::GetLoops() const
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return _members.size() - _free.size();
+}
+
+size_t LoopGroup::Add(EventLoop *loop, int fd)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+
+	size_t index;
+	if (_free.empty())
+	{
+		index = _members.size();
+		_members.push_back(Member { nullptr, -1, 0, false });
+	}
+	else
+	{
+		index = _free.back();
+		_free.pop_back();
+	}
+
+	Member &member = _members[index];
+
+	/* One shot, only one thread at a time gets the loop */
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = (static_cast<uint64_t>(index) << 32) | member.seq;
+	if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+		_free.push_back(index);
+		throw std::runtime_error(
+			"LoopGroup::Add: epoll add error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+
+	member.loop = loop;
+	member.fd = fd;
+	return index;
+}
+
+void LoopGroup::Remove(size_t index)
+{
+	std::unique_lock<std::mutex> lock(_lock);
+
+	epoll_ctl(_epfd, EPOLL_CTL_DEL, _members[index].fd, nullptr);
+	_members[index].loop = nullptr;
+
+	/* Thread serving the loop finishes first, event taken meanwhile is stale */
+	_polled.wait(lock, [this, index]() { return !_members[index].polling; });
+	_members[index].seq++;
+	_members[index].fd = -1;
+	_free.push_back(index);
+}
+
+void LoopGroup::Run()
+{
+	while (true)
+	{
+		struct epoll_event ev;
+		int n = epoll_wait(_epfd, &ev, 1, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || ev.data.u64 == GROUP_WAKE)
+			break;
+
+		size_t index = static_cast<size_t>(ev.data.u64 >> 32);
+		uint32_t seq = static_cast<uint32_t>(ev.data.u64);
+		EventLoop *loop;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			Member &member = _members[index];
+			if (!member.loop || member.seq != seq)
+				continue;
+
+			member.polling = true;
+			loop = member.loop;
+		}
+
+		loop->_owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+		loop->Poll();
+		loop->_owner.store(std::thread::id(), std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> lock(_lock);
+		Member &member = _members[index];
+		member.polling = false;
+		if (!member.loop)
+		{
+			_polled.notify_all();
+			continue;
+		}
+
+		/* Rearming reports events left, next thread takes them */
+		struct epoll_event rearm = {};
+		rearm.events = EPOLLIN | EPOLLONESHOT;
+		rearm.data.u64 = ev.data.u64;
+		epoll_ctl(_epfd, EPOLL_CTL_MOD, member.fd, &rearm);
+	}
+}
+
+void ServerBase::Start()
+{
+	/* Pool survives restarts, buffers are kept for the next run */
+	if (!_pool)
+		_pool.reset(new BufferPool());
+
+	_socket = std::make_shared<ServerSocket>(*this);
+	_socket->Start();
+}
+
+void ServerBase::Stop()
+{
+	if (_socket)
+		_socket->Stop();
+}
+
+void ServerBase::ServeHandoff(const std::string &path, bool clients)
+{
+	if (!_socket || !_socket->listening || _socket->handed_off)
+		throw std::runtime_error("ServerBase::ServeHandoff: Server is not started");
+
+	_socket->ServeHandoff(path, clients);
+}
+
+void ServerBase::TakeOver(const std::string &path)
+{
+	struct sockaddr_un addr;
+	socklen_t len = unix_address(path, addr, "ServerBase::TakeOver");
+
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0)
+		throw std::runtime_error(
+			"ServerBase::TakeOver: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	/* Running server answers at once, do not hang on a stuck one */
+	struct timeval timeout = { HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000 };
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if (connect(sockfd, (struct sockaddr *)&addr, len) < 0)
+	{
+		int error = errno;
+		close(sockfd);
+		throw std::runtime_error(
+			"ServerBase::TakeOver: Connect error: " + std::to_string(error) + ": " + std::string(strerror(error)));
+	}
+
+	HandoffHeader hdr;
+	std::vector<int> fds;
+	bool valid = receive_handoff(sockfd, hdr, fds) && hdr.kind == HandoffHeader::LISTENERS && !fds.empty();
+	for (size_t i = 0; valid && i != fds.size(); i++)
+		valid = listener_matches(fds[i], IsUnix() ? AF_UNIX : AF_INET, IsStream() ? SOCK_STREAM : SOCK_DGRAM);
+
+	if (!valid)
+	{
+		for (int fd : fds)
+			close(fd);
+		close(sockfd);
+		throw std::runtime_error("ServerBase::TakeOver: Invalid handoff at " + path);
+	}
+
+	if (!_pool)
+		_pool.reset(new BufferPool());
+
+	_socket = std::make_shared<ServerSocket>(*this);
+	try
+	{
+		_socket->Start(fds);
+	}
+	catch (...)
+	{
+		close(sockfd);
+		throw;
+	}
+
+	/* Old server stops accepting once this one does, idle clients follow until empty batch */
+	if (send_handoff(sockfd, HandoffHeader::READY, nullptr, 0))
+		while (receive_handoff(sockfd, hdr, fds) && hdr.kind == HandoffHeader::CLIENTS && !fds.empty())
+			for (int fd : fds)
+				_socket->Adopt(fd);
+
+	close(sockfd);
+	_socket->shared = false;
+}
+
+bool ServerBase::IsHandedOff() const
+{
+	return _socket && _socket->handed_off;
+}
+
+ServerBase::ServerSocket::ServerSocket(ServerBase &server)
+	: server(server), clients(new ClientTable(server._max_connections)),
+	  limiter(RateLimiter::Enabled(server._rate_limits) ? new RateLimiter(server._rate_limits) : nullptr) {}
+
+int ServerBase::ServerSocket::Listen()
+{
+	int sockfd = socket(server.IsUnix() ? AF_UNIX : AF_INET, server.IsStream() ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (sockfd < 0)
+		throw std::runtime_error(
+			"ServerBase::Start: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	if (server.IsUnix())
+		return ListenUnix(sockfd);
+
+	/* Allow quick restart while old connections are in TIME_WAIT */
+	int reuse = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	/* Several listeners share the port, kernel balances between them */
+	if (server._listeners > 1 &&
+	    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+	{
+		close(sockfd);
+		throw std::runtime_error(
+			"ServerBase::Start: Reuse port error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+
+	/* Bind socket */
+	struct sockaddr_in serv_addr;
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	serv_addr.sin_port = htons(server._port);
+
+	if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+	{
+		close(sockfd);
+		throw std::runtime_error(
+			"ServerBase::Start: Bind socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+
+	/* Start listening for incoming connections. */
+	if (server.IsStream())
+	{
+		int res = listen(sockfd, server._max_connections);
+		if (res)
+		{
+			close(sockfd);
+			throw std::runtime_error(
+				"ServerBase::Start: Socket listen error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+		}
+	}
+
+	return sockfd;
+}
+
+int ServerBase::ServerSocket::ListenUnix(int sockfd)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+	try
+	{
+		len = unix_address(server._path, addr, "ServerBase::Start");
+	}
+	catch (...)
+	{
+		close(sockfd);
+		throw;
+	}
+
+	/* Socket file of previous run blocks bind, abstract names vanish on close */
+	if (addr.sun_path[0])
+		unlink(addr.sun_path);
+
+	/* Every datagram carries credentials of its sender */
+	int on = 1;
+	if (!server.IsStream())
+		setsockopt(sockfd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+
+	if (bind(sockfd, (struct sockaddr *)&addr, len) < 0)
+	{
+		close(sockfd);
+		throw std::runtime_error(
+			"ServerBase::Start: Bind socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+
+	if (server.IsStream() && listen(sockfd, server._max_connections))
+	{
+		close(sockfd);
+		throw std::runtime_error(
+			"ServerBase::Start: Socket listen error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+
+	return sockfd;
+}
+
+void ServerBase::ServerSocket::Start(const std::vector<int> &inherited)
+{
+	/* Unix socket path can be bound once, there is no port to share */
+	size_t listeners = server.IsUnix() ? 1 : std::max<size_t>(server._listeners, 1);
+
+	/* Inherited sockets are served by the old process until it is told to stop */
+	_sockfds = inherited;
+	shared = !inherited.empty();
+
+	try
+	{
+		wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (wakefd < 0)
+			throw std::runtime_error(
+				"ServerBase::Start: eventfd create error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		for (size_t i = 0; inherited.empty() && i != listeners; i++)
+			_sockfds.push_back(Listen());
+
+		if (server._mode != ServerBase::Mode::THREADED)
+		{
+			for (int sockfd : _sockfds)
+				for (size_t i = 0; i != std::max<size_t>(server._loop_threads, 1); i++)
+					loops.push_back(EventLoop::Create(server, sockfd, server._mode));
+		}
+	}
+	catch (...)
+	{
+		Stop();
+		throw;
+	}
+
+	listening = true;
+
+	/* Threads and loops never block on listening socket, io_uring waits on it */
+	if (server._mode == ServerBase::Mode::EPOLL ||
+	    (server._mode == ServerBase::Mode::THREADED && server.IsStream()))
+		for (int sockfd : _sockfds)
+			fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+	if (server._mode != ServerBase::Mode::THREADED)
+	{
+
+		size_t per_listener = loops.size() / _sockfds.size();
+		for (size_t i = 0; i != loops.size(); i++)
+		{
+			if (server._group)
+				loops[i]->Start(*server._group);
+			else
+				loops[i]->Start(server._affinity ? listener_cpu(i / per_listener) : -1);
+		}
+		return;
+	}
+
+	/* Start server thread per listener, client threads inherit its CPU */
+	for (size_t i = 0; i != _sockfds.size(); i++)
+	{
+		_server_threads.emplace_back(server.IsStream() ?
+			tcp_handler : udp_handler, &server, _sockfds[i]);
+		pin_thread(_server_threads.back(), server._affinity ? listener_cpu(i) : -1);
+	}
+}
+
+void ServerBase::ServerSocket::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(posting);
+		listening = false;
+	}
+
+	/* Wake up threaded handlers and handoff waiting for a peer */
+	if (wakefd >= 0)
+	{
+		uint64_t one = 1;
+		ssize_t res = write(wakefd, &one, sizeof(one));
+		(void)res;
+	}
+
+	if (handoff_thread.joinable())
+		handoff_thread.join();
+
+	if (handoff_fd >= 0)
+	{
+		close(handoff_fd);
+		handoff_fd = -1;
+		if (handoff_path[0] != '@')
+			unlink(handoff_path.c_str());
+	}
+
+	/* Event loops close their own clients on termination */
+	loops.clear();
+
+	/* Shut listening sockets down to terminate server threads, shared ones are served elsewhere */
+	if (!shared)
+		for (int sockfd : _sockfds)
+			shutdown(sockfd, SHUT_RD);
+
+	/* Wait for server threads termination */
+	for (auto &thread : _server_threads)
+		thread.join();
+	_server_threads.clear();
+
+	/* No new clients are accepted, close all client connections */
+	ServerInternal *srv = static_cast<ServerInternal *>(&server);
+	srv->CloseAllClients();
+
+	/* Detached client threads must not outlive the server */
+	srv->WaitForHandlers();
+
+	for (int sockfd : _sockfds)
+		close(sockfd);
+
+	/* Filesystem socket is removed once, restart binds a new one */
+	if (!shared && !_sockfds.empty() && server.IsUnix() && server._path[0] != '@')
+		unlink(server._path.c_str());
+	_sockfds.clear();
+}
+
+ServerBase::ServerSocket::~ServerSocket()
+{
+	Stop();
+
+	if (wakefd >= 0)
+		close(wakefd);
+}
+
+void ServerBase::ServerSocket::ServeHandoff(const std::string &path, bool clients)
+{
+	if (handoff_fd >= 0)
+		throw std::runtime_error("ServerBase::ServeHandoff: Handoff is served already");
+
+	struct sockaddr_un addr;
+	socklen_t len = unix_address(path, addr, "ServerBase::ServeHandoff");
+
+	/* Accept never blocks, stop has to wake the thread up */
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sockfd < 0)
+		throw std::runtime_error(
+			"ServerBase::ServeHandoff: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	/* Socket file is left by the process handed over to */
+	if (addr.sun_path[0])
+		unlink(addr.sun_path);
+
+	if (bind(sockfd, (struct sockaddr *)&addr, len) < 0 || listen(sockfd, 1) < 0)
+	{
+		int error = errno;
+		close(sockfd);
+		throw std::runtime_error(
+			"ServerBase::ServeHandoff: Bind socket error: " + std::to_string(error) + ": " + std::string(strerror(error)));
+	}
+
+	handoff_fd = sockfd;
+	handoff_path = path;
+	handoff_clients = clients;
+	handoff_thread = std::thread(&ServerSocket::Handoff, this);
+}
+
+void ServerBase::ServerSocket::Handoff()
+{
+	/* Peers failing the handoff are dropped, next one may try again */
+	while (wait_handoff(handoff_fd, wakefd, -1))
+	{
+		int peer = accept4(handoff_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (peer < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		bool done = HandOver(peer);
+		close(peer);
+		if (done)
+			return;
+	}
+}
+
+bool ServerBase::ServerSocket::HandOver(int peer)
+{
+	HandoffHeader hdr;
+	std::vector<int> fds;
+
+	/* New process starts on duplicates, both accept until it is ready */
+	if (!send_handoff(peer, HandoffHeader::LISTENERS, _sockfds.data(), _sockfds.size()) ||
+	    !wait_handoff(peer, wakefd, HANDOFF_TIMEOUT_MS) || !receive_handoff(peer, hdr, fds) ||
+	    hdr.kind != HandoffHeader::READY)
+		return false;
+
+	StopAccepting();
+
+	/* New process serves handoff for the next restart at the same path */
+	close(handoff_fd);
+	handoff_fd = -1;
+	if (handoff_path[0] != '@')
+		unlink(handoff_path.c_str());
+
+	if (handoff_clients)
+		ReleaseClients(fds);
+
+	for (size_t i = 0; i < fds.size(); i += HANDOFF_FDS_MAX)
+		if (!send_handoff(peer, HandoffHeader::CLIENTS, &fds[i], std::min<size_t>(fds.size() - i, HANDOFF_FDS_MAX)))
+			break;
+	send_handoff(peer, HandoffHeader::CLIENTS, nullptr, 0);
+
+	/* Peer holds own duplicates now */
+	for (int fd : fds)
+		close(fd);
+	return true;
+}
+
+void ServerBase::ServerSocket::StopAccepting()
+{
+	shared = true;
+	handed_off = true;
+
+	/* Threaded handlers wait on the wake event along with listening socket */
+	uint64_t one = 1;
+	ssize_t res = write(wakefd, &one, sizeof(one));
+	(void)res;
+
+	/* Loops stay alive, stop joins this thread before they go */
+	std::vector<std::future<void>> done;
+	for (auto &loop : loops)
+	{
+		std::shared_ptr<std::promise<void>> stopped = std::make_shared<std::promise<void>>();
+		done.push_back(stopped->get_future());
+
+		EventLoop *target = loop.get();
+		target->Post([target, stopped]() {
+			target->StopAccepting();
+			stopped->set_value();
+		});
+	}
+
+	for (auto &stopped : done)
+		stopped.wait();
+}
+
+void ServerBase::ServerSocket::ReleaseClients(std::vector<int> &fds)
+{
+	std::vector<std::vector<int>> released(loops.size());
+	std::vector<std::future<void>> done;
+
+	for (size_t i = 0; i != loops.size(); i++)
+	{
+		std::shared_ptr<std::promise<void>> collected = std::make_shared<std::promise<void>>();
+		done.push_back(collected->get_future());
+
+		EventLoop *target = loops[i].get();
+		std::vector<int> *out = &released[i];
+		target->Post([target, out, collected]() {
+			target->Release(*out);
+			collected->set_value();
+		});
+	}
+
+	for (size_t i = 0; i != done.size(); i++)
+	{
+		done[i].wait();
+		fds.insert(fds.end(), released[i].begin(), released[i].end());
+	}
+}
+
+void ServerBase::ServerSocket::Adopt(int fd)
+{
+	if (loops.empty())
+	{
+		/* Handler threads read blocking sockets */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+		PeerAddress cli_addr;
+		getpeername(fd, cli_addr.Get(), &cli_addr.len);
+		serve_client(&server, fd, cli_addr);
+		return;
+	}
+
+	/* Clients are spread over loops round robin */
+	EventLoop *target = loops[adopted++ % loops.size()].get();
+	target->Post([target, fd]() { target->Adopt(fd); });
+}
+
+size_t ServerBase::GetNumberOfClients()
+{
+	return _socket ? _socket->clients->Size() : 0;
+}
+
+std::vector<ServerBase::ClientInfo> ServerBase::GetClients() const
+{
+	std::vector<ClientInfo> clients;
+	if (!_socket)
+		return clients;
+
+	ClientInfo info;
+	for (size_t i = 0; i != _socket->clients->Capacity(); i++)
+		if (_socket->clients->Read(i, info))
+			clients.push_back(info);
+	return clients;
+}
+
+bool ServerBase::GetClient(size_t slot, ClientInfo &info) const
+{
+	return _socket && slot < _socket->clients->Capacity() && _socket->clients->Read(slot, info);
+}
+
+size_t ServerBase::GetMaxConnections() const
+{
+	return _max_connections;
+}
+
+void ServerBase::SetLoopThreads(size_t threads)
+{
+	_loop_threads = threads;
+}
+
+void ServerBase::SetLoopGroup(std::shared_ptr<LoopGroup> group)
+{
+	_group = std::move(group);
+}
+
+void ServerBase::SetListeners(size_t listeners, bool affinity)
+{
+	_listeners = listeners;
+	_affinity = affinity;
+}
+
+void ServerBase::SetFramer(std::shared_ptr<Framer> framer)
+{
+	_framer = std::move(framer);
+}
+
+void ServerBase::SetWatermarks(size_t high, size_t low)
+{
+	_high_watermark = high;
+	_low_watermark = std::min(low, high);
+}
+
+void ServerBase::SetTimeouts(std::chrono::milliseconds idle, std::chrono::milliseconds write)
+{
+	_idle_timeout = idle;
+	_write_timeout = write;
+}
+
+void ServerBase::SetRateLimit(RateScope scope, const RateLimit &limit)
+{
+	_rate_limits[static_cast<int>(scope)] = limit;
+}
+
+ServerBase::RateStats ServerBase::GetRateStats() const
+{
+	return _socket && _socket->limiter ? _socket->limiter->GetStats() : RateStats {};
+}
+
+ServerBase::BufferStats ServerBase::GetBufferStats() const
+{
+	return _pool ? _pool->GetStats() : BufferStats {};
+}
+
+ServerBase::Mode ServerBase::GetMode() const
+{
+	return _mode;
+}
+
+Client::Client(const std::string& ip, uint16_t port, ServerBase::Protocol protocol)
+	: _protocol(protocol)
+{
+	if (protocol == ServerBase::Protocol::UNIX_STREAM || protocol == ServerBase::Protocol::UNIX_DGRAM)
+		throw std::runtime_error("Client::Client: Unix protocol needs socket path");
+
+	_sockfd = socket(AF_INET, protocol == ServerBase::Protocol::TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (_sockfd < 0)
+		throw std::runtime_error(
+			"Client::Client: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	struct sockaddr_in serv_addr;
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(port);
+
+	if (inet_pton(AF_INET, ip.c_str(), &serv_addr.sin_addr) <= 0)
+	{
+		close(_sockfd);
+		throw std::runtime_error(
+			"Client::Client: Invalid address/ Address not supported: " + ip);
+	}
+
+	if (connect(_sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+	{
+		close(_sockfd);
+		throw std::runtime_error(
+			"Client::Client: Connection Failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+}
+
+Client::Client(const std::string &path, ServerBase::Protocol protocol)
+	: _protocol(protocol)
+{
+	if (protocol != ServerBase::Protocol::UNIX_STREAM && protocol != ServerBase::Protocol::UNIX_DGRAM)
+		throw std::runtime_error("Client::Client: Socket path needs Unix protocol");
+
+	struct sockaddr_un serv_addr;
+	socklen_t len = unix_address(path, serv_addr, "Client::Client");
+
+	_sockfd = socket(AF_UNIX, IsDatagram() ? SOCK_DGRAM : SOCK_STREAM, 0);
+	if (_sockfd < 0)
+		throw std::runtime_error(
+			"Client::Client: Open socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	/* Family alone autobinds to unique abstract name, replies need an address */
+	sa_family_t family = AF_UNIX;
+	if (IsDatagram() && bind(_sockfd, reinterpret_cast<struct sockaddr *>(&family), sizeof(family)) < 0)
+	{
+		close(_sockfd);
+		throw std::runtime_error(
+			"Client::Client: Bind socket error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+
+	if (connect(_sockfd, (struct sockaddr *)&serv_addr, len) < 0)
+	{
+		close(_sockfd);
+		throw std::runtime_error(
+			"Client::Client: Connection Failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	}
+}
+
+Client::Client(Client &&other) noexcept
+	: _sockfd(other._sockfd), _protocol(other._protocol), _out(std::move(other._out)),
+	  _lengths(std::move(other._lengths)), _iov(std::move(other._iov)),
+	  _zerocopy(std::move(other._zerocopy))
+{
+	other._sockfd = -1;
+}
+
+Client &Client::operator=(Client &&other) noexcept
+{
+	if (this != &other)
+	{
+		Close();
+		_sockfd = other._sockfd;
+		_protocol = other._protocol;
+		_out = std::move(other._out);
+		_lengths = std::move(other._lengths);
+		_iov = std::move(other._iov);
+		_zerocopy = std::move(other._zerocopy);
+		other._sockfd = -1;
+	}
+	return *this;
+}
+
+Client::~Client()
+{
+	Close();
+}
+
+void Client::Write(struct iovec *iov, size_t count)
+{
+	while (count)
+	{
+		struct msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = std::min<size_t>(count, IOV_MAX);
+
+		ssize_t sent = sendmsg(_sockfd, &msg, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0)
+			throw std::runtime_error(
+				"Client::Send: Send failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		/* Partial write, skip buffers already sent */
+		size_t done = static_cast<size_t>(sent);
+		while (count && done >= iov->iov_len)
+		{
+			done -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count)
+		{
+			iov->iov_base = static_cast<char *>(iov->iov_base) + done;
+			iov->iov_len -= done;
+		}
+	}
+}
+
+void Client::SendDatagrams()
+{
+	struct mmsghdr hdrs[CLIENT_MMSG_MAX];
+	struct iovec iov[CLIENT_MMSG_MAX];
+	size_t offset = 0;
+	size_t index = 0;
+
+	while (index != _lengths.size())
+	{
+		unsigned int count = 0;
+		for (size_t pos = offset; count != CLIENT_MMSG_MAX && index + count != _lengths.size(); count++)
+		{
+			iov[count].iov_base = _out.data() + pos;
+			iov[count].iov_len = _lengths[index + count];
+			hdrs[count] = {};
+			hdrs[count].msg_hdr.msg_iov = &iov[count];
+			hdrs[count].msg_hdr.msg_iovlen = 1;
+			pos += _lengths[index + count];
+		}
+
+		int sent = sendmmsg(_sockfd, hdrs, count, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			throw std::runtime_error(
+				"Client::Flush: Send failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+		for (int n = 0; n != sent; n++)
+			offset += _lengths[index++];
+	}
+}
+
+void Client::Send(const char *src, size_t size)
+{
+	struct iovec iov = { const_cast<char *>(src), size };
+	Send(&iov, 1);
+}
+
+void Client::Send(const std::string &msg)
+{
+	Send(msg.c_str(), msg.size());
+}
+
+void Client::Send(const std::vector<char> &msg)
+{
+	Send(msg.data(), msg.size());
+}
+
+void Client::Send(const struct iovec *iov, size_t count)
+{
+	if (IsDatagram())
+	{
+		Flush();
+
+		struct msghdr msg = {};
+		msg.msg_iov = const_cast<struct iovec *>(iov);
+		msg.msg_iovlen = count;
+		if (sendmsg(_sockfd, &msg, MSG_NOSIGNAL) < 0)
+			throw std::runtime_error(
+				"Client::Send: Send failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+		return;
+	}
+
+	/* Queued data and the buffers leave with one write */
+	_iov.clear();
+	if (!_out.empty())
+		_iov.push_back({ _out.data(), _out.size() });
+	_iov.insert(_iov.end(), iov, iov + count);
+
+	Write(_iov.data(), _iov.size());
+	_out.clear();
+	_lengths.clear();
+}
+
+void Client::SendFile(int fd, off_t offset, size_t size)
+{
+	if (IsDatagram())
+		throw std::runtime_error("Client::SendFile: Not supported for datagrams");
+
+	Flush();
+	send_file(_sockfd, fd, offset, size, std::chrono::milliseconds(0), "Client::SendFile");
+}
+
+void Client::SendZeroCopy(const char *src, size_t size)
+{
+	if (IsDatagram() || size < ZEROCOPY_MIN)
+	{
+		Send(src, size);
+		return;
+	}
+
+	/* Completion counter belongs to the socket, tracker lives as long */
+	if (!_zerocopy)
+		_zerocopy.reset(new ZeroCopyTracker);
+
+	if (!_zerocopy->Enable(_sockfd))
+	{
+		Send(src, size);
+		return;
+	}
+
+	Flush();
+	send_zerocopy(_sockfd, *_zerocopy, src, size, std::chrono::milliseconds(0), "Client::SendZeroCopy");
+}
+
+void Client::Queue(const char *src, size_t size)
+{
+	/* Large message is not worth a copy */
+	if (!IsDatagram() && size > CLIENT_COALESCE_MAX)
+	{
+		Send(src, size);
+		return;
+	}
+
+	_out.insert(_out.end(), src, src + size);
+	_lengths.push_back(size);
+
+	if (_out.size() >= CLIENT_COALESCE_MAX || _lengths.size() >= IOV_MAX)
+		Flush();
+}
+
+void Client::Queue(const std::string &msg)
+{
+	Queue(msg.c_str(), msg.size());
+}
+
+void Client::Queue(const std::vector<char> &msg)
+{
+	Queue(msg.data(), msg.size());
+}
+
+void Client::Flush()
+{
+	if (_lengths.empty())
+		return;
+
+	if (IsDatagram())
+	{
+		SendDatagrams();
+	}
+	else
+	{
+		struct iovec iov = { _out.data(), _out.size() };
+		Write(&iov, 1);
+	}
+
+	_out.clear();
+	_lengths.clear();
+}
+
+size_t Client::GetPending() const
+{
+	return _out.size();
+}
+
+size_t Client::Read(char *dst, size_t max_size)
+{
+	ssize_t received;
+	do
+	{
+		received = read(_sockfd, dst, max_size);
+	} while (received < 0 && errno == EINTR);
+
+	if (received < 0)
+		throw std::runtime_error(
+			"Client::Read: Read failed: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+	return static_cast<size_t>(received);
+}
+
+void Client::ReadExact(char *dst, size_t size)
+{
+	while (size)
+	{
+		size_t received = Read(dst, size);
+		if (!received)
+			throw std::runtime_error("Client::ReadExact: Connection closed");
+
+		dst += received;
+		size -= received;
+	}
+}
+
+size_t Client::Read(std::string &out_str, size_t max_size)
+{
+	/* Reuses string storage, no allocation once it is big enough */
+	out_str.resize(max_size);
+	size_t received = Read(&out_str[0], max_size);
+	out_str.resize(received);
+	return received;
+}
+
+std::string Client::ReadString(size_t max_size)
+{
+	std::string result;
+	Read(result, max_size);
+	return result;
+}
+
+std::vector<char> Client::ReadVector(size_t max_size)
+{
+	std::vector<char> buffer(max_size);
+	size_t read_bytes = Read(buffer.data(), max_size);
+	buffer.resize(read_bytes);
+	return buffer;
+}
+
+void Client::Close()
+{
+	if (_sockfd >= 0)
+	{
+		close(_sockfd);
+		_sockfd = -1;
+	}
+
+	_out.clear();
+	_lengths.clear();
+	_zerocopy.reset();
+}
+
+void Client::Shutdown()
+{
+	if (_sockfd >= 0)
+		shutdown(_sockfd, SHUT_RDWR);
+}
+
+bool Client::IsOpen() const
+{
+	return _sockfd >= 0;
+}
+
+bool Client::IsDatagram() const
+{
+	return _protocol == ServerBase::Protocol::UDP || _protocol == ServerBase::Protocol::UNIX_DGRAM;
+}
+
+bool Client::IsStale() const
+{
+	char byte;
+	ssize_t received = recv(_sockfd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+
+	/* Closed by server, failed or holds replies nobody read */
+	return received >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+ClientPool::Lease::~Lease()
+{
+	Release();
+}
+
+ClientPool::Lease::Lease(Lease &&other) noexcept
+	: _pool(other._pool), _key(std::move(other._key)), _client(std::move(other._client)) {}
+
+ClientPool::Lease &ClientPool::Lease::operator=(Lease &&other) noexcept
+{
+	if (this != &other)
+	{
+		Release();
+		_pool = other._pool;
+		_key = std::move(other._key);
+		_client = std::move(other._client);
+	}
+	return *this;
+}
+
+void ClientPool::Lease::Discard()
+{
+	_client.reset();
+}
+
+void ClientPool::Lease::Release()
+{
+	std::unique_ptr<Client> client = std::move(_client);
+	if (!client || !client->IsOpen() || !_pool)
+		return;
+
+	try
+	{
+		client->Flush();
+	}
+	catch (const std::runtime_error &)
+	{
+		return;
+	}
+
+	_pool->Put(_key, std::move(client));
+}
+
+ClientPool::Lease ClientPool::Acquire(const std::string &ip, uint16_t port,
+				      ServerBase::Protocol protocol)
+{
+	bool unix_socket = protocol == ServerBase::Protocol::UNIX_STREAM ||
+			   protocol == ServerBase::Protocol::UNIX_DGRAM;
+	static const char *const names[] = { "/tcp", "/udp", "/unix", "/unix-dgram" };
+	std::string key = (unix_socket ? ip : ip + ":" + std::to_string(port)) +
+		names[static_cast<int>(protocol)];
+
+	while (true)
+	{
+		std::unique_ptr<Client> client;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			auto it = _idle.find(key);
+			if (it == _idle.end() || it->second.empty())
+				break;
+
+			/* Most recently used one is the least likely to be closed */
+			client = std::move(it->second.back());
+			it->second.pop_back();
+		}
+
+		/* Stale connection is closed when client goes out of scope */
+		if (!client->IsStale())
+			return Lease(this, key, std::move(client));
+	}
+
+	return Lease(this, key, std::unique_ptr<Client>(
+		unix_socket ? new Client(ip, protocol) : new Client(ip, port, protocol)));
+}
+
+void ClientPool::Put(const std::string &key, std::unique_ptr<Client> client)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	auto &idle = _idle[key];
+
+	/* Extra connection is closed after the lock is dropped */
+	if (idle.size() < _max_idle)
+		idle.push_back(std::move(client));
+}
+
+size_t ClientPool::GetIdle() const
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	size_t count = 0;
+	for (auto &entry : _idle)
+		count += entry.second.size();
+	return count;
+}
+
+void ClientPool::Clear()
+{
+	decltype(_idle) idle;
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		idle.swap(_idle);
 	}
-}
\ No newline at end of file
+}
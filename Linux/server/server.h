@@ -46,16 +46,36 @@
 #define __SERVER_CPP_H__
 
 #include <stdint.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <cstddef>
 #include <memory>
 #include <thread>
+#include <atomic>
 #include <mutex>
-#include <unordered_set>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
 #include <vector>
 #include <string>
+#include <unordered_map>
+
+class File;
 
 namespace Network {
 
+class EventLoop;
+class LoopGroup;
+struct ClientContext;
+class DatagramBatch;
+class BufferPool;
+class ClientTable;
+class Connection;
+class ZeroCopyTracker;
+class RateLimiter;
+
 class MessageBase
 {
 public:
@@ -73,9 +93,49 @@ public:
 	MessageBase(int sockfd, char *data, size_t size)
 		: _sockfd(sockfd), data(data), size(size) {}
 
+	/**
+	 * @brief Constructor of MessageBase class used by event loops.
+	 *
+	 * @param client	Context of connected client.
+	 * @param data		Pointer to received data.
+	 * @param size		Size of received data.
+	 */
+	MessageBase(ClientContext *client, char *data, size_t size);
+
+	/**
+	 * @brief Constructor of MessageBase class for received datagram.
+	 *
+	 * @param batch		Batch the datagram belongs to, queues replies.
+	 * @param data		Pointer to received data.
+	 * @param size		Size of received data.
+	 * @param peer		Address of datagram sender.
+	 */
+	MessageBase(DatagramBatch *batch, char *data, size_t size,
+		    const struct sockaddr_in &peer);
+
+	/**
+	 * @brief Constructor of MessageBase class for datagram of any family.
+	 *
+	 * @param batch		Batch the datagram belongs to, queues replies.
+	 * @param data		Pointer to received data.
+	 * @param size		Size of received data.
+	 * @param peer		Address of datagram sender.
+	 * @param peer_len	Size of sender address.
+	 * @param cred		Sender credentials, nullptr if not passed.
+	 */
+	MessageBase(DatagramBatch *batch, char *data, size_t size,
+		    const struct sockaddr *peer, socklen_t peer_len,
+		    const struct ucred *cred = nullptr);
+
 	/**
 	 * @brief Send reply to client.
 	 *
+	 * Replies to datagrams are queued and sent to the sender together
+	 * once the batch is handled, so they have to be made from the
+	 * receive handler. In EPOLL and URING modes replies made from the
+	 * loop thread are queued per connection and written as the socket
+	 * drains, the call never blocks. THREADED mode writes synchronously.
+	 *
 	 * @param src		Pointer to the buffer to send.
 	 * @param size		Amount of bytes to send.
 	 */
@@ -95,6 +155,45 @@ public:
 	 */
 	void Reply(const std::vector<char> &msg);
 
+	/**
+	 * @brief Send region of a file to client with sendfile().
+	 *
+	 * Data goes from the page cache to the socket without passing
+	 * through user space. Event loops queue the region behind earlier
+	 * replies, the descriptor is duplicated so the caller may close
+	 * it on return. Not supported for datagrams.
+	 *
+	 * @param fd		File descriptor to send from.
+	 * @param offset	Offset of the region in the file.
+	 * @param size		Size of the region.
+	 */
+	void ReplyFile(int fd, off_t offset, size_t size);
+
+	/**
+	 * @brief Send region of a file to client with sendfile().
+	 *
+	 * @param file		Open file to send from.
+	 * @param offset	Offset of the region in the file.
+	 * @param size		Size of the region.
+	 */
+	void ReplyFile(File &file, off_t offset, size_t size);
+
+	/**
+	 * @brief Send reply to client without copying it.
+	 *
+	 * Buffer is sent with MSG_ZEROCOPY and has to stay unchanged until
+	 * release is called, which happens once the kernel reports it does
+	 * not need the pages anymore. Buffers below ZEROCOPY_MIN, datagram
+	 * replies and sockets without zero-copy support are copied and
+	 * released before the call returns. THREADED mode waits for the
+	 * completion in place.
+	 *
+	 * @param src		Pointer to the buffer to send.
+	 * @param size		Amount of bytes to send.
+	 * @param release	Function giving the buffer back, called in any case.
+	 */
+	void ReplyZeroCopy(const char *src, size_t size, std::function<void()> release);
+
 	/**
 	 * @brief Get pointer to received data.
 	 *
@@ -108,19 +207,253 @@ public:
 	 * @return Size of data buffer.
 	 */
 	size_t GetSize() const;
+
+	/**
+	 * @brief Get address of datagram sender.
+	 *
+	 * @return Sender address, zeroed for stream clients and Unix sockets.
+	 */
+	const struct sockaddr_in &GetPeer() const;
+
+	/**
+	 * @brief Get address of datagram sender as text.
+	 *
+	 * @return IP address, socket path of Unix sender with abstract names
+	 *	   starting with '@', empty for stream clients and unbound senders.
+	 */
+	std::string GetPeerName() const;
+
+	/**
+	 * @brief Get credentials of Unix domain peer.
+	 *
+	 * Stream peers are identified once connected, datagram senders by
+	 * SCM_CREDENTIALS passed with every datagram.
+	 *
+	 * @param cred		Process, user and group of the peer.
+	 * @return False if peer is not a Unix socket.
+	 */
+	bool GetCredentials(struct ucred &cred) const;
+
+	/**
+	 * @brief Get connection table slot of the client.
+	 *
+	 * Slot is stable while the client is connected and is reused after
+	 * disconnect, so it may index per-connection state of the server.
+	 *
+	 * @return Slot index, SIZE_MAX for datagrams.
+	 */
+	size_t GetSlot() const;
+
+	/**
+	 * @brief Arm user timer of the connection.
+	 *
+	 * OnTimer is called once the delay passes, from the thread serving
+	 * the connection. Every connection has one user timer, arming it
+	 * again replaces pending expiry. Has to be called from handlers.
+	 * Throws std::runtime_error for datagrams.
+	 *
+	 * @param delay		Time to expiry, zero cancels the timer.
+	 */
+	void SetTimer(std::chrono::milliseconds delay);
+
+	/**
+	 * @brief Check if more replies can be queued.
+	 *
+	 * Turns false once data queued to the connection exceeds the high
+	 * watermark. Reading from the connection is paused until the queue
+	 * drops below the low watermark, then OnWritable is called.
+	 *
+	 * @return False if producer should wait for OnWritable.
+	 */
+	bool IsWritable() const;
+
+	/**
+	 * @brief Get handle to reply after the handler returned.
+	 *
+	 * Datagrams get an empty handle.
+	 *
+	 * @return Handle of the connection.
+	 */
+	Connection GetConnection() const;
 private:
 	int _sockfd;
+	ClientContext *_client = nullptr;
+	DatagramBatch *_batch = nullptr;
+	struct sockaddr_storage _peer = {};
+	socklen_t _peer_len = 0;
+	struct ucred _cred = {};
 	char *data;
 	size_t size;
 };
 
+/**
+ * Splits TCP byte stream into frames.
+ *
+ * One instance is shared by all connections of a server, implementations
+ * must not keep per-stream state.
+ */
+class Framer
+{
+public:
+	virtual ~Framer() = default;
+
+	/**
+	 * @brief Find frame at the beginning of buffered stream data.
+	 *
+	 * Throws std::runtime_error if data is malformed.
+	 *
+	 * @param data		Pointer to buffered data.
+	 * @param size		Amount of buffered data.
+	 * @param offset	Offset of frame payload.
+	 * @param length	Size of frame payload.
+	 * @return Size of whole frame as soon as it is known, even if it is
+	 *	   not buffered completely yet, 0 if more data is needed.
+	 */
+	virtual size_t Next(const char *data, size_t size,
+			    size_t &offset, size_t &length) const = 0;
+};
+
+/**
+ * Frames prefixed with payload length.
+ */
+class LengthPrefixFramer final: public Framer
+{
+public:
+	/**
+	 * @brief Constructor of LengthPrefixFramer class.
+	 *
+	 * Throws std::runtime_error if prefix size is not supported.
+	 *
+	 * @param prefix_size	Size of length field: 1, 2, 4 or 8 [default = 4].
+	 * @param big_endian	Byte order of length field [default = true].
+	 */
+	explicit LengthPrefixFramer(size_t prefix_size = 4, bool big_endian = true);
+
+	size_t Next(const char *data, size_t size,
+		    size_t &offset, size_t &length) const override;
+private:
+	size_t _prefix_size;
+	bool _big_endian;
+};
+
+/**
+ * Frames terminated by delimiter, delimiter is not passed to handler.
+ */
+class DelimiterFramer final: public Framer
+{
+public:
+	/**
+	 * @brief Constructor of DelimiterFramer class.
+	 *
+	 * Throws std::runtime_error if delimiter is empty.
+	 *
+	 * @param delimiter	Frame terminator [default = "\n"].
+	 */
+	explicit DelimiterFramer(const std::string &delimiter = "\n");
+
+	size_t Next(const char *data, size_t size,
+		    size_t &offset, size_t &length) const override;
+private:
+	std::string _delimiter;
+};
+
 class ServerBase
 {
 public:
-	enum class Protocol { TCP, UDP };
+	/**
+	 * Transport protocol.
+	 *
+	 * TCP		IPv4 stream.
+	 * UDP		IPv4 datagrams.
+	 * UNIX_STREAM	Unix domain stream, for local peers.
+	 * UNIX_DGRAM	Unix domain datagrams, replies need a bound sender.
+	 */
+	enum class Protocol { TCP, UDP, UNIX_STREAM, UNIX_DGRAM };
+
+	/**
+	 * Client handling mode.
+	 *
+	 * THREADED	One thread per connected TCP client.
+	 * EPOLL	Edge-triggered epoll event loops shared by all clients.
+	 * URING	io_uring event loops, falls back to EPOLL if kernel
+	 *		does not support it.
+	 */
+	enum class Mode { THREADED, EPOLL, URING };
+
+	/**
+	 * Receive buffer pool statistics.
+	 *
+	 * hits		Buffers reused from the pool.
+	 * misses	Buffers allocated because the pool had none.
+	 * peak_bytes	Most bytes lent to connections at once.
+	 */
+	struct BufferStats
+	{
+		size_t hits;
+		size_t misses;
+		size_t peak_bytes;
+	};
+
+	/**
+	 * Scope of rate limit.
+	 *
+	 * CONNECTION	Every stream connection on its own.
+	 * SOURCE	Connections and datagrams of one IPv4 address, Unix
+	 *		peers of one user.
+	 * GLOBAL	Everything the server receives.
+	 */
+	enum class RateScope { CONNECTION, SOURCE, GLOBAL };
+
+	/**
+	 * Token bucket limit of received data, zero rate is unlimited.
+	 *
+	 * bytes_per_sec	Bytes refilled per second.
+	 * messages_per_sec	Messages refilled per second.
+	 * burst_bytes		Bucket depth, zero is one second worth.
+	 * burst_messages	Bucket depth, zero is one second worth.
+	 */
+	struct RateLimit
+	{
+		double bytes_per_sec;
+		double messages_per_sec;
+		double burst_bytes;
+		double burst_messages;
+	};
+
+	/**
+	 * Rate limiting statistics.
+	 *
+	 * throttled		Times a stream stopped being read.
+	 * dropped		Datagrams dropped over the limit.
+	 * dropped_bytes	Bytes of dropped datagrams.
+	 */
+	struct RateStats
+	{
+		uint64_t throttled;
+		uint64_t dropped;
+		uint64_t dropped_bytes;
+	};
+
+	/**
+	 * Connected TCP client.
+	 *
+	 * slot		Connection table slot, see MessageBase::GetSlot().
+	 * peer		Client address.
+	 * bytes_in	Bytes received from the client.
+	 * bytes_out	Bytes replied to the client.
+	 * connected	Time of connection.
+	 */
+	struct ClientInfo
+	{
+		size_t slot;
+		struct sockaddr_in peer;
+		uint64_t bytes_in;
+		uint64_t bytes_out;
+		std::chrono::system_clock::time_point connected;
+	};
 
 	explicit ServerBase() = default;
-	~ServerBase();
+	virtual ~ServerBase();
 
 	/**
 	 * @brief Constructor of ServerBase class.
@@ -129,11 +462,33 @@ public:
 	 * @param msg_size		Maximum message size [default = 1500].
 	 * @param max_connections	Maximum amount of incoming connections [32].
 	 * @param protocol		Protocol type (TCP/UDP) [default = TCP].
+	 * @param mode			Client handling mode [default = THREADED].
 	 */
 	ServerBase(uint16_t port,
 			   size_t msg_size = 1500,
 			   size_t max_connections = 32,
-			   Protocol protocol = Protocol::TCP);
+			   Protocol protocol = Protocol::TCP,
+			   Mode mode = Mode::THREADED);
+
+	/**
+	 * @brief Constructor of ServerBase class on Unix domain socket.
+	 *
+	 * Filesystem socket left by previous run is replaced and removed on
+	 * Stop(). Path starting with '@' names a socket in the abstract
+	 * namespace, which leaves nothing behind. Unix sockets have one
+	 * listener, SetListeners() is ignored.
+	 *
+	 * @param path			Socket path.
+	 * @param msg_size		Maximum message size [default = 1500].
+	 * @param max_connections	Maximum amount of incoming connections [32].
+	 * @param protocol		UNIX_STREAM or UNIX_DGRAM [default = UNIX_STREAM].
+	 * @param mode			Client handling mode [default = THREADED].
+	 */
+	ServerBase(const std::string &path,
+			   size_t msg_size = 1500,
+			   size_t max_connections = 32,
+			   Protocol protocol = Protocol::UNIX_STREAM,
+			   Mode mode = Mode::THREADED);
 
 	/**
 	 * @brief Start server thread.
@@ -147,6 +502,40 @@ public:
 	 */
 	void Stop();
 
+	/**
+	 * @brief Serve listening sockets to a process taking over.
+	 *
+	 * Process calling TakeOver() on the Unix socket path gets duplicates
+	 * of listening sockets. Once it confirms it accepts, this server stops
+	 * accepting and reading datagrams, clients connected are served until
+	 * they leave. In EPOLL mode clients may follow between requests, ones
+	 * with data buffered or queued stay. Should be called after Start().
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param path			Unix socket path, leading '@' is abstract.
+	 * @param clients		Hand idle clients over as well.
+	 */
+	void ServeHandoff(const std::string &path, bool clients = false);
+
+	/**
+	 * @brief Start on listening sockets of a running server.
+	 *
+	 * Used instead of Start() for restart without downtime. Listening
+	 * sockets and clients handed over are served, pending connections and
+	 * datagrams are not lost. Throws std::runtime_error if no server
+	 * serves handoff at the path or its sockets are of other protocol.
+	 *
+	 * @param path			Unix socket path given to ServeHandoff().
+	 */
+	void TakeOver(const std::string &path);
+
+	/**
+	 * @brief Check if listening sockets are handed over.
+	 *
+	 * @return True once another process accepts instead of this one.
+	 */
+	bool IsHandedOff() const;
+
 	/**
 	 * @brief Get number of active connections.
 	 *
@@ -154,6 +543,25 @@ public:
 	 */
 	size_t GetNumberOfClients();
 
+	/**
+	 * @brief Get connected TCP clients.
+	 *
+	 * Connection table is read without locks, clients connecting or
+	 * disconnecting meanwhile may be missing.
+	 *
+	 * @return Information of every connected client.
+	 */
+	std::vector<ClientInfo> GetClients() const;
+
+	/**
+	 * @brief Get connected TCP client by connection table slot.
+	 *
+	 * @param slot			Slot index.
+	 * @param info			Client information.
+	 * @return False if no client occupies the slot.
+	 */
+	bool GetClient(size_t slot, ClientInfo &info) const;
+
 	/**
 	 * @brief Get maximum allowed connections.
 	 *
@@ -161,28 +569,329 @@ public:
 	 */
 	size_t GetMaxConnections() const;
 
-	/** Event handlers to override */
+	/**
+	 * @brief Set amount of event loop threads.
+	 *
+	 * Used in EPOLL and URING modes, should be called before Start().
+	 *
+	 * @param threads		Amount of loop threads [default = 1].
+	 */
+	void SetLoopThreads(size_t threads);
+
+	/**
+	 * @brief Serve event loops by threads of the group.
+	 *
+	 * Loops of the server run no threads of their own, so many servers
+	 * share a few threads. Used in EPOLL and URING modes, URING falls
+	 * back to EPOLL. Loop threads set the amount of loops per listener.
+	 * Should be called before Start().
+	 *
+	 * @param group			Group to serve loops, nullptr for own threads.
+	 */
+	void SetLoopGroup(std::shared_ptr<LoopGroup> group);
+
+	/**
+	 * @brief Set amount of listening sockets.
+	 *
+	 * Every listener is a separate SO_REUSEPORT socket bound to the same
+	 * port and served by own threads, kernel spreads connections and UDP
+	 * flows between them. Limits and client counters stay server wide.
+	 * Should be called before Start().
+	 *
+	 * @param listeners		Amount of listeners [default = 1].
+	 * @param affinity		Pin threads of every listener to own CPU.
+	 */
+	void SetListeners(size_t listeners, bool affinity = true);
+
+	/**
+	 * @brief Set framer to reassemble TCP messages.
+	 *
+	 * OnReceive is called once per complete frame with the payload only.
+	 * Frames are collected in per connection buffer of msg_size bytes, the
+	 * connection is dropped if a frame does not fit. Datagrams are never
+	 * framed. Should be called before Start().
+	 *
+	 * @param framer		Framer to use, nullptr to pass data as read.
+	 */
+	void SetFramer(std::shared_ptr<Framer> framer);
+
+	/**
+	 * @brief Get receive buffer pool statistics.
+	 *
+	 * Connections borrow receive buffers from a server wide pool only while
+	 * data is being read or a partial frame is kept, idle ones hold none.
+	 *
+	 * @return Statistics since the server was started first time.
+	 */
+	BufferStats GetBufferStats() const;
+
+	/**
+	 * @brief Set limits of data queued to a connection.
+	 *
+	 * Used in EPOLL and URING modes. Once queued replies exceed the high
+	 * watermark no more requests are read from the connection, reading
+	 * resumes when the queue drops to the low watermark. Should be called
+	 * before Start().
+	 *
+	 * @param high			Pause reading above [default = 1MB].
+	 * @param low			Resume reading at [default = 256KB].
+	 */
+	void SetWatermarks(size_t high, size_t low);
+
+	/**
+	 * @brief Set connection timeouts.
+	 *
+	 * Connection is closed if nothing is received for idle timeout or
+	 * if queued replies make no progress for write timeout. Timers are
+	 * kept in a timer wheel per event loop or handler thread, no system
+	 * call is made per connection. Should be called before Start().
+	 *
+	 * @param idle			Receive idle timeout, zero is off [default].
+	 * @param write			Write stall timeout, zero is off [default].
+	 */
+	void SetTimeouts(std::chrono::milliseconds idle,
+			 std::chrono::milliseconds write = std::chrono::milliseconds(0));
+
+	/**
+	 * @brief Set rate limit of received data.
+	 *
+	 * Stream exceeding any of its limits is not read until the buckets
+	 * refill, the kernel pushes back on the sender while other clients
+	 * are served. Datagrams over source or global limit are dropped and
+	 * counted, connection limit does not apply to them. A message is a
+	 * read of unframed stream, a frame or a datagram. Should be called
+	 * before Start().
+	 *
+	 * @param scope			Scope of the limit.
+	 * @param limit			Limit, zero rates remove it.
+	 */
+	void SetRateLimit(RateScope scope, const RateLimit &limit);
+
+	/**
+	 * @brief Get rate limiting statistics.
+	 *
+	 * @return Statistics since Start().
+	 */
+	RateStats GetRateStats() const;
+
+	/**
+	 * @brief Get client handling mode.
+	 *
+	 * @return Mode in use, differs from requested one after fallback.
+	 */
+	Mode GetMode() const;
+
+	/** Event handlers to override, Unix peers pass socket path as ip */
 	virtual void OnConnect(const std::string& ip) {}
 	virtual void OnReceive(MessageBase &msg) = 0;
 	virtual void OnDisconnect() {}
+
+	/**
+	 * @brief Handle datagrams received by one system call.
+	 *
+	 * Default implementation calls OnConnect, OnReceive and OnDisconnect
+	 * for every datagram. Override to handle the whole batch at once
+	 * without per datagram events.
+	 *
+	 * @param msgs		Received datagrams.
+	 */
+	virtual void OnReceiveBatch(std::vector<MessageBase> &msgs);
+
+	/**
+	 * @brief Handle connection drained after exceeding high watermark.
+	 *
+	 * Called from the loop thread once queued replies drop to the low
+	 * watermark. Producers streaming large replies continue here, the
+	 * message carries no data.
+	 *
+	 * @param msg		Message to reply to the drained connection.
+	 */
+	virtual void OnWritable(MessageBase &msg) {}
+
+	/**
+	 * @brief Handle user timer of the connection.
+	 *
+	 * Called once timer armed by MessageBase::SetTimer expires, the
+	 * message carries no data. Throwing drops the connection.
+	 *
+	 * @param msg		Message to reply to the connection.
+	 */
+	virtual void OnTimer(MessageBase &msg) {}
 protected:
+	friend class EventLoop;
+	friend class Connection;
+	bool IsStream() const { return _protocol == Protocol::TCP || _protocol == Protocol::UNIX_STREAM; }
+	bool IsUnix() const { return _protocol == Protocol::UNIX_STREAM || _protocol == Protocol::UNIX_DGRAM; }
 	struct ServerSocket final {
 		friend class ServerBase;
 		ServerSocket(ServerBase &server);
 		~ServerSocket();
-		void Start();
+		void Start(const std::vector<int> &inherited = std::vector<int>());
 		void Stop();
+		int Listen();
+		int ListenUnix(int sockfd);
+		void ServeHandoff(const std::string &path, bool clients);
+		void Handoff();
+		bool HandOver(int peer);
+		void StopAccepting();
+		void ReleaseClients(std::vector<int> &fds);
+		void Adopt(int fd);
 		ServerBase &server;
-		int _sockfd;
-		std::thread _server_thread;
-		std::unordered_set<int> clients_list;
+		std::vector<int> _sockfds;
+		std::vector<std::thread> _server_threads;
+		std::atomic<bool> listening { false };
+		/* Wakes threaded handlers waiting on listening sockets */
+		int wakefd = -1;
+		/* Listening sockets are used by another process, never shut down */
+		bool shared = false;
+		std::atomic<bool> handed_off { false };
+		int handoff_fd = -1;
+		std::string handoff_path;
+		bool handoff_clients = false;
+		std::thread handoff_thread;
+		size_t adopted = 0;
+		/* Keeps loops alive while work is posted to them */
+		std::mutex posting;
+		std::vector<std::unique_ptr<EventLoop>> loops;
+		std::unique_ptr<ClientTable> clients;
+		/* Set only if any rate limit is */
+		std::unique_ptr<RateLimiter> limiter;
 		std::mutex guard;
+		std::condition_variable handlers_done;
+		std::atomic<size_t> handlers { 0 };
 	};
+	/* Declared first, connections give buffers back while socket goes down */
+	std::unique_ptr<BufferPool> _pool;
+	/* Outlives the socket, its loops leave the group on stop */
+	std::shared_ptr<LoopGroup> _group;
 	std::shared_ptr<ServerSocket> _socket;
-	uint16_t _port;
+	uint16_t _port = 0;
+	std::string _path;
 	size_t _msg_size;
 	size_t _max_connections;
 	Protocol _protocol;
+	Mode _mode = Mode::THREADED;
+	size_t _loop_threads = 1;
+	size_t _listeners = 1;
+	bool _affinity = false;
+	std::shared_ptr<Framer> _framer;
+	size_t _high_watermark = 1024 * 1024;
+	size_t _low_watermark = 256 * 1024;
+	std::chrono::milliseconds _idle_timeout { 0 };
+	std::chrono::milliseconds _write_timeout { 0 };
+	RateLimit _rate_limits[3] = {};
+};
+
+/**
+ * Handle of TCP connection kept after the receive handler returned.
+ *
+ * Lets replies be made later from any thread, e.g. once a backend
+ * answered. Work is passed to the thread serving the connection, so in
+ * EPOLL and URING modes replies are queued in order with the ones made
+ * from handlers. THREADED mode runs it on the calling thread and writes
+ * synchronously. Handle is cheap to copy and safe to use after the
+ * client disconnected or the server stopped.
+ */
+class Connection
+{
+public:
+	Connection() = default;
+
+	/**
+	 * @brief Run function on the thread serving the connection.
+	 *
+	 * Function gets message to reply to, carrying no data, or nullptr
+	 * if the connection is gone. Throwing from it drops the connection.
+	 *
+	 * @param fn		Function to run.
+	 */
+	void Post(std::function<void(MessageBase *)> fn) const;
+
+	/**
+	 * @brief Check if handle refers to a connection.
+	 *
+	 * @return False for empty handle.
+	 */
+	bool IsValid() const;
+
+	/**
+	 * @brief Check if both handles refer to the same connection.
+	 *
+	 * Client connected later to the same slot is another connection.
+	 */
+	bool operator==(const Connection &other) const;
+	bool operator!=(const Connection &other) const { return !(*this == other); }
+private:
+	friend class MessageBase;
+	explicit Connection(ClientContext *client);
+
+	std::weak_ptr<ServerBase::ServerSocket> _socket;
+	EventLoop *_loop = nullptr;
+	size_t _slot = SIZE_MAX;
+	uint32_t _seq = 0;
+};
+
+/**
+ * Threads shared by event loops of many servers.
+ *
+ * Every loop keeps its own epoll instance, clients and timers, the group
+ * waits on all those instances at once and lends a thread to the loop
+ * having events. A loop is served by one thread at a time, so it needs
+ * no locking, while threads and memory stay the same however many
+ * servers are added. Loop left busy by one handler keeps one thread.
+ */
+class LoopGroup
+{
+public:
+	/**
+	 * @brief Constructor of LoopGroup class, starts threads.
+	 *
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param threads		Amount of threads [default = 1].
+	 */
+	explicit LoopGroup(size_t threads = 1);
+
+	/**
+	 * @brief Destructor, servers using the group have to be stopped.
+	 */
+	~LoopGroup();
+
+	LoopGroup(const LoopGroup &) = delete;
+	LoopGroup &operator=(const LoopGroup &) = delete;
+
+	/**
+	 * @brief Get amount of threads.
+	 */
+	size_t GetThreads() const { return _threads.size(); }
+
+	/**
+	 * @brief Get amount of event loops served.
+	 */
+	size_t GetLoops() const;
+private:
+	friend class EventLoop;
+
+	struct Member
+	{
+		EventLoop *loop;
+		int fd;
+		/* Tells events of a loop gone from the ones of the next in the slot */
+		uint32_t seq;
+		bool polling;
+	};
+
+	size_t Add(EventLoop *loop, int fd);
+	void Remove(size_t index);
+	void Run();
+
+	int _epfd = -1;
+	int _wakefd = -1;
+	mutable std::mutex _lock;
+	std::condition_variable _polled;
+	std::vector<Member> _members;
+	std::vector<size_t> _free;
+	std::vector<std::thread> _threads;
 };
 
 class Client
@@ -191,6 +900,11 @@ public:
 	explicit Client() = default;
 	~Client();
 
+	Client(const Client &) = delete;
+	Client &operator=(const Client &) = delete;
+	Client(Client &&other) noexcept;
+	Client &operator=(Client &&other) noexcept;
+
 	/**
 	 * @brief Constructor of client class to connect to server.
 	 * @param ip		IP address of server.
@@ -200,6 +914,18 @@ public:
 	Client(const std::string& ip, uint16_t port,
 		ServerBase::Protocol protocol = ServerBase::Protocol::TCP);
 
+	/**
+	 * @brief Constructor of client class to connect to Unix domain server.
+	 *
+	 * Datagram client is bound to an autogenerated abstract address,
+	 * so the server can reply.
+	 *
+	 * @param path		Socket path of server, '@' starts abstract name.
+	 * @param protocol	UNIX_STREAM or UNIX_DGRAM [default = UNIX_STREAM].
+	 */
+	explicit Client(const std::string &path,
+		ServerBase::Protocol protocol = ServerBase::Protocol::UNIX_STREAM);
+
 	/**
 	 * @brief Send data to server.
 	 *
@@ -223,6 +949,89 @@ public:
 	 */
 	void Send(const std::vector<char> &msg);
 
+	/**
+	 * @brief Send several buffers with one gathering write.
+	 *
+	 * Queued data goes first. Stream data is written in full, for
+	 * datagram sockets the buffers form a single datagram.
+	 *
+	 * @param iov		Array of buffers to send.
+	 * @param count		Number of buffers.
+	 */
+	void Send(const struct iovec *iov, size_t count);
+
+	/**
+	 * @brief Send region of a file to stream server with sendfile().
+	 *
+	 * Queued data goes first.
+	 *
+	 * @param fd		File descriptor to send from.
+	 * @param offset	Offset of the region in the file.
+	 * @param size		Size of the region.
+	 */
+	void SendFile(int fd, off_t offset, size_t size);
+
+	/**
+	 * @brief Send region of a file to stream server with sendfile().
+	 *
+	 * @param file		Open file to send from.
+	 * @param offset	Offset of the region in the file.
+	 * @param size		Size of the region.
+	 */
+	void SendFile(File &file, off_t offset, size_t size);
+
+	/**
+	 * @brief Send large buffer to stream server with MSG_ZEROCOPY.
+	 *
+	 * Queued data goes first. Returns once the kernel is done with the
+	 * buffer, so it can be reused right away. Small buffers and sockets
+	 * without zero-copy support are sent as usual.
+	 *
+	 * @param src		Pointer to the buffer to send.
+	 * @param size		Amount of bytes to send.
+	 */
+	void SendZeroCopy(const char *src, size_t size);
+
+	/**
+	 * @brief Queue data to be sent with the next Flush.
+	 *
+	 * Lets many requests be pipelined before reading replies. Small
+	 * messages are copied and coalesced into one write, queue is
+	 * flushed on its own once it grows past CLIENT_COALESCE_MAX.
+	 * Messages larger than that are written at once together with the
+	 * queue. Datagram sockets keep every message as separate datagram.
+	 *
+	 * @param src		Pointer to the buffer to send.
+	 * @param size		Amount of bytes to send.
+	 */
+	void Queue(const char *src, size_t size);
+
+	/**
+	 * @brief Queue data to be sent with the next Flush.
+	 *
+	 * @param msg		String message to send.
+	 */
+	void Queue(const std::string &msg);
+
+	/**
+	 * @brief Queue data to be sent with the next Flush.
+	 *
+	 * @param msg		Vector with data to send.
+	 */
+	void Queue(const std::vector<char> &msg);
+
+	/**
+	 * @brief Send all queued data.
+	 */
+	void Flush();
+
+	/**
+	 * @brief Get amount of queued bytes not sent yet.
+	 *
+	 * @return Number of bytes.
+	 */
+	size_t GetPending() const;
+
 	/**
 	 * @brief Read data from server.
 	 *
@@ -232,9 +1041,23 @@ public:
 	 */
 	size_t Read(char *dst, size_t max_size = 1500);
 
+	/**
+	 * @brief Read exact amount of bytes from stream.
+	 *
+	 * Used to collect replies to pipelined requests which may arrive
+	 * split or merged. Throws if connection is closed earlier.
+	 *
+	 * @param dst		Pointer to the buffer to read data to.
+	 * @param size		Amount of bytes to read.
+	 */
+	void ReadExact(char *dst, size_t size);
+
 	/**
 	 * @brief Read data from server.
 	 *
+	 * Data is read straight into the string, so a string reused across
+	 * calls keeps its storage.
+	 *
 	 * @param out_str	String to store read data.
 	 * @param max_size	Amount of bytes to read;
 	 * @return		Amount of bytes read.
@@ -261,8 +1084,121 @@ public:
 	 * @brief Terminate current connection.
 	 */
 	void Close();
+
+	/**
+	 * @brief Shut connection down, socket stays open.
+	 *
+	 * Reads blocked in other threads return, unlike Close() it is safe
+	 * while another thread uses the client.
+	 */
+	void Shutdown();
+
+	/**
+	 * @brief Check if connection is open.
+	 *
+	 * @return True if socket is open.
+	 */
+	bool IsOpen() const;
 private:
-	int _sockfd;
+	friend class ClientPool;
+	int _sockfd = -1;
+	ServerBase::Protocol _protocol = ServerBase::Protocol::TCP;
+	std::vector<char> _out;
+	std::vector<size_t> _lengths;
+	std::vector<struct iovec> _iov;
+	std::unique_ptr<ZeroCopyTracker> _zerocopy;
+
+	bool IsStale() const;
+	bool IsDatagram() const;
+	void Write(struct iovec *iov, size_t count);
+	void SendDatagrams();
+};
+
+/**
+ * Pool of idle client connections keyed by endpoint.
+ *
+ * Connections are taken with Acquire and returned to the pool when the
+ * lease goes out of scope, so requests to the same server skip connect.
+ * Idle connections closed by the server or holding unread data are
+ * dropped on the next Acquire. Pool must outlive its leases.
+ */
+class ClientPool
+{
+public:
+	class Lease
+	{
+	public:
+		Lease() = default;
+		~Lease();
+
+		Lease(const Lease &) = delete;
+		Lease &operator=(const Lease &) = delete;
+		Lease(Lease &&other) noexcept;
+		Lease &operator=(Lease &&other) noexcept;
+
+		Client *operator->() const { return _client.get(); }
+		Client &operator*() const { return *_client; }
+
+		/**
+		 * @brief Close connection instead of returning it to the pool.
+		 *
+		 * Should be called once the connection state is unknown,
+		 * e.g. after a failed request.
+		 */
+		void Discard();
+
+		/**
+		 * @brief Return connection to the pool now.
+		 *
+		 * Queued data is flushed first, connection is closed if
+		 * that fails.
+		 */
+		void Release();
+	private:
+		friend class ClientPool;
+		Lease(ClientPool *pool, const std::string &key, std::unique_ptr<Client> client)
+			: _pool(pool), _key(key), _client(std::move(client)) {}
+
+		ClientPool *_pool = nullptr;
+		std::string _key;
+		std::unique_ptr<Client> _client;
+	};
+
+	/**
+	 * @brief Constructor of ClientPool class.
+	 *
+	 * @param max_idle	Maximum idle connections kept per endpoint.
+	 */
+	explicit ClientPool(size_t max_idle = 8) : _max_idle(max_idle) {}
+
+	/**
+	 * @brief Take idle connection to the server or open a new one.
+	 *
+	 * @param ip		IP address of server, socket path for Unix protocols.
+	 * @param port		Port number of server, ignored for Unix protocols.
+	 * @param protocol	Protocol type [default = TCP].
+	 * @return		Lease of connected client.
+	 */
+	Lease Acquire(const std::string &ip, uint16_t port,
+		      ServerBase::Protocol protocol = ServerBase::Protocol::TCP);
+
+	/**
+	 * @brief Get number of idle connections in the pool.
+	 *
+	 * @return Number of connections.
+	 */
+	size_t GetIdle() const;
+
+	/**
+	 * @brief Close all idle connections.
+	 */
+	void Clear();
+private:
+	void Put(const std::string &key, std::unique_ptr<Client> client);
+
+	const size_t _max_idle;
+	mutable std::mutex _lock;
+	std::unordered_map<std::string, std::vector<std::unique_ptr<Client>>> _idle;
 };
 
 } /* namespace Network */
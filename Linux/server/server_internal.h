@@ -0,0 +1,1222 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * C++ Posix server internals shared by event loop implementations.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#ifndef __SERVER_INTERNAL_H__
+#define __SERVER_INTERNAL_H__
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include "server.h"
+
+#ifndef UDP_BATCH_SIZE
+#define UDP_BATCH_SIZE			32
+#endif
+
+#ifndef BUFFER_POOL_MEMORY
+#define BUFFER_POOL_MEMORY		(16 * 1024 * 1024)
+#endif
+
+#ifndef SEND_IOV_MAX
+#define SEND_IOV_MAX			16
+#endif
+
+#ifndef TIMER_TICK_MS
+#define TIMER_TICK_MS			10
+#endif
+
+#ifndef CLIENT_COALESCE_MAX
+#define CLIENT_COALESCE_MAX		(64 * 1024)
+#endif
+
+#ifndef CLIENT_MMSG_MAX
+#define CLIENT_MMSG_MAX			64
+#endif
+
+#ifndef ZEROCOPY_MIN
+#define ZEROCOPY_MIN			(16 * 1024)
+#endif
+
+#ifndef SENDFILE_CHUNK
+#define SENDFILE_CHUNK			(256 * 1024)
+#endif
+
+#ifndef RATE_SOURCES_MAX
+#define RATE_SOURCES_MAX		4096
+#endif
+
+namespace Network {
+
+/**
+ * Socket address of any family, filled by accept() and friends.
+ */
+struct PeerAddress
+{
+	struct sockaddr_storage addr = {};
+	socklen_t len = sizeof(addr);
+
+	struct sockaddr *Get() { return reinterpret_cast<struct sockaddr *>(&addr); }
+
+	/** IPv4 address, zeroed for other families. */
+	struct sockaddr_in Inet() const;
+
+	/** Address as text, see MessageBase::GetPeerName(). */
+	std::string Name() const;
+};
+
+/**
+ * Size-classed pool of receive buffers shared by connections of a server.
+ *
+ * Sizes are rounded up to a power of two, freed buffers are kept per class
+ * up to a memory limit and the rest is given back to the allocator.
+ */
+class BufferPool
+{
+public:
+	/**
+	 * Buffer borrowed from the pool, returned on destruction.
+	 */
+	class Buffer
+	{
+	public:
+		Buffer() = default;
+		Buffer(Buffer &&other) noexcept;
+		Buffer &operator=(Buffer &&other) noexcept;
+		~Buffer() { Reset(); }
+
+		char *GetData() const { return _data; }
+		size_t GetSize() const { return _size; }
+		explicit operator bool() const { return _data != nullptr; }
+
+		/** Give buffer back to the pool. */
+		void Reset();
+	private:
+		friend class BufferPool;
+		Buffer(BufferPool *pool, char *data, size_t size)
+			: _pool(pool), _data(data), _size(size) {}
+
+		BufferPool *_pool = nullptr;
+		char *_data = nullptr;
+		size_t _size = 0;
+	};
+
+	/**
+	 * @brief Constructor of BufferPool class.
+	 *
+	 * @param cache_limit	Maximum amount of bytes kept in free buffers.
+	 */
+	explicit BufferPool(size_t cache_limit = BUFFER_POOL_MEMORY);
+	~BufferPool();
+
+	/**
+	 * @brief Borrow buffer of at least given size.
+	 *
+	 * @param size		Required size.
+	 * @return Buffer, size is rounded up to the size class.
+	 */
+	Buffer Acquire(size_t size);
+
+	/**
+	 * @brief Get pool statistics.
+	 */
+	ServerBase::BufferStats GetStats() const;
+private:
+	void Release(char *data, size_t size);
+
+	mutable std::mutex _lock;
+	std::vector<std::vector<char *>> _free;
+	size_t _cache_limit;
+	size_t _cached = 0;
+	size_t _in_use = 0;
+	ServerBase::BufferStats _stats = {};
+};
+
+/**
+ * Datagrams received by one recvmmsg() call and replies queued to them.
+ *
+ * Replies are copied aside and sent with sendmmsg() once the batch is
+ * handled. Not thread safe, every receiving thread owns its batch.
+ */
+class DatagramBatch
+{
+public:
+	/**
+	 * @brief Constructor of DatagramBatch class.
+	 *
+	 * @param sockfd	UDP socket to receive from and reply to.
+	 * @param msg_size	Maximum datagram size.
+	 * @param count		Maximum amount of datagrams per batch.
+	 * @param limiter	Rate limiter dropping datagrams, nullptr if none.
+	 */
+	DatagramBatch(int sockfd, size_t msg_size, size_t count = UDP_BATCH_SIZE,
+		      RateLimiter *limiter = nullptr);
+
+	/**
+	 * @brief Receive datagrams into own buffers.
+	 *
+	 * @param flags		recvmmsg() flags, MSG_WAITFORONE blocks for first one.
+	 * @return Amount of received datagrams, -1 on error.
+	 */
+	int Receive(int flags);
+
+	/**
+	 * @brief Add datagram stored elsewhere, it has to outlive Dispatch().
+	 *
+	 * Datagram over rate limit is dropped.
+	 *
+	 * @param data		Pointer to received data.
+	 * @param size		Size of received data.
+	 * @param peer		Address of datagram sender.
+	 * @param peer_len	Size of sender address.
+	 * @param cred		Sender credentials, nullptr if not passed.
+	 */
+	void Add(char *data, size_t size, const struct sockaddr *peer, socklen_t peer_len,
+		 const struct ucred *cred = nullptr);
+
+	/**
+	 * @brief Find sender credentials in control data of received message.
+	 *
+	 * @param msg		Received message header.
+	 * @return Credentials, nullptr if none are passed.
+	 */
+	static const struct ucred *Credentials(const struct msghdr &msg);
+
+	/**
+	 * @brief Pass collected datagrams to the server and send replies.
+	 *
+	 * @param server	Server to handle datagrams.
+	 */
+	void Dispatch(ServerBase &server);
+
+	/**
+	 * @brief Queue reply to the datagram sender.
+	 *
+	 * @param peer		Address to send reply to.
+	 * @param peer_len	Size of the address.
+	 * @param src		Pointer to the buffer to send.
+	 * @param size		Amount of bytes to send.
+	 */
+	void Queue(const struct sockaddr_storage &peer, socklen_t peer_len,
+		   const char *src, size_t size);
+
+	/** Amount of datagrams waiting for Dispatch(). */
+	size_t Pending() const { return _messages.size(); }
+private:
+	void Flush();
+
+	int _sockfd;
+	size_t _msg_size;
+	size_t _count;
+	RateLimiter *_limiter;
+	std::unique_ptr<char[]> _buffers;
+	std::vector<struct mmsghdr> _hdrs;
+	std::vector<struct iovec> _iovs;
+	std::vector<struct sockaddr_storage> _addrs;
+	std::vector<MessageBase> _messages;
+
+	/* Unix datagram sockets pass sender credentials with every datagram */
+	union Control
+	{
+		struct cmsghdr hdr;
+		char data[CMSG_SPACE(sizeof(struct ucred))];
+	};
+	bool _credentials = false;
+	std::vector<Control> _controls;
+
+	/* Queued replies, data is kept in one buffer */
+	struct Reply
+	{
+		struct sockaddr_storage peer;
+		socklen_t peer_len;
+		size_t offset;
+		size_t size;
+	};
+	std::vector<char> _out;
+	std::vector<Reply> _replies;
+};
+
+/**
+ * Reassembles frames of one TCP stream in a ring buffer.
+ *
+ * Socket data is read straight into the ring and frames are handed out as
+ * views into it. Only a frame wrapping around the end of the ring is copied
+ * to a linear buffer. Data received elsewhere is framed in place while the
+ * ring is empty, the incomplete rest is copied in.
+ */
+class FrameReader
+{
+public:
+	/**
+	 * @brief Constructor of FrameReader class.
+	 *
+	 * @param framer	Framer splitting the stream.
+	 * @param capacity	Ring size, limits size of a frame.
+	 * @param pool		Pool to borrow ring from while data is buffered.
+	 */
+	FrameReader(const Framer &framer, size_t capacity, BufferPool &pool);
+
+	/**
+	 * @brief Get free space of the ring to read socket data into.
+	 *
+	 * @param iov		Free regions, up to two.
+	 * @return Amount of regions filled.
+	 */
+	int Space(struct iovec iov[2]);
+
+	/**
+	 * @brief Account data written to regions given by Space().
+	 *
+	 * @param size		Amount of bytes written.
+	 */
+	void Commit(size_t size);
+
+	/**
+	 * @brief Take data stored outside of the ring.
+	 *
+	 * Data has to stay valid until Next() returns false.
+	 *
+	 * @param data		Pointer to received data.
+	 * @param size		Size of received data.
+	 */
+	void Feed(char *data, size_t size);
+
+	/**
+	 * @brief Get next complete frame.
+	 *
+	 * Frame stays valid until next call. Throws std::runtime_error if
+	 * stream is malformed or frame does not fit into the ring.
+	 *
+	 * @param data		Pointer to frame payload.
+	 * @param size		Size of frame payload.
+	 * @return True if frame is returned, false if more data is needed.
+	 */
+	bool Next(char *&data, size_t &size);
+
+	/**
+	 * @brief Give buffers back to the pool if nothing is buffered.
+	 */
+	void Release();
+
+	/**
+	 * @brief Check if no partial frame is buffered.
+	 */
+	bool Empty() const { return !_size && !_ext_size; }
+private:
+	void Consume();
+	size_t Append(const char *src, size_t size);
+
+	const Framer &_framer;
+	size_t _capacity;
+	BufferPool &_pool;
+	BufferPool::Buffer _buffer;
+	BufferPool::Buffer _linear;
+	size_t _head = 0;
+	size_t _size = 0;
+	size_t _consume = 0;
+	char *_ext = nullptr;
+	size_t _ext_size = 0;
+};
+
+/**
+ * Fixed size table of connected TCP clients.
+ *
+ * Free slots form a lock-free stack, accepting and disconnecting clients
+ * never contend on a lock. Slot metadata is kept in atomics guarded by a
+ * sequence counter, so any thread can read it while the client is served.
+ */
+class ClientTable
+{
+public:
+	struct Slot
+	{
+		size_t index;
+		std::atomic<int> fd { -1 };
+		std::atomic<uint32_t> addr { 0 };
+		std::atomic<uint16_t> port { 0 };
+		std::atomic<int64_t> connected { 0 };
+		std::atomic<uint64_t> bytes_in { 0 };
+		std::atomic<uint64_t> bytes_out { 0 };
+
+		/* Odd while the slot is being taken or released */
+		std::atomic<uint32_t> seq { 0 };
+		/* Live flag and amount of threads using the socket from outside */
+		std::atomic<uint32_t> state { 0 };
+		/* Next free slot */
+		std::atomic<uint32_t> next { 0 };
+		/* Context of event loop client, used by the loop thread only */
+		ClientContext *context = nullptr;
+	};
+
+	/**
+	 * @brief Constructor of ClientTable class.
+	 *
+	 * @param capacity	Maximum amount of clients.
+	 */
+	explicit ClientTable(size_t capacity);
+
+	/**
+	 * @brief Take free slot for connected client.
+	 *
+	 * @param fd		Client socket.
+	 * @param peer		Client address.
+	 * @return Slot, nullptr if the table is full.
+	 */
+	Slot *Acquire(int fd, const struct sockaddr_in &peer);
+
+	/**
+	 * @brief Free slot of disconnected client.
+	 *
+	 * Has to be called before the socket is closed, waits for Shutdown()
+	 * to finish with it.
+	 *
+	 * @param slot		Slot taken by Acquire().
+	 */
+	void Release(Slot *slot);
+
+	/**
+	 * @brief Shut sockets of all clients down.
+	 */
+	void Shutdown();
+
+	/**
+	 * @brief Read client metadata.
+	 *
+	 * @param index		Slot index.
+	 * @param info		Client information.
+	 * @return False if the slot is free.
+	 */
+	bool Read(size_t index, ServerBase::ClientInfo &info) const;
+
+	/**
+	 * @brief Get slot if it still holds the same connection.
+	 *
+	 * Result is stable only on the thread releasing the slot.
+	 *
+	 * @param index		Slot index.
+	 * @param seq		Sequence read while the connection was live.
+	 * @return Slot, nullptr if the client disconnected.
+	 */
+	Slot *Find(size_t index, uint32_t seq);
+
+	/**
+	 * @brief Keep socket of the connection open from another thread.
+	 *
+	 * Release() waits for Unpin(), so the pin has to be short.
+	 *
+	 * @param index		Slot index.
+	 * @param seq		Sequence read while the connection was live.
+	 * @return Client socket, -1 if the client disconnected.
+	 */
+	int Pin(size_t index, uint32_t seq);
+
+	/**
+	 * @brief Drop pin taken by successful Pin().
+	 *
+	 * @param index		Slot index.
+	 */
+	void Unpin(size_t index);
+
+	size_t Capacity() const { return _capacity; }
+	size_t Size() const { return _size.load(std::memory_order_relaxed); }
+private:
+	static const uint32_t LIVE = 1;
+	static const uint32_t PIN = 2;
+	static const uint32_t NIL = UINT32_MAX;
+
+	void Push(uint32_t index);
+
+	size_t _capacity;
+	std::unique_ptr<Slot[]> _slots;
+	/* Top of free stack in low half, ABA tag in high half */
+	std::atomic<uint64_t> _free { NIL };
+	std::atomic<size_t> _size { 0 };
+};
+
+/**
+ * Hierarchical hashed timer wheel.
+ *
+ * Four levels of 64 slots cover about 46 hours with 10 ms ticks, longer
+ * timers are clamped and rearmed on the way. Timers are intrusive list
+ * nodes, arming, rearming and cancelling is O(1) without allocation.
+ * Not thread safe, every loop owns its wheel.
+ */
+class TimerWheel
+{
+public:
+	class Timer
+	{
+	public:
+		Timer() = default;
+		Timer(const Timer &) = delete;
+		Timer &operator=(const Timer &) = delete;
+		~Timer() { if (_wheel) _wheel->Cancel(*this); }
+
+		bool Armed() const { return _wheel != nullptr; }
+	private:
+		friend class TimerWheel;
+		TimerWheel *_wheel = nullptr;
+		Timer *_next = nullptr;
+		Timer **_pprev = nullptr;
+		uint64_t _expires = 0;
+	};
+
+	/**
+	 * @brief Constructor of TimerWheel class.
+	 *
+	 * @param tick		Timer resolution.
+	 */
+	explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(TIMER_TICK_MS));
+	~TimerWheel();
+
+	/**
+	 * @brief Arm timer, pending one is rearmed.
+	 *
+	 * @param timer		Timer to arm.
+	 * @param delay		Time to expiry, rounded up to the tick.
+	 */
+	void Arm(Timer &timer, std::chrono::milliseconds delay);
+
+	/**
+	 * @brief Cancel timer if armed.
+	 */
+	void Cancel(Timer &timer);
+
+	/**
+	 * @brief Pop next expired timer.
+	 *
+	 * Timers may be armed and cancelled between calls.
+	 *
+	 * @return Expired timer, nullptr if none is left.
+	 */
+	Timer *Expire();
+
+	/**
+	 * @brief Get time to wait for next expiry.
+	 *
+	 * @return Milliseconds for poll(), -1 if no timer is armed.
+	 */
+	int Timeout() const;
+
+	size_t Size() const { return _count; }
+private:
+	static const unsigned LEVELS = 4;
+	static const unsigned SLOT_BITS = 6;
+	static const unsigned SLOTS = 1 << SLOT_BITS;
+
+	uint64_t Now() const;
+	void Insert(Timer &timer);
+	void Unlink(Timer &timer);
+
+	std::chrono::steady_clock::time_point _start;
+	std::chrono::milliseconds _tick;
+	uint64_t _now = 0;
+	size_t _count = 0;
+	Timer *_slots[LEVELS][SLOTS] = {};
+};
+
+/**
+ * Completion tracking of MSG_ZEROCOPY sends of one socket.
+ *
+ * Kernel numbers every zero-copy send call and reports ranges of finished
+ * calls on the socket error queue. Buffers are held until every call made
+ * before they were handed over is finished.
+ */
+class ZeroCopyTracker
+{
+public:
+	ZeroCopyTracker() = default;
+	ZeroCopyTracker(const ZeroCopyTracker &) = delete;
+	ZeroCopyTracker &operator=(const ZeroCopyTracker &) = delete;
+	~ZeroCopyTracker();
+
+	/**
+	 * @brief Enable SO_ZEROCOPY on the socket, tried once.
+	 *
+	 * @param fd		Socket to send from.
+	 * @return False if the socket does not support zero-copy sends.
+	 */
+	bool Enable(int fd);
+
+	/** Account one successful zero-copy send call. */
+	void Sent() { _next++; }
+
+	/**
+	 * @brief Release buffer once every send call made so far is finished.
+	 *
+	 * @param release	Function giving the buffer back, called at once if nothing is pending.
+	 */
+	void Hold(std::function<void()> release);
+
+	/**
+	 * @brief Mark send calls as finished and release buffers not used anymore.
+	 *
+	 * @param lo		First finished call.
+	 * @param hi		Last finished call.
+	 */
+	void Complete(uint32_t lo, uint32_t hi);
+
+	/** Mark oldest pending call as finished, for engines reporting in order. */
+	void Complete() { Complete(_done, _done); }
+
+	/**
+	 * @brief Read completions from the socket error queue.
+	 *
+	 * @param fd		Socket to read from.
+	 * @return False if the queue holds a real socket error.
+	 */
+	bool Reap(int fd);
+
+	bool Pending() const { return _done != _next; }
+private:
+	int _enabled = -1;
+	uint32_t _next = 0;
+	/* Every call below is finished */
+	uint32_t _done = 0;
+	/* Ranges finished ahead of older calls */
+	std::vector<std::pair<uint32_t, uint32_t>> _early;
+	std::deque<std::pair<uint32_t, std::function<void()>>> _held;
+};
+
+/**
+ * Outbound data of one connection waiting for the socket to drain.
+ *
+ * Every queued reply is kept in own chunk, chunks are not moved once
+ * queued so they may be referenced by requests in flight. Besides copied
+ * data a chunk may reference caller memory sent without copy or a region
+ * of a file sent with sendfile().
+ */
+class SendQueue
+{
+public:
+	enum Kind { COPY, ZEROCOPY, FILE_REGION };
+
+	SendQueue() = default;
+	SendQueue(const SendQueue &) = delete;
+	SendQueue &operator=(const SendQueue &) = delete;
+	~SendQueue() { Clear(); }
+
+	/**
+	 * @brief Copy data to the end of the queue.
+	 *
+	 * @param src		Pointer to the buffer to queue.
+	 * @param size		Amount of bytes to queue.
+	 */
+	void Push(const char *src, size_t size);
+
+	/**
+	 * @brief Queue caller buffer without copy.
+	 *
+	 * @param src		Pointer to the buffer to queue.
+	 * @param size		Amount of bytes to queue.
+	 * @param release	Function giving the buffer back once it is sent.
+	 */
+	void PushZeroCopy(const char *src, size_t size, std::function<void()> release);
+
+	/**
+	 * @brief Queue region of a file, descriptor is duplicated.
+	 *
+	 * Throws std::runtime_error if descriptor can not be duplicated.
+	 *
+	 * @param fd		File to send from.
+	 * @param offset	Offset of the region in the file.
+	 * @param size		Size of the region.
+	 */
+	void PushFile(int fd, off_t offset, size_t size);
+
+	/** Kind of the first chunk, queue must not be empty. */
+	Kind Front() const { return _chunks.front().kind; }
+
+	/**
+	 * @brief Get leading memory chunks of the same kind for writev().
+	 *
+	 * @param iov		Regions to fill.
+	 * @param max		Maximum amount of regions.
+	 * @return Amount of regions filled, zero if a file comes first.
+	 */
+	int Peek(struct iovec *iov, int max) const;
+
+	/**
+	 * @brief Get file region queued first for sendfile().
+	 *
+	 * @param fd		File descriptor.
+	 * @param offset	Offset of data left.
+	 * @param size		Amount of bytes left.
+	 * @return False if memory comes first.
+	 */
+	bool PeekFile(int &fd, off_t &offset, size_t &size) const;
+
+	/**
+	 * @brief Drop data written to the socket.
+	 *
+	 * @param size		Amount of bytes written.
+	 * @param zerocopy	Tracker to hold zero-copy buffers sent by MSG_ZEROCOPY,
+	 *			nullptr if they were copied and are released at once.
+	 */
+	void Pop(size_t size, ZeroCopyTracker *zerocopy = nullptr);
+
+	/** Drop everything queued. */
+	void Clear();
+
+	size_t Size() const { return _size; }
+	bool Empty() const { return _chunks.empty(); }
+private:
+	struct Chunk
+	{
+		Kind kind;
+		std::vector<char> data;
+		const char *ptr;
+		size_t size;
+		std::function<void()> release;
+		int fd;
+		off_t offset;
+	};
+
+	static void Finish(Chunk &chunk, ZeroCopyTracker *zerocopy);
+
+	std::deque<Chunk> _chunks;
+	size_t _offset = 0;
+	size_t _size = 0;
+};
+
+/**
+ * Token bucket refilled at constant rate up to its depth.
+ *
+ * Balance may go below zero, stream read ahead of its budget waits until
+ * the debt is paid. Not thread safe.
+ */
+class TokenBucket
+{
+public:
+	/**
+	 * @brief Set rate and fill the bucket.
+	 *
+	 * @param rate		Tokens per second, zero is unlimited.
+	 * @param burst		Bucket depth, zero is one second worth.
+	 * @param now		Current time in seconds.
+	 */
+	void Configure(double rate, double burst, double now);
+
+	/**
+	 * @brief Take tokens, balance may go negative.
+	 *
+	 * @return Seconds until balance is back at zero.
+	 */
+	double Charge(double tokens, double now);
+
+	/**
+	 * @brief Check if tokens can be taken without debt.
+	 */
+	bool Has(double tokens, double now);
+
+	/**
+	 * @brief Check if bucket refilled to its depth.
+	 */
+	bool Full(double now);
+
+	bool Enabled() const { return _rate > 0; }
+private:
+	void Refill(double now);
+
+	double _rate = 0;
+	double _burst = 0;
+	double _tokens = 0;
+	double _stamp = 0;
+};
+
+/**
+ * Byte and message buckets of one rate limit.
+ */
+struct RateBuckets
+{
+	TokenBucket bytes;
+	TokenBucket messages;
+
+	void Configure(const ServerBase::RateLimit &limit, double now);
+	bool Enabled() const { return bytes.Enabled() || messages.Enabled(); }
+
+	/** Charge both buckets, seconds until both are out of debt. */
+	double Charge(size_t size, size_t count, double now);
+
+	/** Check if both buckets have tokens. */
+	bool Has(size_t size, size_t count, double now);
+};
+
+/**
+ * Rate limits of a server.
+ *
+ * Connection buckets are owned by the thread serving the connection,
+ * source and global ones are shared under a lock taken only if such
+ * limits are set. Sources beyond RATE_SOURCES_MAX are admitted only once
+ * idle ones refill and are forgotten, the table is swept for them at most
+ * once per refill time of a source bucket.
+ */
+class RateLimiter
+{
+public:
+	explicit RateLimiter(const ServerBase::RateLimit limits[3]);
+
+	/** Check if any of limits is set. */
+	static bool Enabled(const ServerBase::RateLimit limits[3]);
+
+	/** Current time in seconds. */
+	static double Now();
+
+	/**
+	 * @brief Fill buckets of new connection.
+	 */
+	void Attach(RateBuckets &connection);
+
+	/**
+	 * @brief Charge data read from a stream.
+	 *
+	 * @param connection	Buckets of the connection.
+	 * @param source	Source of the connection, see Source().
+	 * @param size		Bytes read.
+	 * @param count		Messages handed to the server.
+	 * @return Time to stop reading, zero to go on.
+	 */
+	std::chrono::milliseconds Charge(RateBuckets &connection, uint64_t source,
+					 size_t size, size_t count);
+
+	/**
+	 * @brief Take tokens for a datagram.
+	 *
+	 * @param source	Sender, see Source().
+	 * @param size		Datagram size.
+	 * @return False if datagram is dropped.
+	 */
+	bool Admit(uint64_t source, size_t size);
+
+	/**
+	 * @brief Get source key of IPv4 address or Unix peer.
+	 *
+	 * @param peer		Peer address, may be nullptr.
+	 * @param cred		Unix peer credentials, nullptr or zero pid if none.
+	 */
+	static uint64_t Source(const struct sockaddr *peer, const struct ucred *cred);
+
+	/** Count stream stopped by Charge(). */
+	void Throttled() { _throttled.fetch_add(1, std::memory_order_relaxed); }
+
+	ServerBase::RateStats GetStats() const;
+private:
+	RateBuckets *Find(uint64_t source, double now);
+
+	ServerBase::RateLimit _connection;
+	ServerBase::RateLimit _source;
+	bool _shared;
+	std::mutex _lock;
+	RateBuckets _global;
+	std::unordered_map<uint64_t, RateBuckets> _sources;
+	double _sweep_interval;
+	double _next_sweep = 0;
+	std::atomic<uint64_t> _throttled { 0 };
+	std::atomic<uint64_t> _dropped { 0 };
+	std::atomic<uint64_t> _dropped_bytes { 0 };
+};
+
+/**
+ * Per-client state owned by an event loop or a handler thread.
+ */
+struct ClientContext
+{
+	enum TimerKind { IDLE_TIMER, WRITE_TIMER, USER_TIMER, THROTTLE_TIMER, TIMERS };
+
+	struct Timer final: TimerWheel::Timer
+	{
+		ClientContext *client;
+		TimerKind kind;
+	};
+
+	ClientContext(int fd, EventLoop *loop);
+	virtual ~ClientContext() = default;
+
+	/** Data is received, restart idle timer. */
+	void Touch();
+
+	/** Read credentials of connected Unix domain peer. */
+	void ReadCredentials();
+
+	/** Queued data is written, write timer runs while anything is left. */
+	void Progress();
+
+	/** Stop reading until throttle timer expires, client is not idle meanwhile. */
+	void Throttle(std::chrono::milliseconds delay);
+
+	/** Throttle timer expired, read again. */
+	void Unthrottle();
+
+	/** Source of the client for rate limits. */
+	uint64_t RateSource() const;
+
+	int fd;
+	EventLoop *loop;
+	ServerBase *server = nullptr;
+
+	/* Timers are served by the thread owning the client, zero timeout is off */
+	TimerWheel *wheel = nullptr;
+	Timer timers[TIMERS];
+	std::chrono::milliseconds idle_timeout { 0 };
+	std::chrono::milliseconds write_timeout { 0 };
+
+	/* Connection table entry */
+	ClientTable::Slot *slot = nullptr;
+
+	/* Unix domain peer, pid is zero for other sockets */
+	struct ucred cred = {};
+
+	/* Connection rate limit, messages handed to OnReceive since last charge */
+	RateBuckets rate;
+	size_t received = 0;
+	bool throttled = false;
+
+	/* Set if server frames the stream */
+	std::unique_ptr<FrameReader> reader;
+
+	/* Replies not written yet, reading is paused above high watermark */
+	SendQueue out;
+	bool paused = false;
+
+	/* Buffers sent by MSG_ZEROCOPY waiting for the kernel */
+	ZeroCopyTracker zerocopy;
+};
+
+/**
+ * Base class of event loop engines.
+ *
+ * Every loop runs in its own thread and serves clients accepted from the
+ * shared listening socket. Derived classes have to call Stop() in their
+ * destructor, the base one can not wake up the loop anymore.
+ */
+class EventLoop
+{
+public:
+	EventLoop(ServerBase &server, int listenfd)
+		: server(server), _listenfd(listenfd) {}
+	virtual ~EventLoop() = default;
+
+	/**
+	 * @brief Start loop thread.
+	 *
+	 * @param cpu		CPU to pin loop thread to, -1 to not pin.
+	 */
+	void Start(int cpu = -1);
+
+	/**
+	 * @brief Start serving loop by threads of the group.
+	 *
+	 * Loop having no descriptor to poll starts own thread instead.
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param group		Group to serve the loop.
+	 */
+	void Start(LoopGroup &group);
+
+	/**
+	 * @brief Stop loop thread or leave the group. Clients left are disconnected.
+	 */
+	void Stop();
+
+	/**
+	 * @brief Serve what is ready without blocking.
+	 *
+	 * Called by group threads, one at a time.
+	 */
+	virtual void Poll() {}
+
+	/**
+	 * @brief Send data to the client.
+	 *
+	 * Default implementation writes synchronously.
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param client	Client to send data to.
+	 * @param src		Pointer to the buffer to send.
+	 * @param size		Amount of bytes to send.
+	 */
+	virtual void Send(ClientContext &client, const char *src, size_t size);
+
+	/**
+	 * @brief Send region of a file to the client.
+	 *
+	 * Default implementation writes synchronously.
+	 * Throws std::runtime_error on error.
+	 *
+	 * @param client	Client to send data to.
+	 * @param fd		File to send from.
+	 * @param offset	Offset of the region in the file.
+	 * @param size		Size of the region.
+	 */
+	virtual void SendFile(ClientContext &client, int fd, off_t offset, size_t size);
+
+	/**
+	 * @brief Send buffer to the client without copy.
+	 *
+	 * Default implementation copies the buffer with Send() and
+	 * releases it at once, so do calls from other threads and small
+	 * buffers. Throws std::runtime_error on error, release is called
+	 * anyway.
+	 *
+	 * @param client	Client to send data to.
+	 * @param src		Pointer to the buffer to send.
+	 * @param size		Amount of bytes to send.
+	 * @param release	Function giving the buffer back once it is sent.
+	 */
+	virtual void SendZeroCopy(ClientContext &client, const char *src, size_t size,
+				  std::function<void()> release);
+
+	/**
+	 * @brief Run function on the loop thread.
+	 *
+	 * Functions run in order between event batches. Ones posted while
+	 * the loop stops run on the stopping thread once clients are gone.
+	 *
+	 * @param fn		Function to run.
+	 */
+	void Post(std::function<void()> fn);
+
+	/**
+	 * @brief Run function on the connection owned by this loop from any thread.
+	 *
+	 * Posted like Post(), function is stored as is, so one which fits in
+	 * std::function needs no heap memory once the queue has grown.
+	 *
+	 * @param slot		Connection table slot.
+	 * @param seq		Slot sequence of the connection.
+	 * @param fn		Function to run, nullptr is passed if client is gone.
+	 */
+	void Post(size_t slot, uint32_t seq, std::function<void(MessageBase *)> fn);
+
+	/**
+	 * @brief Run function on the connection owned by this loop.
+	 *
+	 * Must be called from the loop thread.
+	 *
+	 * @param slot		Connection table slot.
+	 * @param seq		Slot sequence of the connection.
+	 * @param fn		Function to run, nullptr is passed if client is gone.
+	 */
+	void RunOn(size_t slot, uint32_t seq, const std::function<void(MessageBase *)> &fn);
+
+	/**
+	 * @brief Stop taking clients or datagrams from listening socket.
+	 *
+	 * Called on the loop thread once listening socket is handed over,
+	 * clients connected are served until they leave.
+	 */
+	virtual void StopAccepting() = 0;
+
+	/**
+	 * @brief Serve client accepted by another process.
+	 *
+	 * Called on the loop thread, socket is closed if the loop stops.
+	 *
+	 * @param fd		Connected socket.
+	 */
+	virtual void Adopt(int fd) = 0;
+
+	/**
+	 * @brief Give idle clients away.
+	 *
+	 * Called on the loop thread. Clients with nothing buffered or queued
+	 * are unregistered without closing their sockets. Default
+	 * implementation keeps all clients.
+	 *
+	 * @param fds		Sockets given away are appended to.
+	 */
+	virtual void Release(std::vector<int> &fds) {}
+
+	/**
+	 * @brief Check if queued data of the client is below high watermark.
+	 */
+	bool IsWritable(const ClientContext &client) const
+	{
+		return client.out.Size() <= server._high_watermark;
+	}
+
+	/**
+	 * @brief Create event loop for requested mode.
+	 *
+	 * io_uring loop is replaced by epoll one if the kernel lacks support.
+	 *
+	 * @param server	Server to serve.
+	 * @param listenfd	Listening socket.
+	 * @param mode		Requested mode, updated to the one in use.
+	 * @return Pointer to created loop.
+	 */
+	static std::unique_ptr<EventLoop> Create(ServerBase &server, int listenfd,
+						 ServerBase::Mode &mode);
+protected:
+	friend class LoopGroup;
+
+	virtual void Run() = 0;
+	virtual void Wakeup() = 0;
+
+	/** Descriptor readable while loop has work, -1 if loop needs own thread. */
+	virtual int PollFd() { return -1; }
+
+	/** Disconnect clients left once loop has left the group. */
+	virtual void DisconnectAll() {}
+
+	/** Register new client, nullptr if connections limit is reached. */
+	ClientTable::Slot *AddClient(int fd, const PeerAddress &addr);
+
+	/** Unregister disconnected client, before its socket is closed. */
+	void RemoveClient(ClientContext *client);
+
+	/** Call OnConnect handler with peer address. */
+	void Connected(const PeerAddress &addr);
+
+	/** Call OnReceive handler, false if handler has thrown. */
+	bool Dispatch(ClientContext *client, char *data, size_t size);
+
+	/** Call OnReceive for every complete frame, false if client has to be dropped. */
+	bool DispatchFrames(ClientContext *client);
+
+	/** Queue data to the client, reading is paused above high watermark. */
+	void Enqueue(ClientContext &client, const char *src, size_t size);
+
+	/** Queue file region to the client. */
+	void EnqueueFile(ClientContext &client, int fd, off_t offset, size_t size);
+
+	/** Queue buffer to the client without copy. */
+	void EnqueueZeroCopy(ClientContext &client, const char *src, size_t size,
+			     std::function<void()> release);
+
+	/** Pause client above high watermark, start write timer if queue was empty. */
+	void Queued(ClientContext &client, bool idle);
+
+	/** Unpause client drained to low watermark and call OnWritable, false if handler has thrown. */
+	bool Drained(ClientContext *client);
+
+	/** Handle expired timers, clients timed out are dropped. */
+	void ExpireTimers();
+
+	/** Charge data read from the client, it is throttled over rate limit. */
+	void Admit(ClientContext *client, size_t size);
+
+	/** Run functions posted from other threads. */
+	void RunPosted();
+
+	/** Disconnect client whose timer expired. */
+	virtual void Drop(ClientContext *client) = 0;
+
+	/** Read again from client whose throttle timer expired. */
+	virtual void Resume(ClientContext *client) = 0;
+
+	/** Create client context, frame reader is attached if server has framer. */
+	template <typename T>
+	std::unique_ptr<T> NewClient(int fd, ClientTable::Slot *slot)
+	{
+		std::unique_ptr<T> client(new T(fd, this));
+		client->server = &server;
+		client->slot = slot;
+		if (slot)
+			slot->context = client.get();
+		client->wheel = &_timers;
+		client->idle_timeout = server._idle_timeout;
+		client->write_timeout = server._write_timeout;
+		client->Touch();
+		if (server.IsUnix())
+			client->ReadCredentials();
+		if (Limiter())
+			Limiter()->Attach(client->rate);
+		if (server._framer)
+			client->reader.reset(new FrameReader(*server._framer, MsgSize(), *server._pool));
+		return client;
+	}
+
+	/** Check if called by the thread serving the loop now. */
+	bool OnLoopThread() const { return std::this_thread::get_id() == _owner.load(std::memory_order_relaxed); }
+
+	size_t MsgSize() const { return server._msg_size; }
+	bool IsStream() const { return server.IsStream(); }
+	bool IsUnix() const { return server.IsUnix(); }
+	RateLimiter *Limiter() const { return server._socket->limiter.get(); }
+
+	ServerBase &server;
+	int _listenfd;
+	std::atomic<bool> _running { false };
+	std::thread _thread;
+	/* Thread serving the loop, own or the group one polling it */
+	std::atomic<std::thread::id> _owner;
+	/* Set while served by the group instead of own thread */
+	LoopGroup *_group = nullptr;
+	size_t _member = 0;
+	TimerWheel _timers;
+	/* Posted function, one for a connection has its slot */
+	struct Posted
+	{
+		std::function<void()> fn;
+		std::function<void(MessageBase *)> on_client;
+		size_t slot;
+		uint32_t seq;
+	};
+	std::mutex _post_lock;
+	std::vector<Posted> _posted;
+	/* Swapped with the queue to be run, both keep their capacity */
+	std::vector<Posted> _posted_run;
+};
+
+/**
+ * @brief Create epoll based event loop.
+ */
+std::unique_ptr<EventLoop> CreateEpollLoop(ServerBase &server, int listenfd);
+
+/**
+ * @brief Create io_uring based event loop.
+ *
+ * @return Pointer to created loop, nullptr if io_uring is not usable.
+ */
+std::unique_ptr<EventLoop> CreateUringLoop(ServerBase &server, int listenfd);
+
+} /* namespace Network */
+
+#endif /* __SERVER_INTERNAL_H__ */
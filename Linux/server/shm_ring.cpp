@@ -0,0 +1,388 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Shared memory ring transport of Posix server.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#include "shm_ring.h"
+#include "file_ops.h"
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdexcept>
+
+using namespace Network;
+
+#define SHM_RING_MAGIC			0x31474e49524d4853ULL	/* "SHMRING1" */
+#define SHM_RING_MIN			4096
+#define SHM_RING_ALIGN			8
+/* Record word, size in low bits */
+#define SHM_RING_COMMIT			0x80000000u
+#define SHM_RING_PAD			0x40000000u
+
+/* Shared by all processes, producers and consumer on own cache lines */
+struct ShmRing::Header {
+	uint64_t magic;
+	uint64_t capacity;
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+	std::atomic<uint32_t> waiting;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Ring needs lock free 64 bit atomics");
+
+#define SHM_RING_DATA			((sizeof(ShmRing::Header) + 63) & ~static_cast<size_t>(63))
+
+/* Keeps File::Mmap out of the header */
+struct ShmRing::Mapping {
+	Mapping(int fd, size_t size) : mmap(fd, size) {}
+	File::Mmap mmap;
+};
+
+static size_t align_record(size_t size)
+{
+	return SHM_RING_ALIGN + ((size + SHM_RING_ALIGN - 1) & ~static_cast<size_t>(SHM_RING_ALIGN - 1));
+}
+
+ShmRing::ShmRing(size_t capacity, bool single_producer)
+	: _single_producer(single_producer)
+{
+	size_t size = SHM_RING_MIN;
+	while (size < capacity)
+		size <<= 1;
+
+	_memfd = memfd_create("shm_ring", MFD_CLOEXEC);
+	if (_memfd < 0)
+		throw std::runtime_error(
+			"ShmRing::ShmRing: memfd create error: " + std::to_string(errno) + ": " + std::string(strerror(errno)));
+
+	if (ftruncate(_memfd, SHM_RING_DATA + size) < 0)
+	{
+		int err = errno;
+		close(_memfd);
+		throw std::runtime_error(
+			"ShmRing::ShmRing: memfd truncate error: " + std::to_string(err) + ": " + std::string(strerror(err)));
+	}
+
+	_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_eventfd < 0)
+	{
+		int err = errno;
+		close(_memfd);
+		throw std::runtime_error(
+			"ShmRing::ShmRing: eventfd create error: " + std::to_string(err) + ": " + std::string(strerror(err)));
+	}
+
+	Attach(true, size);
+}
+
+ShmRing::ShmRing(int memfd, int eventfd, bool single_producer)
+	: _single_producer(single_producer)
+{
+	_memfd = dup(memfd);
+	_eventfd = dup(eventfd);
+	struct stat st = {};
+	if (_memfd < 0 || _eventfd < 0 || fstat(_memfd, &st) < 0)
+	{
+		int err = errno;
+		if (_memfd >= 0)
+			close(_memfd);
+		if (_eventfd >= 0)
+			close(_eventfd);
+		throw std::runtime_error(
+			"ShmRing::ShmRing: attach error: " + std::to_string(err) + ": " + std::string(strerror(err)));
+	}
+
+	size_t size = static_cast<size_t>(st.st_size);
+	Attach(false, size > SHM_RING_DATA ? size - SHM_RING_DATA : 0);
+}
+
+ShmRing::~ShmRing()
+{
+	_map.reset();
+	close(_eventfd);
+	close(_memfd);
+}
+
+void ShmRing::Attach(bool created, size_t capacity)
+{
+	try
+	{
+		if (capacity < SHM_RING_MIN || (capacity & (capacity - 1)))
+			throw std::runtime_error("ShmRing::Attach: Not a ring");
+
+		_map.reset(new Mapping(_memfd, SHM_RING_DATA + capacity));
+	}
+	catch (...)
+	{
+		close(_eventfd);
+		close(_memfd);
+		throw;
+	}
+
+	/* New memfd is zero filled, atomics start cleared */
+	_header = _map->mmap.GetPtrAs<Header>();
+	_data = _map->mmap.GetPtrAs<char>() + SHM_RING_DATA;
+	_mask = capacity - 1;
+
+	if (created)
+	{
+		_header->capacity = capacity;
+		_header->magic = SHM_RING_MAGIC;
+	}
+	else if (_header->magic != SHM_RING_MAGIC || _header->capacity != capacity)
+	{
+		_map.reset();
+		close(_eventfd);
+		close(_memfd);
+		throw std::runtime_error("ShmRing::Attach: Not a ring");
+	}
+}
+
+static std::atomic<uint32_t> *record_word(char *data, uint64_t mask, uint64_t pos)
+{
+	return reinterpret_cast<std::atomic<uint32_t> *>(data + (pos & mask));
+}
+
+size_t ShmRing::GetMaxRecord() const
+{
+	/* Half of the ring always fits, even after padding to its end */
+	size_t max = (_mask + 1) / 2 - SHM_RING_ALIGN;
+	return max < SHM_RING_PAD ? max : SHM_RING_PAD - 1;
+}
+
+bool ShmRing::Write(const void *src, size_t size)
+{
+	if (size > GetMaxRecord())
+		return false;
+
+	uint64_t capacity = _mask + 1;
+	uint64_t need = align_record(size);
+	uint64_t head = _header->head.load(std::memory_order_relaxed);
+	uint64_t pos;
+	for (;;)
+	{
+		/* Record does not fit before the end, pad up to it and start over */
+		uint64_t room = capacity - (head & _mask);
+		pos = room < need ? head + room : head;
+
+		/* Acquire pairs with Release, cleared words are seen before reuse */
+		uint64_t tail = _header->tail.load(std::memory_order_acquire);
+		if (pos + need - tail > capacity)
+			return false;
+
+		if (_single_producer)
+		{
+			_header->head.store(pos + need, std::memory_order_relaxed);
+			break;
+		}
+
+		if (_header->head.compare_exchange_weak(head, pos + need, std::memory_order_relaxed))
+			break;
+	}
+
+	if (pos != head)
+		record_word(_data, _mask, head)->store(SHM_RING_COMMIT | SHM_RING_PAD, std::memory_order_release);
+
+	memcpy(_data + (pos & _mask) + SHM_RING_ALIGN, src, size);
+	record_word(_data, _mask, pos)->store(SHM_RING_COMMIT | static_cast<uint32_t>(size), std::memory_order_release);
+
+	/* Pairs with fence of Wait, either consumer sees record or producer sees it sleeping */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (_header->waiting.load(std::memory_order_relaxed) &&
+	    _header->waiting.exchange(0, std::memory_order_relaxed))
+	{
+		uint64_t value = 1;
+		ssize_t res = write(_eventfd, &value, sizeof(value));
+		(void)res;
+	}
+
+	return true;
+}
+
+size_t ShmRing::Peek(std::vector<Record> &records, size_t max_records)
+{
+	records.clear();
+
+	/* Records are committed in any order, batch stops at first missing one */
+	uint64_t pos = _header->tail.load(std::memory_order_relaxed);
+	uint64_t head = _header->head.load(std::memory_order_acquire);
+	while (pos < head && records.size() < max_records)
+	{
+		uint32_t word = record_word(_data, _mask, pos)->load(std::memory_order_acquire);
+		if (!(word & SHM_RING_COMMIT))
+			break;
+
+		uint64_t offset = pos & _mask;
+		if (word & SHM_RING_PAD)
+		{
+			pos += _mask + 1 - offset;
+			continue;
+		}
+
+		size_t size = word & ~(SHM_RING_COMMIT | SHM_RING_PAD);
+		records.push_back({ _data + offset + SHM_RING_ALIGN, size });
+		pos += align_record(size);
+	}
+
+	_peeked = pos;
+	return records.size();
+}
+
+void ShmRing::Release()
+{
+	uint64_t pos = _header->tail.load(std::memory_order_relaxed);
+	uint64_t end = _peeked;
+
+	/*
+	 * Clear whole spans, payload left behind would be taken for committed
+	 * words once records of the next lap are laid out differently
+	 */
+	while (pos != end)
+	{
+		auto word = record_word(_data, _mask, pos);
+		uint32_t value = word->load(std::memory_order_relaxed);
+		uint64_t offset = pos & _mask;
+		uint64_t span = value & SHM_RING_PAD ? _mask + 1 - offset :
+			align_record(value & ~(SHM_RING_COMMIT | SHM_RING_PAD));
+
+		memset(_data + offset + SHM_RING_ALIGN, 0, span - SHM_RING_ALIGN);
+		word->store(0, std::memory_order_relaxed);
+		pos += span;
+	}
+
+	_header->tail.store(end, std::memory_order_release);
+}
+
+bool ShmRing::Empty() const
+{
+	uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+	return tail == _header->head.load(std::memory_order_acquire) ||
+		!(record_word(_data, _mask, tail)->load(std::memory_order_acquire) & SHM_RING_COMMIT);
+}
+
+bool ShmRing::Wait(std::chrono::milliseconds timeout)
+{
+	_header->waiting.store(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (Empty())
+	{
+		struct pollfd pfd = { _eventfd, POLLIN, 0 };
+		poll(&pfd, 1, static_cast<int>(timeout.count()));
+
+		uint64_t value;
+		ssize_t res = read(_eventfd, &value, sizeof(value));
+		(void)res;
+	}
+
+	_header->waiting.store(0, std::memory_order_relaxed);
+	return !Empty();
+}
+
+ShmRingReader::ShmRingReader(ServerBase &server, std::shared_ptr<ShmRing> ring, size_t batch)
+	: _server(server), _ring(ring), _batch(batch ? batch : 1)
+{
+}
+
+ShmRingReader::~ShmRingReader()
+{
+	Stop();
+}
+
+void ShmRingReader::Start()
+{
+	if (_running.exchange(true))
+		return;
+
+	_thread = std::thread(&ShmRingReader::Run, this);
+}
+
+void ShmRingReader::Stop()
+{
+	if (!_running.exchange(false))
+		return;
+
+	/* Wake reader sleeping on empty ring */
+	uint64_t value = 1;
+	ssize_t res = write(_ring->GetEventFd(), &value, sizeof(value));
+	(void)res;
+
+	_thread.join();
+}
+
+void ShmRingReader::Run()
+{
+	std::vector<ShmRing::Record> records;
+	std::vector<MessageBase> msgs;
+
+	for (;;)
+	{
+		if (!_ring->Peek(records, _batch))
+		{
+			/* Written records are drained before leaving */
+			if (!_running)
+				break;
+			_ring->Wait(std::chrono::milliseconds(100));
+			continue;
+		}
+
+		/* Records have no socket to reply to */
+		msgs.clear();
+		for (auto &record : records)
+			msgs.emplace_back(-1, record.data, record.size);
+
+		try
+		{
+			_server.OnReceiveBatch(msgs);
+		}
+		catch (const std::exception &)
+		{
+			/* Nothing to drop, keep serving */
+		}
+
+		_ring->Release();
+		_batches++;
+	}
+}
@@ -0,0 +1,210 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Shared memory ring transport of Posix server.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#ifndef __SERVER_SHM_RING_H__
+#define __SERVER_SHM_RING_H__
+
+#include "server.h"
+
+namespace Network {
+
+/**
+ * Ring of variable size records in shared memory.
+ *
+ * Memory comes from memfd, wakeups go through eventfd, both may be
+ * passed to another process which attaches to the same ring. Any
+ * number of producers may write, one consumer reads records in place
+ * and releases them in batches. Producers write eventfd only when the
+ * consumer is about to sleep, so busy rings cost no system calls.
+ */
+class ShmRing
+{
+public:
+	/** Single record handed to the consumer, points into the ring */
+	struct Record {
+		char *data;
+		size_t size;
+	};
+
+	/**
+	 * @brief Create new ring.
+	 *
+	 * @param capacity		Ring size in bytes, rounded up to power of 2.
+	 * @param single_producer	Only one thread ever writes, skips atomic reservation.
+	 */
+	explicit ShmRing(size_t capacity = 1024 * 1024, bool single_producer = false);
+
+	/**
+	 * @brief Attach to ring created by another process.
+	 *
+	 * Descriptors are duplicated, caller keeps its own.
+	 *
+	 * @param memfd			Ring memory, see GetFd.
+	 * @param eventfd		Consumer wakeup, see GetEventFd.
+	 * @param single_producer	Only one thread ever writes, skips atomic reservation.
+	 */
+	ShmRing(int memfd, int eventfd, bool single_producer = false);
+
+	~ShmRing();
+
+	ShmRing(const ShmRing &) = delete;
+	ShmRing &operator=(const ShmRing &) = delete;
+
+	/**
+	 * @brief Write record to the ring.
+	 *
+	 * Never blocks, wakes the consumer if it waits.
+	 *
+	 * @param src			Record data.
+	 * @param size			Record size.
+	 *
+	 * @return False if ring has no room, record is dropped.
+	 */
+	bool Write(const void *src, size_t size);
+
+	/**
+	 * @brief Write string record to the ring.
+	 *
+	 * @param msg			Record data.
+	 *
+	 * @return False if ring has no room, record is dropped.
+	 */
+	bool Write(const std::string &msg) { return Write(msg.data(), msg.size()); }
+
+	/**
+	 * @brief Get committed records without copying them.
+	 *
+	 * Records stay valid until Release. Consumer side only.
+	 *
+	 * @param records		Filled with records, cleared first.
+	 * @param max_records		Largest batch to return.
+	 *
+	 * @return Number of records returned.
+	 */
+	size_t Peek(std::vector<Record> &records, size_t max_records = 64);
+
+	/**
+	 * @brief Give records returned by last Peek back to producers.
+	 */
+	void Release();
+
+	/**
+	 * @brief Sleep until records are written.
+	 *
+	 * @param timeout		Longest time to sleep.
+	 *
+	 * @return True if records are ready.
+	 */
+	bool Wait(std::chrono::milliseconds timeout);
+
+	/**
+	 * @brief Get largest record ring accepts.
+	 *
+	 * @return Size in bytes.
+	 */
+	size_t GetMaxRecord() const;
+
+	/** Descriptors to pass to other processes */
+	int GetFd() const { return _memfd; }
+	int GetEventFd() const { return _eventfd; }
+private:
+	struct Header;
+	struct Mapping;
+	void Attach(bool created, size_t capacity);
+	bool Empty() const;
+	std::unique_ptr<Mapping> _map;
+	Header *_header = nullptr;
+	char *_data = nullptr;
+	uint64_t _mask = 0;
+	uint64_t _peeked = 0;
+	int _memfd = -1;
+	int _eventfd = -1;
+	bool _single_producer;
+};
+
+/**
+ * Feed records of shared memory ring to server handlers.
+ *
+ * Reader thread hands every batch to ServerBase::OnReceiveBatch, so one
+ * server consumes sockets and rings alike. Records can not be replied
+ * to and have empty peer name. Handlers run on the reader thread.
+ */
+class ShmRingReader
+{
+public:
+	/**
+	 * @brief Constructor of ShmRingReader class.
+	 *
+	 * @param server		Server which handlers get records.
+	 * @param ring			Ring to consume, reader is its only consumer.
+	 * @param batch			Largest number of records per handler call.
+	 */
+	ShmRingReader(ServerBase &server, std::shared_ptr<ShmRing> ring, size_t batch = 64);
+	~ShmRingReader();
+
+	/** Start reader thread */
+	void Start();
+
+	/** Stop reader thread, records already written are handled first */
+	void Stop();
+
+	/**
+	 * @brief Get number of handler calls.
+	 *
+	 * @return Batches handled, compare to records to see batching.
+	 */
+	size_t GetBatches() const { return _batches; }
+private:
+	void Run();
+	ServerBase &_server;
+	std::shared_ptr<ShmRing> _ring;
+	size_t _batch;
+	std::thread _thread;
+	std::atomic<bool> _running { false };
+	std::atomic<size_t> _batches { 0 };
+};
+
+} /* namespace Network */
+
+#endif /* __SERVER_SHM_RING_H__ */
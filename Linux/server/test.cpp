@@ -2,7 +2,14 @@
 #include <cstring>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <dirent.h>
 #include "server.h"
+#include "coro.h"
+#include "shm_ring.h"
+#include "rpc.h"
+#include "broker.h"
+#include "file_ops.h"
 #include "rand.h"
 #include "utils.h"
 
@@ -67,34 +74,1461 @@ public:
 	}
 };
 
-std::vector<char> generate_data(size_t size)
+class Echo_ServerTest final: public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+	void OnReceive(MessageBase &msg) override
+	{
+		msg.Reply(msg.GetData(), msg.GetSize());
+	}
+};
+
+class Batch_ServerTest final: public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+	void OnReceive(MessageBase &msg) override {}
+
+	void OnReceiveBatch(std::vector<MessageBase> &msgs) override
+	{
+		batches++;
+		for (auto &msg : msgs)
+		{
+			msg.Reply(msg.GetData(), msg.GetSize());
+			datagrams++;
+		}
+	}
+
+	std::atomic<size_t> batches {0};
+	std::atomic<size_t> datagrams {0};
+};
+
+/* Frame n carries n % 40 + 1 bytes counting up from n, no line breaks */
+static char frame_byte(size_t n, size_t i)
+{
+	char c = static_cast<char>(n + i);
+	return c == '\r' || c == '\n' ? 0 : c;
+}
+
+class Frame_ServerTest final: public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+	void OnReceive(MessageBase &msg) override
+	{
+		size_t n = frames++;
+		bool ok = msg.GetSize() == n % 40 + 1;
+		for (size_t i = 0; ok && i != msg.GetSize(); i++)
+			ok = msg.GetData()[i] == frame_byte(n, i);
+		if (!ok)
+			errors++;
+	}
+
+	std::atomic<size_t> frames {0};
+	std::atomic<size_t> errors {0};
+};
+
+/* Streams stream_size bytes on "stream" request, echoes anything else */
+class Stream_ServerTest final: public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+	void OnReceive(MessageBase &msg) override
+	{
+		if (std::string(msg.GetData(), msg.GetSize()) != "stream")
+		{
+			msg.Reply(msg.GetData(), msg.GetSize());
+			return;
+		}
+		Produce(msg);
+	}
+
+	void OnWritable(MessageBase &msg) override
+	{
+		resumed++;
+		Produce(msg);
+	}
+
+	void Produce(MessageBase &msg)
+	{
+		char chunk[64 * 1024];
+
+		while (msg.IsWritable() && streamed != stream_size)
+		{
+			size_t size = std::min(sizeof(chunk), stream_size - streamed);
+			for (size_t i = 0; i != size; i++)
+				chunk[i] = static_cast<char>((streamed + i) % 251);
+			msg.Reply(chunk, size);
+			streamed += size;
+		}
+	}
+
+	const size_t stream_size = 32 * 1024 * 1024;
+	size_t streamed = 0;
+	std::atomic<size_t> resumed {0};
+};
+
+/* Replies with file region, zero-copy buffer and a copied tail on any request */
+class ZeroCopy_ServerTest final: public ServerBase
+{
+public:
+	ZeroCopy_ServerTest(File &file, size_t file_size, uint16_t port, Mode mode)
+		: ServerBase(port, 1500, 4, Protocol::TCP, mode), file(file), file_size(file_size),
+		  buffer(256 * 1024)
+	{
+		for (size_t i = 0; i != buffer.size(); i++)
+			buffer[i] = static_cast<char>(i % 253);
+	}
+
+	void OnReceive(MessageBase &msg) override
+	{
+		msg.ReplyFile(file, 0, file_size);
+		msg.ReplyZeroCopy(buffer.data(), buffer.size(), [this]() { released++; });
+		msg.Reply("end");
+	}
+
+	File &file;
+	size_t file_size;
+	std::vector<char> buffer;
+	std::atomic<size_t> released {0};
+};
+
+/* Replies with pid of the peer process as seen by the server */
+class Credentials_ServerTest final: public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+	void OnReceive(MessageBase &msg) override
+	{
+		struct ucred cred;
+		msg.Reply(msg.GetCredentials(cred) ? std::to_string(cred.pid) : "none");
+	}
+};
+
+/* Echoes TCP, sums numbered records handed over from shared memory ring */
+class Ring_ServerTest final: public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+	void OnReceive(MessageBase &msg) override
+	{
+		msg.Reply(msg.GetData(), msg.GetSize());
+	}
+
+	void OnReceiveBatch(std::vector<MessageBase> &msgs) override
+	{
+		batches++;
+		for (auto &msg : msgs)
+		{
+			sum += std::stoull(std::string(msg.GetData(), msg.GetSize()));
+			records++;
+		}
+	}
+
+	std::atomic<size_t> batches {0};
+	std::atomic<size_t> records {0};
+	std::atomic<uint64_t> sum {0};
+};
+
+/* Arms user timer on "timer" request and replies from it, echoes anything else */
+class Timer_ServerTest final: public ServerBase
+{
+public:
+	using ServerBase::ServerBase;
+	void OnReceive(MessageBase &msg) override
+	{
+		if (std::string(msg.GetData(), msg.GetSize()) == "timer")
+			msg.SetTimer(std::chrono::milliseconds(50));
+		else
+			msg.Reply(msg.GetData(), msg.GetSize());
+	}
+
+	void OnTimer(MessageBase &msg) override
+	{
+		msg.Reply("tick");
+	}
+};
+
+/* Replies with its tag followed by the request, tells which server answered */
+class Tag_ServerTest final: public ServerBase
+{
+public:
+	Tag_ServerTest(const std::string &tag, uint16_t port, Protocol protocol, Mode mode)
+		: ServerBase(port, 1500, 8, protocol, mode), tag(tag) {}
+
+	void OnReceive(MessageBase &msg) override
+	{
+		msg.Reply(tag + std::string(msg.GetData(), msg.GetSize()));
+	}
+
+	const std::string tag;
+};
+
+/*
+ * Echo over filesystem stream socket and abstract datagram socket,
+ * check peer credentials and that socket file is gone after stop.
+ */
+static bool check_unix(ServerBase::Mode mode, uint16_t port)
+{
+	const std::string path = "/tmp/server_test_" + std::to_string(port) + ".sock";
+	const std::string abstract = "@server_test_" + std::to_string(port);
+	const std::string pid = std::to_string(getpid());
+
+	bool stream;
+	{
+		Credentials_ServerTest server(path, 1500, 4, ServerBase::Protocol::UNIX_STREAM, mode);
+		server.Start();
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		Client first(path);
+		Client second(path, ServerBase::Protocol::UNIX_STREAM);
+		first.Send(message);
+		second.Send(message);
+		stream = first.ReadString() == pid && second.ReadString() == pid;
+		server.Stop();
+	}
+	bool removed = access(path.c_str(), F_OK) != 0;
+
+	bool dgram;
+	{
+		Credentials_ServerTest server(abstract, 1500, 4, ServerBase::Protocol::UNIX_DGRAM, mode);
+		server.Start();
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		Client client(abstract, ServerBase::Protocol::UNIX_DGRAM);
+		client.Send(message);
+		dgram = client.ReadString() == pid;
+		server.Stop();
+	}
+
+	std::cout << "[Unix] stream " << (stream ? "ok" : "failed") << ", datagram "
+		  << (dgram ? "ok" : "failed") << ", socket file " << (removed ? "removed" : "left")
+		  << std::endl;
+
+	return stream && dgram && removed;
+}
+
+/*
+ * Write numbered records from several producers attached to the ring by
+ * descriptors, as other processes would, while the same server echoes
+ * TCP. Every record is handled once and records arrive in batches.
+ */
+/*
+ * Wrap smallest ring many times with records laid out differently every
+ * lap. Payload is made of words reading as committed records, none of
+ * them may show up once the ring is drained.
+ */
+static bool check_shm_ring_wrap()
+{
+	const size_t sizes[] = { 1000, 1000, 1000, 1000, 100, 24, 1000 };
+	const uint32_t fake = 0x80000008u;
+
+	ShmRing ring(4096);
+	std::vector<ShmRing::Record> records;
+	for (size_t i = 0; i != 200; i++)
+	{
+		size_t size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+		std::vector<uint32_t> data(size / sizeof(uint32_t), fake);
+		data[0] = static_cast<uint32_t>(i);
+		if (!ring.Write(data.data(), size))
+			return false;
+
+		if (ring.Peek(records) != 1 || records[0].size != size ||
+		    memcmp(records[0].data, data.data(), size))
+			return false;
+		ring.Release();
+
+		if (ring.Peek(records))
+			return false;
+		ring.Release();
+	}
+
+	return true;
+}
+
+static bool check_shm_ring(ServerBase::Mode mode, uint16_t port)
+{
+	const size_t producers = 4;
+	const size_t count = 20000;
+	const size_t total = producers * count;
+
+	Ring_ServerTest server(port, 1500, 4, ServerBase::Protocol::TCP, mode);
+	server.Start();
+
+	auto ring = std::make_shared<ShmRing>(64 * 1024);
+	ShmRingReader reader(server, ring);
+	reader.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::vector<std::thread> threads;
+	for (size_t p = 0; p != producers; p++)
+	{
+		threads.emplace_back([&ring, p, count]() {
+			ShmRing attached(ring->GetFd(), ring->GetEventFd());
+			for (size_t i = 0; i != count; i++)
+			{
+				std::string record = std::to_string(p * count + i);
+				while (!attached.Write(record))
+					std::this_thread::yield();
+			}
+		});
+	}
+
+	bool echoed;
+	{
+		Client client("127.0.0.1", port, ServerBase::Protocol::TCP);
+		client.Send(message);
+		echoed = client.ReadString() == message;
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	for (int i = 0; i != 200 && server.records != total; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::vector<char> large(ring->GetMaxRecord() + 1);
+	bool rejected = !ring->Write(large.data(), large.size());
+
+	reader.Stop();
+	server.Stop();
+
+	bool wrapped = check_shm_ring_wrap();
+
+	std::cout << "[Shm ring] " << server.records << " records in " << server.batches
+		  << " batches, echo " << (echoed ? "ok" : "failed")
+		  << ", wrap " << (wrapped ? "ok" : "failed") << std::endl;
+
+	return server.records == total && server.sum == total * (total - 1) / 2 &&
+		server.batches < total && echoed && rejected && wrapped;
+}
+
+/*
+ * Flood a rate limited TCP server from one client while another one
+ * keeps pinging it, the flood is stretched and the pings stay fast.
+ * Flood is paced, io_uring takes a burst into its buffers at once.
+ * Datagrams over the source limit are dropped and counted.
+ */
+static bool check_rate_limit(ServerBase::Mode mode, uint16_t port)
+{
+	const size_t chunk = 1000;
+	const size_t chunks = 30;
+	const size_t datagrams = 50;
+
+	Echo_ServerTest server(port, 1500, 4, ServerBase::Protocol::TCP, mode);
+	server.SetRateLimit(ServerBase::RateScope::CONNECTION, { 100000, 0, 4000, 0 });
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	Client flooder("127.0.0.1", port, ServerBase::Protocol::TCP);
+	Client polite("127.0.0.1", port, ServerBase::Protocol::TCP);
+
+	bool flooded = false;
+	auto start = std::chrono::steady_clock::now();
+	std::chrono::milliseconds flood_time(0);
+	std::thread flood([&]() {
+		std::string data(chunk * chunks, 'f');
+		for (size_t i = 0; i != chunks; i++)
+		{
+			flooder.Send(data.data() + i * chunk, chunk);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		std::string reply(data.size(), 0);
+		flooder.ReadExact(&reply[0], reply.size());
+		flooded = reply == data;
+		flood_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - start);
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	bool pinged = true;
+	std::chrono::microseconds max_rtt(0);
+	for (int i = 0; i != 10; i++)
+	{
+		auto sent = std::chrono::steady_clock::now();
+		polite.Send(message);
+		pinged = pinged && polite.ReadString() == message;
+		max_rtt = std::max(max_rtt, std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - sent));
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	flood.join();
+	ServerBase::RateStats tcp = server.GetRateStats();
+	server.Stop();
+
+	Batch_ServerTest udp(port, 1500, 4, ServerBase::Protocol::UDP, mode);
+	udp.SetRateLimit(ServerBase::RateScope::SOURCE, { 0, 10, 0, 0 });
+	udp.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	Client sender("127.0.0.1", port, ServerBase::Protocol::UDP);
+	for (size_t i = 0; i != datagrams; i++)
+		sender.Send(message);
+
+	for (int i = 0; i != 100 && udp.datagrams + udp.GetRateStats().dropped != datagrams; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	ServerBase::RateStats stats = udp.GetRateStats();
+	size_t admitted = udp.datagrams;
+	udp.Stop();
+
+	std::cout << "[Rate limit] flood " << flood_time.count() << " ms, " << tcp.throttled
+		  << " throttles, ping max " << max_rtt.count() << " us, " << admitted
+		  << " datagrams admitted, " << stats.dropped << " dropped" << std::endl;
+
+	return flooded && pinged && tcp.throttled && flood_time >= std::chrono::milliseconds(200) &&
+		max_rtt < std::chrono::milliseconds(100) && admitted >= 10 && admitted <= 15 &&
+		admitted + stats.dropped == datagrams && stats.dropped_bytes == stats.dropped * message.size();
+}
+
+/*
+ * Hand listening sockets over to a second server as restarted process
+ * would while one client keeps requesting and others keep connecting.
+ * Nothing is refused or lost, new clients reach the new server, idle one
+ * follows in EPOLL mode and is drained by the old server otherwise. New
+ * server keeps serving once the old one stops, datagrams as well.
+ */
+static bool check_handoff(ServerBase::Mode mode, uint16_t port)
+{
+	const std::string path = "@server_handoff_" + std::to_string(port);
+	const std::string moved = mode == ServerBase::Mode::EPOLL ? "new" : "old";
+
+	Tag_ServerTest old_server("old:", port, ServerBase::Protocol::TCP, mode);
+	old_server.Start();
+	old_server.ServeHandoff(path, true);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	Client idle("127.0.0.1", port, ServerBase::Protocol::TCP);
+	idle.Send(message);
+	bool served = idle.ReadString() == "old:" + message;
+
+	std::atomic<bool> switched {false};
+	std::atomic<size_t> requests {0};
+	std::atomic<size_t> connections {0};
+	std::atomic<bool> lost {false};
+
+	std::thread busy([&]() {
+		Client client("127.0.0.1", port, ServerBase::Protocol::TCP);
+		for (size_t i = 0; !switched || i < 100; i++)
+		{
+			std::string request = "r" + std::to_string(i);
+			client.Send(request);
+			std::string reply = client.ReadString();
+			if (reply.size() < request.size() ||
+			    reply.compare(reply.size() - request.size(), request.size(), request))
+				lost = true;
+			requests++;
+		}
+	});
+
+	std::thread connector([&]() {
+		for (size_t i = 0; !switched || i < 20; i++)
+		{
+			try
+			{
+				Client client("127.0.0.1", port, ServerBase::Protocol::TCP);
+				client.Send(message);
+				std::string reply = client.ReadString();
+				if (reply != "old:" + message && reply != "new:" + message)
+					lost = true;
+			}
+			catch (const std::exception &)
+			{
+				lost = true;
+			}
+			connections++;
+		}
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	Tag_ServerTest new_server("new:", port, ServerBase::Protocol::TCP, mode);
+	new_server.TakeOver(path);
+	switched = true;
+
+	busy.join();
+	connector.join();
+
+	bool handed = old_server.IsHandedOff() && !new_server.IsHandedOff();
+
+	Client fresh("127.0.0.1", port, ServerBase::Protocol::TCP);
+	fresh.Send(message);
+	bool fresh_new = fresh.ReadString() == "new:" + message;
+
+	idle.Send(message);
+	bool idle_ok = idle.ReadString() == moved + ":" + message;
+
+	/* Shared sockets are not shut down by the old server */
+	old_server.Stop();
+
+	Client late("127.0.0.1", port, ServerBase::Protocol::TCP);
+	late.Send(message);
+	bool late_new = late.ReadString() == "new:" + message;
+	new_server.Stop();
+
+	Tag_ServerTest old_udp("old:", port, ServerBase::Protocol::UDP, mode);
+	old_udp.Start();
+	old_udp.ServeHandoff(path);
+
+	Tag_ServerTest new_udp("new:", port, ServerBase::Protocol::UDP, mode);
+	new_udp.TakeOver(path);
+	old_udp.Stop();
+
+	Client sender("127.0.0.1", port, ServerBase::Protocol::UDP);
+	sender.Send(message);
+	bool udp_new = sender.ReadString() == "new:" + message;
+	new_udp.Stop();
+
+	std::cout << "[Handoff] " << requests << " requests, " << connections
+		  << " connections across the switch" << (lost ? ", some lost" : "")
+		  << ", idle client served by " << (idle_ok ? moved : "none") << std::endl;
+
+	return served && !lost && handed && fresh_new && idle_ok && late_new && udp_new;
+}
+
+/*
+ * Call RPC server from several threads sharing one client while deferred
+ * calls stay pending, then answer those in reverse order. Unknown and
+ * failing methods report it, calls pending when server stops fail.
+ */
+static bool check_rpc(ServerBase::Mode mode, uint16_t port)
+{
+	const size_t threads = 4;
+	const size_t calls = 500;
+	const size_t deferred = 8;
+
+	std::mutex lock;
+	std::vector<std::pair<RpcReply, std::string>> later;
+
+	RpcServer server(port, 64 * 1024, 8, ServerBase::Protocol::TCP, mode);
+	server.Register(Hash("echo"), [](RpcRequest &request) {
+		request.Reply(request.GetData(), request.GetSize());
+	});
+	server.Register(Hash("later"), [&](RpcRequest &request) {
+		std::lock_guard<std::mutex> guard(lock);
+		later.emplace_back(request.Defer(), std::string(request.GetData(), request.GetSize()));
+	});
+	server.Register(Hash("fail"), [](RpcRequest &) {
+		throw std::runtime_error("failed on purpose");
+	});
+
+	bool duplicate = false;
+	try
+	{
+		server.Register(Hash("echo"), [](RpcRequest &) {});
+	}
+	catch (const std::runtime_error &)
+	{
+		duplicate = true;
+	}
+
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	RpcClient client("127.0.0.1", port);
+
+	std::mutex order_lock;
+	std::vector<std::string> order;
+	auto received = [&lock, &later]() {
+		std::lock_guard<std::mutex> guard(lock);
+		return later.size();
+	};
+	auto answered = [&order_lock, &order]() {
+		std::lock_guard<std::mutex> guard(order_lock);
+		return order.size();
+	};
+	for (size_t i = 0; i != deferred; i++)
+	{
+		std::string request = std::to_string(i);
+		client.Call(Hash("later"), request.data(), request.size(),
+			    [&order_lock, &order](RpcStatus status, const char *data, size_t size) {
+			std::lock_guard<std::mutex> guard(order_lock);
+			order.push_back(status == RpcStatus::OK ? std::string(data, size) : "failed");
+		});
+	}
+
+	std::atomic<bool> echoed {true};
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t != threads; t++)
+	{
+		workers.emplace_back([&client, &echoed, t, calls]() {
+			for (size_t i = 0; i != calls; i++)
+			{
+				std::string request = std::to_string(t) + ":" + std::to_string(i), response;
+				if (client.Call(Hash("echo"), request, response) != RpcStatus::OK || response != request)
+					echoed = false;
+			}
+		});
+	}
+
+	for (auto &worker : workers)
+		worker.join();
+
+	bool pending = client.GetPending() == deferred;
+
+	/* Deferred calls are answered from this thread, last one first */
+	for (int i = 0; i != 200 && received() != deferred; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto call = later.rbegin(); call != later.rend(); ++call)
+			call->first.Send(call->second);
+	}
+
+	for (int i = 0; i != 200 && answered() != deferred; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	bool reversed = answered() == deferred;
+	for (size_t i = 0; reversed && i != deferred; i++)
+		reversed = order[i] == std::to_string(deferred - 1 - i);
+
+	std::string response;
+	bool missing = client.Call(Hash("missing"), "", response) == RpcStatus::NO_METHOD;
+	bool failed = client.Call(Hash("fail"), "", response) == RpcStatus::FAILED &&
+		response == "failed on purpose";
+
+	/* Server stops with a call pending */
+	std::atomic<bool> disconnected {false};
+	client.Call(Hash("later"), "x", 1, [&disconnected](RpcStatus status, const char *, size_t) {
+		disconnected = status == RpcStatus::DISCONNECTED;
+	});
+	for (int i = 0; i != 200 && received() != deferred + 1; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	server.Stop();
+
+	for (int i = 0; i != 200 && !disconnected; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::cout << "[RPC] " << threads * calls << " calls from " << threads
+		  << " threads on one connection, deferred answered " << (reversed ? "in reverse order" : "wrong")
+		  << std::endl;
+
+	return duplicate && echoed && pending && reversed && missing && failed && disconnected;
+}
+
+/*
+ * Fan published messages out to two subscribers and to a multicast
+ * listener, each getting the topics it subscribed to only. In loop modes
+ * a subscriber not reading falls behind, the oldest queued messages are
+ * dropped then and the latest one still comes.
+ */
+static bool check_broker(ServerBase::Mode mode, uint16_t port)
+{
+	const size_t messages = 100;
+	const size_t bulk = 2000;
+
+	Broker broker(port, 64 * 1024, 8, ServerBase::Protocol::TCP, mode);
+	broker.EnableMulticast("239.255.0.1", port, 1, "127.0.0.1");
+	broker.SetWatermarks(64 * 1024, 16 * 1024);
+	broker.SetQueueLimit(128, DropPolicy::DROP_OLDEST);
+	broker.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	auto subscribed = [&broker](const std::string &topic, size_t count) {
+		for (int i = 0; i != 200 && broker.GetSubscribers(topic) != count; i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		return broker.GetSubscribers(topic) == count;
+	};
+
+	BrokerClient first("127.0.0.1", port), second("127.0.0.1", port), other("127.0.0.1", port);
+	MulticastSubscriber lan("239.255.0.1", port, "127.0.0.1");
+	lan.Subscribe("humidity");
+	first.Subscribe("temp");
+	second.Subscribe("temp");
+	other.Subscribe("humidity");
+	if (!subscribed("temp", 2) || !subscribed("humidity", 1))
+		return false;
+
+	/* Large one is written with MSG_ZEROCOPY in loop modes */
+	BrokerClient producer("127.0.0.1", port);
+	std::string large(32 * 1024, 'x');
+	for (size_t i = 0; i != messages; i++)
+		producer.Publish("temp", std::to_string(i));
+	producer.Publish("temp", large);
+	producer.Publish("humidity", "55");
+
+	bool delivered = true;
+	std::string topic, payload;
+	for (BrokerClient *client : { &first, &second })
+	{
+		for (size_t i = 0; i <= messages; i++)
+		{
+			client->Receive(topic, payload);
+			if (topic != "temp" || payload != (i == messages ? large : std::to_string(i)))
+				delivered = false;
+		}
+	}
+
+	other.Receive(topic, payload);
+	delivered = delivered && topic == "humidity" && payload == "55";
+
+	bool multicast = lan.Receive(topic, payload, std::chrono::milliseconds(1000)) &&
+		topic == "humidity" && payload == "55";
+
+	second.Unsubscribe("temp");
+	bool unsubscribed = subscribed("temp", 1) && broker.Publish("nobody", "", 0) == 0;
+
+	/* THREADED mode writes from the publisher, slow subscriber would stall it */
+	bool dropped = true;
+	if (mode != ServerBase::Mode::THREADED)
+	{
+		BrokerClient slow("127.0.0.1", port);
+		slow.Subscribe("bulk");
+		if (!subscribed("bulk", 1))
+			return false;
+
+		std::string chunk(16 * 1024, 'b');
+		for (size_t i = 0; i != bulk; i++)
+		{
+			std::string message = std::to_string(i) + ":" + chunk;
+			broker.Publish("bulk", message.data(), message.size());
+		}
+
+		dropped = broker.GetDropped() != 0;
+		size_t last = 0;
+		do
+		{
+			slow.Receive(topic, payload);
+			size_t seq = std::stoul(payload);
+			dropped = dropped && (seq > last || !last) && topic == "bulk";
+			last = seq;
+		} while (last != bulk - 1);
+	}
+
+	std::cout << "[Broker] " << messages + 1 << " messages to 2 subscribers and multicast "
+		  << (multicast ? "received" : "lost") << ", " << broker.GetDropped()
+		  << " dropped by slow subscriber" << std::endl;
+
+	return delivered && multicast && unsubscribed && dropped;
+}
+
+/*
+ * Ping-pong small messages from several clients at once and report
+ * wall clock throughput and average round trip time for given mode.
+ */
+static void compare_mode(const char *name, ServerBase::Mode mode, uint16_t port)
+{
+	const size_t num_clients = 8;
+	const size_t round_trips = 2000;
+
+	Echo_ServerTest server(port, 1500, num_clients, ServerBase::Protocol::TCP, mode);
+	server.SetLoopThreads(2);
+	server.Start();
+
+	if (server.GetMode() != mode)
+		std::cout << "[Compare] " << name << " is not supported, fallback used" << std::endl;
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> clients;
+	for (size_t i = 0; i != num_clients; i++)
+	{
+		clients.emplace_back([port, round_trips]() {
+			Client client("127.0.0.1", port, ServerBase::Protocol::TCP);
+			char buffer[64];
+			for (size_t n = 0; n != round_trips; n++)
+			{
+				client.Send(message);
+				size_t received = 0;
+				while (received < message.size())
+					received += client.Read(buffer, sizeof(buffer));
+			}
+		});
+	}
+
+	for (auto &client : clients)
+		client.join();
+
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	size_t total = num_clients * round_trips;
+
+	std::cout << "[Compare] " << name << ": " << total * 1000000 / (us ? us : 1)
+		  << " msg/s, avg RTT " << us * num_clients / total << " us" << std::endl;
+
+	server.Stop();
+}
+
+/*
+ * Spread clients over several SO_REUSEPORT listeners and check client
+ * limit and counter are shared by all of them.
+ */
+static bool check_listeners(ServerBase::Mode mode, uint16_t port)
+{
+	const size_t max_clients = 16;
+
+	Echo_ServerTest server(port, 1500, max_clients, ServerBase::Protocol::TCP, mode);
+	server.SetListeners(4);
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::vector<std::unique_ptr<Client>> clients;
+	for (size_t i = 0; i != max_clients; i++)
+	{
+		clients.emplace_back(new Client("127.0.0.1", port, ServerBase::Protocol::TCP));
+		clients.back()->Send(message);
+		if (clients.back()->ReadString() != message)
+			return false;
+	}
+
+	/* One more is over the limit, it is dropped by any listener */
+	Client extra("127.0.0.1", port, ServerBase::Protocol::TCP);
+	bool dropped;
+	try
+	{
+		char byte;
+		dropped = extra.Read(&byte, sizeof(byte)) == 0;
+	}
+	catch (const std::runtime_error &)
+	{
+		dropped = true;
+	}
+
+	size_t connected = server.GetNumberOfClients();
+	std::cout << "[Listeners] " << connected << " clients connected over 4 listeners" << std::endl;
+
+	server.Stop();
+
+	return connected == max_clients && dropped;
+}
+
+/*
+ * Burst datagrams at UDP server, check every one is echoed back to the
+ * sender and report how many were handled per batch.
+ */
+static bool check_udp_batch(ServerBase::Mode mode, uint16_t port)
 {
-	std::vector<char> data(size);
+	const size_t count = 64;
 
-	BenchmarkTimer timer("Random data generation");
-	for (size_t i = 0; i < size; ++i)
+	Batch_ServerTest server(port, 1500, 32, ServerBase::Protocol::UDP, mode);
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	Client client("127.0.0.1", port, ServerBase::Protocol::UDP);
+	for (size_t i = 0; i != count; i++)
+		client.Send(message);
+
+	size_t replies = 0;
+	while (replies != count && client.ReadString() == message)
+		replies++;
+
+	std::cout << "[UDP batch] " << server.datagrams << " datagrams in "
+		  << server.batches << " batches" << std::endl;
+
+	server.Stop();
+
+	return replies == count && server.datagrams == count;
+}
+
+/*
+ * Stream frames split and merged at random points through a buffer small
+ * enough to wrap, check every frame arrives whole and in order.
+ */
+static bool check_framing(ServerBase::Mode mode, uint16_t port, bool delimited)
+{
+	const size_t count = 1000;
+
+	Frame_ServerTest server(port, 64, 4, ServerBase::Protocol::TCP, mode);
+	if (delimited)
+		server.SetFramer(std::make_shared<DelimiterFramer>("\r\n"));
+	else
+		server.SetFramer(std::make_shared<LengthPrefixFramer>(2));
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::vector<char> stream;
+	for (size_t n = 0; n != count; n++)
 	{
-		data[i] = static_cast<char>(tinymt32_generate() % 256);
+		size_t size = n % 40 + 1;
+		if (!delimited)
+		{
+			stream.push_back(static_cast<char>(size >> 8));
+			stream.push_back(static_cast<char>(size));
+		}
+		for (size_t i = 0; i != size; i++)
+			stream.push_back(frame_byte(n, i));
+		if (delimited)
+		{
+			stream.push_back('\r');
+			stream.push_back('\n');
+		}
 	}
-	return data;
+
+	Client client("127.0.0.1", port, ServerBase::Protocol::TCP);
+	for (size_t sent = 0; sent != stream.size(); )
+	{
+		size_t chunk = std::min<size_t>(tinymt32_generate() % 100 + 1, stream.size() - sent);
+		client.Send(stream.data() + sent, chunk);
+		sent += chunk;
+	}
+
+	for (int i = 0; i != 100 && server.frames != count; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::cout << "[Framing] " << (delimited ? "delimiter: " : "length prefix: ")
+		  << server.frames << " frames, " << server.errors << " errors" << std::endl;
+
+	client.Close();
+	server.Stop();
+
+	return server.frames == count && !server.errors;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Keep many clients connected with big message size, check idle ones hold
+ * no receive buffers and a few buffers are reused by all of them in turn.
+ */
+static bool check_buffer_pool(ServerBase::Mode mode, uint16_t port, bool framed)
 {
-	tinymt32_init(12345);
+	const size_t num_clients = 32;
+	const size_t msg_size = 1024 * 1024;
 
-	auto data = generate_data(1024 * 1024); // 1 MB of random data
+	Echo_ServerTest server(port, msg_size, num_clients, ServerBase::Protocol::TCP, mode);
+	if (framed)
+		server.SetFramer(std::make_shared<DelimiterFramer>());
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::vector<std::unique_ptr<Client>> clients;
+	for (size_t i = 0; i != num_clients; i++)
+		clients.emplace_back(new Client("127.0.0.1", port, ServerBase::Protocol::TCP));
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	size_t idle_peak = server.GetBufferStats().peak_bytes;
+
+	for (auto &client : clients)
+	{
+		client->Send(message + "\n");
+		client->ReadString();
+	}
+
+	auto stats = server.GetBufferStats();
+	std::cout << "[Buffer pool] hits " << stats.hits << ", misses " << stats.misses
+		  << ", peak " << stats.peak_bytes << " bytes" << std::endl;
+
+	server.Stop();
+
+	/*
+	 * Next client may be served before previous buffer is given back, a few
+	 * buffers are fine. io_uring frames in place and may not use the pool.
+	 */
+	return !idle_peak && stats.misses <= 4 && stats.peak_bytes <= 4 * msg_size;
+}
+
+/*
+ * Check connection table metadata and reuse of slots after disconnect.
+ */
+static bool check_client_table(ServerBase::Mode mode, uint16_t port)
+{
+	const size_t max_clients = 8;
+
+	Echo_ServerTest server(port, 1500, max_clients, ServerBase::Protocol::TCP, mode);
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	/* Client i echoes i + 1 messages */
+	std::vector<std::unique_ptr<Client>> clients;
+	for (size_t i = 0; i != max_clients; i++)
+	{
+		clients.emplace_back(new Client("127.0.0.1", port, ServerBase::Protocol::TCP));
+		for (size_t n = 0; n != i + 1; n++)
+		{
+			clients.back()->Send(message);
+			if (clients.back()->ReadString() != message)
+				return false;
+		}
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	auto now = std::chrono::system_clock::now();
+	auto infos = server.GetClients();
+	uint64_t total = 0;
+	std::vector<bool> used(max_clients);
+	bool ok = infos.size() == max_clients;
+
+	for (auto &info : infos)
+	{
+		ok = ok && info.slot < max_clients && !used[info.slot];
+		ok = ok && info.bytes_in == info.bytes_out && info.bytes_in % message.size() == 0;
+		ok = ok && info.peer.sin_addr.s_addr == htonl(INADDR_LOOPBACK);
+		ok = ok && info.connected <= now && now - info.connected < std::chrono::seconds(10);
+		if (info.slot < max_clients)
+			used[info.slot] = true;
+		total += info.bytes_in;
+	}
+	ok = ok && total == message.size() * max_clients * (max_clients + 1) / 2;
+
+	/* Freed slots are taken by new clients */
+	clients.resize(max_clients / 2);
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	size_t left = server.GetNumberOfClients();
+
+	for (size_t i = 0; i != max_clients / 2; i++)
+	{
+		clients.emplace_back(new Client("127.0.0.1", port, ServerBase::Protocol::TCP));
+		clients.back()->Send(message);
+		ok = ok && clients.back()->ReadString() == message;
+	}
+
+	size_t connected = server.GetNumberOfClients();
+	std::cout << "[Client table] " << infos.size() << " clients, " << total << " bytes, "
+		  << left << " left, " << connected << " reconnected" << std::endl;
+
+	server.Stop();
+
+	return ok && left == max_clients / 2 && connected == max_clients &&
+	       server.GetClients().empty();
+}
+
+/* Wait for the server to close the connection, false on data or timeout */
+static bool wait_dropped(Client &client)
+{
+	try
+	{
+		char byte;
+		return client.Read(&byte, sizeof(byte)) == 0;
+	}
+	catch (const std::runtime_error &)
+	{
+		return true;
+	}
+}
+
+/*
+ * Silent client is dropped on idle timeout while active one stays, user
+ * timer replies on its own. Client not reading a stream is dropped on
+ * write timeout.
+ */
+static bool check_timeouts(ServerBase::Mode mode, uint16_t port)
+{
+	using namespace std::chrono;
+
+	Timer_ServerTest server(port, 1500, 8, ServerBase::Protocol::TCP, mode);
+	server.SetTimeouts(milliseconds(200));
+	server.Start();
+
+	std::this_thread::sleep_for(milliseconds(10));
+
+	Client silent("127.0.0.1", port, ServerBase::Protocol::TCP);
+	Client active("127.0.0.1", port, ServerBase::Protocol::TCP);
+	Client timed("127.0.0.1", port, ServerBase::Protocol::TCP);
+	auto start = steady_clock::now();
+
+	timed.Send("timer");
+	bool ticked = timed.ReadString() == "tick";
+	auto tick_time = steady_clock::now() - start;
+
+	bool alive = true;
+	for (int i = 0; i != 8 && alive; i++)
+	{
+		std::this_thread::sleep_for(milliseconds(50));
+		active.Send(message);
+		alive = active.ReadString() == message;
+	}
+
+	bool dropped = wait_dropped(silent);
+	auto idle_time = steady_clock::now() - start;
+	server.Stop();
+
+	/* Stream is never read, queue stops moving */
+	Stream_ServerTest stream(port, 1500, 8, ServerBase::Protocol::TCP, mode);
+	stream.SetTimeouts(milliseconds(0), milliseconds(200));
+	stream.Start();
+
+	std::this_thread::sleep_for(milliseconds(10));
+
+	Client stalled("127.0.0.1", port, ServerBase::Protocol::TCP);
+	stalled.Send("stream");
+	std::this_thread::sleep_for(milliseconds(500));
+	size_t stalled_left = stream.GetNumberOfClients();
+	stream.Stop();
+
+	std::cout << "[Timeouts] tick in " << duration_cast<milliseconds>(tick_time).count()
+		  << " ms, idle drop in " << duration_cast<milliseconds>(idle_time).count()
+		  << " ms, " << stalled_left << " stalled clients left" << std::endl;
+
+	return ticked && tick_time >= milliseconds(50) && alive && dropped &&
+	       idle_time >= milliseconds(200) && !stalled_left;
+}
+
+/*
+ * Request a large stream and do not read it for a while, other client
+ * has to be served meanwhile. Event loops pause the stream on the high
+ * watermark and continue from OnWritable once it drains.
+ */
+static bool check_backpressure(ServerBase::Mode mode, uint16_t port)
+{
+	Stream_ServerTest server(port, 1500, 2, ServerBase::Protocol::TCP, mode);
+	server.SetWatermarks(256 * 1024, 64 * 1024);
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	Client slow("127.0.0.1", port, ServerBase::Protocol::TCP);
+	Client fast("127.0.0.1", port, ServerBase::Protocol::TCP);
+
+	slow.Send("stream");
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	fast.Send(message);
+	bool served = fast.ReadString() == message;
+
+	std::vector<char> buf(64 * 1024);
+	size_t received = 0, errors = 0;
+	while (received != server.stream_size)
+	{
+		size_t size = slow.Read(buf.data(), buf.size());
+		if (!size)
+			break;
+		for (size_t i = 0; i != size; i++)
+			if (buf[i] != static_cast<char>((received + i) % 251))
+				errors++;
+		received += size;
+	}
+
+	std::cout << "[Backpressure] " << received << " bytes, " << errors << " errors, "
+		  << server.resumed << " resumes" << std::endl;
+
+	server.Stop();
+
+	/* THREADED mode blocks the client own thread instead */
+	bool paused = mode == ServerBase::Mode::THREADED || server.resumed;
+	return served && received == server.stream_size && !errors && paused;
+}
+
+/*
+ * Pipelined requests come back in order over pooled connection, which is
+ * reused while healthy and replaced once it holds unread replies.
+ */
+static bool check_client_pool(ServerBase::Mode mode, uint16_t port)
+{
+	const size_t requests = 200;
+
+	Echo_ServerTest server(port, 1500, 8, ServerBase::Protocol::TCP, mode);
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	ClientPool pool;
+	bool ok;
+	{
+		auto client = pool.Acquire("127.0.0.1", port);
+		std::string expected;
+		for (size_t n = 0; n != requests; n++)
+		{
+			std::string request = message + std::to_string(n);
+			client->Queue(request);
+			expected += request;
+		}
+
+		/* Too big to coalesce, written together with the queue */
+		std::string large(96 * 1024, 'x');
+		client->Queue(large);
+		expected += large;
+
+		std::string reply(expected.size(), 0);
+		client->ReadExact(&reply[0], reply.size());
+		ok = reply == expected && !client->GetPending();
+	}
+	size_t idle = pool.GetIdle();
+
+	{
+		auto client = pool.Acquire("127.0.0.1", port);
+		ok = ok && !pool.GetIdle();
+		client->Send(message);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	size_t reused = server.GetNumberOfClients();
 
-	TCP_ServerTest tcp_server(8081, data.size(), 32, ServerBase::Protocol::TCP);
-	UDP_ServerTest udp_server(8082, 1500, 32, ServerBase::Protocol::UDP);
+	{
+		auto client = pool.Acquire("127.0.0.1", port);
+		client->Send(message);
+		ok = ok && client->ReadString() == message;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	size_t replaced = server.GetNumberOfClients();
+
+	pool.Clear();
+
+	std::cout << "[Client pool] " << requests << " pipelined, " << idle << " idle, "
+		  << reused << " reused, " << replaced << " after stale" << std::endl;
+
+	server.Stop();
+
+	return ok && idle == 1 && reused == 1 && replaced == 1 && !pool.GetIdle();
+}
+
+/*
+ * File regions and zero-copy buffers keep their order with copied replies,
+ * every zero-copy buffer is released once sent. Client sends large buffer
+ * with MSG_ZEROCOPY and gets it echoed back.
+ */
+static bool check_zerocopy(ServerBase::Mode mode, uint16_t port)
+{
+	const char *path = "/tmp/server_zerocopy_test.bin";
+	const size_t file_size = 1024 * 1024 + 123;
+	const size_t requests = 4;
+
+	unlink(path);
+	File file(path);
+	std::vector<char> content(file_size);
+	for (size_t i = 0; i != file_size; i++)
+		content[i] = static_cast<char>(i % 247);
+	file.Write(content.data(), content.size());
+
+	ZeroCopy_ServerTest server(file, file_size, port, mode);
+	server.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::string expected(content.begin(), content.end());
+	expected.append(server.buffer.begin(), server.buffer.end());
+	expected += "end";
+
+	bool ok = true;
+	{
+		Client client("127.0.0.1", port, ServerBase::Protocol::TCP);
+		for (size_t n = 0; n != requests; n++)
+		{
+			client.Send(message);
+			std::string reply(expected.size(), 0);
+			client.ReadExact(&reply[0], reply.size());
+			ok = ok && reply == expected;
+		}
+	}
+
+	/* Released on completion notification, give the loop a moment */
+	for (int i = 0; i != 100 && server.released != requests; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	size_t released = server.released;
+	server.Stop();
+
+	Echo_ServerTest echo(port, 1500, 4, ServerBase::Protocol::TCP, mode);
+	echo.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	bool echoed;
+	{
+		Client client("127.0.0.1", port, ServerBase::Protocol::TCP);
+		std::vector<char> large(64 * 1024);
+		for (size_t i = 0; i != large.size(); i++)
+			large[i] = static_cast<char>(i % 241);
+
+		client.SendZeroCopy(large.data(), large.size());
+		std::vector<char> reply(large.size());
+		client.ReadExact(reply.data(), reply.size());
+		echoed = reply == large;
+	}
+	echo.Stop();
+
+	file.Close();
+	unlink(path);
+
+	std::cout << "[Zero-copy] " << requests << " replies of " << expected.size() << " bytes, "
+		  << released << " released, echo " << (echoed ? "ok" : "failed") << std::endl;
+
+	return ok && released == requests && echoed;
+}
+
+#ifdef NETWORK_COROUTINES
+/* Passes every request to backend, replies once backend answered */
+class Proxy_ServerTest final: public AsyncServer
+{
+public:
+	Proxy_ServerTest(Reactor &reactor, uint16_t backend, uint16_t port, ServerBase::Mode mode)
+		: AsyncServer(port, 1500, 256, ServerBase::Protocol::TCP, mode),
+		  reactor(reactor), backend(backend) {}
+
+	Task<void> OnRequest(Request request) override
+	{
+		AsyncClient client = co_await AsyncClient::Connect(reactor, "127.0.0.1", backend);
+		co_await client.Send(request.GetData(), request.GetSize());
+
+		std::vector<char> reply(request.GetSize());
+		co_await client.ReadExact(reply.data(), reply.size());
+		if (co_await request.Reply(reply.data(), reply.size()))
+			replied++;
+	}
+
+	Reactor &reactor;
+	uint16_t backend;
+	std::atomic<size_t> replied {0};
+};
+
+static Task<void> converse(Reactor &reactor, uint16_t port, size_t n,
+			   std::atomic<size_t> &done, std::atomic<size_t> &errors)
+{
+	try
+	{
+		AsyncClient client = co_await AsyncClient::Connect(reactor, "127.0.0.1", port);
+		std::string request = message + std::to_string(n);
+		co_await client.Send(request);
+
+		std::string reply(request.size(), 0);
+		co_await client.ReadExact(&reply[0], reply.size());
+		if (reply != request)
+			errors++;
+	}
+	catch (const std::exception &)
+	{
+		errors++;
+	}
+	done++;
+}
+
+/*
+ * Many concurrent conversations on one reactor thread go through server
+ * whose coroutine handlers await a backend before replying.
+ */
+static bool check_coroutines(ServerBase::Mode mode, uint16_t backend_port, uint16_t port)
+{
+	const size_t conversations = 200;
+
+	Reactor reactor;
+	Echo_ServerTest backend(backend_port, 1500, 256, ServerBase::Protocol::TCP, ServerBase::Mode::EPOLL);
+	Proxy_ServerTest proxy(reactor, backend_port, port, mode);
+	backend.Start();
+	proxy.Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::atomic<size_t> done {0};
+	std::atomic<size_t> errors {0};
+	for (size_t n = 0; n != conversations; n++)
+		Spawn(converse(reactor, port, n, done, errors));
+
+	for (int i = 0; i != 1000 && done != conversations; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::cout << "[Coroutines] " << done << " conversations, " << errors << " errors, "
+		  << proxy.replied << " replied" << std::endl;
+
+	proxy.Stop();
+	backend.Stop();
+
+	return done == conversations && !errors && proxy.replied == conversations;
+}
+#endif
+
+/* Threads of this process */
+static size_t count_threads()
+{
+	size_t count = 0;
+	DIR *dir = opendir("/proc/self/task");
+	if (!dir)
+		return 0;
+
+	while (struct dirent *entry = readdir(dir))
+		if (entry->d_name[0] != '.')
+			count++;
+	closedir(dir);
+	return count;
+}
+
+/*
+ * Several TCP servers and a UDP one share two group threads, none starts
+ * a thread of its own. Timers still fire, server restarted in the group
+ * serves again while the others keep going.
+ */
+static bool check_loop_group(ServerBase::Mode mode, uint16_t port)
+{
+	const size_t servers = 3;
+
+	auto group = std::make_shared<LoopGroup>(2);
+	size_t threads = count_threads();
+
+	std::vector<std::unique_ptr<Timer_ServerTest>> tcp;
+	for (size_t i = 0; i != servers; i++)
+	{
+		tcp.emplace_back(new Timer_ServerTest(port + i, 1500, 8, ServerBase::Protocol::TCP, mode));
+		tcp.back()->SetTimeouts(std::chrono::milliseconds(200));
+		tcp.back()->SetLoopGroup(group);
+		tcp.back()->Start();
+	}
+	Echo_ServerTest udp(port + servers, 1500, 8, ServerBase::Protocol::UDP, mode);
+	udp.SetLoopGroup(group);
+	udp.Start();
+
+	size_t started = count_threads();
+	size_t loops = group->GetLoops();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	bool served = true;
+	std::vector<std::unique_ptr<Client>> clients;
+	for (size_t i = 0; i != servers; i++)
+	{
+		clients.emplace_back(new Client("127.0.0.1", port + i, ServerBase::Protocol::TCP));
+		clients.back()->Send(message);
+		served = served && clients.back()->ReadString() == message;
+	}
+
+	Client datagrams("127.0.0.1", port + servers, ServerBase::Protocol::UDP);
+	datagrams.Send(message);
+	served = served && datagrams.ReadString() == message;
+
+	clients[0]->Send("timer");
+	bool ticked = clients[0]->ReadString() == "tick";
+
+	/* Idle timers of the group loops drop silent clients */
+	bool dropped = wait_dropped(*clients[1]);
+
+	/* Restarted server takes a free place in the group */
+	tcp[2]->Stop();
+	tcp[2]->Start();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	Client again("127.0.0.1", port + 2, ServerBase::Protocol::TCP);
+	again.Send(message);
+	bool restarted = again.ReadString() == message && group->GetLoops() == loops;
+
+	std::cout << "[Loop group] " << loops << " loops on " << group->GetThreads()
+		  << " threads, " << started - threads << " threads started by servers" << std::endl;
+
+	for (auto &server : tcp)
+		server->Stop();
+	udp.Stop();
+
+	return served && ticked && dropped && restarted && started <= threads &&
+	       loops == servers + 1 && !group->GetLoops();
+}
+
+/*
+ * Run basic TCP/UDP scenario using given mode.
+ */
+static bool run_scenario(ServerBase::Mode mode, uint16_t tcp_port, uint16_t udp_port,
+			 const std::vector<char> &data)
+{
+	inc_step = 0;
+
+	TCP_ServerTest tcp_server(tcp_port, data.size(), 32, ServerBase::Protocol::TCP, mode);
+	UDP_ServerTest udp_server(udp_port, 1500, 32, ServerBase::Protocol::UDP, mode);
 
 	tcp_server.Start();
 	udp_server.Start();
 
 	std::this_thread::sleep_for(std::chrono::milliseconds(10));
 
-	Client tcp_client("127.0.0.1", 8081, ServerBase::Protocol::TCP);
-	Client udp_client("127.0.0.1", 8082, ServerBase::Protocol::UDP);
+	Client tcp_client("127.0.0.1", tcp_port, ServerBase::Protocol::TCP);
+	Client udp_client("127.0.0.1", udp_port, ServerBase::Protocol::UDP);
 	
 	std::this_thread::sleep_for(std::chrono::milliseconds(10));
 
@@ -122,9 +1556,132 @@ int main(int argc, char *argv[])
 	tcp_client.Close();
 	udp_client.Close();
 
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
 	tcp_server.Stop();
 	udp_server.Stop();
 
-	return inc_step > 10 ? 0 : 1;
+	return inc_step > 10;
+}
+
+std::vector<char> generate_data(size_t size)
+{
+	std::vector<char> data(size);
+
+	BenchmarkTimer timer("Random data generation");
+	for (size_t i = 0; i < size; ++i)
+	{
+		data[i] = static_cast<char>(tinymt32_generate() % 256);
+	}
+	return data;
 }
 
+int main(int argc, char *argv[])
+{
+	tinymt32_init(12345);
+
+	auto data = generate_data(1024 * 1024); // 1 MB of random data
+
+	if (!run_scenario(ServerBase::Mode::THREADED, 8081, 8082, data))
+		return 1;
+
+	if (!run_scenario(ServerBase::Mode::EPOLL, 8083, 8084, data))
+		return 1;
+
+	if (!run_scenario(ServerBase::Mode::URING, 8085, 8086, data))
+		return 1;
+
+	if (!check_listeners(ServerBase::Mode::THREADED, 8090) ||
+	    !check_listeners(ServerBase::Mode::EPOLL, 8091) ||
+	    !check_listeners(ServerBase::Mode::URING, 8092))
+		return 1;
+
+	if (!check_udp_batch(ServerBase::Mode::THREADED, 8093) ||
+	    !check_udp_batch(ServerBase::Mode::EPOLL, 8094) ||
+	    !check_udp_batch(ServerBase::Mode::URING, 8095))
+		return 1;
+
+	for (bool delimited : { false, true })
+		if (!check_framing(ServerBase::Mode::THREADED, 8096, delimited) ||
+		    !check_framing(ServerBase::Mode::EPOLL, 8097, delimited) ||
+		    !check_framing(ServerBase::Mode::URING, 8098, delimited))
+			return 1;
+
+	if (!check_buffer_pool(ServerBase::Mode::THREADED, 8099, false) ||
+	    !check_buffer_pool(ServerBase::Mode::THREADED, 8100, true) ||
+	    !check_buffer_pool(ServerBase::Mode::EPOLL, 8101, true) ||
+	    !check_buffer_pool(ServerBase::Mode::URING, 8102, true))
+		return 1;
+
+	if (!check_client_table(ServerBase::Mode::THREADED, 8106) ||
+	    !check_client_table(ServerBase::Mode::EPOLL, 8107) ||
+	    !check_client_table(ServerBase::Mode::URING, 8108))
+		return 1;
+
+	if (!check_timeouts(ServerBase::Mode::THREADED, 8109) ||
+	    !check_timeouts(ServerBase::Mode::EPOLL, 8110) ||
+	    !check_timeouts(ServerBase::Mode::URING, 8111))
+		return 1;
+
+	if (!check_backpressure(ServerBase::Mode::THREADED, 8103) ||
+	    !check_backpressure(ServerBase::Mode::EPOLL, 8104) ||
+	    !check_backpressure(ServerBase::Mode::URING, 8105))
+		return 1;
+
+	if (!check_client_pool(ServerBase::Mode::THREADED, 8112) ||
+	    !check_client_pool(ServerBase::Mode::EPOLL, 8113) ||
+	    !check_client_pool(ServerBase::Mode::URING, 8114))
+		return 1;
+
+	if (!check_zerocopy(ServerBase::Mode::THREADED, 8121) ||
+	    !check_zerocopy(ServerBase::Mode::EPOLL, 8122) ||
+	    !check_zerocopy(ServerBase::Mode::URING, 8123))
+		return 1;
+
+	if (!check_unix(ServerBase::Mode::THREADED, 8124) ||
+	    !check_unix(ServerBase::Mode::EPOLL, 8125) ||
+	    !check_unix(ServerBase::Mode::URING, 8126))
+		return 1;
+
+	if (!check_shm_ring(ServerBase::Mode::THREADED, 8127) ||
+	    !check_shm_ring(ServerBase::Mode::EPOLL, 8128) ||
+	    !check_shm_ring(ServerBase::Mode::URING, 8129))
+		return 1;
+
+	if (!check_rate_limit(ServerBase::Mode::THREADED, 8130) ||
+	    !check_rate_limit(ServerBase::Mode::EPOLL, 8131) ||
+	    !check_rate_limit(ServerBase::Mode::URING, 8132))
+		return 1;
+
+	if (!check_handoff(ServerBase::Mode::THREADED, 8133) ||
+	    !check_handoff(ServerBase::Mode::EPOLL, 8134) ||
+	    !check_handoff(ServerBase::Mode::URING, 8135))
+		return 1;
+
+	if (!check_rpc(ServerBase::Mode::THREADED, 8136) ||
+	    !check_rpc(ServerBase::Mode::EPOLL, 8137) ||
+	    !check_rpc(ServerBase::Mode::URING, 8138))
+		return 1;
+
+	if (!check_broker(ServerBase::Mode::THREADED, 8139) ||
+	    !check_broker(ServerBase::Mode::EPOLL, 8140) ||
+	    !check_broker(ServerBase::Mode::URING, 8141))
+		return 1;
+
+	if (!check_loop_group(ServerBase::Mode::EPOLL, 8142) ||
+	    !check_loop_group(ServerBase::Mode::URING, 8146))
+		return 1;
+
+#ifdef NETWORK_COROUTINES
+	if (!check_coroutines(ServerBase::Mode::THREADED, 8115, 8116) ||
+	    !check_coroutines(ServerBase::Mode::EPOLL, 8117, 8118) ||
+	    !check_coroutines(ServerBase::Mode::URING, 8119, 8120))
+		return 1;
+#endif
+
+	compare_mode("THREADED", ServerBase::Mode::THREADED, 8087);
+	compare_mode("EPOLL", ServerBase::Mode::EPOLL, 8088);
+	compare_mode("URING", ServerBase::Mode::URING, 8089);
+
+	return 0;
+}
@@ -0,0 +1,1153 @@
+/*
+ * This file is provided under a MIT license.  When using or
+ * redistributing this file, you may do so under either license.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2026 Pavel Nadein
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * C++ Posix server io_uring event loop.
+ *
+ * Contact Information:
+ * Pavel Nadein <pavelnadein@gmail.com>
+ */
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <algorithm>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+#include "server_internal.h"
+
+#ifndef URING_ENTRIES
+#define URING_ENTRIES			256
+#endif
+
+#ifndef URING_BUFFERS_MEMORY
+#define URING_BUFFERS_MEMORY		(8 * 1024 * 1024)
+#endif
+
+using namespace Network;
+
+namespace {
+
+/*
+ * Minimal io_uring wrapper talking to the kernel directly, so liburing
+ * is not needed. Rings are used by a single loop thread only.
+ */
+class Ring
+{
+public:
+	explicit Ring(unsigned entries);
+	~Ring();
+
+	/* Get free submission entry, nullptr if ring is full even after flush */
+	struct io_uring_sqe *GetSqe();
+
+	/* Free submission entries left */
+	unsigned SqSpace() const;
+
+	/* Submit pending entries and wait for wait_nr completions up to timeout ms, -1 is forever */
+	int Submit(unsigned wait_nr, int timeout = -1);
+
+	/* Check completion queue is not empty */
+	bool CqReady() const;
+
+	/* Pop next completion, false if queue is empty */
+	bool PopCqe(struct io_uring_cqe &cqe);
+
+	/* Check opcode is supported by running kernel */
+	bool Probe(uint8_t opcode);
+
+	int Register(unsigned opcode, void *arg, unsigned nr_args);
+
+	int fd = -1;
+private:
+	void Release();
+
+	void *_ring = MAP_FAILED;
+	size_t _ring_size = 0;
+	struct io_uring_sqe *_sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+	size_t _sqes_size = 0;
+
+	unsigned *_sq_head;
+	unsigned *_sq_tail;
+	unsigned _sq_mask;
+	unsigned _sq_entries;
+	unsigned _sqe_tail = 0;
+
+	unsigned *_cq_head;
+	unsigned *_cq_tail;
+	unsigned _cq_mask;
+	struct io_uring_cqe *_cqes;
+};
+
+Ring::Ring(unsigned entries)
+{
+	struct io_uring_params p = {};
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	p.cq_entries = entries * 4;
+
+	fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+	if (fd < 0 && errno == EINVAL)
+	{
+		/* Older kernel, retry without optional flags */
+		p = {};
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = entries * 4;
+		fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+	}
+
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG))
+	{
+		close(fd);
+		throw std::system_error(ENOTSUP, std::generic_category(), "io_uring features");
+	}
+
+	_ring_size = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+			      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	_ring = mmap(nullptr, _ring_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+	_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (_ring != MAP_FAILED)
+		_sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, _sqes_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+
+	if (_ring == MAP_FAILED || _sqes == MAP_FAILED)
+	{
+		int err = errno;
+		Release();
+		throw std::system_error(err, std::generic_category(), "io_uring mmap");
+	}
+
+	char *ring = static_cast<char *>(_ring);
+	_sq_head = reinterpret_cast<unsigned *>(ring + p.sq_off.head);
+	_sq_tail = reinterpret_cast<unsigned *>(ring + p.sq_off.tail);
+	_sq_mask = *reinterpret_cast<unsigned *>(ring + p.sq_off.ring_mask);
+	_sq_entries = p.sq_entries;
+	_sqe_tail = *_sq_tail;
+
+	/* Submission array maps one to one to entries */
+	unsigned *array = reinterpret_cast<unsigned *>(ring + p.sq_off.array);
+	for (unsigned i = 0; i != _sq_entries; i++)
+		array[i] = i;
+
+	_cq_head = reinterpret_cast<unsigned *>(ring + p.cq_off.head);
+	_cq_tail = reinterpret_cast<unsigned *>(ring + p.cq_off.tail);
+	_cq_mask = *reinterpret_cast<unsigned *>(ring + p.cq_off.ring_mask);
+	_cqes = reinterpret_cast<struct io_uring_cqe *>(ring + p.cq_off.cqes);
+}
+
+Ring::~Ring()
+{
+	Release();
+}
+
+void Ring::Release()
+{
+	if (_sqes != MAP_FAILED)
+		munmap(_sqes, _sqes_size);
+	if (_ring != MAP_FAILED)
+		munmap(_ring, _ring_size);
+	if (fd >= 0)
+		close(fd);
+
+	_sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+	_ring = MAP_FAILED;
+	fd = -1;
+}
+
+unsigned Ring::SqSpace() const
+{
+	return _sq_entries - (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE));
+}
+
+struct io_uring_sqe *Ring::GetSqe()
+{
+	if (!SqSpace())
+	{
+		/* Flush entries collected so far to make room */
+		Submit(0);
+		if (!SqSpace())
+			return nullptr;
+	}
+
+	struct io_uring_sqe *sqe = &_sqes[_sqe_tail & _sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	_sqe_tail++;
+	return sqe;
+}
+
+int Ring::Submit(unsigned wait_nr, int timeout)
+{
+	unsigned to_submit = _sqe_tail - *_sq_tail;
+	__atomic_store_n(_sq_tail, _sqe_tail, __ATOMIC_RELEASE);
+
+	if (!to_submit && !wait_nr)
+		return 0;
+
+	unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec ts = {};
+	struct io_uring_getevents_arg arg = {};
+	void *argp = nullptr;
+	size_t argsz = 0;
+
+	/* Wait is bounded by the timespec, -ETIME if it runs out */
+	if (wait_nr && timeout >= 0)
+	{
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = reinterpret_cast<uint64_t>(&ts);
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		argsz = sizeof(arg);
+	}
+
+	int ret = static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, wait_nr,
+		flags, argp, argsz));
+	return ret < 0 ? -errno : ret;
+}
+
+bool Ring::CqReady() const
+{
+	return *_cq_head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+}
+
+bool Ring::PopCqe(struct io_uring_cqe &cqe)
+{
+	unsigned head = *_cq_head;
+	if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+
+	cqe = _cqes[head & _cq_mask];
+	__atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+int Ring::Register(unsigned opcode, void *arg, unsigned nr_args)
+{
+	int ret = static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+	return ret < 0 ? -errno : ret;
+}
+
+bool Ring::Probe(uint8_t opcode)
+{
+	const unsigned nr_ops = 256;
+	std::vector<char> buffer(sizeof(struct io_uring_probe) +
+				 nr_ops * sizeof(struct io_uring_probe_op));
+	struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(buffer.data());
+
+	if (Register(IORING_REGISTER_PROBE, probe, nr_ops) < 0)
+		return false;
+
+	return opcode <= probe->last_op &&
+		(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+} /* namespace */
+
+/*
+ * Event loop used in URING mode. Accepts are served by one multishot
+ * request, every client has one multishot receive picking buffers from
+ * a ring shared with the kernel, so received data is handed to OnReceive
+ * without a copy and the buffer is given back right after the handler.
+ * Replies are queued per client and gathered by one SENDMSG request, the
+ * whole loop iteration costs a single io_uring_enter syscall. Receive is
+ * cancelled while replies stay above high watermark or client is over
+ * rate limit and rearmed once they drain or throttle timer expires.
+ */
+class UringLoop final: public EventLoop
+{
+public:
+	UringLoop(ServerBase &server, int listenfd);
+	~UringLoop();
+	void Send(ClientContext &client, const char *src, size_t size) override;
+	void SendFile(ClientContext &client, int fd, off_t offset, size_t size) override;
+	void SendZeroCopy(ClientContext &client, const char *src, size_t size,
+			  std::function<void()> release) override;
+	void StopAccepting() override;
+	void Adopt(int fd) override;
+private:
+	enum Op : uint64_t { ACCEPT, RECV, SEND, WAKEUP, CANCEL, OP_MASK = 7 };
+
+	struct Client final: ClientContext
+	{
+		using ClientContext::ClientContext;
+		struct msghdr msg = {};
+		struct iovec iov[SEND_IOV_MAX];
+		bool sending = false;
+		bool recv_armed = false;
+		bool recv_cancel = false;
+		bool closing = false;
+		bool dirty = false;
+		bool starved = false;
+		/* Request in flight is SENDMSG_ZC, buffers wait for notification */
+		bool zerocopy_send = false;
+		/* Request in flight waits for room to write file region */
+		bool polling = false;
+		bool nonblock = false;
+	};
+
+	void Run() override;
+	void Wakeup() override;
+	void Teardown();
+	void Complete(const struct io_uring_cqe &cqe);
+	void ArmAccept();
+	void ArmReceive(Client *client);
+	void CancelReceive(Client *client);
+	void ArmWakeup();
+	void Accepted(int fd);
+	void Received(Client *client, const struct io_uring_cqe &cqe);
+	void ReceivedUDP(const struct io_uring_cqe &cqe);
+	void DispatchDatagrams();
+	void Sent(Client *client, int res);
+	void Polled(Client *client, int res);
+	void Notified(Client *client);
+	void WriteFile(Client *client);
+	void FlushSends();
+	void MarkDirty(Client *client);
+	void Rearm();
+	void Drop(ClientContext *client) override;
+	void Resume(ClientContext *client) override;
+	void Close(Client *client, bool abort);
+	void Finish(Client *client);
+	void RecycleBuffer(uint16_t bid);
+	bool Prepare(struct io_uring_sqe *&sqe);
+
+	static uint64_t Tag(void *ptr, Op op) { return reinterpret_cast<uint64_t>(ptr) | op; }
+
+	std::unique_ptr<Ring> _ring;
+	int _wakefd = -1;
+	uint64_t _wake_value = 0;
+	size_t _outstanding = 0;
+	bool _accept_armed = false;
+	bool _accepting = true;
+	bool _zerocopy = false;
+
+	/* Provided buffers */
+	struct io_uring_buf_ring *_buf_ring = static_cast<struct io_uring_buf_ring *>(MAP_FAILED);
+	size_t _buf_ring_size = 0;
+	unsigned _buf_entries = 0;
+	uint16_t _buf_tail = 0;
+	size_t _buf_size = 0;
+	std::unique_ptr<char[]> _buffers;
+
+	struct msghdr _msghdr = {};
+	std::unordered_map<Client *, std::unique_ptr<Client>> _clients;
+	std::vector<Client *> _dirty;
+	std::vector<Client *> _starved;
+
+	/* Datagrams keep their buffers until the batch is handled */
+	std::unique_ptr<DatagramBatch> _batch;
+	std::vector<uint16_t> _batch_bids;
+};
+
+UringLoop::UringLoop(ServerBase &server, int listenfd)
+	: EventLoop(server, listenfd), _ring(new Ring(URING_ENTRIES))
+{
+	/* Multishot receive came with SEND_ZC in 6.0, probe it as a marker */
+	if (!_ring->Probe(IORING_OP_SEND_ZC) || !_ring->Probe(IORING_OP_RECVMSG) ||
+	    !_ring->Probe(IORING_OP_ASYNC_CANCEL))
+		throw std::system_error(ENOTSUP, std::generic_category(), "io_uring opcodes");
+
+	/* Zero-copy replies fall back to copying sends without it */
+	_zerocopy = _ring->Probe(IORING_OP_SENDMSG_ZC);
+
+	/* Template for datagrams, sender address and Unix credentials are needed */
+	_msghdr.msg_namelen = IsUnix() ? sizeof(struct sockaddr_un) : sizeof(struct sockaddr_in);
+	_msghdr.msg_controllen = IsUnix() ? CMSG_SPACE(sizeof(struct ucred)) : 0;
+
+	_buf_size = MsgSize();
+	if (!IsStream())
+		_buf_size += sizeof(struct io_uring_recvmsg_out) + _msghdr.msg_namelen + _msghdr.msg_controllen;
+
+	/* Power of two amount of buffers within memory budget */
+	_buf_entries = 256;
+	while (_buf_entries > 8 && _buf_entries * _buf_size > URING_BUFFERS_MEMORY)
+		_buf_entries >>= 1;
+
+	_buf_ring_size = _buf_entries * sizeof(struct io_uring_buf);
+	_buf_ring = static_cast<struct io_uring_buf_ring *>(mmap(nullptr, _buf_ring_size,
+		PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+	if (_buf_ring == MAP_FAILED)
+		throw std::system_error(errno, std::generic_category(), "io_uring buffers");
+
+	struct io_uring_buf_reg reg = {};
+	reg.ring_addr = reinterpret_cast<uint64_t>(_buf_ring);
+	reg.ring_entries = _buf_entries;
+	reg.bgid = 0;
+
+	int ret = _ring->Register(IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (ret < 0)
+	{
+		munmap(_buf_ring, _buf_ring_size);
+		throw std::system_error(-ret, std::generic_category(), "io_uring buffer ring");
+	}
+
+	_buffers.reset(new char[_buf_entries * _buf_size]);
+	for (unsigned i = 0; i != _buf_entries; i++)
+		RecycleBuffer(static_cast<uint16_t>(i));
+
+	_wakefd = eventfd(0, EFD_CLOEXEC);
+	if (_wakefd < 0)
+	{
+		munmap(_buf_ring, _buf_ring_size);
+		throw std::system_error(errno, std::generic_category(), "eventfd");
+	}
+
+	if (!IsStream())
+		_batch.reset(new DatagramBatch(listenfd, MsgSize(), UDP_BATCH_SIZE, Limiter()));
+}
+
+UringLoop::~UringLoop()
+{
+	Stop();
+
+	/* Ring has to go first, kernel may still reference buffers */
+	_ring.reset();
+	close(_wakefd);
+	munmap(_buf_ring, _buf_ring_size);
+}
+
+void UringLoop::Wakeup()
+{
+	uint64_t one = 1;
+	ssize_t res = write(_wakefd, &one, sizeof(one));
+	(void)res;
+}
+
+void UringLoop::RecycleBuffer(uint16_t bid)
+{
+	/*
+	 * Entries overlay the ring header, avoid bufs[] member as some
+	 * uapi headers shift it by an empty struct when built as C++.
+	 */
+	struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(_buf_ring) +
+		(_buf_tail & (_buf_entries - 1));
+	buf->addr = reinterpret_cast<uint64_t>(_buffers.get() + bid * _buf_size);
+	buf->len = static_cast<uint32_t>(_buf_size);
+	buf->bid = bid;
+	_buf_tail++;
+	__atomic_store_n(&_buf_ring->tail, _buf_tail, __ATOMIC_RELEASE);
+}
+
+bool UringLoop::Prepare(struct io_uring_sqe *&sqe)
+{
+	sqe = _ring->GetSqe();
+	if (!sqe)
+		return false;
+
+	_outstanding++;
+	return true;
+}
+
+void UringLoop::ArmAccept()
+{
+	struct io_uring_sqe *sqe;
+	if (!Prepare(sqe))
+		return;
+
+	if (IsStream())
+	{
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = _listenfd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+	}
+	else
+	{
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = _listenfd;
+		sqe->addr = reinterpret_cast<uint64_t>(&_msghdr);
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+	}
+
+	sqe->user_data = Tag(nullptr, ACCEPT);
+	_accept_armed = true;
+}
+
+void UringLoop::ArmReceive(Client *client)
+{
+	struct io_uring_sqe *sqe;
+	if (!Prepare(sqe))
+	{
+		Close(client, true);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->fd;
+	/* Rate limited client reads one buffer at a time, no more is taken ahead of its budget */
+	sqe->ioprio = Limiter() ? 0 : IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = Tag(client, RECV);
+	client->recv_armed = true;
+}
+
+void UringLoop::CancelReceive(Client *client)
+{
+	/* Best effort, client keeps reading if the ring is full */
+	struct io_uring_sqe *sqe = _ring->GetSqe();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = Tag(client, RECV);
+	sqe->user_data = Tag(nullptr, CANCEL);
+	client->recv_cancel = true;
+}
+
+void UringLoop::StopAccepting()
+{
+	_accepting = false;
+	if (!_accept_armed)
+		return;
+
+	/* Best effort, next completion retries if the ring is full */
+	struct io_uring_sqe *sqe = _ring->GetSqe();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = Tag(nullptr, ACCEPT);
+	sqe->user_data = Tag(nullptr, CANCEL);
+}
+
+void UringLoop::Adopt(int fd)
+{
+	/* Sockets are blocking as accepted ones, requests wait in the ring */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	Accepted(fd);
+}
+
+void UringLoop::ArmWakeup()
+{
+	struct io_uring_sqe *sqe;
+	if (!Prepare(sqe))
+		return;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = _wakefd;
+	sqe->addr = reinterpret_cast<uint64_t>(&_wake_value);
+	sqe->len = sizeof(_wake_value);
+	sqe->off = static_cast<uint64_t>(-1);
+	sqe->user_data = Tag(nullptr, WAKEUP);
+}
+
+void UringLoop::Run()
+{
+	bool teardown = false;
+
+	ArmWakeup();
+	ArmAccept();
+
+	while (_running || _outstanding)
+	{
+		if (!_running && !teardown)
+		{
+			Teardown();
+			teardown = true;
+		}
+
+		FlushSends();
+
+		/* Submit and wait in one syscall, timer wheel bounds the wait */
+		int ret = _ring->Submit(_ring->CqReady() || !_dirty.empty() ? 0 : 1, _timers.Timeout());
+		if (ret < 0 && ret != -EINTR && ret != -EBUSY && ret != -EAGAIN && ret != -ETIME)
+			break;
+
+		struct io_uring_cqe cqe;
+		while (_ring->PopCqe(cqe))
+			Complete(cqe);
+
+		ExpireTimers();
+		RunPosted();
+
+		Rearm();
+	}
+
+	/* Loop is terminated, close clients left */
+	while (!_clients.empty())
+		Finish(_clients.begin()->first);
+}
+
+void UringLoop::Teardown()
+{
+	/* Cancel every request in flight, loop exits once all of them complete */
+	struct io_uring_sqe *sqe = _ring->GetSqe();
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = Tag(nullptr, CANCEL);
+	}
+
+	/* Fail pending sends quickly */
+	for (auto &client : _clients)
+		shutdown(client.first->fd, SHUT_RDWR);
+}
+
+void UringLoop::Complete(const struct io_uring_cqe &cqe)
+{
+	Op op = static_cast<Op>(cqe.user_data & OP_MASK);
+	Client *client = reinterpret_cast<Client *>(cqe.user_data & ~static_cast<uint64_t>(OP_MASK));
+	bool more = cqe.flags & IORING_CQE_F_MORE;
+
+	if (op == CANCEL)
+		return;
+
+	if (!more)
+		_outstanding--;
+
+	switch (op)
+	{
+	case ACCEPT:
+		if (!more)
+			_accept_armed = false;
+		else if (!_accepting)
+			/* Cancel did not fit into the ring, try again */
+			StopAccepting();
+
+		if (IsStream())
+		{
+			if (cqe.res >= 0)
+				Accepted(cqe.res);
+		}
+		else
+		{
+			ReceivedUDP(cqe);
+		}
+		break;
+	case RECV:
+		if (!more)
+			client->recv_armed = false;
+		Received(client, cqe);
+		break;
+	case SEND:
+		/* Zero-copy send completes twice, notification comes once buffers are free */
+		if (cqe.flags & IORING_CQE_F_NOTIF)
+		{
+			Notified(client);
+		}
+		else if (client->polling)
+		{
+			Polled(client, cqe.res);
+		}
+		else
+		{
+			if (more)
+				client->zerocopy.Sent();
+			Sent(client, cqe.res);
+		}
+		break;
+	case WAKEUP:
+		if (_running)
+			ArmWakeup();
+		break;
+	default:
+		break;
+	}
+}
+
+void UringLoop::Accepted(int fd)
+{
+	PeerAddress cli_addr;
+	getpeername(fd, cli_addr.Get(), &cli_addr.len);
+
+	ClientTable::Slot *slot = _running ? AddClient(fd, cli_addr) : nullptr;
+	if (!slot)
+	{
+		/* Stopping or too many connections, close socket */
+		close(fd);
+		return;
+	}
+
+	Connected(cli_addr);
+
+	std::unique_ptr<Client> ctx = NewClient<Client>(fd, slot);
+	Client *client = ctx.get();
+	_clients[client] = std::move(ctx);
+	ArmReceive(client);
+}
+
+void UringLoop::Received(Client *client, const struct io_uring_cqe &cqe)
+{
+	bool more = cqe.flags & IORING_CQE_F_MORE;
+
+	if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+	{
+		uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		char *data = _buffers.get() + bid * _buf_size;
+		bool ok = client->closing;
+
+		if (!ok)
+		{
+			client->slot->bytes_in.fetch_add(static_cast<size_t>(cqe.res), std::memory_order_relaxed);
+			client->Touch();
+		}
+
+		if (!ok && client->reader)
+		{
+			/* Whole frames are handled in place, the rest is copied out */
+			client->reader->Feed(data, static_cast<size_t>(cqe.res));
+			ok = DispatchFrames(client);
+		}
+		else if (!ok)
+		{
+			ok = Dispatch(client, data, static_cast<size_t>(cqe.res));
+		}
+
+		RecycleBuffer(bid);
+
+		if (!ok)
+		{
+			Close(client, true);
+			return;
+		}
+
+		/* Over rate limit, stop reading until throttle timer expires */
+		if (!client->closing)
+			Admit(client, static_cast<size_t>(cqe.res));
+		if (client->throttled && client->recv_armed && !client->recv_cancel)
+			CancelReceive(client);
+	}
+
+	if (more)
+		return;
+
+	client->recv_cancel = false;
+
+	/* Multishot receive ended, rearm unless client is gone */
+	if (client->closing || !_running ||
+	    (cqe.res <= 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED))
+	{
+		Close(client, false);
+	}
+	else if (client->paused || client->throttled)
+	{
+		/* Replies are not draining or client is over rate limit, rearmed once it changes */
+	}
+	else if (cqe.res == -ENOBUFS)
+	{
+		/* Out of buffers, wait for the batch to give them back */
+		client->starved = true;
+		_starved.push_back(client);
+	}
+	else
+	{
+		ArmReceive(client);
+	}
+}
+
+void UringLoop::ReceivedUDP(const struct io_uring_cqe &cqe)
+{
+	if (cqe.res <= 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+		return;
+
+	uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+	char *buf = _buffers.get() + bid * _buf_size;
+	struct io_uring_recvmsg_out *out = reinterpret_cast<struct io_uring_recvmsg_out *>(buf);
+	char *payload = buf + sizeof(*out) + _msghdr.msg_namelen + _msghdr.msg_controllen;
+	size_t max_payload = static_cast<size_t>(cqe.res) - (payload - buf);
+	size_t size = std::min<size_t>(out->payloadlen, max_payload);
+
+	socklen_t namelen = std::min<socklen_t>(out->namelen, _msghdr.msg_namelen);
+	socklen_t minlen = IsUnix() ? sizeof(sa_family_t) : sizeof(struct sockaddr_in);
+
+	/* Control data follows the name unaligned, parse a copy */
+	const struct ucred *cred = nullptr;
+	union
+	{
+		struct cmsghdr hdr;
+		char data[CMSG_SPACE(sizeof(struct ucred))];
+	} control;
+	struct msghdr msg = {};
+	if (_msghdr.msg_controllen)
+	{
+		msg.msg_control = &control;
+		msg.msg_controllen = std::min<size_t>(out->controllen, sizeof(control));
+		memcpy(&control, buf + sizeof(*out) + _msghdr.msg_namelen, msg.msg_controllen);
+		cred = DatagramBatch::Credentials(msg);
+	}
+
+	/* Credentials point into the copy, message keeps its own */
+	if (namelen >= minlen)
+		_batch->Add(payload, size, reinterpret_cast<struct sockaddr *>(buf + sizeof(*out)), namelen, cred);
+
+	_batch_bids.push_back(bid);
+	if (_batch_bids.size() >= UDP_BATCH_SIZE)
+		DispatchDatagrams();
+}
+
+void UringLoop::DispatchDatagrams()
+{
+	if (_batch_bids.empty())
+		return;
+
+	_batch->Dispatch(server);
+
+	for (uint16_t bid : _batch_bids)
+		RecycleBuffer(bid);
+	_batch_bids.clear();
+}
+
+void UringLoop::Rearm()
+{
+	/* Completions are handled, give the last buffers back to the ring */
+	DispatchDatagrams();
+
+	if (!_accept_armed && _accepting && _running)
+		ArmAccept();
+
+	std::vector<Client *> starved;
+	starved.swap(_starved);
+
+	for (Client *client : starved)
+	{
+		client->starved = false;
+		if (client->closing || !_running)
+			Close(client, false);
+		else if (!client->paused && !client->throttled)
+			ArmReceive(client);
+	}
+}
+
+void UringLoop::Send(ClientContext &ctx, const char *src, size_t size)
+{
+	/* Other threads can not touch the ring, write synchronously */
+	if (!OnLoopThread())
+	{
+		EventLoop::Send(ctx, src, size);
+		return;
+	}
+
+	Client &client = static_cast<Client &>(ctx);
+	if (client.closing)
+		throw std::runtime_error("MessageBase::Reply: Client is disconnected");
+
+	Enqueue(client, src, size);
+	MarkDirty(&client);
+}
+
+void UringLoop::SendFile(ClientContext &ctx, int fd, off_t offset, size_t size)
+{
+	if (!OnLoopThread())
+	{
+		EventLoop::SendFile(ctx, fd, offset, size);
+		return;
+	}
+
+	Client &client = static_cast<Client &>(ctx);
+	if (client.closing)
+		throw std::runtime_error("MessageBase::ReplyFile: Client is disconnected");
+
+	EnqueueFile(client, fd, offset, size);
+	MarkDirty(&client);
+}
+
+void UringLoop::SendZeroCopy(ClientContext &ctx, const char *src, size_t size,
+			     std::function<void()> release)
+{
+	Client &client = static_cast<Client &>(ctx);
+
+	/* Small buffers are cheaper to copy than to track, Unix sockets always copy */
+	if (!OnLoopThread() ||
+	    size < ZEROCOPY_MIN || !_zerocopy || IsUnix() || client.closing)
+	{
+		EventLoop::SendZeroCopy(ctx, src, size, std::move(release));
+		return;
+	}
+
+	EnqueueZeroCopy(client, src, size, std::move(release));
+	MarkDirty(&client);
+}
+
+void UringLoop::MarkDirty(Client *client)
+{
+	if (!client->dirty)
+	{
+		client->dirty = true;
+		_dirty.push_back(client);
+	}
+
+	/* Stop reading requests until replies drain */
+	if (client->paused && client->recv_armed && !client->recv_cancel)
+		CancelReceive(client);
+}
+
+void UringLoop::FlushSends()
+{
+	std::vector<Client *> dirty;
+	dirty.swap(_dirty);
+
+	for (Client *client : dirty)
+	{
+		client->dirty = false;
+
+		/* Request is in flight, the rest goes once it completes */
+		if (client->sending || client->out.Empty())
+			continue;
+
+		if (client->out.Front() == SendQueue::FILE_REGION)
+		{
+			WriteFile(client);
+			continue;
+		}
+
+		struct io_uring_sqe *sqe;
+		if (!Prepare(sqe))
+		{
+			client->dirty = true;
+			_dirty.push_back(client);
+			continue;
+		}
+
+		/* Queued chunks stay in place until the request completes */
+		client->msg.msg_iov = client->iov;
+		client->msg.msg_iovlen = client->out.Peek(client->iov, SEND_IOV_MAX);
+
+		client->zerocopy_send = _zerocopy && client->out.Front() == SendQueue::ZEROCOPY;
+
+		sqe->opcode = client->zerocopy_send ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+		sqe->fd = client->fd;
+		sqe->addr = reinterpret_cast<uint64_t>(&client->msg);
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = Tag(client, SEND);
+		client->sending = true;
+	}
+}
+
+void UringLoop::WriteFile(Client *client)
+{
+	/*
+	 * Ring has no sendfile opcode. Region is written in place from the
+	 * loop thread, socket is made non-blocking for that and polled for
+	 * room once full. Written chunk is completed like a send.
+	 */
+	if (!client->nonblock)
+	{
+		fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+		client->nonblock = true;
+	}
+
+	int file;
+	off_t offset;
+	size_t size;
+	client->out.PeekFile(file, offset, size);
+
+	ssize_t sent;
+	do
+		sent = sendfile(client->fd, file, &offset, std::min<size_t>(size, SENDFILE_CHUNK));
+	while (sent < 0 && errno == EINTR);
+
+	if (sent > 0)
+	{
+		Sent(client, static_cast<int>(sent));
+		return;
+	}
+
+	/* File got shorter since it was queued, stream can not be completed */
+	if (!sent || (errno != EAGAIN && errno != EWOULDBLOCK))
+	{
+		Sent(client, sent ? -errno : -EIO);
+		return;
+	}
+
+	struct io_uring_sqe *sqe;
+	if (!Prepare(sqe))
+	{
+		MarkDirty(client);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = client->fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = Tag(client, SEND);
+	client->sending = true;
+	client->polling = true;
+}
+
+void UringLoop::Polled(Client *client, int res)
+{
+	client->polling = false;
+
+	/* Cancelled or failed poll ends the connection like a failed send */
+	if (res < 0)
+	{
+		Sent(client, res);
+		return;
+	}
+
+	client->sending = false;
+	MarkDirty(client);
+}
+
+void UringLoop::Notified(Client *client)
+{
+	client->zerocopy.Complete();
+
+	if (client->closing)
+		Close(client, false);
+}
+
+void UringLoop::Sent(Client *client, int res)
+{
+	bool zerocopy = client->zerocopy_send;
+
+	client->sending = false;
+	client->zerocopy_send = false;
+
+	if (res < 0)
+	{
+		/* Peer is gone, drop everything queued */
+		client->out.Clear();
+		Close(client, true);
+		return;
+	}
+
+	client->out.Pop(static_cast<size_t>(res), zerocopy ? &client->zerocopy : nullptr);
+	client->Progress();
+
+	bool paused = client->paused;
+	if (!client->closing && !Drained(client))
+	{
+		Close(client, true);
+		return;
+	}
+
+	/* Replies drained, read requests again */
+	if (paused && !client->paused && !client->throttled && !client->recv_armed &&
+	    !client->starved && !client->closing && _running)
+		ArmReceive(client);
+
+	if (!client->out.Empty() && _running)
+	{
+		if (!client->dirty)
+		{
+			client->dirty = true;
+			_dirty.push_back(client);
+		}
+		return;
+	}
+
+	if (client->closing && !client->recv_armed && !client->zerocopy.Pending())
+		Finish(client);
+}
+
+void UringLoop::Drop(ClientContext *client)
+{
+	Close(static_cast<Client *>(client), true);
+}
+
+void UringLoop::Resume(ClientContext *ctx)
+{
+	Client *client = static_cast<Client *>(ctx);
+
+	/* Receive still armed is rearmed once its cancel completes */
+	if (!client->paused && !client->recv_armed && !client->starved && !client->closing && _running)
+		ArmReceive(client);
+}
+
+void UringLoop::Close(Client *client, bool abort)
+{
+	if (!client->closing)
+	{
+		client->closing = true;
+		RemoveClient(client);
+	}
+
+	/* Terminate multishot receive, it completes with zero size */
+	if (abort)
+		shutdown(client->fd, SHUT_RDWR);
+
+	/* Notifications of zero-copy sends still reference the client */
+	if (!client->recv_armed && !client->sending && !client->zerocopy.Pending() &&
+	    (client->out.Empty() || !_running))
+		Finish(client);
+}
+
+void UringLoop::Finish(Client *client)
+{
+	RemoveClient(client);
+	close(client->fd);
+
+	if (client->dirty)
+	{
+		auto it = std::find(_dirty.begin(), _dirty.end(), client);
+		if (it != _dirty.end())
+			_dirty.erase(it);
+	}
+
+	if (client->starved)
+		_starved.erase(std::find(_starved.begin(), _starved.end(), client));
+
+	_clients.erase(client);
+	server.OnDisconnect();
+}
+
+std::unique_ptr<EventLoop> Network::CreateUringLoop(ServerBase &server, int listenfd)
+{
+	try
+	{
+		return std::unique_ptr<EventLoop>(new UringLoop(server, listenfd));
+	}
+	catch (const std::system_error &)
+	{
+		return nullptr;
+	}
+}
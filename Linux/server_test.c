@@ -0,0 +1,366 @@
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "server.h"
+#include "server_test.h"
+
+#define TEST_PORT			8150
+#define TEST_CLIENTS			2
+#define TEST_FDS			256
+
+struct test_server {
+	const char *name;
+	uint16_t port;
+	server_config_t config;
+	server_event_t ops;
+	server_t server;
+	int connected;
+	int disconnected;
+	int rejected;
+	int exhausted;
+	/* Clients kept until stop */
+	int busy;
+	int refilled;
+};
+
+static int get_count(int *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+}
+
+static void add_count(int *counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELEASE);
+}
+
+static int connected(client_t client)
+{
+	add_count(&((struct test_server *)get_user_data(client))->connected);
+	return 0;
+}
+
+static int receive(client_t client, void *data, size_t size)
+{
+	return send_to_client(client, data, size);
+}
+
+static void disconnected(client_t client)
+{
+	add_count(&((struct test_server *)get_user_data(client))->disconnected);
+}
+
+/* Asks to stop on EMFILE, server has to keep running anyway */
+static int error(const char *str, int error, void *user)
+{
+	struct test_server *test = user;
+
+	if (error == EAGAIN)
+		add_count(&test->rejected);
+	else if (error == EMFILE)
+		add_count(&test->exhausted);
+	else
+		fprintf(stderr, "%s: %s, %s\n", test->name, str,
+			strerror(error));
+
+	return error == EMFILE ? error : 0;
+}
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+static int wait_count(int *counter, int value)
+{
+	int i;
+
+	for (i = 0; i != 200 && get_count(counter) < value; i++)
+		sleep_ms(10);
+
+	return get_count(counter) < value;
+}
+
+static int client_socket(void)
+{
+	struct timeval tv = { .tv_sec = 2, .tv_usec = 0 };
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd >= 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	return fd;
+}
+
+static int client_connect(int fd, uint16_t port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		.sin_port = htons(port),
+	};
+
+	return connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+static int open_client(uint16_t port)
+{
+	int fd = client_socket();
+
+	if (fd >= 0 && client_connect(fd, port)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Zero if server echoed the message */
+static int echo(int fd)
+{
+	char msg[] = "ping";
+	char reply[sizeof(msg)];
+
+	if (send(fd, msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg))
+		return -1;
+
+	if (recv(fd, reply, sizeof(reply), MSG_WAITALL) != sizeof(reply))
+		return -1;
+
+	return memcmp(msg, reply, sizeof(msg));
+}
+
+/* Zero if server closed the connection */
+static int closed(int fd)
+{
+	char c;
+	ssize_t res = recv(fd, &c, sizeof(c), 0);
+
+	return !(res == 0 || (res < 0 && errno == ECONNRESET));
+}
+
+static int fail(struct test_server *test, const char *what)
+{
+	fprintf(stderr, "Server test: %s: %s failed\n", test->name, what);
+	return -1;
+}
+
+/* Lower descriptor limit and use it up with copies of fd, count of copies */
+static int fill_fds(int fd, struct rlimit *old, int *fds)
+{
+	struct rlimit low;
+	int count = 0;
+
+	if (getrlimit(RLIMIT_NOFILE, old))
+		return -1;
+
+	low = *old;
+	low.rlim_cur = TEST_FDS;
+	if (setrlimit(RLIMIT_NOFILE, &low))
+		return -1;
+
+	while (count != TEST_FDS) {
+		fds[count] = dup(fd);
+		if (fds[count] < 0)
+			break;
+		count++;
+	}
+
+	return count;
+}
+
+static void release_fds(const struct rlimit *old, int *fds, int count)
+{
+	while (count)
+		close(fds[--count]);
+	setrlimit(RLIMIT_NOFILE, old);
+}
+
+/*
+ * Fill descriptor table, so server accepts fail with EMFILE, then give
+ * descriptors back. Client connected meanwhile is served, the next one
+ * is refused for the client limit, which shows accepting goes on.
+ */
+static int check_exhausted(struct test_server *test)
+{
+	struct rlimit old;
+	int fds[TEST_FDS];
+	int exhausted = get_count(&test->exhausted);
+	int res = -1;
+	int count, fd;
+
+	test->refilled = client_socket();
+	if (test->refilled < 0)
+		return fail(test, "client socket");
+
+	count = fill_fds(test->refilled, &old, fds);
+	if (count < 0)
+		return fail(test, "setrlimit");
+
+	if (!client_connect(test->refilled, test->port))
+		res = wait_count(&test->exhausted, exhausted + 1);
+
+	release_fds(&old, fds, count);
+
+	if (res)
+		return fail(test, "accept out of descriptors");
+
+	if (echo(test->refilled))
+		return fail(test, "echo after running out of descriptors");
+
+	fd = open_client(test->port);
+	res = fd < 0 || closed(fd) || wait_count(&test->rejected, 2);
+	if (fd >= 0)
+		close(fd);
+
+	return res ? fail(test, "accept after running out of descriptors") : 0;
+}
+
+/*
+ * Server with workers is started with one descriptor left, listening
+ * socket takes it and epoll setup fails. Start has to report the error,
+ * no worker is running yet.
+ */
+static int check_start_exhausted(uint16_t port)
+{
+	struct test_server test = {
+		.name = "EPOLL workers start",
+		.port = port,
+		.config = { SERVER_MODE_EPOLL, TEST_CLIENTS, 2 },
+		.ops = { .error = error },
+	};
+	struct rlimit old;
+	int fds[TEST_FDS];
+	int count;
+
+	count = fill_fds(STDERR_FILENO, &old, fds);
+	if (count <= 0)
+		return fail(&test, "setrlimit");
+
+	close(fds[--count]);
+	test.server = server_start_ex(test.port, &test.ops, 64, &test,
+		&test.config);
+	release_fds(&old, fds, count);
+
+	if (test.server) {
+		server_stop(test.server);
+		return fail(&test, "start out of descriptors");
+	}
+
+	return get_count(&test.exhausted) ? 0 :
+		fail(&test, "start error out of descriptors");
+}
+
+/*
+ * Servers of every mode run side by side, each with own client table.
+ * Third client is refused, idle one expires while the busy one stays,
+ * pending client is served after descriptors run out and stop drops
+ * clients still connected. Start out of descriptors fails cleanly.
+ */
+int do_server_test()
+{
+	struct test_server tests[] = {
+		{ .name = "THREADED",
+		  .config = { SERVER_MODE_THREADED, TEST_CLIENTS, 0 } },
+		{ .name = "EPOLL",
+		  .config = { SERVER_MODE_EPOLL, TEST_CLIENTS, 0 } },
+		{ .name = "EPOLL workers",
+		  .config = { SERVER_MODE_EPOLL, TEST_CLIENTS, 2 } },
+	};
+	const size_t num = sizeof(tests) / sizeof(tests[0]);
+	int idle[sizeof(tests) / sizeof(tests[0])];
+	int res = check_start_exhausted(TEST_PORT + num);
+	size_t i;
+	int t, fd;
+
+	for (i = 0; i != num; i++) {
+		tests[i].busy = -1;
+		tests[i].refilled = -1;
+		idle[i] = -1;
+	}
+
+	for (i = 0; i != num && !res; i++) {
+		struct test_server *test = &tests[i];
+
+		test->port = TEST_PORT + i;
+		test->ops.connected = connected;
+		test->ops.receive = receive;
+		test->ops.disconnected = disconnected;
+		test->ops.error = error;
+		test->ops.read_timeout_s = 1;
+
+		test->server = server_start_ex(test->port, &test->ops, 64, test,
+			&test->config);
+		if (!test->server)
+			res = fail(test, "start");
+	}
+
+	for (i = 0; i != num && !res; i++) {
+		struct test_server *test = &tests[i];
+
+		test->busy = open_client(test->port);
+		idle[i] = open_client(test->port);
+		if (test->busy < 0 || idle[i] < 0 ||
+			echo(test->busy) || echo(idle[i])) {
+			res = fail(test, "echo");
+			break;
+		}
+
+		fd = open_client(test->port);
+		if (fd < 0 || closed(fd) || wait_count(&test->rejected, 1))
+			res = fail(test, "client limit");
+		if (fd >= 0)
+			close(fd);
+	}
+
+	/* Idle client is gone within three seconds, busy one stays */
+	for (t = 0; t != 14 && !res; t++) {
+		sleep_ms(250);
+		for (i = 0; i != num && !res; i++)
+			if (echo(tests[i].busy))
+				res = fail(&tests[i], "busy client");
+	}
+
+	for (i = 0; i != num && !res; i++)
+		if (closed(idle[i]))
+			res = fail(&tests[i], "idle client expiry");
+
+	for (i = 0; i != num && !res; i++)
+		res = check_exhausted(&tests[i]);
+
+	for (i = 0; i != num; i++) {
+		struct test_server *test = &tests[i];
+
+		if (!test->server)
+			continue;
+
+		if (server_stop(test->server) && !res)
+			res = fail(test, "stop");
+
+		if (!res && (closed(test->busy) || closed(test->refilled)))
+			res = fail(test, "drop on stop");
+
+		if (!res && get_count(&test->connected) !=
+			get_count(&test->disconnected))
+			res = fail(test, "disconnect events");
+
+		if (test->busy >= 0)
+			close(test->busy);
+		if (test->refilled >= 0)
+			close(test->refilled);
+		if (idle[i] >= 0)
+			close(idle[i]);
+	}
+
+	return res;
+}
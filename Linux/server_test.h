@@ -0,0 +1,12 @@
+#ifndef SERVER_TEST_H
+#define SERVER_TEST_H
+
+#ifdef __cplusplus
+
+extern "C" {
+    int do_server_test();
+}
+
+#endif /* __cplusplus */
+
+#endif /* SERVER_TEST_H */
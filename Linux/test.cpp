@@ -3,6 +3,7 @@
 #include "utils.h"
 #include "i2c.h"
 #include "spi.h"
+#include "server_test.h"
 
 int main(int argc, char *argv[])
 {
@@ -22,5 +23,7 @@ int main(int argc, char *argv[])
 		std::cout << "Expected error: " << e.what() << std::endl;
 	}
 
+	assert(!do_server_test());
+
 	return 0;
 }